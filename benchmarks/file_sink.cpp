@@ -0,0 +1,59 @@
+#include <benchmark/benchmark.h>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <pipeline/pipeline.hpp>
+#include <string>
+#if __has_include(<unistd.h>)
+#include <fcntl.h>
+#include <unistd.h>
+#define PIPELINE_BENCHMARK_POSIX
+#endif
+using namespace pipeline;
+
+// Appending 41-byte records (40 characters and a newline) to a file:
+// file_sink, which batches them into large buffers written in the
+// background, against one write() per record
+
+static const std::string record(40, 'x');
+
+static std::string temp_path() {
+  return (std::filesystem::temp_directory_path() / "pipeline_file_sink_benchmark.txt").string();
+}
+
+static void BM_file_sink(benchmark::State &state) {
+  const auto path = temp_path();
+  for (auto _ : state) {
+    std::remove(path.c_str());
+    auto sink = file_sink(path);
+    for (std::int64_t i = 0; i < state.range(0); ++i) {
+      sink(record);
+    }
+    sink.close();
+  }
+  std::remove(path.c_str());
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  state.SetBytesProcessed(state.iterations() * state.range(0) * (record.size() + 1));
+}
+BENCHMARK(BM_file_sink)->Range(1 << 10, 1 << 20)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+#ifdef PIPELINE_BENCHMARK_POSIX
+static void BM_write_per_record(benchmark::State &state) {
+  const auto path = temp_path();
+  const auto line = record + '\n';
+  for (auto _ : state) {
+    const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    for (std::int64_t i = 0; i < state.range(0); ++i) {
+      benchmark::DoNotOptimize(::write(fd, line.data(), line.size()));
+    }
+    ::close(fd);
+  }
+  std::remove(path.c_str());
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  state.SetBytesProcessed(state.iterations() * state.range(0) * line.size());
+}
+BENCHMARK(BM_write_per_record)
+    ->Range(1 << 10, 1 << 20)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+#endif
@@ -0,0 +1,63 @@
+#include <benchmark/benchmark.h>
+#include <numeric>
+#include <optional>
+#include <pipeline/pipeline.hpp>
+#include <vector>
+using namespace pipeline;
+
+// Keeping every other element: filter and filter | for_each against the
+// for_each-returning-std::optional workaround, which allocates a result
+// per element and compacts it afterwards
+
+static std::vector<int> numbers(std::size_t n) {
+  std::vector<int> result(n);
+  std::iota(result.begin(), result.end(), 0);
+  return result;
+}
+
+static auto is_even = [](int a) { return a % 2 == 0; };
+static auto square = [](int a) { return a * a; };
+
+static void BM_filter(benchmark::State &state) {
+  const auto input = numbers(state.range(0));
+  auto stage = filter(is_even);
+  for (auto _ : state) {
+    auto result = stage(input);
+    benchmark::DoNotOptimize(result.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_filter)->Range(1 << 10, 1 << 22)->UseRealTime();
+
+static void BM_filter_for_each(benchmark::State &state) {
+  const auto input = numbers(state.range(0));
+  auto stage = filter(is_even) | for_each(square);
+  for (auto _ : state) {
+    auto result = stage(input);
+    benchmark::DoNotOptimize(result.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_filter_for_each)->Range(1 << 10, 1 << 22)->UseRealTime();
+
+static void BM_for_each_optional(benchmark::State &state) {
+  const auto input = numbers(state.range(0));
+  auto stage = for_each([](int a) {
+                 return is_even(a) ? std::optional<int>(square(a)) : std::nullopt;
+               }) |
+               fn([](const std::vector<std::optional<int>> &results) {
+                 std::vector<int> compacted;
+                 for (auto &result : results) {
+                   if (result) {
+                     compacted.push_back(*result);
+                   }
+                 }
+                 return compacted;
+               });
+  for (auto _ : state) {
+    auto result = stage(input);
+    benchmark::DoNotOptimize(result.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_for_each_optional)->Range(1 << 10, 1 << 22)->UseRealTime();
@@ -0,0 +1,78 @@
+#include <algorithm>
+#include <array>
+#include <benchmark/benchmark.h>
+#include <numeric>
+#include <pipeline/pipeline.hpp>
+#if defined(PIPELINE_PARALLEL_STL) && __has_include(<execution>)
+#include <execution>
+#endif
+using namespace pipeline;
+
+// for_each throughput against element count and payload size, with a raw
+// loop, std::transform and std::transform(std::execution::par) as baselines
+
+template <std::size_t Bytes> struct payload {
+  std::array<unsigned char, Bytes> bytes{};
+};
+
+template <std::size_t Bytes> static unsigned checksum(const payload<Bytes> &p) {
+  return std::accumulate(p.bytes.begin(), p.bytes.end(), 0u);
+}
+
+template <std::size_t Bytes> static void BM_for_each(benchmark::State &state) {
+  std::vector<payload<Bytes>> input(state.range(0));
+  auto stage = for_each([](const payload<Bytes> &p) { return checksum(p); });
+  for (auto _ : state) {
+    auto results = stage(input);
+    benchmark::DoNotOptimize(results.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  state.SetBytesProcessed(state.iterations() * state.range(0) * Bytes);
+}
+BENCHMARK_TEMPLATE(BM_for_each, 4)->Range(1 << 10, 1 << 20)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_for_each, 256)->Range(1 << 10, 1 << 16)->UseRealTime();
+
+template <std::size_t Bytes> static void BM_raw_loop(benchmark::State &state) {
+  std::vector<payload<Bytes>> input(state.range(0));
+  for (auto _ : state) {
+    std::vector<unsigned> results;
+    results.reserve(input.size());
+    for (const auto &p : input) {
+      results.push_back(checksum(p));
+    }
+    benchmark::DoNotOptimize(results.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  state.SetBytesProcessed(state.iterations() * state.range(0) * Bytes);
+}
+BENCHMARK_TEMPLATE(BM_raw_loop, 4)->Range(1 << 10, 1 << 20);
+BENCHMARK_TEMPLATE(BM_raw_loop, 256)->Range(1 << 10, 1 << 16);
+
+template <std::size_t Bytes> static void BM_std_transform(benchmark::State &state) {
+  std::vector<payload<Bytes>> input(state.range(0));
+  for (auto _ : state) {
+    std::vector<unsigned> results(input.size());
+    std::transform(input.begin(), input.end(), results.begin(), checksum<Bytes>);
+    benchmark::DoNotOptimize(results.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  state.SetBytesProcessed(state.iterations() * state.range(0) * Bytes);
+}
+BENCHMARK_TEMPLATE(BM_std_transform, 4)->Range(1 << 10, 1 << 20);
+BENCHMARK_TEMPLATE(BM_std_transform, 256)->Range(1 << 10, 1 << 16);
+
+#if defined(__cpp_lib_execution) && defined(PIPELINE_PARALLEL_STL)
+template <std::size_t Bytes> static void BM_std_transform_par(benchmark::State &state) {
+  std::vector<payload<Bytes>> input(state.range(0));
+  for (auto _ : state) {
+    std::vector<unsigned> results(input.size());
+    std::transform(std::execution::par, input.begin(), input.end(), results.begin(),
+                   checksum<Bytes>);
+    benchmark::DoNotOptimize(results.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  state.SetBytesProcessed(state.iterations() * state.range(0) * Bytes);
+}
+BENCHMARK_TEMPLATE(BM_std_transform_par, 4)->Range(1 << 10, 1 << 20)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_std_transform_par, 256)->Range(1 << 10, 1 << 16)->UseRealTime();
+#endif
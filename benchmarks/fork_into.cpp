@@ -0,0 +1,57 @@
+#include <benchmark/benchmark.h>
+#include <pipeline/pipeline.hpp>
+using namespace pipeline;
+
+// Fan-out latency: a fork of N branches doing almost no work, against
+// calling the N branches one after the other
+
+static auto branch = [](int a) {
+  benchmark::DoNotOptimize(a);
+  return a + 1;
+};
+
+template <std::size_t N> auto make_fork() {
+  return std::apply([](auto... fns) { return fork_into(fns...); },
+                    details::make_repeated_tuple<N>(std::make_tuple(branch)));
+}
+
+template <std::size_t N> static void BM_fork_into(benchmark::State &state) {
+  auto fork = make_fork<N>();
+  for (auto _ : state) {
+    auto results = fork(1);
+    benchmark::DoNotOptimize(results.data());
+  }
+  state.SetItemsProcessed(state.iterations() * N);
+}
+BENCHMARK_TEMPLATE(BM_fork_into, 1)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_fork_into, 2)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_fork_into, 4)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_fork_into, 8)->UseRealTime();
+
+// The same fork with every branch marked cheap, i.e., run on the calling thread
+template <std::size_t N> static void BM_fork_into_cheap(benchmark::State &state) {
+  auto fork = std::apply([](auto... fns) { return fork_into(cheap(fns)...); },
+                         details::make_repeated_tuple<N>(std::make_tuple(branch)));
+  for (auto _ : state) {
+    auto results = fork(1);
+    benchmark::DoNotOptimize(results.data());
+  }
+  state.SetItemsProcessed(state.iterations() * N);
+}
+BENCHMARK_TEMPLATE(BM_fork_into_cheap, 2);
+BENCHMARK_TEMPLATE(BM_fork_into_cheap, 8);
+
+template <std::size_t N> static void BM_serial_branches(benchmark::State &state) {
+  for (auto _ : state) {
+    std::vector<int> results;
+    for (std::size_t i = 0; i < N; ++i) {
+      results.push_back(branch(1));
+    }
+    benchmark::DoNotOptimize(results.data());
+  }
+  state.SetItemsProcessed(state.iterations() * N);
+}
+BENCHMARK_TEMPLATE(BM_serial_branches, 1);
+BENCHMARK_TEMPLATE(BM_serial_branches, 2);
+BENCHMARK_TEMPLATE(BM_serial_branches, 4);
+BENCHMARK_TEMPLATE(BM_serial_branches, 8);
@@ -0,0 +1,41 @@
+#include <benchmark/benchmark.h>
+#include <numeric>
+#include <pipeline/pipeline.hpp>
+#include <vector>
+using namespace pipeline;
+
+// Three element-wise stages before a parallel one: lazy maps, which run
+// inside for_each's chunks, against for_each stages that each build a
+// full std::vector
+
+static auto scale = [](double a) { return a * 1.5; };
+static auto shift = [](double a) { return a + 2.0; };
+static auto clamp = [](double a) { return a < 100.0 ? a : 100.0; };
+
+static std::vector<double> numbers(std::size_t n) {
+  std::vector<double> result(n);
+  std::iota(result.begin(), result.end(), 0.0);
+  return result;
+}
+
+static void BM_lazy_maps(benchmark::State &state) {
+  const auto input = numbers(state.range(0));
+  auto pipeline = lazy() | map(scale) | map(shift) | for_each(clamp);
+  for (auto _ : state) {
+    auto result = pipeline(input);
+    benchmark::DoNotOptimize(result.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_lazy_maps)->Range(1 << 10, 1 << 22)->UseRealTime();
+
+static void BM_for_each_stages(benchmark::State &state) {
+  const auto input = numbers(state.range(0));
+  auto pipeline = for_each(scale) | for_each(shift) | for_each(clamp);
+  for (auto _ : state) {
+    auto result = pipeline(input);
+    benchmark::DoNotOptimize(result.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_for_each_stages)->Range(1 << 10, 1 << 22)->UseRealTime();
@@ -0,0 +1,57 @@
+#include <algorithm>
+#include <benchmark/benchmark.h>
+#include <pipeline/pipeline.hpp>
+#include <vector>
+using namespace pipeline;
+
+// Three element-wise stages over floats: fused map against one
+// std::transform pass per stage
+
+static auto scale = [](float a) { return a * 1.5f; };
+static auto shift = [](float a) { return a + 2.0f; };
+static auto clamp = [](float a) { return std::min(a, 100.0f); };
+
+static void BM_map_fused(benchmark::State &state) {
+  const std::vector<float> input(state.range(0), 1.0f);
+  auto pipeline = map(scale) | map(shift) | map(clamp);
+  for (auto _ : state) {
+    auto result = pipeline(input);
+    benchmark::DoNotOptimize(result.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_map_fused)->Arg(1 << 10)->Arg(1 << 16)->Arg(1 << 22);
+
+static void BM_map_in_place(benchmark::State &state) {
+  std::vector<float> input(state.range(0), 1.0f);
+  auto pipeline = map(scale) | map(shift) | map(clamp);
+  for (auto _ : state) {
+    input = pipeline(std::move(input));
+    benchmark::DoNotOptimize(input.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_map_in_place)->Arg(1 << 10)->Arg(1 << 16)->Arg(1 << 22);
+
+static void BM_transform_per_stage(benchmark::State &state) {
+  const std::vector<float> input(state.range(0), 1.0f);
+  auto pipeline = fn([](const std::vector<float> &in) {
+                    std::vector<float> out(in.size());
+                    std::transform(in.begin(), in.end(), out.begin(), scale);
+                    return out;
+                  }) |
+                  fn([](std::vector<float> v) {
+                    std::transform(v.begin(), v.end(), v.begin(), shift);
+                    return v;
+                  }) |
+                  fn([](std::vector<float> v) {
+                    std::transform(v.begin(), v.end(), v.begin(), clamp);
+                    return v;
+                  });
+  for (auto _ : state) {
+    auto result = pipeline(input);
+    benchmark::DoNotOptimize(result.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_transform_per_stage)->Arg(1 << 10)->Arg(1 << 16)->Arg(1 << 22);
@@ -0,0 +1,61 @@
+#include <benchmark/benchmark.h>
+#include <pipeline/pipeline.hpp>
+using namespace pipeline;
+
+// Per-stage call overhead: a chain of N trivial stages against N direct calls
+
+static auto add_one = [](int a) {
+  benchmark::DoNotOptimize(a);
+  return a + 1;
+};
+
+template <std::size_t N> auto make_chain() {
+  if constexpr (N == 1) {
+    return fn(add_one);
+  } else {
+    return make_chain<N - 1>() | fn(add_one);
+  }
+}
+
+template <std::size_t N> static void BM_pipe_chain(benchmark::State &state) {
+  auto pipeline = make_chain<N>();
+  int value = 0;
+  for (auto _ : state) {
+    value = pipeline(value);
+    benchmark::DoNotOptimize(value);
+  }
+  state.SetItemsProcessed(state.iterations() * N);
+}
+BENCHMARK_TEMPLATE(BM_pipe_chain, 1);
+BENCHMARK_TEMPLATE(BM_pipe_chain, 4);
+BENCHMARK_TEMPLATE(BM_pipe_chain, 16);
+
+template <std::size_t N> static void BM_raw_chain(benchmark::State &state) {
+  int value = 0;
+  for (auto _ : state) {
+    for (std::size_t i = 0; i < N; ++i) {
+      value = add_one(value);
+    }
+    benchmark::DoNotOptimize(value);
+  }
+  state.SetItemsProcessed(state.iterations() * N);
+}
+BENCHMARK_TEMPLATE(BM_raw_chain, 1);
+BENCHMARK_TEMPLATE(BM_raw_chain, 4);
+BENCHMARK_TEMPLATE(BM_raw_chain, 16);
+
+// Passing a large buffer from stage to stage
+static void BM_pipe_buffer(benchmark::State &state) {
+  auto touch = fn([](std::vector<int> v) {
+    v[0] += 1;
+    return v;
+  });
+  auto pipeline = fn([](std::vector<int> v) { return v; }) | touch | touch | touch;
+  std::vector<int> input(state.range(0));
+  for (auto _ : state) {
+    auto output = pipeline(input);
+    benchmark::DoNotOptimize(output.data());
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0) * sizeof(int));
+}
+BENCHMARK(BM_pipe_buffer)->Range(1 << 10, 1 << 20);
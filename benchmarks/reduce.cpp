@@ -0,0 +1,57 @@
+#include <benchmark/benchmark.h>
+#include <numeric>
+#include <pipeline/pipeline.hpp>
+#include <vector>
+#if defined(PIPELINE_PARALLEL_STL) && __has_include(<execution>)
+#include <execution>
+#endif
+using namespace pipeline;
+
+// Sum of squares: parallel reduce against for_each followed by a serial
+// std::accumulate, and std::transform_reduce as a baseline
+
+static auto square = [](int a) { return static_cast<long long>(a) * a; };
+
+static void BM_transform_reduce(benchmark::State &state) {
+  const std::vector<int> input(state.range(0), 3);
+  auto stage = transform_reduce(0LL, std::plus<>(), square);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(stage(input));
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_transform_reduce)->Range(1 << 10, 1 << 24)->UseRealTime();
+
+static void BM_for_each_then_accumulate(benchmark::State &state) {
+  const std::vector<int> input(state.range(0), 3);
+  auto pipeline = for_each(square) | fn([](const std::vector<long long> &squares) {
+                    return std::accumulate(squares.begin(), squares.end(), 0LL);
+                  });
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(pipeline(input));
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_for_each_then_accumulate)->Range(1 << 10, 1 << 24)->UseRealTime();
+
+static void BM_std_transform_reduce(benchmark::State &state) {
+  const std::vector<int> input(state.range(0), 3);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        std::transform_reduce(input.begin(), input.end(), 0LL, std::plus<>(), square));
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_std_transform_reduce)->Range(1 << 10, 1 << 24)->UseRealTime();
+
+#if defined(PIPELINE_PARALLEL_STL) && __has_include(<execution>)
+static void BM_std_transform_reduce_par(benchmark::State &state) {
+  const std::vector<int> input(state.range(0), 3);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(std::transform_reduce(std::execution::par, input.begin(),
+                                                   input.end(), 0LL, std::plus<>(), square));
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_std_transform_reduce_par)->Range(1 << 10, 1 << 24)->UseRealTime();
+#endif
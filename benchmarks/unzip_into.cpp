@@ -0,0 +1,78 @@
+#include <benchmark/benchmark.h>
+#include <numeric>
+#include <pipeline/pipeline.hpp>
+using namespace pipeline;
+
+// Summing each column of a tuple of three columns in parallel, against
+// summing them one after the other
+
+static auto sum = [](const std::vector<long> &column) {
+  return std::accumulate(column.begin(), column.end(), 0L);
+};
+
+static auto make_columns(std::size_t size) {
+  return std::make_tuple(std::vector<long>(size, 1), std::vector<long>(size, 2),
+                         std::vector<long>(size, 3));
+}
+
+static void BM_unzip_into(benchmark::State &state) {
+  const auto columns = make_columns(state.range(0));
+  auto unzip = unzip_into(sum);
+  for (auto _ : state) {
+    auto results = unzip(columns);
+    benchmark::DoNotOptimize(results.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0) * 3);
+}
+BENCHMARK(BM_unzip_into)->Range(1 << 10, 1 << 22)->UseRealTime();
+
+static void BM_serial_columns(benchmark::State &state) {
+  const auto columns = make_columns(state.range(0));
+  for (auto _ : state) {
+    std::vector<long> results{sum(std::get<0>(columns)), sum(std::get<1>(columns)),
+                              sum(std::get<2>(columns))};
+    benchmark::DoNotOptimize(results.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0) * 3);
+}
+BENCHMARK(BM_serial_columns)->Range(1 << 10, 1 << 22);
+
+// Squaring every element of three columns of uneven sizes: one task per
+// column against chunks of every column spread over the pool
+
+static auto square_column = [](const std::vector<long> &column) {
+  std::vector<long> squares(column.size());
+  for (std::size_t i = 0; i < column.size(); ++i) {
+    squares[i] = column[i] * column[i];
+  }
+  return squares;
+};
+
+static auto square = [](long x) { return x * x; };
+
+static auto make_uneven_columns(std::size_t size) {
+  return std::make_tuple(std::vector<long>(size, 1), std::vector<long>(size / 8, 2),
+                         std::vector<long>(size / 64, 3));
+}
+
+static void BM_unzip_into_columns(benchmark::State &state) {
+  const auto columns = make_uneven_columns(state.range(0));
+  auto unzip = unzip_into(square_column);
+  for (auto _ : state) {
+    auto results = unzip(columns);
+    benchmark::DoNotOptimize(results.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_unzip_into_columns)->Range(1 << 10, 1 << 22)->UseRealTime();
+
+static void BM_unzip_into_for_each(benchmark::State &state) {
+  const auto columns = make_uneven_columns(state.range(0));
+  auto unzip = unzip_into(square).for_each();
+  for (auto _ : state) {
+    auto results = unzip(columns);
+    benchmark::DoNotOptimize(std::get<0>(results).data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_unzip_into_for_each)->Range(1 << 10, 1 << 22)->UseRealTime();
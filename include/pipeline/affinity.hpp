@@ -0,0 +1,130 @@
+#pragma once
+#include <cstddef>
+#include <exception>
+#include <fstream>
+#include <initializer_list>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+namespace pipeline {
+
+// CPUs, as numbered by the OS, that a thread may run on. An empty set
+// leaves the thread wherever the OS puts it.
+//
+// Pinning is best effort: it only does something on Linux, and CPUs that
+// don't exist or aren't available to the process are skipped.
+class cpu_set {
+  std::vector<std::size_t> cpus_;
+
+public:
+  cpu_set() = default;
+
+  cpu_set(std::initializer_list<std::size_t> cpus) : cpus_(cpus) {}
+
+  explicit cpu_set(std::vector<std::size_t> cpus) : cpus_(std::move(cpus)) {}
+
+  // CPUs `first` to `last`, inclusive
+  static cpu_set range(std::size_t first, std::size_t last) {
+    std::vector<std::size_t> cpus;
+    for (auto cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+    return cpu_set(std::move(cpus));
+  }
+
+  // CPUs of a NUMA node, so that threads pinned to them share its memory
+  // (and usually an L3 cache). Empty if the node is unknown.
+  static cpu_set numa_node(std::size_t node) {
+    // e.g., "0-7,16-23"
+    std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    std::string list;
+    if (!std::getline(file, list)) {
+      return {};
+    }
+    std::vector<std::size_t> cpus;
+    std::size_t pos = 0;
+    while (pos < list.size()) {
+      auto end = list.find(',', pos);
+      if (end == std::string::npos) {
+        end = list.size();
+      }
+      const auto item = list.substr(pos, end - pos);
+      const auto dash = item.find('-');
+      try {
+        const auto first = std::stoul(item.substr(0, dash));
+        const auto last = dash == std::string::npos ? first : std::stoul(item.substr(dash + 1));
+        for (auto cpu = first; cpu <= last; ++cpu) {
+          cpus.push_back(cpu);
+        }
+      } catch (const std::exception &) {
+        return {};
+      }
+      pos = end + 1;
+    }
+    return cpu_set(std::move(cpus));
+  }
+
+  bool empty() const { return cpus_.empty(); }
+
+  std::size_t size() const { return cpus_.size(); }
+
+  std::size_t operator[](std::size_t i) const { return cpus_[i]; }
+
+  auto begin() const { return cpus_.begin(); }
+
+  auto end() const { return cpus_.end(); }
+
+  // Restricts the calling thread to these CPUs. Returns whether it did.
+  bool pin_current_thread() const {
+#if defined(__linux__)
+    if (cpus_.empty()) {
+      return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (auto cpu : cpus_) {
+      if (cpu < CPU_SETSIZE) {
+        CPU_SET(cpu, &set);
+      }
+    }
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+  }
+};
+
+namespace details {
+
+// Calls f() on a thread pinned to `cpus` and waits for it. Memory that f
+// touches first is then placed on their NUMA node (Linux allocates pages
+// on the node of the thread that first writes them).
+template <typename F> void run_on(const cpu_set &cpus, F &&f) {
+  if (cpus.empty()) {
+    f();
+    return;
+  }
+  std::exception_ptr error;
+  std::thread thread([&cpus, &f, &error] {
+    cpus.pin_current_thread();
+    try {
+      f();
+    } catch (...) {
+      error = std::current_exception();
+    }
+  });
+  thread.join();
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+} // namespace details
+
+} // namespace pipeline
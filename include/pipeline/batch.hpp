@@ -0,0 +1,149 @@
+#pragma once
+#include <chrono>
+#include <iterator>
+#include <pipeline/details.hpp>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace pipeline {
+
+namespace details {
+
+// Streaming state of batch for items of type T. Each batch's storage is
+// handed downstream with the batch, so the next batch gets a buffer of its
+// own, reserved when its first item arrives: none is allocated after the
+// last batch, or while the stream is idle.
+template <typename T> class batcher {
+  std::size_t size_;
+  std::chrono::steady_clock::duration max_delay_;
+  std::vector<T> buffer_;
+  std::chrono::steady_clock::time_point deadline_;
+
+public:
+  typedef std::vector<T> output_type;
+
+  batcher(std::size_t size, std::chrono::steady_clock::duration max_delay)
+      : size_(size), max_delay_(max_delay) {}
+
+  template <typename Emit> void process(T &&item, Emit &emit) {
+    if (buffer_.empty()) {
+      buffer_.reserve(size_);
+      deadline_ = max_delay_ == std::chrono::steady_clock::duration::max()
+                      ? std::chrono::steady_clock::time_point::max()
+                      : std::chrono::steady_clock::now() + max_delay_;
+    }
+    buffer_.push_back(std::move(item));
+    if (buffer_.size() >= size_) {
+      flush(emit);
+    }
+  }
+
+  template <typename Emit> void flush(Emit &emit) {
+    if (!buffer_.empty()) {
+      emit(std::move(buffer_));
+      buffer_.clear();
+    }
+  }
+
+  std::chrono::steady_clock::time_point deadline() const {
+    return buffer_.empty() ? std::chrono::steady_clock::time_point::max() : deadline_;
+  }
+};
+
+// Streaming state of unbatch for batches of type Batch
+template <typename Batch> class unbatcher {
+public:
+  typedef typename std::decay<Batch>::type::value_type output_type;
+
+  template <typename Emit> void process(Batch &&batch, Emit &emit) {
+    for (auto &item : batch) {
+      emit(std::move(item));
+    }
+  }
+
+  template <typename Emit> void flush(Emit &) {}
+
+  std::chrono::steady_clock::time_point deadline() const {
+    return std::chrono::steady_clock::time_point::max();
+  }
+};
+
+} // namespace details
+
+// Groups items into std::vectors of `size` items.
+//
+// Called on a container, returns the container's items split into
+// batches. In a stream, emits a batch once `size` items have arrived or
+// `max_delay` after the first item of the batch arrived, whichever comes
+// first; a partial batch is also emitted when the stream closes.
+class batch {
+  std::size_t size_;
+  std::chrono::steady_clock::duration max_delay_;
+
+public:
+  explicit batch(std::size_t size,
+                 std::chrono::steady_clock::duration max_delay =
+                     std::chrono::steady_clock::duration::max())
+      : size_(size > 0 ? size : 1), max_delay_(max_delay) {}
+
+  template <typename Container> auto operator()(Container &&items) const {
+    typedef typename std::decay<Container>::type::value_type value_type;
+    std::vector<std::vector<value_type>> batches;
+    std::vector<value_type> current;
+    for (auto &item : items) {
+      if (current.empty()) {
+        current.reserve(size_);
+      }
+      if constexpr (std::is_lvalue_reference<Container>::value) {
+        current.push_back(item);
+      } else {
+        current.push_back(std::move(item));
+      }
+      if (current.size() == size_) {
+        batches.push_back(std::move(current));
+        current = {};
+      }
+    }
+    if (!current.empty()) {
+      batches.push_back(std::move(current));
+    }
+    return batches;
+  }
+
+  template <typename T> details::batcher<T> stream_state() const {
+    return details::batcher<T>(size_, max_delay_);
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) const {
+    return pipe_pair<batch, typename std::decay<T3>::type>(*this, std::forward<T3>(rhs));
+  }
+};
+
+// The inverse of batch: flattens a container of batches into their items
+class unbatch {
+public:
+  template <typename Container> auto operator()(Container &&batches) const {
+    typedef typename std::decay<Container>::type::value_type batch_type;
+    std::vector<typename batch_type::value_type> items;
+    for (auto &b : batches) {
+      if constexpr (std::is_lvalue_reference<Container>::value) {
+        items.insert(items.end(), std::begin(b), std::end(b));
+      } else {
+        items.insert(items.end(), std::make_move_iterator(std::begin(b)),
+                     std::make_move_iterator(std::end(b)));
+      }
+    }
+    return items;
+  }
+
+  template <typename Batch> details::unbatcher<Batch> stream_state() const {
+    return details::unbatcher<Batch>();
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) const {
+    return pipe_pair<unbatch, typename std::decay<T3>::type>(*this, std::forward<T3>(rhs));
+  }
+};
+
+} // namespace pipeline
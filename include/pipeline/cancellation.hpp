@@ -0,0 +1,101 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+
+namespace pipeline {
+
+// Thrown by a parallel stage that stopped before it was done because it
+// was cancelled, or because an enclosing stage or stream is stopping
+class operation_cancelled : public std::runtime_error {
+public:
+  operation_cancelled() : std::runtime_error("pipeline: operation cancelled") {}
+};
+
+// Asks the stages it is attached to, with .cancel_on(...), to stop early:
+// their tasks that haven't started are skipped, the running ones see
+// stop_requested(), and the stage throws operation_cancelled. Cancelled by
+// cancel(), from any thread, or once its deadline passes. Must outlive the
+// stages it is attached to.
+class cancellation {
+  std::atomic<bool> cancelled_{false};
+  std::chrono::steady_clock::time_point deadline_;
+
+public:
+  cancellation() : deadline_(std::chrono::steady_clock::time_point::max()) {}
+
+  explicit cancellation(std::chrono::steady_clock::time_point deadline) : deadline_(deadline) {}
+
+  explicit cancellation(std::chrono::steady_clock::duration timeout)
+      : deadline_(std::chrono::steady_clock::now() + timeout) {}
+
+  cancellation(const cancellation &) = delete;
+  cancellation &operator=(const cancellation &) = delete;
+
+  void cancel() { cancelled_.store(true, std::memory_order_release); }
+
+  bool cancelled() const {
+    return cancelled_.load(std::memory_order_acquire) ||
+           (deadline_ != std::chrono::steady_clock::time_point::max() &&
+            std::chrono::steady_clock::now() >= deadline_);
+  }
+};
+
+namespace details {
+
+// Stop request of one parallel call or stream. A call made from inside a
+// task of another one stops along with it, so the first failure stops
+// every nested stage too.
+class stop_flag {
+  std::atomic<bool> stopped_{false};
+  const stop_flag *parent_;
+  const cancellation *token_;
+
+public:
+  explicit stop_flag(const stop_flag *parent, const cancellation *token = nullptr)
+      : parent_(parent), token_(token) {}
+
+  void request_stop() { stopped_.store(true, std::memory_order_release); }
+
+  bool requested() const {
+    for (auto flag = this; flag; flag = flag->parent_) {
+      if (flag->stopped_.load(std::memory_order_acquire) ||
+          (flag->token_ && flag->token_->cancelled())) {
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+// The stop flag of the task running on this thread, if any
+inline const stop_flag *&current_stop() {
+  static thread_local const stop_flag *flag = nullptr;
+  return flag;
+}
+
+// Makes `flag` the current stop flag while in scope
+class stop_scope {
+  const stop_flag *previous_;
+
+public:
+  explicit stop_scope(const stop_flag &flag) : previous_(current_stop()) { current_stop() = &flag; }
+
+  stop_scope(const stop_scope &) = delete;
+  stop_scope &operator=(const stop_scope &) = delete;
+
+  ~stop_scope() { current_stop() = previous_; }
+};
+
+} // namespace details
+
+// Whether the stage calling this should give up early: another task of its
+// stage (or of a stage it is nested in) failed, its cancellation fired, or
+// its stream is stopping. Long-running functions can poll it and return
+// early; the stage then throws instead of returning partial results.
+inline bool stop_requested() {
+  const auto flag = details::current_stop();
+  return flag && flag->requested();
+}
+
+} // namespace pipeline
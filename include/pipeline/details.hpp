@@ -1,14 +1,51 @@
 #pragma once
+#include <iterator>
 #include <tuple>
+#include <type_traits>
+
+// Coroutine support (pipeline::task, async stages) when built as C++20
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define PIPELINE_HAS_COROUTINES
+#endif
+
+// Promise that a pointer doesn't alias any other pointer in scope, so that
+// loops over it can be vectorized without runtime overlap checks
+#if defined(__GNUC__) || defined(_MSC_VER)
+#define PIPELINE_RESTRICT __restrict
+#else
+#define PIPELINE_RESTRICT
+#endif
 
 namespace pipeline {
 
+template <typename Fn> class fn;
+
+template <typename Fn> class map;
+
+template <typename Pred, typename Fn> class filter;
+
 template <typename T1, typename T2> class pipe_pair;
 
 template <typename Fn, typename... Fns> class fork_into;
 
 namespace details {
 
+// Whether filter stage T1 fuses with stage T2, see filter::operator|
+template <typename T1, typename T2> struct fuses_with_filter : std::false_type {};
+
+// How an iterator can be moved around: its iterator_concept if it has one,
+// since an iterator whose reference is a value (the lines of a file, the
+// elements of a lazy map) can only claim input_iterator_tag as its
+// iterator_category
+template <typename Iterator, typename = void> struct iterator_concept {
+  typedef typename std::iterator_traits<Iterator>::iterator_category type;
+};
+
+template <typename Iterator>
+struct iterator_concept<Iterator, std::void_t<typename Iterator::iterator_concept>> {
+  typedef typename Iterator::iterator_concept type;
+};
+
 // is_tuple constexpr check
 template <typename> struct is_tuple : std::false_type {};
 template <typename... T> struct is_tuple<std::tuple<T...>> : std::true_type {};
@@ -50,6 +87,10 @@ template <typename... Ts, typename F> void for_each_in_tuple(std::tuple<Ts...> c
   for_each(t, f, std::make_integer_sequence<int, sizeof...(Ts)>());
 }
 
+template <typename... Ts, typename F> void for_each_in_tuple(std::tuple<Ts...> &t, F f) {
+  for_each(t, f, std::make_integer_sequence<int, sizeof...(Ts)>());
+}
+
 } // namespace details
 
 } // namespace pipeline
\ No newline at end of file
@@ -0,0 +1,121 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <pipeline/cancellation.hpp>
+#include <pipeline/details.hpp>
+#include <thread>
+#include <type_traits>
+
+namespace pipeline {
+
+// An executor runs the tasks submitted by the parallel stages
+// (for_each, fork_into, unzip_into). Derive from this class to plug
+// in your own scheduler; see thread_pool for the default one.
+class executor {
+public:
+  virtual ~executor() = default;
+
+  // Run `task` at some point, possibly on another thread
+  virtual void execute(std::function<void()> task) = 0;
+
+  // Number of tasks that can make progress at once; used to size chunks
+  virtual std::size_t concurrency() const { return std::thread::hardware_concurrency(); }
+
+  // Runs one pending task on the calling thread, if there is one, and
+  // returns whether it did. A stage waiting for its tasks calls this to
+  // help out instead of blocking. Executors that can't, or won't on this
+  // thread, return false.
+  virtual bool try_run_pending() { return false; }
+};
+
+namespace details {
+
+// Counts the tasks of one parallel call still in flight and keeps the
+// first exception they threw. Lives on the caller's stack, so waiting for
+// a batch of tasks needs no shared state on the heap. While waiting, the
+// caller runs pending tasks of the executor, so a join nested in a task
+// keeps its worker busy instead of idling it.
+//
+// The first failure, a fired cancellation or a stop of the enclosing
+// call or stream stops the group: tasks check skip() before they start
+// and skip their work, and wait() throws. A group stopped only after all
+// of its work was done doesn't throw.
+class task_group {
+  executor &executor_;
+  stop_flag stop_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::size_t pending_{0};
+  std::exception_ptr error_;
+  std::atomic<bool> skipped_{false};
+
+  bool finished() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return pending_ == 0;
+  }
+
+public:
+  explicit task_group(executor &ex, const cancellation *token = nullptr)
+      : executor_(ex), stop_(current_stop(), token) {}
+
+  const stop_flag &stop() const { return stop_; }
+
+  // Called before a piece of work starts: true if the group is stopped,
+  // in which case the work is skipped and wait() throws
+  bool skip() {
+    if (!stop_.requested()) {
+      return false;
+    }
+    skipped_.store(true, std::memory_order_relaxed);
+    return true;
+  }
+
+  void add() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++pending_;
+  }
+
+  // Called by a task when it is finished; its last access to the group
+  void done() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--pending_ == 0) {
+      cv_.notify_all();
+    }
+  }
+
+  void fail(std::exception_ptr error) {
+    stop_.request_stop();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!error_) {
+      error_ = std::move(error);
+    }
+  }
+
+  // Blocks until every task is done, then rethrows the first exception, or
+  // throws operation_cancelled if work was skipped
+  void wait() {
+    while (!finished()) {
+      if (!executor_.try_run_pending()) {
+        // nothing to help with; our tasks are running elsewhere
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait_for(lock, std::chrono::microseconds(100), [this] { return pending_ == 0; });
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+    if (skipped_.load(std::memory_order_relaxed)) {
+      throw operation_cancelled();
+    }
+  }
+};
+
+} // namespace details
+
+} // namespace pipeline
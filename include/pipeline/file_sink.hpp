@@ -0,0 +1,447 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <pipeline/details.hpp>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <climits>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#else
+#include <fstream>
+#endif
+
+namespace pipeline {
+
+// When a file_sink asks the OS to make its writes durable (fsync)
+enum class sync_policy {
+  never,      // leave it to the OS
+  on_flush,   // after the writes of each flush() and close()
+  every_write // after every batch of buffers written
+};
+
+namespace details {
+
+typedef std::vector<char> write_buffer;
+
+// The file a file_sink writes to. Writes a batch of buffers with one
+// writev call where possible.
+class output_file {
+#if defined(__unix__) || defined(__APPLE__)
+  int fd_{-1};
+  std::string path_;
+
+  [[noreturn]] void fail() const {
+    throw std::system_error(errno, std::generic_category(), "pipeline::file_sink: " + path_);
+  }
+
+public:
+  explicit output_file(const std::string &path) : path_(path) {
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0) {
+      fail();
+    }
+  }
+
+  ~output_file() { ::close(fd_); }
+
+  void write(std::vector<write_buffer> &buffers) {
+    std::vector<iovec> pending;
+    for (auto &buffer : buffers) {
+      if (!buffer.empty()) {
+        pending.push_back(iovec{buffer.data(), buffer.size()});
+      }
+    }
+    auto first = pending.begin();
+    while (first != pending.end()) {
+      const auto count = std::min<std::ptrdiff_t>(pending.end() - first, IOV_MAX);
+      const auto written = ::writev(fd_, &*first, static_cast<int>(count));
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        fail();
+      }
+      // skip what was written, which may end in the middle of a buffer
+      auto left = static_cast<std::size_t>(written);
+      while (first != pending.end() && left >= first->iov_len) {
+        left -= first->iov_len;
+        ++first;
+      }
+      if (left > 0) {
+        first->iov_base = static_cast<char *>(first->iov_base) + left;
+        first->iov_len -= left;
+      }
+    }
+  }
+
+  void sync() {
+    if (::fsync(fd_) != 0) {
+      fail();
+    }
+  }
+#else
+  std::ofstream file_;
+  std::string path_;
+
+  [[noreturn]] void fail() const {
+    throw std::system_error(std::make_error_code(std::errc::io_error),
+                            "pipeline::file_sink: " + path_);
+  }
+
+public:
+  explicit output_file(const std::string &path)
+      : file_(path, std::ios::binary | std::ios::trunc), path_(path) {
+    if (!file_) {
+      fail();
+    }
+  }
+
+  void write(std::vector<write_buffer> &buffers) {
+    for (auto &buffer : buffers) {
+      file_.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    }
+    if (!file_) {
+      fail();
+    }
+  }
+
+  void sync() {
+    if (!file_.flush()) {
+      fail();
+    }
+  }
+#endif
+};
+
+// The state a file_sink and its copies share: the buffer being filled,
+// the full buffers waiting for the writer thread and the written ones
+// waiting to be reused.
+class file_writer {
+  static constexpr auto no_interval = std::chrono::steady_clock::duration::max();
+
+  output_file file_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::size_t buffer_size_{1 << 20};
+  std::size_t buffers_{2};
+  sync_policy sync_{sync_policy::never};
+  std::chrono::steady_clock::duration flush_interval_{no_interval};
+  write_buffer active_;
+  std::vector<write_buffer> full_;
+  std::vector<write_buffer> free_;
+  std::size_t writing_{0};
+  std::uint64_t submitted_{0}; // buffers handed to the writer
+  std::uint64_t written_{0};
+  std::uint64_t syncs_requested_{0}; // by flush(), with sync_policy::on_flush
+  std::uint64_t synced_{0};
+  bool stop_{false};
+  std::exception_ptr error_;
+  std::thread thread_;
+
+  void rethrow_if_failed() {
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+  }
+
+  // Hands the active buffer to the writer and starts a new one
+  void submit() {
+    full_.push_back(std::move(active_));
+    ++submitted_;
+    if (free_.empty()) {
+      active_ = write_buffer();
+    } else {
+      active_ = std::move(free_.back());
+      free_.pop_back();
+    }
+    active_.reserve(buffer_size_);
+    cv_.notify_all();
+  }
+
+  // Makes room for `size` more bytes, handing the active buffer off once
+  // it is full; blocks while every other buffer is still being written
+  void reserve(std::unique_lock<std::mutex> &lock, std::size_t size) {
+    rethrow_if_failed();
+    if (stop_) {
+      throw std::logic_error("pipeline::file_sink: the sink is closed");
+    }
+    if (active_.empty() || active_.size() + size <= buffer_size_) {
+      return;
+    }
+    cv_.wait(lock, [this] { return full_.size() + writing_ + 1 < buffers_ || error_; });
+    rethrow_if_failed();
+    submit();
+  }
+
+  bool has_work() const { return !full_.empty() || synced_ < syncs_requested_; }
+
+  void run() {
+    std::vector<write_buffer> batch;
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto last_flush = std::chrono::steady_clock::now();
+    while (true) {
+      if (flush_interval_ == no_interval) {
+        cv_.wait(lock, [this] {
+          return stop_ || has_work() || flush_interval_ != no_interval;
+        });
+      } else if (!cv_.wait_until(lock, last_flush + flush_interval_,
+                                 [this] { return stop_ || has_work(); })) {
+        // time-based flush of a partly filled buffer
+        if (!active_.empty() && !error_) {
+          submit();
+        }
+        last_flush = std::chrono::steady_clock::now();
+      }
+      if (!has_work()) {
+        if (stop_) {
+          return;
+        }
+        continue;
+      }
+
+      // a flush() syncs even when it had nothing left to write
+      batch.swap(full_);
+      writing_ = batch.size();
+      const auto syncs = syncs_requested_;
+      const bool sync = (sync_ == sync_policy::every_write && !batch.empty()) || synced_ < syncs;
+      lock.unlock();
+      std::exception_ptr error;
+      try {
+        file_.write(batch);
+        if (sync) {
+          file_.sync();
+        }
+      } catch (...) {
+        error = std::current_exception();
+      }
+      lock.lock();
+
+      if (error && !error_) {
+        error_ = error;
+      }
+      written_ += batch.size();
+      synced_ = syncs;
+      writing_ = 0;
+      for (auto &buffer : batch) {
+        buffer.clear();
+        free_.push_back(std::move(buffer));
+      }
+      batch.clear();
+      cv_.notify_all();
+    }
+  }
+
+public:
+  explicit file_writer(const std::string &path) : file_(path), thread_([this] { run(); }) {
+    active_.reserve(buffer_size_);
+  }
+
+  file_writer(const file_writer &) = delete;
+  file_writer &operator=(const file_writer &) = delete;
+
+  ~file_writer() {
+    try {
+      close();
+    } catch (...) {
+      // errors are reported by an explicit flush() or close()
+    }
+  }
+
+  void configure(std::size_t buffer_size, std::size_t buffers, sync_policy sync,
+                 std::chrono::steady_clock::duration flush_interval) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      buffer_size_ = std::max<std::size_t>(buffer_size, 1);
+      buffers_ = std::max<std::size_t>(buffers, 2);
+      sync_ = sync;
+      flush_interval_ = flush_interval;
+    }
+    cv_.notify_all();
+  }
+
+  // Appends whatever `write(buffer)` appends, at most `size` bytes
+  template <typename Write> void append(std::size_t size, Write &&write) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    reserve(lock, size);
+    write(active_);
+  }
+
+  // Hands off what was appended so far and waits until it is written (and
+  // synced, with sync_policy::on_flush)
+  void flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    rethrow_if_failed();
+    if (!active_.empty()) {
+      submit();
+    }
+    const auto target = submitted_;
+    const auto sync_target = sync_ == sync_policy::on_flush ? ++syncs_requested_ : synced_;
+    cv_.notify_all();
+    cv_.wait(lock, [this, target, sync_target] {
+      return (written_ >= target && synced_ >= sync_target) || error_;
+    });
+    rethrow_if_failed();
+  }
+
+  void close() {
+    if (!thread_.joinable()) {
+      return;
+    }
+    std::exception_ptr error;
+    try {
+      flush();
+    } catch (...) {
+      error = std::current_exception();
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+};
+
+template <typename T>
+constexpr bool is_text = std::is_convertible<const T &, std::string_view>::value;
+
+template <typename T, typename = void> struct is_text_range : std::false_type {};
+
+template <typename T>
+struct is_text_range<T, std::void_t<decltype(std::begin(std::declval<const T &>()))>>
+    : std::bool_constant<is_text<typename std::decay<decltype(
+          *std::begin(std::declval<const T &>()))>::type>> {};
+
+} // namespace details
+
+// Sink stage that writes each record it is given to a file, followed by a
+// delimiter ("\n" by default). Records are strings, numbers (formatted
+// with std::to_chars, bools as 0 or 1) or ranges of strings.
+//
+// Records are copied into large buffers that a background thread writes
+// out, several at a time with writev, so the stages feeding the sink never
+// wait on a write syscall unless every buffer is still being written.
+// Copies of the sink share its file, buffers and thread; records from
+// concurrent callers don't interleave but come in no particular order.
+// Written records reach the file once a buffer fills up, on flush() or
+// close(), when the last copy of the sink is destroyed, or every
+// flush_every(interval).
+class file_sink {
+  std::shared_ptr<details::file_writer> writer_;
+  std::string delimiter_{"\n"};
+  std::size_t buffer_size_{1 << 20};
+  std::size_t buffers_{2};
+  sync_policy sync_{sync_policy::never};
+  std::chrono::steady_clock::duration flush_interval_{std::chrono::steady_clock::duration::max()};
+
+  void configure() { writer_->configure(buffer_size_, buffers_, sync_, flush_interval_); }
+
+  void write_text(std::string_view text) {
+    writer_->append(text.size() + delimiter_.size(), [&](details::write_buffer &buffer) {
+      buffer.insert(buffer.end(), text.begin(), text.end());
+      buffer.insert(buffer.end(), delimiter_.begin(), delimiter_.end());
+    });
+  }
+
+public:
+  // Creates (or truncates) the file at `path`
+  explicit file_sink(const std::string &path)
+      : writer_(std::make_shared<details::file_writer>(path)) {}
+
+  // Bytes per buffer, 1 MiB by default
+  file_sink &buffer_size(std::size_t bytes) & {
+    buffer_size_ = bytes;
+    configure();
+    return *this;
+  }
+
+  file_sink &&buffer_size(std::size_t bytes) && { return std::move(buffer_size(bytes)); }
+
+  // Number of buffers, at least (and by default) 2: one being filled while
+  // the others are written
+  file_sink &buffers(std::size_t count) & {
+    buffers_ = count;
+    configure();
+    return *this;
+  }
+
+  file_sink &&buffers(std::size_t count) && { return std::move(buffers(count)); }
+
+  file_sink &sync(sync_policy policy) & {
+    sync_ = policy;
+    configure();
+    return *this;
+  }
+
+  file_sink &&sync(sync_policy policy) && { return std::move(sync(policy)); }
+
+  // Also write partly filled buffers once `interval` has passed, so that
+  // records of a slow stream don't sit in memory indefinitely
+  file_sink &flush_every(std::chrono::steady_clock::duration interval) & {
+    flush_interval_ = interval;
+    configure();
+    return *this;
+  }
+
+  file_sink &&flush_every(std::chrono::steady_clock::duration interval) && {
+    return std::move(flush_every(interval));
+  }
+
+  // Written after each record; may be empty
+  file_sink &delimiter(std::string delimiter) & {
+    delimiter_ = std::move(delimiter);
+    return *this;
+  }
+
+  file_sink &&delimiter(std::string delimiter) && {
+    return std::move(this->delimiter(std::move(delimiter)));
+  }
+
+  template <typename T> void operator()(const T &record) {
+    if constexpr (details::is_text<T>) {
+      write_text(record);
+    } else if constexpr (std::is_same<T, bool>::value) {
+      write_text(record ? "1" : "0");
+    } else if constexpr (std::is_arithmetic<T>::value) {
+      char text[64];
+      const auto end = std::to_chars(text, text + sizeof text, record).ptr;
+      write_text(std::string_view(text, static_cast<std::size_t>(end - text)));
+    } else {
+      static_assert(details::is_text_range<T>::value,
+                    "file_sink writes strings, numbers or ranges of strings");
+      for (const auto &item : record) {
+        write_text(item);
+      }
+    }
+  }
+
+  // Waits until every record given so far is written; rethrows a write
+  // error, if any
+  void flush() { writer_->flush(); }
+
+  // Flushes and stops the background thread; the sink can't be used after
+  void close() { writer_->close(); }
+};
+
+} // namespace pipeline
@@ -0,0 +1,189 @@
+#pragma once
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <numeric>
+#include <pipeline/details.hpp>
+#include <pipeline/fn.hpp>
+#include <pipeline/for_each.hpp>
+#include <pipeline/parallel_for.hpp>
+#include <pipeline/parallel_stage.hpp>
+#include <pipeline/thread_pool.hpp>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace pipeline {
+
+namespace details {
+
+// filter on its own: survivors are copied as they are
+struct keep {};
+
+template <typename Pred, typename Fn>
+struct fuses_with_filter<filter<Pred, keep>, pipeline::for_each<Fn, false>> : std::true_type {};
+
+} // namespace details
+
+// Keeps the elements of a container for which pred(element) is true, in
+// order, evaluating pred in parallel chunks. A first pass records which
+// elements pass and counts them per chunk; a prefix sum over the counts
+// gives each chunk its offset into a result of exactly the right size,
+// which the second pass fills in parallel. Elements of a non-const
+// container rvalue are moved rather than copied. Each chunk calls its own
+// copies of pred and fn. Elements are read once each: when reading one
+// makes a new value (a lazy map calls its function), each chunk keeps its
+// survivors until the second pass moves them into the result.
+//
+// filter(pred) | for_each(fn) fuses into one stage that calls fn on the
+// survivors only and writes its results straight into the output, so
+// neither rejected elements nor the survivors themselves are ever copied.
+// With a void fn it is a single pass: fn is called right after pred.
+template <typename Pred, typename Fn = details::keep>
+class filter : public details::chunked_stage<filter<Pred, Fn>> {
+  template <typename, typename> friend class filter;
+
+  Pred pred_;
+  Fn fn_;
+
+  static constexpr bool keeps = std::is_same<Fn, details::keep>::value;
+
+public:
+  filter(Pred pred, Fn fn = {}) : pred_(std::move(pred)), fn_(std::move(fn)) {}
+
+  template <typename Container> auto operator()(Container &&args) {
+    typedef typename std::decay<Container>::type::value_type value_type;
+    typedef typename std::conditional<keeps, std::decay<value_type>,
+                                      std::invoke_result<Fn &, value_type &>>::type::type
+        fn_result_type;
+    typedef typename std::conditional<std::is_same<fn_result_type, void>::value, void,
+                                      typename std::decay<fn_result_type>::type>::type
+        result_type;
+    constexpr bool moves = keeps && std::is_rvalue_reference<Container &&>::value &&
+                           !std::is_const<typename std::remove_reference<Container>::type>::value;
+    // *it makes a new element on every call (a lazy map calls its function
+    // again), so such elements are read once and kept until they're placed
+    constexpr bool buffers = !std::is_reference<decltype(*std::begin(args))>::value;
+
+    auto &ex = this->get_executor();
+    const details::loop_range<decltype(std::begin(args))> input(std::begin(args), std::end(args));
+    const auto size = input.size();
+    const auto grain = input.grain(this->grain(size, ex));
+
+    if constexpr (std::is_same<result_type, void>::value) {
+      details::parallel_for(ex, input, grain,
+                            [this](auto it, std::size_t begin, std::size_t end) {
+                              auto pred = pred_;
+                              auto fn = fn_;
+                              for (; begin != end; ++begin, ++it) {
+                                auto &&element = *it;
+                                if (pred(element)) {
+                                  fn(element);
+                                }
+                              }
+                            },
+                            this->cancellation_);
+    } else if constexpr (buffers) {
+      // survivors, or fn of them, per chunk
+      std::vector<std::vector<result_type>> survivors((size + grain - 1) / grain);
+      std::vector<std::size_t> offsets(survivors.size() + 1);
+      details::parallel_for(ex, input, grain,
+                            [this, &survivors, &offsets, grain](auto it, std::size_t begin,
+                                                                std::size_t end) {
+                              auto pred = pred_;
+                              auto fn = fn_;
+                              const auto chunk = begin / grain;
+                              auto &kept = survivors[chunk];
+                              for (; begin != end; ++begin, ++it) {
+                                auto &&element = *it;
+                                if (!pred(element)) {
+                                  continue;
+                                }
+                                if constexpr (keeps) {
+                                  kept.push_back(std::move(element));
+                                } else {
+                                  kept.push_back(fn(element));
+                                }
+                              }
+                              offsets[chunk + 1] = kept.size();
+                            },
+                            this->cancellation_);
+      std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+      details::map_output<result_type, std::allocator<result_type>> output(
+          offsets.back(), std::allocator<result_type>());
+      details::parallel_for(ex, input, grain,
+                            [&survivors, &offsets, &output, grain](auto, std::size_t begin,
+                                                                   std::size_t) {
+                              auto offset = offsets[begin / grain];
+                              for (auto &&value : survivors[begin / grain]) {
+                                output.set(offset++, std::move(value));
+                              }
+                            },
+                            this->cancellation_);
+      return output.take();
+    } else {
+      // which elements pass, and how many per chunk
+      std::unique_ptr<bool[]> passed(new bool[size]);
+      std::vector<std::size_t> offsets((size + grain - 1) / grain + 1);
+      details::parallel_for(ex, input, grain,
+                            [this, &passed, &offsets, grain](auto it, std::size_t begin,
+                                                             std::size_t end) {
+                              auto pred = pred_;
+                              std::size_t count = 0;
+                              for (auto i = begin; i != end; ++i, ++it) {
+                                passed[i] = static_cast<bool>(pred(*it));
+                                count += passed[i];
+                              }
+                              offsets[begin / grain + 1] = count;
+                            },
+                            this->cancellation_);
+      // offsets[c] is where the survivors of chunk c go
+      std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+      details::map_output<result_type, std::allocator<result_type>> output(
+          offsets.back(), std::allocator<result_type>());
+      details::parallel_for(ex, input, grain,
+                            [this, &passed, &offsets, &output, grain](
+                                auto it, std::size_t begin, std::size_t end) {
+                              auto offset = offsets[begin / grain];
+                              auto fn = fn_;
+                              for (; begin != end; ++begin, ++it) {
+                                if (!passed[begin]) {
+                                  continue;
+                                }
+                                if constexpr (moves) {
+                                  output.set(offset++, std::move(*it));
+                                } else if constexpr (keeps) {
+                                  output.set(offset++, *it);
+                                } else {
+                                  output.set(offset++, fn(*it));
+                                }
+                              }
+                            },
+                            this->cancellation_);
+      return output.take();
+    }
+  }
+
+  // filter(pred) | for_each(fn) fuses into a single stage, see above. The
+  // fused stage runs on the for_each's executor and grain size, if set.
+  template <typename T3> auto operator|(T3 &&rhs) const & {
+    return filter(*this) | std::forward<T3>(rhs);
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) && {
+    if constexpr (details::fuses_with_filter<filter, typename std::decay<T3>::type>::value) {
+      auto fn = std::forward<T3>(rhs).fn_;
+      filter<Pred, decltype(fn)> fused(std::move(pred_), std::move(fn));
+      fused.adopt_settings(*this);
+      fused.adopt_settings(rhs);
+      return fused;
+    } else {
+      return pipe_pair<filter<Pred, Fn>, typename std::decay<T3>::type>(std::move(*this),
+                                                                         std::forward<T3>(rhs));
+    }
+  }
+};
+
+} // namespace pipeline
@@ -1,23 +1,104 @@
 #pragma once
 #include <pipeline/details.hpp>
+#include <pipeline/task.hpp>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 
 namespace pipeline {
 
+namespace details {
+
+// A linear chain of functions, each called with the result of the one
+// before it - what fn(a) | fn(b) | fn(c) turns into. Unlike a tree of
+// nested pipe_pairs, the chain is one flat type, so deep chains stay
+// cheap to compile and the optimizer sees a single call.
+template <typename... Fns> class fused {
+  std::tuple<Fns...> fns_;
+
+  template <std::size_t I, typename... T> decltype(auto) call(T &&... args) {
+    auto &stage = std::get<I>(fns_);
+    typedef typename std::invoke_result<decltype(stage), T...>::type result_type;
+    if constexpr (I + 1 == sizeof...(Fns)) {
+      return stage(std::forward<T>(args)...);
+#ifdef PIPELINE_HAS_COROUTINES
+    } else if constexpr (is_task<result_type>::value) {
+      // async stage: the rest of the chain runs once its task is done
+      return then(stage(std::forward<T>(args)...), [this](auto &&... result) -> decltype(auto) {
+        return call<I + 1>(std::forward<decltype(result)>(result)...);
+      });
+#endif
+    } else if constexpr (std::is_same<result_type, void>::value) {
+      stage(std::forward<T>(args)...);
+      return call<I + 1>();
+    } else {
+      return call<I + 1>(stage(std::forward<T>(args)...));
+    }
+  }
+
+public:
+  explicit fused(std::tuple<Fns...> fns) : fns_(std::move(fns)) {}
+
+  template <typename... T> decltype(auto) operator()(T &&... args) {
+    return call<0>(std::forward<T>(args)...);
+  }
+
+  const std::tuple<Fns...> &stages() const & { return fns_; }
+
+  std::tuple<Fns...> stages() && { return std::move(fns_); }
+};
+
+template <typename F> auto fused_stages(F &&f) {
+  if constexpr (is_specialization<typename std::decay<F>::type, fused>::value) {
+    return std::forward<F>(f).stages();
+  } else {
+    return std::make_tuple(std::forward<F>(f));
+  }
+}
+
+template <typename F1, typename F2> auto fuse(F1 &&f1, F2 &&f2) {
+  return fused(std::tuple_cat(fused_stages(std::forward<F1>(f1)),
+                              fused_stages(std::forward<F2>(f2))));
+}
+
+} // namespace details
+
 template <typename Fn> class fn {
+  template <typename> friend class fn;
+
   Fn fn_;
 
 public:
-  fn(Fn fn) : fn_(fn) {}
+  fn(Fn fn) : fn_(std::move(fn)) {}
 
-  template <typename... T> decltype(auto) operator()(T &&... args) { return fn_(args...); }
+  template <typename... T> decltype(auto) operator()(T &&... args) {
+    return fn_(std::forward<T>(args)...);
+  }
 
   template <typename... A> static constexpr bool is_invocable_on() {
     return std::is_invocable<Fn, A...>::value;
   }
 
-  template <typename T> auto operator|(T &&rhs) {
-    return pipe_pair<fn<Fn>, T>(*this, std::forward<T>(rhs));
+  // The wrapped function
+  Fn &function() { return fn_; }
+
+  // fn | fn fuses both functions into a single fn
+  template <typename T> auto operator|(T &&rhs) const & {
+    if constexpr (details::is_specialization<typename std::decay<T>::type, pipeline::fn>::value) {
+      return pipeline::fn(details::fuse(fn_, std::forward<T>(rhs).fn_));
+    } else {
+      return pipe_pair<fn<Fn>, typename std::decay<T>::type>(*this, std::forward<T>(rhs));
+    }
+  }
+
+  template <typename T> auto operator|(T &&rhs) && {
+    if constexpr (details::is_specialization<typename std::decay<T>::type, pipeline::fn>::value) {
+      return pipeline::fn(details::fuse(std::move(fn_), std::forward<T>(rhs).fn_));
+    } else {
+      return pipe_pair<fn<Fn>, typename std::decay<T>::type>(std::move(*this),
+                                                             std::forward<T>(rhs));
+    }
   }
 };
 
-} // namespace pipeline
\ No newline at end of file
+} // namespace pipeline
@@ -1,44 +1,328 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
 #include <pipeline/details.hpp>
 #include <pipeline/fn.hpp>
+#include <pipeline/parallel_for.hpp>
+#include <pipeline/parallel_stage.hpp>
+#include <pipeline/spsc_queue.hpp>
+#include <pipeline/thread_pool.hpp>
+#include <type_traits>
+#include <variant>
 #include <vector>
-#include <future>
 
 namespace pipeline {
 
-template <typename Fn> class for_each {
-  Fn fn_;
+namespace details {
 
-public:
-  for_each(Fn fn) : fn_(fn) {}
+// Streaming state of for_each: calls fn on each item on an executor, with
+// at most `window` items in flight. Ordered, results leave in input order
+// through a reorder buffer of `window` slots. Unordered, they leave as soon
+// as they are done, so one slow item doesn't hold back the ones after it.
+// Once an item fails, or the stream stops, the items still queued are
+// skipped and the first exception is rethrown.
+template <typename Fn, typename In> class parallel_map_state {
+  typedef typename std::invoke_result<Fn &, In>::type result_type;
+  static constexpr bool returns_void = std::is_same<result_type, void>::value;
+  typedef typename std::conditional<returns_void, std::monostate,
+                                    typename std::decay<result_type>::type>::type value_type;
 
-  template <typename Container> decltype(auto) operator()(Container &&args) {
-    typedef typename std::result_of<Fn(typename std::decay<Container>::type::value_type &)>::type result_type;
+  // How often a stage with items in flight checks for finished ones while
+  // no new input arrives
+  static constexpr std::chrono::microseconds poll_interval{100};
 
-    if constexpr (std::is_same<result_type, void>::value) {
-      // result type is void
-      std::vector<std::future<result_type>> futures;
-      for (auto &arg : std::forward<Container>(args)) {
-        futures.push_back(std::async(std::launch::async | std::launch::deferred, fn_, arg));
+  struct slot {
+    std::optional<In> input;
+    std::optional<value_type> value;
+    bool failed{false}; // or skipped
+    std::atomic<bool> done{false};
+  };
+
+  Fn &fn_;
+  executor &executor_;
+  const cancellation *token_;
+  stop_flag stop_;
+  std::mutex error_mutex_;
+  std::exception_ptr error_;
+  bool ordered_;
+  std::size_t window_;
+  std::unique_ptr<slot[]> slots_;
+  std::size_t submitted_{0}; // ordered: sequence number of the next item
+  std::size_t emitted_{0};   // ordered: sequence number of the next result
+  std::vector<std::size_t> free_; // unordered: free slots
+  std::size_t in_flight_{0};
+  std::atomic<std::size_t> running_{0};
+
+  void run(std::size_t index) {
+    auto &s = slots_[index];
+    if (stop_.requested()) {
+      s.failed = true;
+    } else {
+      stop_scope scope(stop_);
+      try {
+        auto fn = fn_;
+        if constexpr (returns_void) {
+          fn(std::move(*s.input));
+          s.value.emplace();
+        } else {
+          s.value.emplace(fn(std::move(*s.input)));
+        }
+      } catch (...) {
+        s.failed = true;
+        stop_.request_stop();
+        std::lock_guard<std::mutex> lock(error_mutex_);
+        if (!error_) {
+          error_ = std::current_exception();
+        }
+      }
+    }
+    s.input.reset();
+    s.done.store(true, std::memory_order_release);
+    running_.fetch_sub(1, std::memory_order_release);
+  }
+
+  void wait_all() {
+    backoff wait;
+    while (running_.load(std::memory_order_acquire) > 0) {
+      wait();
+    }
+  }
+
+  template <typename Emit> void deliver(std::size_t index, Emit &emit) {
+    auto &s = slots_[index];
+    s.done.store(false, std::memory_order_relaxed);
+    --in_flight_;
+    if (s.failed) {
+      // nothing may still refer to this state once the error unwinds it
+      wait_all();
+      std::lock_guard<std::mutex> lock(error_mutex_);
+      if (error_) {
+        std::rethrow_exception(error_);
       }
+      throw operation_cancelled();
+    }
+    if constexpr (!returns_void) {
+      emit(std::move(*s.value));
+    }
+    s.value.reset();
+  }
 
-      for (auto &f : futures) {
-        f.get();
+  // Emits the results that are ready; returns whether there were any
+  template <typename Emit> bool drain(Emit &emit) {
+    bool any = false;
+    if (ordered_) {
+      while (in_flight_ > 0 && slots_[emitted_ % window_].done.load(std::memory_order_acquire)) {
+        deliver(emitted_++ % window_, emit);
+        any = true;
       }
     } else {
-      // result is not void
-      std::vector<result_type> results;
-      std::vector<std::future<result_type>> futures;
-      for (auto &arg : std::forward<Container>(args)) {
-        futures.push_back(std::async(std::launch::async | std::launch::deferred, fn_, arg));
+      for (std::size_t i = 0; i < window_ && in_flight_ > 0; ++i) {
+        if (slots_[i].done.load(std::memory_order_acquire)) {
+          deliver(i, emit);
+          free_.push_back(i);
+          any = true;
+        }
+      }
+    }
+    return any;
+  }
+
+public:
+  typedef typename std::conditional<returns_void, void, value_type>::type output_type;
+
+  parallel_map_state(Fn &fn, executor &ex, const cancellation *token, bool ordered,
+                     std::size_t window)
+      : fn_(fn), executor_(ex), token_(token), stop_(current_stop(), token), ordered_(ordered),
+        window_(std::max<std::size_t>(window, 1)), slots_(std::make_unique<slot[]>(window_)) {
+    if (!ordered_) {
+      for (std::size_t i = window_; i > 0; --i) {
+        free_.push_back(i - 1);
+      }
+    }
+  }
+
+  parallel_map_state(parallel_map_state &&other)
+      : parallel_map_state(other.fn_, other.executor_, other.token_, other.ordered_,
+                           other.window_) {}
+
+  ~parallel_map_state() { wait_all(); }
+
+  template <typename Emit> void process(In &&item, Emit &emit) {
+    backoff wait;
+    while (in_flight_ == window_) {
+      if (!drain(emit)) {
+        wait();
       }
+    }
+
+    std::size_t index;
+    if (ordered_) {
+      index = submitted_++ % window_;
+    } else {
+      index = free_.back();
+      free_.pop_back();
+    }
+    slots_[index].input.emplace(std::move(item));
+    ++in_flight_;
+    running_.fetch_add(1, std::memory_order_relaxed);
+    executor_.execute([this, index] { run(index); });
 
-      for (auto &f : futures) {
-        results.push_back(f.get());
+    drain(emit);
+  }
+
+  template <typename Emit> void flush(Emit &emit) { drain(emit); }
+
+  // Input has ended: wait for the items in flight
+  template <typename Emit> void finish(Emit &emit) {
+    backoff wait;
+    while (in_flight_ > 0) {
+      if (!drain(emit)) {
+        wait();
       }
-      return results;
     }
   }
+
+  std::chrono::steady_clock::time_point deadline() const {
+    return in_flight_ > 0 ? std::chrono::steady_clock::now() + poll_interval
+                          : std::chrono::steady_clock::time_point::max();
+  }
+};
+
+} // namespace details
+
+// Calls fn on every element of a container, in chunks on an executor.
+// Each chunk (and, in a stream, each item) works on its own copy of fn,
+// so a stateful or mutable function object is never called from two
+// threads at once.
+//
+// Pmr: results are a std::pmr::vector allocated from a memory resource,
+// see allocate_from()
+template <typename Fn, bool Pmr = false>
+class for_each : public details::chunked_stage<for_each<Fn, Pmr>> {
+  template <typename, bool> friend class for_each;
+  template <typename, typename> friend class filter;
+
+  Fn fn_;
+  std::pmr::memory_resource *resource_{nullptr};
+  bool ordered_{true};
+  std::size_t window_{0};
+
+  template <typename T> auto allocator() const {
+    if constexpr (Pmr) {
+      return std::pmr::polymorphic_allocator<T>(resource_);
+    } else {
+      return std::allocator<T>();
+    }
+  }
+
+public:
+  for_each(Fn fn) : fn_(std::move(fn)) {}
+
+  // In a stream, for_each calls the function on each item, several items at
+  // once on the executor, with at most `window` items in flight (0, the
+  // default, is twice the executor's concurrency). ordered() - the default -
+  // emits results in input order, holding back finished results behind a
+  // slower one; unordered() emits them as soon as they are done.
+  for_each &ordered(std::size_t window = 0) & {
+    ordered_ = true;
+    window_ = window;
+    return *this;
+  }
+
+  for_each &&ordered(std::size_t window = 0) && {
+    ordered_ = true;
+    window_ = window;
+    return std::move(*this);
+  }
+
+  for_each &unordered(std::size_t window = 0) & {
+    ordered_ = false;
+    window_ = window;
+    return *this;
+  }
+
+  for_each &&unordered(std::size_t window = 0) && {
+    ordered_ = false;
+    window_ = window;
+    return std::move(*this);
+  }
+
+  // Allocate results from `resource` and return them as a std::pmr::vector.
+  // With a pooling resource (e.g., std::pmr::unsynchronized_pool_resource)
+  // a pipeline called over and over reuses the same memory instead of
+  // going to the heap each time.
+  for_each<Fn, true> allocate_from(std::pmr::memory_resource &resource) const & {
+    return for_each(*this).allocate_from(resource);
+  }
+
+  for_each<Fn, true> allocate_from(std::pmr::memory_resource &resource) && {
+    for_each<Fn, true> result(std::move(fn_));
+    result.adopt_settings(*this);
+    result.resource_ = &resource;
+    result.ordered_ = ordered_;
+    result.window_ = window_;
+    return result;
+  }
+
+  template <typename Container> decltype(auto) operator()(Container &&args) {
+    typedef typename std::result_of<Fn(typename std::decay<Container>::type::value_type &)>::type result_type;
+
+    auto &ex = this->get_executor();
+    const details::loop_range<decltype(std::begin(args))> input(std::begin(args), std::end(args));
+    const auto size = input.size();
+    const auto grain = this->grain(size, ex);
+
+    if constexpr (std::is_same<result_type, void>::value) {
+      // result type is void
+      details::parallel_for(ex, input, grain,
+                            [this](auto it, std::size_t begin, std::size_t end) {
+                              auto fn = fn_;
+                              for (; begin != end; ++begin, ++it) {
+                                fn(*it);
+                              }
+                            },
+                            this->cancellation_);
+    } else {
+      // result is not void - each chunk writes its results in place
+      details::map_output<result_type, decltype(allocator<result_type>())> output(
+          size, allocator<result_type>());
+      details::parallel_for(ex, input, grain,
+                            [this, &output](auto it, std::size_t begin, std::size_t end) {
+                              auto fn = fn_;
+                              for (; begin != end; ++begin, ++it) {
+                                output.set(begin, fn(*it));
+                              }
+                            },
+                            this->cancellation_);
+      return output.take();
+    }
+  }
+
+  // Streams of items the function takes one at a time (rather than streams
+  // of containers) run through a parallel_map_state
+  template <typename In, typename = std::enable_if_t<std::is_invocable<Fn &, In>::value>>
+  auto stream_state() {
+    auto &ex = this->get_executor();
+    return details::parallel_map_state<Fn, In>(fn_, ex, this->cancellation_, ordered_,
+                                               window_ ? window_ : 2 * ex.concurrency());
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) const & {
+    return pipe_pair<for_each<Fn, Pmr>, typename std::decay<T3>::type>(*this,
+                                                                       std::forward<T3>(rhs));
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) && {
+    return pipe_pair<for_each<Fn, Pmr>, typename std::decay<T3>::type>(std::move(*this),
+                                                                       std::forward<T3>(rhs));
+  }
 };
 
-} // namespace pipeline
\ No newline at end of file
+} // namespace pipeline
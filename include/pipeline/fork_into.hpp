@@ -1,48 +1,216 @@
 #pragma once
+#include <exception>
 #include <functional>
-#include <future>
+#include <optional>
 #include <pipeline/details.hpp>
 #include <pipeline/fn.hpp>
+#include <pipeline/parallel_stage.hpp>
+#include <pipeline/thread_pool.hpp>
 #include <thread>
+#include <tuple>
+#include <utility>
+#include <variant>
+#include <vector>
 
 namespace pipeline {
 
-template <typename Fn, typename... Fns> class fork_into {
+// Marks a fork_into / fork_into_tuple / unzip_into branch as cheap: it
+// runs on the calling thread instead of being handed to the executor
+template <typename Fn> class cheap {
+  Fn fn_;
+
+public:
+  cheap(Fn fn) : fn_(std::move(fn)) {}
+
+  template <typename... T> decltype(auto) operator()(T &&... args) {
+    return fn_(std::forward<T>(args)...);
+  }
+};
+
+namespace details {
+
+// Result of a fork branch; void becomes std::monostate so that it fits in a tuple
+template <typename T> struct branch_result { typedef T type; };
+template <> struct branch_result<void> { typedef std::monostate type; };
+
+template <typename F> auto invoke_branch(F &f) {
+  typedef typename std::invoke_result<F &>::type result_type;
+  if constexpr (std::is_same<result_type, void>::value) {
+    f();
+    return std::monostate{};
+  } else {
+    return typename branch_result<result_type>::type(f());
+  }
+}
+
+// A trivial branch result (a number, most often) is value-initialized up
+// front rather than kept in a std::optional, so no uninitialized bytes are
+// ever copied, even on paths the compiler can't rule out
+template <typename T> class trivial_value {
+  T value_{};
+  bool engaged_{false};
+
+public:
+  template <typename U> void emplace(U &&value) {
+    value_ = std::forward<U>(value);
+    engaged_ = true;
+  }
+
+  explicit operator bool() const { return engaged_; }
+
+  T &operator*() { return value_; }
+};
+
+template <typename T>
+using branch_value =
+    typename std::conditional<std::is_trivially_copyable<T>::value &&
+                                  std::is_default_constructible<T>::value &&
+                                  std::is_move_assignable<T>::value,
+                              trivial_value<T>, std::optional<T>>::type;
+
+// Result slot of one fork branch. An exception is passed to the group,
+// which stops the branches that haven't started yet and rethrows it once
+// every branch is joined. An offloaded branch is handed to the executor as
+// a pointer to its slot, which std::function stores without allocating.
+template <typename Call> class branch {
+  typedef decltype(std::declval<Call &>()()) result_type;
+
+  // Converts to the result of call_, so the result is constructed right in
+  // value_ rather than moved there from a temporary
+  struct result_of_call {
+    Call &call;
+    operator result_type() const { return call(); }
+  };
+
+  Call &call_;
+  task_group *group_{nullptr};
+  branch_value<result_type> value_;
+
+public:
+  explicit branch(Call &call) : call_(call) {}
+
+  void run(task_group &group) {
+    if (group.skip()) {
+      return;
+    }
+    stop_scope scope(group.stop());
+    try {
+      value_.emplace(result_of_call{call_});
+    } catch (...) {
+      group.fail(std::current_exception());
+    }
+  }
+
+  // Runs the branch on `ex`; `group` tracks when it is done
+  void start(executor &ex, task_group &group) {
+    group_ = &group;
+    group.add();
+    try {
+      ex.execute([this] {
+        run(*group_);
+        group_->done();
+      });
+    } catch (...) {
+      group.fail(std::current_exception());
+      group.done();
+    }
+  }
+
+  // Only called once the group was joined without an error, so every
+  // branch has a value
+  result_type get() {
+    if (!value_) {
+      throw operation_cancelled();
+    }
+    return std::move(*value_);
+  }
+};
+
+// The calling thread would only block while waiting for the branches, so
+// it runs the last one itself, along with any branch marked cheap
+template <std::size_t I, std::size_t N, typename Fn>
+constexpr bool runs_inline = I + 1 == N || is_specialization<Fn, cheap>::value;
+
+// Runs each call in the tuple `calls` once, in parallel on `ex`; call I
+// runs on the calling thread if Inline[I]. Waits for all of them and
+// returns their results as a tuple. The completion latch and the result
+// slots live on this stack frame, since the number of branches is fixed.
+template <typename Calls, bool... Inline, std::size_t... Is>
+auto run_branches(executor &ex, const cancellation *token, Calls &calls,
+                  std::integer_sequence<bool, Inline...>, std::index_sequence<Is...>) {
+  std::tuple<branch<typename std::tuple_element<Is, Calls>::type>...> branches{
+      std::get<Is>(calls)...};
+
+  // offload branches left to right, then run the inline ones
+  task_group group(ex, token);
+  ((Inline ? void() : std::get<Is>(branches).start(ex, group)), ...);
+  ((Inline ? std::get<Is>(branches).run(group) : void()), ...);
+
+  // join every branch before an exception can unwind what they refer to
+  group.wait();
+  return std::make_tuple(std::get<Is>(branches).get()...);
+}
+
+// Runs every function in `fns` on the same `args`, in parallel on `ex`.
+// Waits for all of them and returns their results as a tuple.
+template <typename Fns, typename ArgsTuple, std::size_t... Is>
+auto fork(executor &ex, const cancellation *token, Fns &fns, const ArgsTuple &args,
+          std::index_sequence<Is...>) {
+  auto calls = std::make_tuple([&fn = std::get<Is>(fns), &args] {
+    auto call = [&] { return std::apply(fn, args); };
+    return invoke_branch(call);
+  }...);
+  return run_branches(
+      ex, token, calls,
+      std::integer_sequence<bool, runs_inline<Is, sizeof...(Is),
+                                              typename std::tuple_element<Is, Fns>::type>...>{},
+      std::index_sequence<Is...>{});
+}
+
+// The results of a fork, moved into a std::vector<R>
+template <typename R, typename Results> std::vector<R> to_vector(Results &&results) {
+  return std::apply(
+      [](auto &&... branch_results) {
+        std::vector<R> vector;
+        vector.reserve(sizeof...(branch_results));
+        (vector.push_back(std::move(branch_results)), ...);
+        return vector;
+      },
+      std::forward<Results>(results));
+}
+
+} // namespace details
+
+template <typename Fn, typename... Fns>
+class fork_into : public details::parallel_stage<fork_into<Fn, Fns...>> {
   std::tuple<Fn, Fns...> fns_;
 
 public:
-  fork_into(Fn first, Fns... fns) : fns_(first, fns...) {}
+  fork_into(Fn first, Fns... fns) : fns_(std::move(first), std::move(fns)...) {}
 
   template <typename... Args> decltype(auto) operator()(Args &&... args) {
-    typedef typename std::result_of<Fn(Args...)>::type result_type;
-
-    std::vector<std::future<result_type>> futures;
-
-    auto apply_fn = [&futures,
-                     args_tuple = std::tuple<Args...>(std::forward<Args>(args)...)](auto fn) {
-      auto unpack = [](auto tuple, auto fn) { return details::apply(tuple, fn); };
-      futures.push_back(
-          std::async(std::launch::async | std::launch::deferred, unpack, args_tuple, fn));
-    };
-
-    details::for_each_in_tuple(fns_, apply_fn);
-
-    if constexpr (std::is_same<result_type, void>::value) {
-      for (auto &f : futures) {
-        f.get();
-      }
-    } else {
-      std::vector<result_type> results;
-      for (auto &f : futures) {
-        results.push_back(f.get());
-      }
-      return results;
+    typedef typename std::result_of<Fn(const typename std::decay<Args>::type &...)>::type
+        result_type;
+
+    // Every branch reads the same, immutable arguments
+    const auto args_tuple = std::forward_as_tuple(std::as_const(args)...);
+    auto results = details::fork(this->get_executor(), this->cancellation_, fns_, args_tuple,
+                                 std::index_sequence_for<Fn, Fns...>{});
+
+    if constexpr (!std::is_same<result_type, void>::value) {
+      return details::to_vector<result_type>(std::move(results));
     }
   }
 
-  template <typename T3> auto operator|(T3 &&rhs) {
-    return pipe_pair<fork_into<Fn, Fns...>, T3>(*this, std::forward<T3>(rhs));
+  template <typename T3> auto operator|(T3 &&rhs) const & {
+    return pipe_pair<fork_into<Fn, Fns...>, typename std::decay<T3>::type>(*this,
+                                                                           std::forward<T3>(rhs));
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) && {
+    return pipe_pair<fork_into<Fn, Fns...>, typename std::decay<T3>::type>(std::move(*this),
+                                                                           std::forward<T3>(rhs));
   }
 };
 
-} // namespace pipeline
\ No newline at end of file
+} // namespace pipeline
@@ -0,0 +1,40 @@
+#pragma once
+#include <pipeline/details.hpp>
+#include <pipeline/fork_into.hpp>
+#include <pipeline/parallel_stage.hpp>
+#include <pipeline/thread_pool.hpp>
+#include <tuple>
+#include <utility>
+
+namespace pipeline {
+
+// Like fork_into, but returns std::tuple<R1, R2, ...> holding the result
+// of each branch with its own type, so the branches don't need to agree
+// on a common result type (or a std::variant). Branches returning void
+// contribute a std::monostate.
+template <typename Fn, typename... Fns>
+class fork_into_tuple : public details::parallel_stage<fork_into_tuple<Fn, Fns...>> {
+  std::tuple<Fn, Fns...> fns_;
+
+public:
+  fork_into_tuple(Fn first, Fns... fns) : fns_(std::move(first), std::move(fns)...) {}
+
+  template <typename... Args> auto operator()(Args &&... args) {
+    // Every branch reads the same, immutable arguments
+    const auto args_tuple = std::forward_as_tuple(std::as_const(args)...);
+    return details::fork(this->get_executor(), this->cancellation_, fns_, args_tuple,
+                         std::index_sequence_for<Fn, Fns...>{});
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) const & {
+    return pipe_pair<fork_into_tuple<Fn, Fns...>, typename std::decay<T3>::type>(
+        *this, std::forward<T3>(rhs));
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) && {
+    return pipe_pair<fork_into_tuple<Fn, Fns...>, typename std::decay<T3>::type>(
+        std::move(*this), std::forward<T3>(rhs));
+  }
+};
+
+} // namespace pipeline
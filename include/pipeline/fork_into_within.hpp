@@ -0,0 +1,190 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <pipeline/cancellation.hpp>
+#include <pipeline/details.hpp>
+#include <pipeline/fork_into.hpp>
+#include <pipeline/parallel_stage.hpp>
+#include <pipeline/thread_pool.hpp>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace pipeline {
+
+namespace details {
+
+// What a timed fork shares with its branches. Branches that miss the
+// deadline keep running after the call has returned, so unlike a plain
+// fork this lives on the heap and owns copies of the functions and the
+// arguments. For the same reason `stop` has no parent: the enclosing
+// call's stop flag may be gone by the time a straggler checks it. The
+// caller passes a stop of the enclosing call on to `stop` instead. `stop`
+// fires at the deadline by itself.
+template <typename Fns, typename Args, typename R, std::size_t N> struct timed_fork_state {
+  Fns fns;
+  Args args;
+  cancellation deadline;
+  stop_flag stop{nullptr, &deadline};
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::size_t pending{N};
+  std::array<std::optional<R>, N> results;
+  std::exception_ptr error;
+
+  timed_fork_state(const Fns &fns, Args args, std::chrono::steady_clock::time_point deadline)
+      : fns(fns), args(std::move(args)), deadline(deadline) {}
+
+  template <std::size_t I> void run() {
+    if (!stop.requested()) {
+      stop_scope scope(stop);
+      try {
+        auto call = [this] { return std::apply(std::get<I>(fns), std::as_const(args)); };
+        auto value = invoke_branch(call);
+        std::lock_guard<std::mutex> lock(mutex);
+        std::get<I>(results).emplace(std::move(value));
+      } catch (...) {
+        // past the deadline, an exception is the branch giving up
+        if (!stop.requested()) {
+          fail(std::current_exception());
+        }
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    --pending;
+    cv.notify_all();
+  }
+
+  void fail(std::exception_ptr e) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!error) {
+      error = std::move(e);
+    }
+  }
+};
+
+} // namespace details
+
+// Like fork_into, but waits at most `timeout` for the branches. Returns a
+// std::vector with a std::optional per branch, empty for the branches
+// that didn't finish in time (std::monostate for branches returning void).
+// If a branch throws before the deadline, the exception is rethrown.
+//
+// Branches still running at the deadline see stop_requested() and their
+// results are dropped; branches that haven't started are skipped. Each
+// call works on its own copies of the functions and the arguments, so it
+// doesn't wait for them. Every branch but the cheap ones runs on the
+// executor, and a cheap branch only starts before the deadline. The
+// caller runs no other tasks while it waits, so it returns at the
+// deadline; nested in a stage on the same pool, it keeps its worker until
+// then, so when such calls can fill the pool, run the branches on a pool
+// of their own with on(). If the call is cancelled, or the enclosing call
+// or stream stops, the branches are stopped too and the call throws
+// operation_cancelled, unless every branch was done.
+template <typename Fn, typename... Fns>
+class fork_into_within : public details::parallel_stage<fork_into_within<Fn, Fns...>> {
+  std::tuple<Fn, Fns...> fns_;
+  std::chrono::steady_clock::duration timeout_;
+
+  // How often a waiting caller checks whether it was cancelled
+  static constexpr std::chrono::microseconds poll_interval{100};
+
+  template <std::size_t I>
+  static constexpr bool is_cheap =
+      details::is_specialization<typename std::tuple_element<I, std::tuple<Fn, Fns...>>::type,
+                                 cheap>::value;
+
+  template <typename State, typename Expired, std::size_t... Is>
+  void start(executor &ex, const std::shared_ptr<State> &state, Expired &expired,
+             std::index_sequence<Is...>) {
+    // offload branches left to right, then run the cheap ones
+    (offload<Is>(ex, state), ...);
+    ((is_cheap<Is> ? run_cheap<Is>(*state, expired) : void()), ...);
+  }
+
+  template <std::size_t I, typename State, typename Expired>
+  static void run_cheap(State &state, Expired &expired) {
+    if (expired()) {
+      state.stop.request_stop(); // run() skips the branch
+    }
+    state.template run<I>();
+  }
+
+  template <std::size_t I, typename State>
+  void offload(executor &ex, const std::shared_ptr<State> &state) {
+    if constexpr (!is_cheap<I>) {
+      try {
+        ex.execute([state] { state->template run<I>(); });
+      } catch (...) {
+        // the executor refused the task
+        state->fail(std::current_exception());
+        std::lock_guard<std::mutex> lock(state->mutex);
+        --state->pending;
+      }
+    }
+  }
+
+public:
+  fork_into_within(std::chrono::steady_clock::duration timeout, Fn first, Fns... fns)
+      : fns_(std::move(first), std::move(fns)...), timeout_(timeout) {}
+
+  template <typename... Args> auto operator()(Args &&... args) {
+    typedef typename std::invoke_result<Fn &, const typename std::decay<Args>::type &...>::type
+        result_type;
+    typedef typename details::branch_result<result_type>::type value_type;
+    typedef details::timed_fork_state<std::tuple<Fn, Fns...>,
+                                      std::tuple<typename std::decay<Args>::type...>, value_type,
+                                      sizeof...(Fns) + 1>
+        state_type;
+
+    auto &ex = this->get_executor();
+    const details::stop_flag parent(details::current_stop(), this->cancellation_);
+    const auto deadline = std::chrono::steady_clock::now() + timeout_;
+    auto expired = [&parent, deadline] {
+      return std::chrono::steady_clock::now() >= deadline || parent.requested();
+    };
+    auto state = std::make_shared<state_type>(
+        fns_, std::tuple<typename std::decay<Args>::type...>(std::forward<Args>(args)...),
+        deadline);
+    start(ex, state, expired, std::index_sequence_for<Fn, Fns...>{});
+
+    auto finished = [&state] { return state->pending == 0 || state->error; };
+    std::unique_lock<std::mutex> lock(state->mutex);
+    while (!finished() && !expired()) {
+      state->cv.wait_until(
+          lock, std::min(deadline, std::chrono::steady_clock::now() + poll_interval), finished);
+    }
+    // stragglers give up
+    state->stop.request_stop();
+    if (state->error) {
+      std::rethrow_exception(state->error);
+    }
+    if (state->pending > 0 && parent.requested()) {
+      throw operation_cancelled();
+    }
+    std::vector<std::optional<value_type>> results;
+    results.reserve(sizeof...(Fns) + 1);
+    for (auto &result : state->results) {
+      results.push_back(std::move(result));
+    }
+    return results;
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) const & {
+    return pipe_pair<fork_into_within<Fn, Fns...>, typename std::decay<T3>::type>(
+        *this, std::forward<T3>(rhs));
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) && {
+    return pipe_pair<fork_into_within<Fn, Fns...>, typename std::decay<T3>::type>(
+        std::move(*this), std::forward<T3>(rhs));
+  }
+};
+
+} // namespace pipeline
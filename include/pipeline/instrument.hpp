@@ -0,0 +1,282 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <pipeline/details.hpp>
+#include <pipeline/stream.hpp>
+#include <set>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+namespace pipeline {
+
+// Receives timings from instrumented stages. Calls may arrive from
+// several threads at once.
+class observer {
+public:
+  virtual ~observer() = default;
+
+  // `stage` ran once for `duration` on `thread`
+  virtual void on_call(const std::string &stage, std::chrono::nanoseconds duration,
+                       std::thread::id thread) = 0;
+
+  // Streaming only: `stage` waited `duration` for an input item or for
+  // room in its output queue
+  virtual void on_queue_wait(const std::string &, std::chrono::nanoseconds) {}
+};
+
+namespace details {
+
+// Reports the time between its construction and destruction as one call
+class call_timer {
+  observer &observer_;
+  const std::string &stage_;
+  std::chrono::steady_clock::time_point start_;
+  std::chrono::steady_clock::duration excluded_{0};
+
+public:
+  call_timer(observer &obs, const std::string &stage)
+      : observer_(obs), stage_(stage), start_(std::chrono::steady_clock::now()) {}
+
+  ~call_timer() {
+    const auto duration = std::chrono::steady_clock::now() - start_ - excluded_;
+    observer_.on_call(stage_, std::chrono::duration_cast<std::chrono::nanoseconds>(duration),
+                      std::this_thread::get_id());
+  }
+
+  // Leave `duration` (e.g., time blocked on a full queue) out of the call
+  void exclude(std::chrono::steady_clock::duration duration) { excluded_ += duration; }
+};
+
+// Streaming state of an instrumented stage: times the wrapped state's
+// process(), one call per item, and reports the time spent waiting on the
+// stream's queues. Flushes on a deadline and the final finish are not
+// calls of the stage, so they aren't counted, but their time blocked on
+// the output queue is.
+template <typename State> class instrumented_state {
+  State state_;
+  const std::string &stage_;
+  observer &observer_;
+
+  // `timer`, if any, leaves the time blocked on the output queue out
+  template <typename Emit> auto timed(call_timer *timer, Emit &emit) {
+    return [this, timer, &emit](auto &&result) {
+      const auto start = std::chrono::steady_clock::now();
+      emit(std::forward<decltype(result)>(result));
+      const auto blocked = std::chrono::steady_clock::now() - start;
+      if (timer) {
+        timer->exclude(blocked);
+      }
+      on_queue_wait(blocked);
+    };
+  }
+
+public:
+  typedef typename State::output_type output_type;
+
+  instrumented_state(State state, const std::string &stage, observer &obs)
+      : state_(std::move(state)), stage_(stage), observer_(obs) {}
+
+  template <typename In, typename Emit> void process(In &&item, Emit &emit) {
+    call_timer timer(observer_, stage_);
+    auto timed_emit = timed(&timer, emit);
+    state_.process(std::forward<In>(item), timed_emit);
+  }
+
+  template <typename Emit> void flush(Emit &emit) {
+    auto timed_emit = timed(nullptr, emit);
+    state_.flush(timed_emit);
+  }
+
+  template <typename Emit> void finish(Emit &emit) {
+    auto timed_emit = timed(nullptr, emit);
+    finish_state(state_, timed_emit);
+  }
+
+  std::chrono::steady_clock::time_point deadline() const { return state_.deadline(); }
+
+  void on_queue_wait(std::chrono::steady_clock::duration duration) {
+    observer_.on_queue_wait(stage_,
+                            std::chrono::duration_cast<std::chrono::nanoseconds>(duration));
+  }
+};
+
+} // namespace details
+
+// Wraps a stage and reports every call of it to an observer, under a name.
+// Works in one-shot pipelines, as a fork branch and in streams.
+template <typename Stage> class instrumented {
+  Stage stage_;
+  std::string name_;
+  observer *observer_;
+
+public:
+  instrumented(Stage stage, std::string name, observer &obs)
+      : stage_(std::move(stage)), name_(std::move(name)), observer_(&obs) {}
+
+  template <typename... T> decltype(auto) operator()(T &&... args) {
+    details::call_timer timer(*observer_, name_);
+    return stage_(std::forward<T>(args)...);
+  }
+
+  const std::string &name() const { return name_; }
+
+  template <typename In> auto stream_state() {
+    auto state = details::make_stream_state<In>(stage_);
+    return details::instrumented_state<decltype(state)>(std::move(state), name_, *observer_);
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) const & {
+    return pipe_pair<instrumented<Stage>, typename std::decay<T3>::type>(*this,
+                                                                         std::forward<T3>(rhs));
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) && {
+    return pipe_pair<instrumented<Stage>, typename std::decay<T3>::type>(std::move(*this),
+                                                                         std::forward<T3>(rhs));
+  }
+};
+
+// instrument(stage, "name", obs) reports the stage's calls to `obs`.
+// instrument<false>(...) returns the stage itself, so instrumentation
+// behind a compile-time switch costs nothing when it is off.
+template <bool Enabled = true, typename Stage>
+auto instrument(Stage stage, std::string name, observer &obs) {
+  if constexpr (Enabled) {
+    return instrumented<Stage>(std::move(stage), std::move(name), obs);
+  } else {
+    return stage;
+  }
+}
+
+// Observer that aggregates per-stage call counts, a histogram of call
+// durations, queue wait time and the threads each stage ran on
+class stage_metrics : public observer {
+public:
+  struct stats {
+    std::uint64_t calls{0};
+    std::chrono::nanoseconds total{0};
+    std::chrono::nanoseconds max{0};
+    // histogram[i] counts calls that took [2^i, 2^(i+1)) nanoseconds
+    std::array<std::uint64_t, 64> histogram{};
+    std::chrono::nanoseconds queue_wait{0};
+    std::set<std::thread::id> threads;
+
+    // Upper bound of the duration within which `fraction` of the calls finished
+    std::chrono::nanoseconds percentile(double fraction) const {
+      std::uint64_t seen = 0;
+      for (std::size_t i = 0; i < histogram.size(); ++i) {
+        seen += histogram[i];
+        if (calls > 0 && seen >= fraction * calls) {
+          return i < 62 ? std::min(max, std::chrono::nanoseconds(std::int64_t(2) << i)) : max;
+        }
+      }
+      return max;
+    }
+  };
+
+private:
+  mutable std::mutex mutex_;
+  std::map<std::string, stats> stages_;
+
+  static void write_json_string(std::ostream &os, const std::string &s) {
+    os << '"';
+    for (auto c : s) {
+      if (static_cast<unsigned char>(c) < 0x20) {
+        // Control characters are written as \u00XX
+        static constexpr char hex[] = "0123456789abcdef";
+        os << "\\u00" << hex[(c >> 4) & 0xf] << hex[c & 0xf];
+      } else {
+        if (c == '"' || c == '\\') {
+          os << '\\';
+        }
+        os << c;
+      }
+    }
+    os << '"';
+  }
+
+public:
+  void on_call(const std::string &stage, std::chrono::nanoseconds duration,
+               std::thread::id thread) override {
+    std::size_t bucket = 0;
+    while (bucket < 62 && (std::int64_t(2) << bucket) <= duration.count()) {
+      ++bucket;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto &s = stages_[stage];
+    ++s.calls;
+    s.total += duration;
+    s.max = std::max(s.max, duration);
+    ++s.histogram[bucket];
+    s.threads.insert(thread);
+  }
+
+  void on_queue_wait(const std::string &stage, std::chrono::nanoseconds duration) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stages_[stage].queue_wait += duration;
+  }
+
+  // Copy of the statistics gathered so far, by stage name
+  std::map<std::string, stats> snapshot() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stages_;
+  }
+
+  void reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stages_.clear();
+  }
+
+  // One line per stage; durations in microseconds
+  void dump_text(std::ostream &os) const {
+    const auto stages = snapshot();
+    const auto us = [](std::chrono::nanoseconds ns) { return ns.count() / 1000.0; };
+    os << std::left << std::setw(20) << "stage" << std::right << std::setw(10) << "calls"
+       << std::setw(14) << "total_us" << std::setw(12) << "mean_us" << std::setw(12) << "p50_us"
+       << std::setw(12) << "p99_us" << std::setw(12) << "max_us" << std::setw(14) << "wait_us"
+       << std::setw(9) << "threads" << "\n";
+    os << std::fixed << std::setprecision(1);
+    for (const auto &[name, s] : stages) {
+      os << std::left << std::setw(20) << name << std::right << std::setw(10) << s.calls
+         << std::setw(14) << us(s.total) << std::setw(12)
+         << (s.calls ? us(s.total) / s.calls : 0.0) << std::setw(12) << us(s.percentile(0.5))
+         << std::setw(12) << us(s.percentile(0.99)) << std::setw(12) << us(s.max)
+         << std::setw(14) << us(s.queue_wait) << std::setw(9) << s.threads.size() << "\n";
+    }
+  }
+
+  // {"stages": [{"name": ..., "calls": ..., ...}, ...]}; durations in nanoseconds
+  void dump_json(std::ostream &os) const {
+    const auto stages = snapshot();
+    os << "{\"stages\": [";
+    bool first = true;
+    for (const auto &[name, s] : stages) {
+      os << (first ? "" : ", ") << "{\"name\": ";
+      write_json_string(os, name);
+      os << ", \"calls\": " << s.calls << ", \"total_ns\": " << s.total.count()
+         << ", \"max_ns\": " << s.max.count() << ", \"queue_wait_ns\": " << s.queue_wait.count()
+         << ", \"threads\": " << s.threads.size() << ", \"histogram_ns\": {";
+      bool first_bucket = true;
+      for (std::size_t i = 0; i < s.histogram.size(); ++i) {
+        if (s.histogram[i]) {
+          os << (first_bucket ? "" : ", ") << "\"" << (std::uint64_t(1) << i) << "\": "
+             << s.histogram[i];
+          first_bucket = false;
+        }
+      }
+      os << "}}";
+      first = false;
+    }
+    os << "]}\n";
+  }
+};
+
+} // namespace pipeline
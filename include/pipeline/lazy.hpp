@@ -0,0 +1,255 @@
+#pragma once
+#include <cstddef>
+#include <iterator>
+#include <optional>
+#include <pipeline/details.hpp>
+#include <pipeline/fn.hpp>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#if __has_include(<version>)
+#include <version>
+#endif
+
+// Lazy ranges model std::ranges::view when built as C++20
+#if defined(__cpp_lib_ranges)
+#include <ranges>
+#define PIPELINE_HAS_RANGES
+#endif
+
+namespace pipeline {
+
+namespace details {
+
+#ifdef PIPELINE_HAS_RANGES
+typedef std::ranges::view_base view_base;
+#else
+struct view_base {};
+#endif
+
+// The elements of a container without a copy of them: a pointer to an
+// lvalue container, or the container itself when it was an rvalue
+template <typename Range> class lazy_range : public view_base {
+  typedef typename std::remove_reference<Range>::type container_type;
+  typedef typename std::conditional<std::is_lvalue_reference<Range>::value, container_type *,
+                                    container_type>::type storage_type;
+
+  // const like a pointer: some views (std::views::filter) can only be
+  // iterated over non-const
+  mutable storage_type range_;
+
+  container_type &get() const {
+    if constexpr (std::is_pointer<storage_type>::value) {
+      return *range_;
+    } else {
+      return range_;
+    }
+  }
+
+public:
+  typedef typename std::iterator_traits<decltype(
+      std::begin(std::declval<container_type &>()))>::value_type value_type;
+
+  lazy_range(container_type &range) : range_(&range) {}
+
+  lazy_range(container_type &&range) : range_(std::move(range)) {}
+
+  auto begin() const { return std::begin(get()); }
+
+  auto end() const { return std::end(get()); }
+};
+
+// A function object that can be assigned even when Fn can't (a lambda
+// with captures), which a range has to be to be a std::ranges::view.
+// Like the other stages, it calls Fn non-const, also from a const range.
+// A default-constructed one holds no function and can only be assigned to.
+template <typename Fn> class assignable_fn {
+  mutable std::optional<Fn> fn_;
+
+public:
+  assignable_fn() = default;
+
+  assignable_fn(Fn fn) : fn_(std::move(fn)) {}
+
+  assignable_fn(const assignable_fn &) = default;
+  assignable_fn(assignable_fn &&) = default;
+
+  assignable_fn &operator=(const assignable_fn &other) {
+    if (this != &other) {
+      fn_.reset();
+      if (other.fn_) {
+        fn_.emplace(*other.fn_);
+      }
+    }
+    return *this;
+  }
+
+  assignable_fn &operator=(assignable_fn &&other) {
+    if (this != &other) {
+      fn_.reset();
+      if (other.fn_) {
+        fn_.emplace(std::move(*other.fn_));
+      }
+    }
+    return *this;
+  }
+
+  Fn &get() const { return *fn_; }
+};
+
+// Applies fn to the elements of Base as they are read; what map turns into
+// when it is given a lazy range. Iterators move like the ones of Base, up
+// to random access, which their iterator_concept says and parallel stages
+// go by to split the range into chunks. Unless fn returns a reference,
+// *it is a new value on every call, so the iterator_category is only
+// input_iterator_tag. Each iterator calls its own copy of fn, so chunks
+// read in parallel never share one.
+template <typename Base, typename Fn> class transform_range : public view_base {
+  Base base_;
+  assignable_fn<Fn> fn_;
+
+public:
+  class iterator {
+    typedef decltype(std::begin(std::declval<const Base &>())) base_iterator;
+
+    base_iterator it_{};
+    assignable_fn<Fn> fn_;
+
+  public:
+    typedef typename std::invoke_result<Fn &, decltype(*std::declval<base_iterator>())>::type
+        reference;
+    typedef typename std::common_type<
+        std::random_access_iterator_tag,
+        typename details::iterator_concept<base_iterator>::type>::type iterator_concept;
+    typedef typename std::conditional<std::is_reference<reference>::value, iterator_concept,
+                                      std::input_iterator_tag>::type iterator_category;
+    typedef typename std::decay<reference>::type value_type;
+    typedef typename std::iterator_traits<base_iterator>::difference_type difference_type;
+    typedef void pointer;
+
+    iterator() = default;
+
+    iterator(base_iterator it, const Fn &fn) : it_(it), fn_(fn) {}
+
+    reference operator*() const { return fn_.get()(*it_); }
+
+    reference operator[](difference_type n) const { return fn_.get()(it_[n]); }
+
+    iterator &operator++() {
+      ++it_;
+      return *this;
+    }
+
+    iterator operator++(int) {
+      auto previous = *this;
+      ++it_;
+      return previous;
+    }
+
+    iterator &operator--() {
+      --it_;
+      return *this;
+    }
+
+    iterator operator--(int) {
+      auto previous = *this;
+      --it_;
+      return previous;
+    }
+
+    iterator &operator+=(difference_type n) {
+      it_ += n;
+      return *this;
+    }
+
+    iterator &operator-=(difference_type n) {
+      it_ -= n;
+      return *this;
+    }
+
+    friend iterator operator+(iterator it, difference_type n) { return it += n; }
+
+    friend iterator operator+(difference_type n, iterator it) { return it += n; }
+
+    friend iterator operator-(iterator it, difference_type n) { return it -= n; }
+
+    friend difference_type operator-(const iterator &a, const iterator &b) {
+      return a.it_ - b.it_;
+    }
+
+    friend bool operator==(const iterator &a, const iterator &b) { return a.it_ == b.it_; }
+
+    friend bool operator!=(const iterator &a, const iterator &b) { return a.it_ != b.it_; }
+
+    friend bool operator<(const iterator &a, const iterator &b) { return a.it_ < b.it_; }
+
+    friend bool operator>(const iterator &a, const iterator &b) { return a.it_ > b.it_; }
+
+    friend bool operator<=(const iterator &a, const iterator &b) { return a.it_ <= b.it_; }
+
+    friend bool operator>=(const iterator &a, const iterator &b) { return a.it_ >= b.it_; }
+  };
+
+  typedef typename iterator::value_type value_type;
+
+  transform_range(Base base, Fn fn) : base_(std::move(base)), fn_(std::move(fn)) {}
+
+  iterator begin() const { return iterator(std::begin(base_), fn_.get()); }
+
+  iterator end() const { return iterator(std::end(base_), fn_.get()); }
+};
+
+template <typename> struct is_lazy_range : std::false_type {};
+
+template <typename Range> struct is_lazy_range<lazy_range<Range>> : std::true_type {};
+
+template <typename Base, typename Fn>
+struct is_lazy_range<transform_range<Base, Fn>> : std::true_type {};
+
+} // namespace details
+
+// Starts the lazy part of a pipeline: lazy() passes on the container it is
+// given (or a std::ranges view) as a lazy range, without copying it, and
+// a map given a lazy range returns a lazy range in turn, applying its
+// function as the elements are read. Nothing is computed until a stage
+// iterates over the range - collect(), for_each, reduce, a loop - so
+// lazy() | map(f) | map(g) | collect() makes a single pass and builds a
+// single std::vector, however many maps there are. With C++20 the lazy
+// ranges are std::ranges::views, so std::views adaptors apply to them.
+inline auto lazy() {
+  return fn([](auto &&range) {
+    typedef decltype(range) range_type;
+    if constexpr (details::is_lazy_range<typename std::decay<range_type>::type>::value) {
+      return std::forward<range_type>(range);
+    } else {
+      typedef typename std::conditional<std::is_lvalue_reference<range_type>::value, range_type,
+                                        typename std::decay<range_type>::type>::type stored_type;
+      return details::lazy_range<stored_type>(std::forward<range_type>(range));
+    }
+  });
+}
+
+// Reads a range - typically a lazy one - into a std::vector
+inline auto collect() {
+  return fn([](auto &&range) {
+    auto first = std::begin(range);
+    auto last = std::end(range);
+    typedef typename std::decay<decltype(*first)>::type value_type;
+    typedef typename details::iterator_concept<decltype(first)>::type category;
+
+    std::vector<value_type> results;
+    if constexpr (std::is_same<decltype(first), decltype(last)>::value &&
+                  std::is_base_of<std::random_access_iterator_tag, category>::value) {
+      results.reserve(static_cast<std::size_t>(last - first));
+    } else if constexpr (std::is_same<decltype(first), decltype(last)>::value &&
+                         std::is_base_of<std::forward_iterator_tag, category>::value) {
+      results.reserve(static_cast<std::size_t>(std::distance(first, last)));
+    }
+    for (; first != last; ++first) {
+      results.push_back(*first);
+    }
+    return results;
+  });
+}
+
+} // namespace pipeline
@@ -0,0 +1,130 @@
+#pragma once
+#include <iterator>
+#include <pipeline/details.hpp>
+#include <pipeline/fn.hpp>
+#include <pipeline/lazy.hpp>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace pipeline {
+
+namespace details {
+
+template <typename Container, typename = void> struct is_contiguous : std::false_type {};
+
+template <typename Container>
+struct is_contiguous<Container, std::void_t<decltype(std::data(std::declval<Container &>())),
+                                            decltype(std::size(std::declval<Container &>()))>>
+    : std::true_type {};
+
+// Elements per block of map_n / map_in_place. A loop with a fixed trip
+// count needs no remainder handling, so compilers vectorize it even at -O2
+// (where GCC won't vectorize a loop of unknown length); the leftover
+// elements run one at a time.
+constexpr std::size_t map_block_size = 16;
+
+// The loops the compiler vectorizes: counted, over raw pointers that don't
+// overlap. With fused maps, `fn` is the whole chain, inlined per element.
+template <typename T, typename R, typename Fn>
+void map_n(T *PIPELINE_RESTRICT in, R *PIPELINE_RESTRICT out, std::size_t n, Fn &fn) {
+  std::size_t i = 0;
+  for (; i + map_block_size <= n; i += map_block_size) {
+    for (std::size_t j = 0; j < map_block_size; ++j) {
+      out[i + j] = fn(in[i + j]);
+    }
+  }
+  for (; i < n; ++i) {
+    out[i] = fn(in[i]);
+  }
+}
+
+template <typename T, typename Fn> void map_in_place(T *data, std::size_t n, Fn &fn) {
+  std::size_t i = 0;
+  for (; i + map_block_size <= n; i += map_block_size) {
+    for (std::size_t j = 0; j < map_block_size; ++j) {
+      data[i + j] = fn(data[i + j]);
+    }
+  }
+  for (; i < n; ++i) {
+    data[i] = fn(data[i]);
+  }
+}
+
+} // namespace details
+
+// Element-wise map over a container: map(f)(numbers) returns a std::vector
+// with f applied to each element, in a single sequential pass (for_each is
+// the parallel counterpart).
+//
+// Made for contiguous ranges of numbers: the elements are read and written
+// through raw pointers in a plain counted loop, which compilers turn into
+// SIMD code. map(f) | map(g) fuses into one map, so the data goes through
+// memory once rather than once per stage. Given a std::vector rvalue whose
+// element type the function returns, the results overwrite the input and
+// the same vector is returned - no allocation at all. Given a lazy range
+// (see lazy()), map returns a lazy range too.
+template <typename Fn> class map {
+  template <typename> friend class map;
+
+  Fn fn_;
+
+public:
+  map(Fn fn) : fn_(std::move(fn)) {}
+
+  // The wrapped function
+  Fn &function() { return fn_; }
+
+  template <typename Container> auto operator()(Container &&input) {
+    typedef typename std::decay<Container>::type container_type;
+    typedef decltype(*std::begin(input)) element_type;
+    typedef typename std::decay<typename std::invoke_result<Fn &, element_type>::type>::type
+        result_type;
+    static_assert(!std::is_same<result_type, void>::value,
+                  "map needs a function that returns a value; use for_each for side effects");
+
+    if constexpr (details::is_lazy_range<container_type>::value) {
+      // lazy in, lazy out: fn runs as the elements are read, see lazy()
+      return details::transform_range<container_type, Fn>(std::forward<Container>(input), fn_);
+    } else if constexpr (std::is_rvalue_reference<Container &&>::value &&
+                  !std::is_const<typename std::remove_reference<Container>::type>::value &&
+                  details::is_specialization<container_type, std::vector>::value &&
+                  std::is_same<typename container_type::value_type, result_type>::value &&
+                  !std::is_same<result_type, bool>::value) {
+      details::map_in_place(input.data(), input.size(), fn_);
+      return container_type(std::move(input));
+    } else if constexpr (details::is_contiguous<Container>::value &&
+                         std::is_default_constructible<result_type>::value &&
+                         !std::is_same<result_type, bool>::value) {
+      std::vector<result_type> results(std::size(input));
+      details::map_n(std::data(input), results.data(), results.size(), fn_);
+      return results;
+    } else {
+      std::vector<result_type> results;
+      for (auto &&element : input) {
+        results.push_back(fn_(element));
+      }
+      return results;
+    }
+  }
+
+  // map | map fuses both functions into a single map
+  template <typename T> auto operator|(T &&rhs) const & {
+    if constexpr (details::is_specialization<typename std::decay<T>::type, pipeline::map>::value) {
+      return pipeline::map(details::fuse(fn_, std::forward<T>(rhs).fn_));
+    } else {
+      return pipe_pair<map<Fn>, typename std::decay<T>::type>(*this, std::forward<T>(rhs));
+    }
+  }
+
+  template <typename T> auto operator|(T &&rhs) && {
+    if constexpr (details::is_specialization<typename std::decay<T>::type, pipeline::map>::value) {
+      return pipeline::map(details::fuse(std::move(fn_), std::forward<T>(rhs).fn_));
+    } else {
+      return pipe_pair<map<Fn>, typename std::decay<T>::type>(std::move(*this),
+                                                              std::forward<T>(rhs));
+    }
+  }
+};
+
+} // namespace pipeline
@@ -0,0 +1,294 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <pipeline/details.hpp>
+#include <pipeline/fn.hpp>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define PIPELINE_HAS_MMAP
+#endif
+
+namespace pipeline {
+
+namespace details {
+
+// Forward range over the records of a text, as std::string_views into it.
+// Next(text, pos) gives the length of the record starting at pos, including
+// its separator; View(record) trims it to what the range yields. Iterators
+// hold the text and functions themselves, so they outlive the range.
+template <typename Next, typename View> class record_range {
+  std::string_view text_;
+  Next next_;
+  View view_;
+
+public:
+  class iterator {
+    std::string_view text_;
+    std::size_t pos_{0};
+    std::size_t length_{0};
+    Next next_{};
+    View view_{};
+
+  public:
+    // Records are views made on the fly, not references into the range,
+    // which a C++17 forward iterator must yield; it is one all the same
+    typedef std::input_iterator_tag iterator_category;
+    typedef std::forward_iterator_tag iterator_concept;
+    typedef std::string_view value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const std::string_view *pointer;
+    typedef std::string_view reference;
+
+    iterator() = default;
+
+    iterator(std::string_view text, std::size_t pos, const Next &next, const View &view)
+        : text_(text), pos_(pos), length_(pos < text.size() ? next(text, pos) : 0), next_(next),
+          view_(view) {}
+
+    std::string_view operator*() const { return view_(text_.substr(pos_, length_)); }
+
+    iterator &operator++() {
+      pos_ += length_;
+      length_ = pos_ < text_.size() ? next_(text_, pos_) : 0;
+      return *this;
+    }
+
+    iterator operator++(int) {
+      auto previous = *this;
+      ++*this;
+      return previous;
+    }
+
+    bool operator==(const iterator &other) const { return pos_ == other.pos_; }
+
+    bool operator!=(const iterator &other) const { return pos_ != other.pos_; }
+  };
+
+  typedef std::string_view value_type;
+
+  record_range(std::string_view text, Next next, View view)
+      : text_(text), next_(std::move(next)), view_(std::move(view)) {}
+
+  iterator begin() const { return iterator(text_, 0, next_, view_); }
+
+  iterator end() const { return iterator(text_, text_.size(), next_, view_); }
+};
+
+// Length of the line starting at `pos`, with its '\n' if it has one
+inline std::size_t line_length(std::string_view text, std::size_t pos) {
+  const auto newline = std::memchr(text.data() + pos, '\n', text.size() - pos);
+  return newline ? static_cast<const char *>(newline) - (text.data() + pos) + 1
+                 : text.size() - pos;
+}
+
+struct next_line {
+  std::size_t operator()(std::string_view text, std::size_t pos) const {
+    return line_length(text, pos);
+  }
+};
+
+// A line without its "\n" or "\r\n"
+struct trim_newline {
+  std::string_view operator()(std::string_view line) const {
+    if (!line.empty() && line.back() == '\n') {
+      line.remove_suffix(1);
+    }
+    if (!line.empty() && line.back() == '\r') {
+      line.remove_suffix(1);
+    }
+    return line;
+  }
+};
+
+// At least `size` bytes, extended to the end of the line they stop in
+struct next_chunk {
+  std::size_t size;
+
+  std::size_t operator()(std::string_view text, std::size_t pos) const {
+    const auto length = std::min(std::max<std::size_t>(size, 1), text.size() - pos);
+    const auto end = pos + length;
+    if (end == text.size() || text[end - 1] == '\n') {
+      return length;
+    }
+    return length + line_length(text, end);
+  }
+};
+
+struct whole_record {
+  std::string_view operator()(std::string_view record) const { return record; }
+};
+
+} // namespace details
+
+// The lines of `text`, without their "\n" or "\r\n", as std::string_views
+// into it. Found lazily with memchr, so iterating over a huge text doesn't
+// allocate.
+inline auto lines(std::string_view text) {
+  return details::record_range<details::next_line, details::trim_newline>(text, {}, {});
+}
+
+// `text` in pieces of about `size` bytes, each one extended to the end of
+// the line it stops in, so no line is split across two chunks. Handing
+// chunks to for_each, rather than lines, keeps tasks large.
+inline auto chunks(std::string_view text, std::size_t size) {
+  return details::record_range<details::next_chunk, details::whole_record>(
+      text, details::next_chunk{size}, {});
+}
+
+// A file mapped read-only into memory, for reading large inputs without
+// copying them. The kernel is told the whole file will be needed, so it
+// starts reading it in; not that it will be read sequentially, since
+// parallel stages read their chunks all over it at once. Where mmap isn't
+// available, the file is read into memory instead.
+class mapped_file {
+  const char *data_{nullptr};
+  std::size_t size_{0};
+  std::string buffer_; // without mmap
+
+  [[noreturn]] static void fail(const std::string &path) {
+    throw std::system_error(errno, std::generic_category(), "pipeline::mapped_file: " + path);
+  }
+
+  void unmap() {
+#ifdef PIPELINE_HAS_MMAP
+    if (size_ > 0 && buffer_.empty()) {
+      munmap(const_cast<char *>(data_), size_);
+    }
+#endif
+  }
+
+public:
+  explicit mapped_file(const std::string &path) {
+#ifdef PIPELINE_HAS_MMAP
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      fail(path);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+      const auto error = errno;
+      close(fd);
+      errno = error;
+      fail(path);
+    }
+    size_ = static_cast<std::size_t>(info.st_size);
+    if (size_ > 0) {
+      void *data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+        const auto error = errno;
+        close(fd);
+        errno = error;
+        fail(path);
+      }
+      madvise(data, size_, MADV_WILLNEED);
+      data_ = static_cast<const char *>(data);
+    }
+    close(fd);
+#else
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+      fail(path);
+    }
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    buffer_ = contents.str();
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+#endif
+  }
+
+  mapped_file(mapped_file &&other) noexcept
+      : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)),
+        buffer_(std::move(other.buffer_)) {
+    if (!buffer_.empty()) {
+      data_ = buffer_.data();
+    }
+  }
+
+  mapped_file &operator=(mapped_file &&other) noexcept {
+    if (this != &other) {
+      unmap();
+      data_ = std::exchange(other.data_, nullptr);
+      size_ = std::exchange(other.size_, 0);
+      buffer_ = std::move(other.buffer_);
+      if (!buffer_.empty()) {
+        data_ = buffer_.data();
+      }
+    }
+    return *this;
+  }
+
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+
+  ~mapped_file() { unmap(); }
+
+  std::string_view contents() const { return std::string_view(data_, size_); }
+
+  std::size_t size() const { return size_; }
+
+  auto lines() const { return pipeline::lines(contents()); }
+
+  auto chunks(std::size_t size) const { return pipeline::chunks(contents(), size); }
+};
+
+namespace details {
+
+// Records of a mapped file that keep it mapped, so that they can be read
+// after the stage that gave them is gone
+template <typename Records> class mapped_records {
+  std::shared_ptr<const mapped_file> file_;
+  Records records_;
+
+public:
+  typedef typename Records::value_type value_type;
+
+  mapped_records(std::shared_ptr<const mapped_file> file, Records records)
+      : file_(std::move(file)), records_(std::move(records)) {}
+
+  auto begin() const { return records_.begin(); }
+
+  auto end() const { return records_.end(); }
+};
+
+template <typename Records>
+mapped_records<Records> make_mapped_records(std::shared_ptr<const mapped_file> file,
+                                            Records records) {
+  return mapped_records<Records>(std::move(file), std::move(records));
+}
+
+} // namespace details
+
+// Source stage over the file at `path`: calling it gives the lines of the
+// file (or, given a chunk size, chunks of whole lines) as std::string_views
+// into a mapped_file, e.g., mmap_source("access.log") | for_each(parse).
+// The file is mapped once, when the stage is made, and stays mapped as long
+// as the stage, a copy of it or a range it returned exists; so does
+// `for (auto line : mmap_source(path)())`.
+inline auto mmap_source(const std::string &path) {
+  auto file = std::make_shared<const mapped_file>(path);
+  return fn([file] { return details::make_mapped_records(file, file->lines()); });
+}
+
+inline auto mmap_source(const std::string &path, std::size_t chunk_size) {
+  auto file = std::make_shared<const mapped_file>(path);
+  return fn([file, chunk_size] {
+    return details::make_mapped_records(file, file->chunks(chunk_size));
+  });
+}
+
+} // namespace pipeline
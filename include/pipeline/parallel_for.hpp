@@ -0,0 +1,206 @@
+#pragma once
+#include <algorithm>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <pipeline/details.hpp>
+#include <pipeline/executor.hpp>
+#include <type_traits>
+#include <vector>
+
+namespace pipeline {
+
+namespace details {
+
+// Grain size used when a stage was not given one: about four chunks per
+// worker, so that uneven chunks still balance out
+inline std::size_t auto_grain_size(std::size_t size, std::size_t concurrency) {
+  return std::max<std::size_t>(1, size / (std::max<std::size_t>(concurrency, 1) * 4));
+}
+
+template <typename Iterator>
+constexpr bool is_random_access =
+    std::is_base_of<std::random_access_iterator_tag,
+                    typename iterator_concept<Iterator>::type>::value;
+
+// The elements a parallel loop runs over, [first, last): how many there
+// are and where each chunk starts. With random access that is just
+// `first`. Otherwise a single pass counts the elements and keeps an
+// iterator to every stride-th one on the way, the stride doubling whenever
+// the marks fill up, so that finding the chunks of, e.g., the lines of a
+// file takes no second pass. Chunks then start at marks: grain() rounds a
+// grain size up to a multiple of the stride.
+template <typename Iterator> class loop_range {
+  static constexpr std::size_t max_marks = 1024;
+
+  Iterator first_;
+  std::size_t size_{0};
+  std::size_t stride_{1};
+  std::vector<Iterator> marks_;
+
+public:
+  loop_range(Iterator first, Iterator last) : first_(first) {
+    if constexpr (is_random_access<Iterator>) {
+      // not std::distance, which goes by iterator_category
+      size_ = static_cast<std::size_t>(last - first);
+    } else {
+      for (; first != last; ++first, ++size_) {
+        if (size_ % stride_ != 0) {
+          continue;
+        }
+        if (marks_.size() == max_marks) {
+          // keep every other mark
+          for (std::size_t i = 1; i < max_marks / 2; ++i) {
+            marks_[i] = marks_[2 * i];
+          }
+          marks_.erase(marks_.begin() + max_marks / 2, marks_.end());
+          stride_ *= 2;
+        }
+        if (size_ % stride_ == 0) {
+          marks_.push_back(first);
+        }
+      }
+    }
+  }
+
+  std::size_t size() const { return size_; }
+
+  // `grain`, at least 1 and rounded up so that every chunk starts at a mark
+  std::size_t grain(std::size_t grain) const {
+    grain = std::max<std::size_t>(grain, 1);
+    return (grain + stride_ - 1) / stride_ * stride_;
+  }
+
+  // Iterator to element `i`, a multiple of grain()
+  Iterator at(std::size_t i) const {
+    if constexpr (is_random_access<Iterator>) {
+      return first_ + i;
+    } else {
+      return marks_[i / stride_];
+    }
+  }
+};
+
+// Splits `range` into contiguous chunks of `grain` elements and calls
+// body(chunk_first, begin, end) for each one, where chunk_first points to
+// element `begin`. offload() submits all but the last chunk to an
+// executor, run_last() runs the last one on the calling thread and
+// `group` tracks the submitted chunks; several loops may share a group.
+//
+// A submitted task is just a pointer and an offset, which std::function
+// stores inline, so a loop makes no heap allocations of its own. The loop
+// must stay put until its group is done.
+template <typename Iterator, typename Body> class chunk_loop {
+  task_group &group_;
+  const loop_range<Iterator> &range_;
+  std::size_t size_;
+  std::size_t grain_;
+  Body &body_;
+  std::size_t last_begin_{0};
+
+  void run(std::size_t begin) {
+    if (group_.skip()) {
+      return;
+    }
+    stop_scope scope(group_.stop());
+    try {
+      body_(range_.at(begin), begin, std::min(begin + grain_, size_));
+    } catch (...) {
+      group_.fail(std::current_exception());
+    }
+  }
+
+public:
+  chunk_loop(task_group &group, const loop_range<Iterator> &range, std::size_t grain, Body &body)
+      : group_(group), range_(range), size_(range.size()), grain_(range.grain(grain)),
+        body_(body) {}
+
+  void offload(executor &ex) {
+    std::size_t begin = 0;
+    for (; size_ - begin > grain_; begin += grain_) {
+      if (group_.skip()) {
+        break;
+      }
+      group_.add();
+      try {
+        ex.execute([this, begin] {
+          run(begin);
+          group_.done();
+        });
+      } catch (...) {
+        // the executor refused the task; the group rethrows on wait()
+        group_.fail(std::current_exception());
+        group_.done();
+        break;
+      }
+    }
+    last_begin_ = begin;
+  }
+
+  void run_last() {
+    if (size_ > 0) {
+      run(last_begin_);
+    }
+  }
+};
+
+// Runs body(chunk_first, begin, end) over `range` in chunks of `grain`
+// elements on `ex`, see chunk_loop. The last chunk runs on the calling
+// thread. Waits for every chunk and rethrows the first exception, if any;
+// once a chunk has thrown (or `token` fired) the chunks not yet started
+// are skipped. A stage that relies on the chunk size should pass
+// range.grain(n) as `grain`.
+template <typename Iterator, typename Body>
+void parallel_for(executor &ex, const loop_range<Iterator> &range, std::size_t grain,
+                  Body &&body, const cancellation *token = nullptr) {
+  task_group group(ex, token);
+  chunk_loop<Iterator, typename std::remove_reference<Body>::type> loop(group, range, grain,
+                                                                        body);
+  loop.offload(ex);
+  loop.run_last();
+  group.wait();
+}
+
+// Results of a data-parallel map, written by index from several threads:
+// input i produces result i. Results that can't be written by index (no
+// default constructor, or std::vector<bool> whose elements share words)
+// are staged in std::optionals first. Alloc allocates the result vector.
+template <typename R, typename Alloc> class map_output {
+  static constexpr bool by_index =
+      std::is_default_constructible<R>::value && !std::is_same<R, bool>::value;
+  typedef typename std::conditional<by_index, R, std::optional<R>>::type slot_type;
+  typedef typename std::allocator_traits<Alloc>::template rebind_alloc<slot_type> slot_allocator;
+
+  Alloc allocator_;
+  std::vector<slot_type, slot_allocator> slots_;
+
+public:
+  map_output(std::size_t size, const Alloc &allocator)
+      : allocator_(allocator), slots_(size, slot_allocator(allocator)) {}
+
+  template <typename V> void set(std::size_t i, V &&value) {
+    if constexpr (by_index) {
+      slots_[i] = std::forward<V>(value);
+    } else {
+      slots_[i].emplace(std::forward<V>(value));
+    }
+  }
+
+  std::vector<R, Alloc> take() {
+    if constexpr (by_index) {
+      return std::move(slots_);
+    } else {
+      std::vector<R, Alloc> results(allocator_);
+      results.reserve(slots_.size());
+      for (auto &slot : slots_) {
+        results.push_back(std::move(*slot));
+      }
+      return results;
+    }
+  }
+};
+
+} // namespace details
+
+} // namespace pipeline
@@ -0,0 +1,87 @@
+#pragma once
+#include <cstddef>
+#include <pipeline/cancellation.hpp>
+#include <pipeline/executor.hpp>
+#include <pipeline/parallel_for.hpp>
+#include <pipeline/thread_pool.hpp>
+#include <utility>
+
+namespace pipeline {
+
+namespace details {
+
+// What every parallel stage can be told - where to run and when to give up
+// - with its setters, for a stage Derived to inherit
+template <typename Derived> class parallel_stage {
+  template <typename> friend class parallel_stage;
+
+protected:
+  executor *executor_{nullptr};
+  const cancellation *cancellation_{nullptr};
+
+  // The executor given to on(), or the default one
+  executor &get_executor() const { return executor_ ? *executor_ : default_executor(); }
+
+  // Takes the settings that `other` has, keeping its own for the others;
+  // for a stage built out of another one
+  template <typename Other> void adopt_settings(const parallel_stage<Other> &other) {
+    if (other.executor_) {
+      executor_ = other.executor_;
+    }
+    if (other.cancellation_) {
+      cancellation_ = other.cancellation_;
+    }
+  }
+
+public:
+  // Run on `ex` instead of the default executor
+  Derived &on(executor &ex) & {
+    executor_ = &ex;
+    return static_cast<Derived &>(*this);
+  }
+
+  Derived &&on(executor &ex) && { return std::move(on(ex)); }
+
+  // Stop early once `token` is cancelled: tasks not yet started are
+  // skipped and the stage throws operation_cancelled
+  Derived &cancel_on(const cancellation &token) & {
+    cancellation_ = &token;
+    return static_cast<Derived &>(*this);
+  }
+
+  Derived &&cancel_on(const cancellation &token) && { return std::move(cancel_on(token)); }
+};
+
+// A parallel stage that splits its input into chunks of a grain size
+template <typename Derived> class chunked_stage : public parallel_stage<Derived> {
+  template <typename> friend class chunked_stage;
+
+protected:
+  std::size_t grain_size_{0};
+
+  // The grain size for `size` elements on `ex`
+  std::size_t grain(std::size_t size, const executor &ex) const {
+    return grain_size_ ? grain_size_ : auto_grain_size(size, ex.concurrency());
+  }
+
+  template <typename Other> void adopt_settings(const chunked_stage<Other> &other) {
+    parallel_stage<Derived>::adopt_settings(other);
+    if (other.grain_size_) {
+      grain_size_ = other.grain_size_;
+    }
+  }
+
+public:
+  // Number of consecutive elements handled by one task.
+  // 0 (the default) picks a grain size from the input size and executor.
+  Derived &grain_size(std::size_t n) & {
+    grain_size_ = n;
+    return static_cast<Derived &>(*this);
+  }
+
+  Derived &&grain_size(std::size_t n) && { return std::move(grain_size(n)); }
+};
+
+} // namespace details
+
+} // namespace pipeline
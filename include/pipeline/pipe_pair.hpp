@@ -1,5 +1,6 @@
 #pragma once
 #include <pipeline/details.hpp>
+#include <pipeline/task.hpp>
 
 namespace pipeline {
 
@@ -7,13 +8,30 @@ template <typename T1, typename T2> class pipe_pair {
   T1 left_;
   T2 right_;
 
+  template <typename T3>
+  static constexpr bool is_fusable =
+      (details::is_specialization<T2, fn>::value &&
+       details::is_specialization<typename std::decay<T3>::type, fn>::value) ||
+      (details::is_specialization<T2, map>::value &&
+       details::is_specialization<typename std::decay<T3>::type, map>::value) ||
+      details::fuses_with_filter<T2, typename std::decay<T3>::type>::value;
+
 public:
-  pipe_pair(T1 left, T2 right) : left_(left), right_(right) {}
+  pipe_pair(T1 left, T2 right) : left_(std::move(left)), right_(std::move(right)) {}
 
   template <typename... T> decltype(auto) operator()(T &&... args) {
     typedef typename std::result_of<T1(T...)>::type left_result_type;
 
-    if constexpr (!std::is_same<left_result_type, void>::value) {
+#ifdef PIPELINE_HAS_COROUTINES
+    if constexpr (details::is_task<left_result_type>::value) {
+      // async stage: right_ runs once its task is done
+      return details::then(left_(std::forward<T>(args)...),
+                           [this](auto &&... result) -> decltype(auto) {
+                             return right_(std::forward<decltype(result)>(result)...);
+                           });
+    } else
+#endif
+        if constexpr (!std::is_same<left_result_type, void>::value) {
       return right_(left_(std::forward<T>(args)...));
     } else {
       left_(std::forward<T>(args)...);
@@ -21,13 +39,36 @@ public:
     }
   }
 
-  template <typename T3> auto operator|(T3 &&rhs) {
-    return pipe_pair<pipe_pair<T1, T2>, T3>(*this, std::forward<T3>(rhs));
+  T1 &left() { return left_; }
+
+  T2 &right() { return right_; }
+
+  // (x | fn) | fn fuses the two fns, see fn::operator|; same for map, and
+  // for filter | for_each
+  template <typename T3> auto operator|(T3 &&rhs) const & {
+    if constexpr (is_fusable<T3>) {
+      auto fused = right_ | std::forward<T3>(rhs);
+      return pipe_pair<T1, decltype(fused)>(left_, std::move(fused));
+    } else {
+      return pipe_pair<pipe_pair<T1, T2>, typename std::decay<T3>::type>(*this,
+                                                                         std::forward<T3>(rhs));
+    }
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) && {
+    if constexpr (is_fusable<T3>) {
+      auto fused = std::move(right_) | std::forward<T3>(rhs);
+      return pipe_pair<T1, decltype(fused)>(std::move(left_), std::move(fused));
+    } else {
+      return pipe_pair<pipe_pair<T1, T2>, typename std::decay<T3>::type>(std::move(*this),
+                                                                         std::forward<T3>(rhs));
+    }
   }
 };
 
 template <typename T1, typename T2> auto pipe(T1 &&t1, T2 &&t2) {
-  return pipe_pair<T1, T2>(std::forward<T1>(t1), std::forward<T2>(t2));
+  return pipe_pair<typename std::decay<T1>::type, typename std::decay<T2>::type>(
+      std::forward<T1>(t1), std::forward<T2>(t2));
 }
 
 template <typename T1, typename T2, typename... T> auto pipe(T1 &&t1, T2 &&t2, T &&... args) {
@@ -1,7 +1,26 @@
 #pragma once
+#include <pipeline/affinity.hpp>
+#include <pipeline/batch.hpp>
+#include <pipeline/cancellation.hpp>
+#include <pipeline/executor.hpp>
+#include <pipeline/file_sink.hpp>
+#include <pipeline/filter.hpp>
 #include <pipeline/fn.hpp>
 #include <pipeline/from.hpp>
 #include <pipeline/for_each.hpp>
 #include <pipeline/fork_into.hpp>
+#include <pipeline/fork_into_tuple.hpp>
+#include <pipeline/fork_into_within.hpp>
+#include <pipeline/instrument.hpp>
+#include <pipeline/lazy.hpp>
+#include <pipeline/map.hpp>
+#include <pipeline/mapped_file.hpp>
+#include <pipeline/parallel_for.hpp>
+#include <pipeline/parallel_stage.hpp>
 #include <pipeline/pipe_pair.hpp>
+#include <pipeline/reduce.hpp>
+#include <pipeline/stream.hpp>
+#include <pipeline/task.hpp>
+#include <pipeline/thread_pool.hpp>
+#include <pipeline/unzip_for_each.hpp>
 #include <pipeline/unzip_into.hpp>
\ No newline at end of file
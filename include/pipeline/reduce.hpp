@@ -0,0 +1,167 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <pipeline/details.hpp>
+#include <pipeline/fn.hpp>
+#include <pipeline/parallel_for.hpp>
+#include <pipeline/parallel_stage.hpp>
+#include <pipeline/thread_pool.hpp>
+#include <type_traits>
+#include <utility>
+
+namespace pipeline {
+
+namespace details {
+
+// Partial results of a parallel reduction, one per chunk, combined in a
+// binary tree as the chunks finish. The second chunk of a pair to finish
+// merges the pair and carries on up the tree, so the merges of different
+// subtrees run in parallel and nobody waits for a whole level. A partial
+// is always merged with the one to its right, in that order, so `merge`
+// need not be commutative. Each partial has a cache line of its own.
+template <typename T> class reduction_tree {
+  static constexpr std::size_t cache_line = 64;
+
+  struct alignas(cache_line) node {
+    std::optional<T> value;
+    // set by the first of the two halves whose right half starts here
+    std::atomic<bool> arrived{false};
+  };
+
+  std::size_t size_;
+  std::unique_ptr<node[]> nodes_;
+
+public:
+  explicit reduction_tree(std::size_t size)
+      : size_(size), nodes_(std::make_unique<node[]>(size)) {}
+
+  template <typename Merge> void add(std::size_t i, T value, Merge &merge) {
+    nodes_[i].value.emplace(std::move(value));
+    // i is the first chunk of a subtree of `width` chunks
+    for (std::size_t width = 1; width < size_; width *= 2) {
+      const auto left = i & ~(2 * width - 1);
+      const auto right = left + width;
+      if (right >= size_) {
+        continue; // no right half at this level
+      }
+      if (!nodes_[right].arrived.exchange(true, std::memory_order_acq_rel)) {
+        return; // the other half merges
+      }
+      auto &l = nodes_[left].value;
+      auto &r = nodes_[right].value;
+      l.emplace(merge(std::move(*l), std::move(*r)));
+      r.reset();
+      i = left;
+    }
+  }
+
+  T take() { return std::move(*nodes_[0].value); }
+};
+
+struct identity {
+  template <typename U> U &&operator()(U &&value) const { return std::forward<U>(value); }
+};
+
+// Partials are merged with the reduction's own op
+struct merge_with_op {};
+
+} // namespace details
+
+// Parallel reduction of a container: each chunk folds its elements into an
+// accumulator of its own, starting from a copy of `init`, with
+// acc = op(std::move(acc), element); the partials are then merged
+// pairwise in a tree, with op(std::move(left), std::move(right)) or the
+// function given to combine(). `init` is therefore the identity of op
+// (0 for a sum, an empty histogram, ...), and op must be associative.
+// Each chunk folds and merges with its own copies of op, the transform
+// and the merge function, so stateful function objects don't race.
+template <typename T, typename Op, typename Transform = details::identity,
+          typename Combine = details::merge_with_op>
+class reduce : public details::chunked_stage<reduce<T, Op, Transform, Combine>> {
+  template <typename, typename, typename, typename> friend class reduce;
+
+  T init_;
+  Op op_;
+  Transform transform_;
+  Combine combine_;
+
+  static T merge(Op &op, Combine &combine, T left, T right) {
+    if constexpr (std::is_same<Combine, details::merge_with_op>::value) {
+      return op(std::move(left), std::move(right));
+    } else {
+      return combine(std::move(left), std::move(right));
+    }
+  }
+
+public:
+  reduce(T init, Op op, Transform transform = {}, Combine combine = {})
+      : init_(std::move(init)), op_(std::move(op)), transform_(std::move(transform)),
+        combine_(std::move(combine)) {}
+
+  // Merge partial results with merge(std::move(left), std::move(right))
+  // instead of op, for when folding in an element and merging two
+  // accumulators differ, e.g., counting into a histogram vs adding two
+  template <typename Merge> reduce<T, Op, Transform, Merge> combine(Merge merge) const & {
+    return reduce(*this).combine(std::move(merge));
+  }
+
+  template <typename Merge> reduce<T, Op, Transform, Merge> combine(Merge merge) && {
+    reduce<T, Op, Transform, Merge> result(std::move(init_), std::move(op_),
+                                           std::move(transform_), std::move(merge));
+    result.adopt_settings(*this);
+    return result;
+  }
+
+  template <typename Container> T operator()(Container &&args) {
+    auto &ex = this->get_executor();
+    const details::loop_range<decltype(std::begin(args))> input(std::begin(args), std::end(args));
+    const auto size = input.size();
+    if (size == 0) {
+      return init_;
+    }
+    const auto grain = input.grain(this->grain(size, ex));
+
+    details::reduction_tree<T> tree((size + grain - 1) / grain);
+    details::parallel_for(ex, input, grain,
+                          [this, &tree, grain](auto it, std::size_t begin, std::size_t end) {
+                            const auto chunk = begin / grain;
+                            auto op = op_;
+                            auto transform = transform_;
+                            T acc = init_;
+                            for (; begin != end; ++begin, ++it) {
+                              acc = op(std::move(acc), transform(*it));
+                            }
+                            // the merges up the tree run on this chunk's copies too
+                            auto combine = combine_;
+                            auto merge = [&op, &combine](T left, T right) {
+                              return reduce::merge(op, combine, std::move(left),
+                                                   std::move(right));
+                            };
+                            tree.add(chunk, std::move(acc), merge);
+                          },
+                          this->cancellation_);
+    return tree.take();
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) const & {
+    return pipe_pair<reduce<T, Op, Transform, Combine>, typename std::decay<T3>::type>(
+        *this, std::forward<T3>(rhs));
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) && {
+    return pipe_pair<reduce<T, Op, Transform, Combine>, typename std::decay<T3>::type>(
+        std::move(*this), std::forward<T3>(rhs));
+  }
+};
+
+// reduce over transform(element) rather than the elements themselves, e.g.,
+// transform_reduce(0.0, std::plus<>(), [](const order &o) { return o.total; })
+template <typename T, typename Op, typename Transform>
+auto transform_reduce(T init, Op op, Transform transform) {
+  return reduce<T, Op, Transform>(std::move(init), std::move(op), std::move(transform));
+}
+
+} // namespace pipeline
@@ -0,0 +1,239 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+namespace pipeline {
+
+namespace details {
+
+// Spin, then yield, then sleep - used while waiting for tasks in flight.
+// Blocking queue operations park instead once spinning and yielding are
+// exhausted(), see spsc_queue.
+class backoff {
+  unsigned count_{0};
+
+public:
+  void operator()() {
+    if (count_ < 64) {
+      ++count_;
+    } else if (count_ < 128) {
+      ++count_;
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+  }
+
+  bool exhausted() const { return count_ >= 128; }
+
+  void reset() { count_ = 0; }
+};
+
+// Bounded lock-free single-producer/single-consumer ring buffer.
+//
+// One thread pushes, another pops. The producer close()s the queue once
+// it is done; the consumer cancel()s it when it stops consuming early, which
+// makes pending and future pushes fail instead of blocking forever.
+//
+// A side that has to wait spins and yields for a moment, then parks on a
+// condition variable until the other side makes progress, so an idle
+// stream doesn't use any CPU. Each push or pop checks for a parked peer
+// after a fence, and only takes the mutex to wake one up.
+template <typename T> class spsc_queue {
+  static constexpr std::size_t cache_line = 64;
+
+  std::size_t mask_;
+  std::unique_ptr<std::optional<T>[]> slots_;
+
+  alignas(cache_line) std::atomic<std::size_t> head_{0}; // next slot to pop
+  std::size_t cached_tail_{0};                           // consumer's view of tail_
+
+  alignas(cache_line) std::atomic<std::size_t> tail_{0}; // next slot to push
+  std::size_t cached_head_{0};                           // producer's view of head_
+
+  alignas(cache_line) std::atomic<bool> closed_{false};
+  std::atomic<bool> cancelled_{false};
+
+  std::atomic<unsigned> parked_{0};
+  std::mutex park_mutex_;
+  std::condition_variable park_cv_;
+
+  // Wakes the other side if it is parked. The fence orders the caller's
+  // update of the queue before the read of parked_, as park() orders its
+  // update of parked_ before re-checking the queue, so a wake-up can't be
+  // missed.
+  void wake() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (parked_.load(std::memory_order_relaxed) > 0) {
+      std::lock_guard<std::mutex> lock(park_mutex_);
+      park_cv_.notify_all();
+    }
+  }
+
+  // Sleeps until ready() or `deadline`
+  template <typename Ready, typename Clock, typename Duration>
+  void park(Ready ready, const std::chrono::time_point<Clock, Duration> &deadline) {
+    std::unique_lock<std::mutex> lock(park_mutex_);
+    parked_.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (deadline == std::chrono::time_point<Clock, Duration>::max()) {
+      park_cv_.wait(lock, ready);
+    } else {
+      park_cv_.wait_until(lock, deadline, ready);
+    }
+    parked_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  bool can_push() const {
+    return tail_.load(std::memory_order_relaxed) - head_.load(std::memory_order_acquire) <= mask_ ||
+           cancelled_.load(std::memory_order_acquire);
+  }
+
+  bool can_pop() const {
+    return head_.load(std::memory_order_relaxed) != tail_.load(std::memory_order_acquire) ||
+           cancelled_.load(std::memory_order_acquire) || closed_.load(std::memory_order_acquire);
+  }
+
+public:
+  typedef T value_type;
+
+  // `capacity` is rounded up to a power of two
+  explicit spsc_queue(std::size_t capacity) {
+    std::size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    mask_ = size - 1;
+    slots_ = std::make_unique<std::optional<T>[]>(size);
+  }
+
+  spsc_queue(const spsc_queue &) = delete;
+  spsc_queue &operator=(const spsc_queue &) = delete;
+
+  std::size_t capacity() const { return mask_ + 1; }
+
+  // Producer side. Returns false if the queue is full.
+  bool try_push(T &&value) {
+    const auto tail = tail_.load(std::memory_order_relaxed);
+    if (tail - cached_head_ > mask_) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail - cached_head_ > mask_) {
+        return false;
+      }
+    }
+    slots_[tail & mask_].emplace(std::move(value));
+    tail_.store(tail + 1, std::memory_order_release);
+    wake();
+    return true;
+  }
+
+  // Producer side. Blocks while the queue is full; returns false if the
+  // consumer cancelled the queue.
+  bool push(T value) {
+    backoff wait;
+    while (!try_push(std::move(value))) {
+      if (cancelled_.load(std::memory_order_acquire)) {
+        return false;
+      }
+      if (wait.exhausted()) {
+        park([this] { return can_push(); }, std::chrono::steady_clock::time_point::max());
+      } else {
+        wait();
+      }
+    }
+    return true;
+  }
+
+  // Consumer side. Returns std::nullopt if the queue is empty.
+  std::optional<T> try_pop() {
+    const auto head = head_.load(std::memory_order_relaxed);
+    if (head == cached_tail_) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if (head == cached_tail_) {
+        return std::nullopt;
+      }
+    }
+    auto &slot = slots_[head & mask_];
+    std::optional<T> value(std::move(slot));
+    slot.reset();
+    head_.store(head + 1, std::memory_order_release);
+    wake();
+    return value;
+  }
+
+  // Consumer side. Blocks while the queue is empty; returns std::nullopt
+  // once the queue is closed and drained, or cancelled.
+  std::optional<T> pop() {
+    backoff wait;
+    while (true) {
+      if (auto value = try_pop()) {
+        return value;
+      }
+      if (cancelled_.load(std::memory_order_acquire)) {
+        return std::nullopt;
+      }
+      if (closed_.load(std::memory_order_acquire)) {
+        // a push may have landed just before close()
+        return try_pop();
+      }
+      if (wait.exhausted()) {
+        park([this] { return can_pop(); }, std::chrono::steady_clock::time_point::max());
+      } else {
+        wait();
+      }
+    }
+  }
+
+  // Consumer side. Like pop(), but gives up and returns std::nullopt once
+  // `deadline` has passed.
+  template <typename Clock, typename Duration>
+  std::optional<T> pop_until(const std::chrono::time_point<Clock, Duration> &deadline) {
+    backoff wait;
+    while (true) {
+      if (auto value = try_pop()) {
+        return value;
+      }
+      if (cancelled_.load(std::memory_order_acquire)) {
+        return std::nullopt;
+      }
+      if (closed_.load(std::memory_order_acquire)) {
+        return try_pop();
+      }
+      if (Clock::now() >= deadline) {
+        return std::nullopt;
+      }
+      if (wait.exhausted()) {
+        park([this] { return can_pop(); }, deadline);
+      } else {
+        wait();
+      }
+    }
+  }
+
+  // Producer side: no more values will be pushed
+  void close() {
+    closed_.store(true, std::memory_order_release);
+    wake();
+  }
+
+  // Consumer side: no more values will be popped. May also be called from
+  // another thread to stop both sides.
+  void cancel() {
+    cancelled_.store(true, std::memory_order_release);
+    wake();
+  }
+
+  bool closed() const { return closed_.load(std::memory_order_acquire); }
+
+  bool cancelled() const { return cancelled_.load(std::memory_order_acquire); }
+};
+
+} // namespace details
+
+} // namespace pipeline
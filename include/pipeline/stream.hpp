@@ -0,0 +1,364 @@
+#pragma once
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <pipeline/affinity.hpp>
+#include <pipeline/cancellation.hpp>
+#include <pipeline/details.hpp>
+#include <pipeline/fn.hpp>
+#include <pipeline/pipe_pair.hpp>
+#include <pipeline/spsc_queue.hpp>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+namespace pipeline {
+
+namespace details {
+
+template <typename T> struct is_fused_fn : std::false_type {};
+template <typename... Fns> struct is_fused_fn<fn<fused<Fns...>>> : std::true_type {};
+
+// Flattens a chain of pipe_pairs, e.g., (a | b) | c, into a tuple of its
+// stages (a, b, c). Fused fns are split back into one stage per function.
+template <typename T> auto stages_of(T &&stage) {
+  typedef typename std::decay<T>::type stage_type;
+  if constexpr (is_specialization<stage_type, pipe_pair>::value) {
+    return std::tuple_cat(stages_of(stage.left()), stages_of(stage.right()));
+  } else if constexpr (is_fused_fn<stage_type>::value) {
+    return std::apply([](auto &... fns) { return std::make_tuple(pipeline::fn(fns)...); },
+                      stage.function().stages());
+  } else {
+    return std::make_tuple(std::forward<T>(stage));
+  }
+}
+
+// Per-stream state of a stage that is called once per item. Stages that
+// emit zero or several results per item (see batch) provide their own
+// state through a stream_state<In>() member instead.
+template <typename Stage, typename In> class call_state {
+  Stage &stage_;
+
+public:
+  typedef typename std::invoke_result<Stage &, In>::type result_type;
+  typedef typename std::conditional<std::is_same<result_type, void>::value, void,
+                                    typename std::decay<result_type>::type>::type output_type;
+
+  explicit call_state(Stage &stage) : stage_(stage) {}
+
+  template <typename Emit> void process(In &&item, Emit &emit) {
+    if constexpr (std::is_same<result_type, void>::value) {
+      stage_(std::move(item));
+    } else {
+      emit(stage_(std::move(item)));
+    }
+  }
+
+  template <typename Emit> void flush(Emit &) {}
+
+  std::chrono::steady_clock::time_point deadline() const {
+    return std::chrono::steady_clock::time_point::max();
+  }
+};
+
+template <typename Stage, typename In, typename = void>
+struct has_stream_state : std::false_type {};
+
+template <typename Stage, typename In>
+struct has_stream_state<
+    Stage, In, std::void_t<decltype(std::declval<Stage &>().template stream_state<In>())>>
+    : std::true_type {};
+
+// Stream states may want to know how long their stage waited for input
+template <typename State, typename = void> struct has_queue_wait_hook : std::false_type {};
+
+template <typename State>
+struct has_queue_wait_hook<State, std::void_t<decltype(std::declval<State &>().on_queue_wait(
+                                      std::chrono::steady_clock::duration()))>>
+    : std::true_type {};
+
+// Stream states may need to do more when the input ends than on a
+// deadline (e.g., wait for work still in flight); they do it in finish()
+template <typename State, typename Emit, typename = void> struct has_finish : std::false_type {};
+
+template <typename State, typename Emit>
+struct has_finish<State, Emit,
+                  std::void_t<decltype(std::declval<State &>().finish(std::declval<Emit &>()))>>
+    : std::true_type {};
+
+template <typename State, typename Emit> void finish_state(State &state, Emit &emit) {
+  if constexpr (has_finish<State, Emit>::value) {
+    state.finish(emit);
+  } else {
+    state.flush(emit);
+  }
+}
+
+template <typename In, typename Stage> auto make_stream_state(Stage &stage) {
+  if constexpr (has_stream_state<Stage, In>::value) {
+    return stage.template stream_state<In>();
+  } else {
+    return call_state<Stage, In>(stage);
+  }
+}
+
+template <typename Stage, typename In>
+using stream_output_t =
+    typename decltype(make_stream_state<In>(std::declval<Stage &>()))::output_type;
+
+// The queues in front of each stage (and after the last one, unless it
+// returns void) of a stream fed with `In`
+template <typename In, typename... Stages> struct stream_queues;
+
+template <typename In> struct stream_queues<In> {
+  typedef std::tuple<std::unique_ptr<spsc_queue<In>>> type;
+  typedef In output_type;
+};
+
+template <> struct stream_queues<void> {
+  typedef std::tuple<> type;
+  typedef void output_type;
+};
+
+template <typename In, typename Stage, typename... Stages>
+struct stream_queues<In, Stage, Stages...> {
+  typedef stream_output_t<Stage, In> result_type;
+  static_assert(sizeof...(Stages) == 0 || !std::is_same<result_type, void>::value,
+                "only the last stage of a stream may return void");
+
+  typedef stream_queues<result_type, Stages...> next;
+  typedef decltype(std::tuple_cat(std::declval<std::tuple<std::unique_ptr<spsc_queue<In>>>>(),
+                                  std::declval<typename next::type>())) type;
+  typedef typename next::output_type output_type;
+};
+
+} // namespace details
+
+// Runs each stage of a pipeline on its own thread, connected by bounded
+// single-producer/single-consumer queues. While stage N works on one item,
+// stage N - 1 is already working on the next one.
+//
+// push() feeds the first stage (from a single thread) and blocks while its
+// queue is full, so a slow stage throttles everything upstream of it. If
+// the last stage returns a value, pop() its results until it returns
+// std::nullopt. Call close() when there is no more input, then wait().
+//
+// stop(), or an exception in any stage, stops the whole stream at once:
+// queued items are dropped, and parallel stages skip the tasks they have
+// not started and see stop_requested() in the ones that are running.
+template <typename In, typename... Stages> class streaming_pipeline {
+  typedef details::stream_queues<In, Stages...> queues_traits;
+  typedef typename queues_traits::type queues_type;
+
+public:
+  typedef typename queues_traits::output_type output_type;
+
+private:
+  static constexpr bool has_output = !std::is_same<output_type, void>::value;
+
+  std::tuple<Stages...> stages_;
+  std::vector<cpu_set> placement_;
+  queues_type queues_;
+  std::vector<std::thread> threads_;
+  details::stop_flag stop_{nullptr};
+  std::mutex error_mutex_;
+  std::exception_ptr error_;
+
+  template <std::size_t I> auto &queue() { return *std::get<I>(queues_); }
+
+  // CPUs stage I runs on; anywhere if none were given
+  const cpu_set &placement(std::size_t stage) const {
+    static const cpu_set anywhere;
+    return stage < placement_.size() ? placement_[stage] : anywhere;
+  }
+
+  // The input queue of a pinned stage is allocated on that stage's CPUs,
+  // so its buffer lives in the consumer's NUMA node
+  template <std::size_t... Is> void make_queues(std::size_t capacity, std::index_sequence<Is...>) {
+    (details::run_on(placement(Is),
+                     [this, capacity] {
+                       std::get<Is>(queues_) = std::make_unique<
+                           typename std::tuple_element<Is, queues_type>::type::element_type>(
+                           capacity);
+                     }),
+     ...);
+  }
+
+  template <std::size_t... Is> void cancel_queues(std::index_sequence<Is...>) {
+    (queue<Is>().cancel(), ...);
+  }
+
+  template <std::size_t... Is> void start(std::index_sequence<Is...>) {
+    threads_.reserve(sizeof...(Is));
+    try {
+      (threads_.emplace_back([this] { run_stage<Is>(); }), ...);
+    } catch (...) {
+      // a thread couldn't be started: stop and join the ones that were
+      stop();
+      join();
+      throw;
+    }
+  }
+
+  template <std::size_t I> void run_stage() {
+    typedef typename std::tuple_element<I, queues_type>::type::element_type::value_type input_type;
+    constexpr bool has_next = I + 1 < std::tuple_size<queues_type>::value;
+
+    placement(I).pin_current_thread();
+    details::stop_scope scope(stop_);
+    auto &input = queue<I>();
+    bool stopped = false;
+    auto emit = [this, &stopped](auto &&result) {
+      if constexpr (has_next) {
+        if (!stopped && !queue<I + 1>().push(std::forward<decltype(result)>(result))) {
+          stopped = true; // downstream has stopped
+        }
+      }
+    };
+
+    try {
+      auto state = details::make_stream_state<input_type>(std::get<I>(stages_));
+      auto pop = [&input, &state](auto deadline) {
+        if constexpr (details::has_queue_wait_hook<decltype(state)>::value) {
+          const auto start = std::chrono::steady_clock::now();
+          auto value = input.pop_until(deadline);
+          state.on_queue_wait(std::chrono::steady_clock::now() - start);
+          return value;
+        } else {
+          return input.pop_until(deadline);
+        }
+      };
+
+      while (!stopped && !stop_.requested()) {
+        const auto deadline = state.deadline();
+        if (auto value = pop(deadline)) {
+          state.process(std::move(*value), emit);
+        } else if (std::chrono::steady_clock::now() >= deadline) {
+          state.flush(emit);
+        } else {
+          // input closed and drained
+          details::finish_state(state, emit);
+          break;
+        }
+      }
+    } catch (...) {
+      {
+        // once stopping, other stages may fail with operation_cancelled
+        std::lock_guard<std::mutex> lock(error_mutex_);
+        if (!error_ && !stop_.requested()) {
+          error_ = std::current_exception();
+        }
+      }
+      stop();
+    }
+    // stop upstream stages, let downstream stages drain
+    input.cancel();
+    if constexpr (has_next) {
+      queue<I + 1>().close();
+    }
+  }
+
+  void rethrow_if_failed() {
+    std::lock_guard<std::mutex> lock(error_mutex_);
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+  }
+
+  void join() {
+    for (auto &thread : threads_) {
+      if (thread.joinable()) {
+        thread.join();
+      }
+    }
+  }
+
+public:
+  // `placement` gives the CPUs each stage's thread is pinned to, in stage
+  // order; stages past its end, or with an empty cpu_set, aren't pinned
+  streaming_pipeline(std::size_t capacity, Stages... stages, std::vector<cpu_set> placement = {})
+      : stages_(std::move(stages)...), placement_(std::move(placement)) {
+    make_queues(capacity, std::make_index_sequence<std::tuple_size<queues_type>::value>{});
+    start(std::index_sequence_for<Stages...>{});
+  }
+
+  streaming_pipeline(const streaming_pipeline &) = delete;
+  streaming_pipeline &operator=(const streaming_pipeline &) = delete;
+
+  // Closes the input and waits for the stages to finish; results that were
+  // not popped are dropped
+  ~streaming_pipeline() {
+    close();
+    if constexpr (has_output) {
+      queue<sizeof...(Stages)>().cancel();
+    }
+    join();
+  }
+
+  // Feeds one item to the first stage, blocking while its queue is full.
+  // Rethrows the exception of a failed stage.
+  void push(In value) {
+    if (!queue<0>().push(std::move(value))) {
+      rethrow_if_failed();
+      throw std::runtime_error("pipeline::streaming_pipeline: stream has stopped");
+    }
+  }
+
+  // Feeds every element of `range` to the first stage, e.g., the lines of
+  // an mmap_source; see push()
+  template <typename Range> void push_all(Range &&range) {
+    for (auto &&value : range) {
+      push(In(std::forward<decltype(value)>(value)));
+    }
+  }
+
+  // Next result of the last stage; std::nullopt once the stream is closed
+  // and drained. Rethrows the exception of a failed stage.
+  template <typename T = output_type> std::optional<T> pop() {
+    static_assert(has_output, "the last stage of this stream returns void");
+    auto value = queue<sizeof...(Stages)>().pop();
+    if (!value) {
+      rethrow_if_failed();
+    }
+    return value;
+  }
+
+  // No more input will be pushed
+  void close() { queue<0>().close(); }
+
+  // Stops every stage as soon as possible, dropping the items in flight.
+  // Safe to call from any thread; wait() still joins the stages.
+  void stop() {
+    stop_.request_stop();
+    cancel_queues(std::make_index_sequence<std::tuple_size<queues_type>::value>{});
+  }
+
+  // Closes the input and waits for every stage to drain. Pop all results
+  // first if the last stage returns a value.
+  void wait() {
+    close();
+    join();
+    rethrow_if_failed();
+  }
+};
+
+// Turns a pipeline (a | b | c) into a streaming_pipeline fed with values of
+// type `In`, with queues of `capacity` items between stages. `placement`
+// optionally pins stage i to placement[i], e.g., to keep a producer and its
+// consumer on CPUs that share an L3 cache.
+template <typename In, typename Pipeline>
+auto stream(Pipeline &&pipeline, std::size_t capacity = 1024,
+            std::vector<cpu_set> placement = {}) {
+  return std::apply(
+      [capacity, &placement](auto &&... stages) {
+        return streaming_pipeline<In, typename std::decay<decltype(stages)>::type...>(
+            capacity, std::move(stages)..., std::move(placement));
+      },
+      details::stages_of(std::forward<Pipeline>(pipeline)));
+}
+
+} // namespace pipeline
@@ -0,0 +1,441 @@
+#pragma once
+#include <pipeline/details.hpp>
+
+#ifdef PIPELINE_HAS_COROUTINES
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <pipeline/parallel_for.hpp>
+#include <pipeline/thread_pool.hpp>
+#include <queue>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace pipeline {
+
+template <typename T = void> class task;
+
+namespace details {
+
+template <typename T> struct is_task : std::false_type {};
+template <typename T> struct is_task<task<T>> : std::true_type {};
+
+// What co_await on a T gives: U for a task<U>, T itself otherwise
+template <typename T> struct awaited { typedef T type; };
+template <typename T> struct awaited<task<T>> { typedef T type; };
+
+class task_promise_base {
+  std::coroutine_handle<> continuation_;
+
+  // Resumes whoever awaits the task, without growing the stack
+  struct final_awaiter {
+    bool await_ready() noexcept { return false; }
+
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+      auto continuation = handle.promise().continuation_;
+      return continuation ? continuation : std::noop_coroutine();
+    }
+
+    void await_resume() noexcept {}
+  };
+
+public:
+  std::suspend_always initial_suspend() noexcept { return {}; }
+
+  final_awaiter final_suspend() noexcept { return {}; }
+
+  void set_continuation(std::coroutine_handle<> continuation) { continuation_ = continuation; }
+};
+
+template <typename T> class task_promise : public task_promise_base {
+  std::variant<std::monostate, T, std::exception_ptr> result_;
+
+public:
+  task<T> get_return_object();
+
+  template <typename U> void return_value(U &&value) {
+    result_.template emplace<1>(std::forward<U>(value));
+  }
+
+  void unhandled_exception() { result_.template emplace<2>(std::current_exception()); }
+
+  T result() {
+    if (result_.index() == 2) {
+      std::rethrow_exception(std::get<2>(result_));
+    }
+    return std::move(std::get<1>(result_));
+  }
+};
+
+template <> class task_promise<void> : public task_promise_base {
+  std::exception_ptr error_;
+
+public:
+  task<void> get_return_object();
+
+  void return_void() {}
+
+  void unhandled_exception() { error_ = std::current_exception(); }
+
+  void result() {
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+  }
+};
+
+} // namespace details
+
+// A lazily started coroutine producing a T. It starts when it is
+// co_awaited and resumes its awaiter when done, so a chain of tasks never
+// blocks a thread while one of them waits on a timer, I/O or an executor.
+//
+// A stage that returns a task is an async stage: `fn(a) | fn(b)` where
+// `a` returns task<T> gives a pipeline that returns a task too, and calls
+// `b` with the awaited T. The pipeline object must outlive the tasks it
+// returns, and async stages should take their arguments by value.
+template <typename T> class task {
+public:
+  typedef details::task_promise<T> promise_type;
+
+private:
+  std::coroutine_handle<promise_type> handle_;
+
+  struct awaiter {
+    std::coroutine_handle<promise_type> handle;
+
+    // A moved-from task has no coroutine, and so no result to wait for
+    bool await_ready() {
+      if (!handle) {
+        throw std::logic_error("pipeline::task: awaiting an empty task");
+      }
+      return handle.done();
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+      handle.promise().set_continuation(awaiting);
+      return handle;
+    }
+
+    T await_resume() { return handle.promise().result(); }
+  };
+
+public:
+  explicit task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+  task(task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+
+  task &operator=(task &&other) noexcept {
+    if (this != &other) {
+      if (handle_) {
+        handle_.destroy();
+      }
+      handle_ = std::exchange(other.handle_, nullptr);
+    }
+    return *this;
+  }
+
+  task(const task &) = delete;
+  task &operator=(const task &) = delete;
+
+  ~task() {
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+
+  bool done() const { return handle_ && handle_.done(); }
+
+  awaiter operator co_await() && { return awaiter{handle_}; }
+
+  awaiter operator co_await() & { return awaiter{handle_}; }
+};
+
+namespace details {
+
+template <typename T> task<T> task_promise<T>::get_return_object() {
+  return task<T>(std::coroutine_handle<task_promise<T>>::from_promise(*this));
+}
+
+inline task<void> task_promise<void>::get_return_object() {
+  return task<void>(std::coroutine_handle<task_promise<void>>::from_promise(*this));
+}
+
+template <typename T, typename Continuation> struct then_result {
+  typedef typename std::invoke_result<Continuation &, T>::type type;
+};
+
+template <typename Continuation> struct then_result<void, Continuation> {
+  typedef typename std::invoke_result<Continuation &>::type type;
+};
+
+// Awaits `first`, then calls `continuation` with its result - what piping
+// an async stage into the next stage turns into
+template <typename T, typename Continuation>
+auto then(task<T> first, Continuation continuation)
+    -> task<typename awaited<typename then_result<T, Continuation>::type>::type> {
+  typedef typename then_result<T, Continuation>::type result_type;
+  if constexpr (std::is_void<T>::value) {
+    co_await std::move(first);
+    if constexpr (is_task<result_type>::value) {
+      co_return co_await continuation();
+    } else {
+      co_return continuation();
+    }
+  } else {
+    auto value = co_await std::move(first);
+    if constexpr (is_task<result_type>::value) {
+      co_return co_await continuation(std::move(value));
+    } else {
+      co_return continuation(std::move(value));
+    }
+  }
+}
+
+// Eagerly started coroutine that nobody awaits; it cleans up after itself
+struct detached {
+  struct promise_type {
+    detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+// Completion state shared by the tasks of a when_all
+class when_all_latch {
+  std::atomic<std::size_t> count_;
+  std::coroutine_handle<> awaiting_;
+  std::mutex mutex_;
+  std::exception_ptr error_;
+
+public:
+  explicit when_all_latch(std::size_t count) : count_(count + 1) {}
+
+  void fail(std::exception_ptr error) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!error_) {
+      error_ = std::move(error);
+    }
+  }
+
+  // The last task to arrive resumes the awaiting coroutine
+  void arrive() {
+    if (count_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      awaiting_.resume();
+    }
+  }
+
+  bool await_ready() { return false; }
+
+  bool await_suspend(std::coroutine_handle<> awaiting) {
+    awaiting_ = awaiting;
+    return count_.fetch_sub(1, std::memory_order_acq_rel) > 1;
+  }
+
+  void await_resume() {
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+  }
+};
+
+template <typename T, typename Output>
+detached run_child(task<T> &child, std::size_t index, Output &output, when_all_latch &latch) {
+  try {
+    if constexpr (std::is_void<T>::value) {
+      co_await child;
+    } else {
+      output.set(index, co_await child);
+    }
+  } catch (...) {
+    latch.fail(std::current_exception());
+  }
+  latch.arrive();
+}
+
+template <typename T>
+using when_all_result =
+    typename std::conditional<std::is_void<T>::value, void, std::vector<T>>::type;
+
+} // namespace details
+
+// Runs every task concurrently and completes once all of them are done.
+// Gives their results in order (nothing for void tasks); rethrows the
+// first exception, if any.
+template <typename T>
+task<details::when_all_result<T>> when_all(std::vector<task<T>> tasks) {
+  if constexpr (std::is_void<T>::value) {
+    details::when_all_latch latch(tasks.size());
+    std::monostate no_output;
+    for (std::size_t i = 0; i < tasks.size(); ++i) {
+      details::run_child(tasks[i], i, no_output, latch);
+    }
+    co_await latch;
+  } else {
+    details::map_output<T, std::allocator<T>> output(tasks.size(), std::allocator<T>());
+    details::when_all_latch latch(tasks.size());
+    for (std::size_t i = 0; i < tasks.size(); ++i) {
+      details::run_child(tasks[i], i, output, latch);
+    }
+    co_await latch;
+    co_return output.take();
+  }
+}
+
+// Awaitable that resumes the awaiting coroutine on `ex`
+inline auto schedule(executor &ex) {
+  struct awaiter {
+    executor &ex;
+
+    bool await_ready() { return false; }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+      ex.execute([handle] { handle.resume(); });
+    }
+
+    void await_resume() {}
+  };
+  return awaiter{ex};
+}
+
+// Resumes coroutines once their deadline passes, on an executor, from a
+// single timer thread - a stand-in for an event loop (epoll, io_uring)
+// that lets thousands of waits share a handful of threads. Every sleep
+// must be over before the queue is destroyed.
+class timer_queue {
+  struct timer {
+    std::chrono::steady_clock::time_point deadline;
+    std::coroutine_handle<> handle;
+
+    bool operator>(const timer &other) const { return deadline > other.deadline; }
+  };
+
+  executor &executor_;
+  std::priority_queue<timer, std::vector<timer>, std::greater<timer>> timers_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_{false};
+  std::thread thread_;
+
+  void add(std::chrono::steady_clock::time_point deadline, std::coroutine_handle<> handle) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      timers_.push({deadline, handle});
+    }
+    cv_.notify_one();
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_) {
+      if (timers_.empty()) {
+        cv_.wait(lock);
+      } else if (const auto deadline = timers_.top().deadline;
+                 deadline > std::chrono::steady_clock::now()) {
+        cv_.wait_until(lock, deadline);
+      } else {
+        const auto handle = timers_.top().handle;
+        timers_.pop();
+        lock.unlock();
+        executor_.execute([handle] { handle.resume(); });
+        lock.lock();
+      }
+    }
+  }
+
+public:
+  explicit timer_queue(executor &ex = default_executor())
+      : executor_(ex), thread_([this] { run(); }) {}
+
+  timer_queue(const timer_queue &) = delete;
+  timer_queue &operator=(const timer_queue &) = delete;
+
+  ~timer_queue() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+  }
+
+  // Awaitable that resumes the awaiting coroutine once `deadline` has passed
+  auto sleep_until(std::chrono::steady_clock::time_point deadline) {
+    struct awaiter {
+      timer_queue &queue;
+      std::chrono::steady_clock::time_point deadline;
+
+      bool await_ready() { return false; }
+
+      void await_suspend(std::coroutine_handle<> handle) { queue.add(deadline, handle); }
+
+      void await_resume() {}
+    };
+    return awaiter{*this, deadline};
+  }
+
+  auto sleep_for(std::chrono::steady_clock::duration duration) {
+    return sleep_until(std::chrono::steady_clock::now() + duration);
+  }
+};
+
+namespace details {
+
+template <typename T> struct sync_wait_state {
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool done{false};
+  std::optional<typename std::conditional<std::is_void<T>::value, std::monostate, T>::type>
+      value;
+  std::exception_ptr error;
+};
+
+template <typename T> detached notify_when_done(task<T> &t, sync_wait_state<T> &state) {
+  try {
+    if constexpr (std::is_void<T>::value) {
+      co_await t;
+      state.value.emplace();
+    } else {
+      state.value.emplace(co_await t);
+    }
+  } catch (...) {
+    state.error = std::current_exception();
+  }
+  std::lock_guard<std::mutex> lock(state.mutex);
+  state.done = true;
+  state.cv.notify_one();
+}
+
+} // namespace details
+
+// Blocks the calling thread until `t` is done and returns its result - the
+// bridge from synchronous code into async stages
+template <typename T> T sync_wait(task<T> t) {
+  details::sync_wait_state<T> state;
+  details::notify_when_done(t, state);
+  {
+    std::unique_lock<std::mutex> lock(state.mutex);
+    state.cv.wait(lock, [&state] { return state.done; });
+  }
+  if (state.error) {
+    std::rethrow_exception(state.error);
+  }
+  if constexpr (!std::is_void<T>::value) {
+    return std::move(*state.value);
+  }
+}
+
+} // namespace pipeline
+
+#endif
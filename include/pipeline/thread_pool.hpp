@@ -0,0 +1,233 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <pipeline/affinity.hpp>
+#include <pipeline/executor.hpp>
+#include <thread>
+#include <vector>
+
+namespace pipeline {
+
+namespace details {
+
+// Double-ended queue of tasks in a growable ring buffer. Unlike std::deque
+// it keeps its storage once it has grown, so a pool that runs at a steady
+// load stops allocating for its queues.
+class task_ring {
+  std::vector<std::function<void()>> slots_{8};
+  std::size_t head_{0};
+  std::size_t size_{0};
+
+  void grow() {
+    std::vector<std::function<void()>> slots(slots_.size() * 2);
+    for (std::size_t i = 0; i < size_; ++i) {
+      slots[i] = std::move(slots_[(head_ + i) % slots_.size()]);
+    }
+    slots_ = std::move(slots);
+    head_ = 0;
+  }
+
+public:
+  bool empty() const { return size_ == 0; }
+
+  void push_back(std::function<void()> task) {
+    if (size_ == slots_.size()) {
+      grow();
+    }
+    slots_[(head_ + size_) % slots_.size()] = std::move(task);
+    ++size_;
+  }
+
+  std::function<void()> pop_front() {
+    auto task = std::move(slots_[head_]);
+    slots_[head_] = nullptr;
+    head_ = (head_ + 1) % slots_.size();
+    --size_;
+    return task;
+  }
+
+  std::function<void()> pop_back() {
+    auto &slot = slots_[(head_ + size_ - 1) % slots_.size()];
+    auto task = std::move(slot);
+    slot = nullptr;
+    --size_;
+    return task;
+  }
+};
+
+} // namespace details
+
+// Work-stealing pool of worker threads. Each worker owns a task queue;
+// tasks submitted from outside the pool are spread round-robin over the
+// queues.
+//
+// Tasks submitted from one of the pool's own workers (e.g., the branches
+// of a fork_into nested inside a for_each) go onto that worker's queue.
+// A worker runs the newest task of its own queue first, which keeps nested
+// work hot in its cache, and idle workers steal the oldest task of a
+// neighbour's queue, which tends to be the largest piece of work left.
+// A stage waiting for its tasks on one of the workers runs pending tasks
+// meanwhile (see try_run_pending), so nested parallel stages compose
+// without oversubscribing the machine or idling a worker in a join. Other
+// threads just wait: they would pick up unrelated tasks of the pool,
+// which could hold them up for arbitrarily long.
+class thread_pool : public executor {
+  struct worker_queue {
+    std::mutex mutex;
+    details::task_ring tasks;
+  };
+
+  std::vector<std::unique_ptr<worker_queue>> queues_;
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::atomic<std::size_t> pending_{0};
+  std::atomic<std::size_t> next_{0};
+  bool stop_{false};
+
+  inline static thread_local thread_pool *current_pool_ = nullptr;
+  inline static thread_local std::size_t current_index_ = 0;
+
+  bool try_pop(std::size_t index, std::function<void()> &task) {
+    for (std::size_t i = 0; i < queues_.size(); ++i) {
+      auto &queue = *queues_[(index + i) % queues_.size()];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (queue.tasks.empty()) {
+        continue;
+      }
+      if (i == 0) {
+        // own queue, newest task first
+        task = queue.tasks.pop_back();
+      } else {
+        // steal from the other end
+        task = queue.tasks.pop_front();
+      }
+      pending_.fetch_sub(1);
+      return true;
+    }
+    return false;
+  }
+
+  // Queue a task submitted from this thread goes to, and is taken from
+  std::size_t home_queue() {
+    return current_pool_ == this ? current_index_ : next_.fetch_add(1) % queues_.size();
+  }
+
+  void start(std::size_t threads, const cpu_set &cpus) {
+    for (std::size_t i = 0; i < threads; ++i) {
+      queues_.push_back(std::make_unique<worker_queue>());
+    }
+    for (std::size_t i = 0; i < threads; ++i) {
+      threads_.emplace_back([this, i, cpu = cpus.empty() ? cpu_set() : cpu_set{cpus[i]}] {
+        cpu.pin_current_thread();
+        run(i);
+      });
+    }
+  }
+
+  void run(std::size_t index) {
+    current_pool_ = this;
+    current_index_ = index;
+    std::function<void()> task;
+    while (true) {
+      if (try_pop(index, task)) {
+        task();
+        task = nullptr;
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] { return stop_ || pending_.load() > 0; });
+      if (stop_ && pending_.load() == 0) {
+        return;
+      }
+    }
+  }
+
+public:
+  explicit thread_pool(std::size_t threads = std::thread::hardware_concurrency()) {
+    start(std::max<std::size_t>(threads, 1), {});
+  }
+
+  // One worker per CPU in `cpus`, each pinned to its CPU, e.g.,
+  // thread_pool(cpu_set::numa_node(0)) keeps a pool on the first socket
+  explicit thread_pool(const cpu_set &cpus) {
+    if (cpus.empty()) {
+      start(std::max<std::size_t>(std::thread::hardware_concurrency(), 1), {});
+    } else {
+      start(cpus.size(), cpus);
+    }
+  }
+
+  thread_pool(const thread_pool &) = delete;
+  thread_pool &operator=(const thread_pool &) = delete;
+
+  // Runs the remaining tasks, then joins the workers
+  ~thread_pool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto &thread : threads_) {
+      thread.join();
+    }
+  }
+
+  std::size_t size() const { return threads_.size(); }
+
+  std::size_t concurrency() const override { return size(); }
+
+  void execute(std::function<void()> task) override {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_.fetch_add(1);
+    }
+    auto &queue = *queues_[home_queue()];
+    {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.tasks.push_back(std::move(task));
+    }
+    cv_.notify_one();
+  }
+
+  bool try_run_pending() override {
+    if (current_pool_ != this || pending_.load() == 0) {
+      return false;
+    }
+    std::function<void()> task;
+    if (!try_pop(home_queue(), task)) {
+      return false;
+    }
+    task();
+    return true;
+  }
+};
+
+namespace details {
+
+inline std::atomic<executor *> &default_executor_override() {
+  static std::atomic<executor *> ex{nullptr};
+  return ex;
+}
+
+} // namespace details
+
+// The executor used by stages that were not given one with `.on(...)`.
+// Unless overridden, this is a process-wide thread_pool with one worker
+// per hardware thread.
+inline executor &default_executor() {
+  if (auto ex = details::default_executor_override().load()) {
+    return *ex;
+  }
+  static thread_pool pool;
+  return pool;
+}
+
+// Replace the default executor; `ex` must outlive every pipeline using it
+inline void set_default_executor(executor &ex) { details::default_executor_override() = &ex; }
+
+} // namespace pipeline
@@ -0,0 +1,129 @@
+#pragma once
+#include <array>
+#include <iterator>
+#include <memory>
+#include <pipeline/details.hpp>
+#include <pipeline/parallel_for.hpp>
+#include <pipeline/parallel_stage.hpp>
+#include <pipeline/thread_pool.hpp>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+namespace pipeline {
+
+// Data-parallel unzip_into for struct-of-arrays inputs: takes a tuple of
+// columns (ranges) and calls the I-th function on every element of the
+// I-th column - or the only function on every element of every column.
+//
+// Each column is split into contiguous chunks and the chunks of all the
+// columns are spread over the executor at once, so a task stays within
+// one column and large columns don't end up as one task each. Returns a
+// std::tuple with a std::vector of results per column (std::monostate for
+// a column whose function returns void), or nothing if every function
+// returns void. Build one with unzip_into(...).for_each().
+template <typename Fn, typename... Fns>
+class unzip_for_each : public details::chunked_stage<unzip_for_each<Fn, Fns...>> {
+  std::tuple<Fn, Fns...> fns_;
+
+  template <std::size_t I>
+  using function_type =
+      typename std::tuple_element<sizeof...(Fns) == 0 ? 0 : I, std::tuple<Fn, Fns...>>::type;
+
+  template <std::size_t I> function_type<I> &function() {
+    return std::get<sizeof...(Fns) == 0 ? 0 : I>(fns_);
+  }
+
+  template <std::size_t I, typename Tuple>
+  using column_iterator = decltype(std::begin(std::get<I>(std::declval<Tuple &>())));
+
+  template <std::size_t I, typename Tuple>
+  using column_result =
+      typename std::invoke_result<function_type<I> &,
+                                  decltype(*std::declval<column_iterator<I, Tuple>>())>::type;
+
+  // Where the results of column I go; nothing for a void column
+  template <std::size_t I, typename Tuple> auto make_output(std::size_t size) {
+    typedef column_result<I, Tuple> result_type;
+    if constexpr (std::is_same<result_type, void>::value) {
+      return std::monostate{};
+    } else {
+      return details::map_output<result_type, std::allocator<result_type>>(
+          size, std::allocator<result_type>());
+    }
+  }
+
+  template <typename Output> static auto take(Output &output) {
+    if constexpr (std::is_same<Output, std::monostate>::value) {
+      return std::monostate{};
+    } else {
+      return output.take();
+    }
+  }
+
+  template <typename Tuple, std::size_t... Is>
+  decltype(auto) run(Tuple &columns, std::index_sequence<Is...>) {
+    auto &ex = this->get_executor();
+
+    const std::tuple<details::loop_range<column_iterator<Is, Tuple>>...> inputs{
+        {std::begin(std::get<Is>(columns)), std::end(std::get<Is>(columns))}...};
+    const std::array<std::size_t, sizeof...(Is)> sizes{std::get<Is>(inputs).size()...};
+    std::size_t total = 0;
+    for (auto size : sizes) {
+      total += size;
+    }
+    // grain sizes apply to each column, picked from the total size
+    const auto grain = this->grain(total, ex);
+
+    auto outputs = std::make_tuple(make_output<Is, Tuple>(sizes[Is])...);
+    auto bodies = std::make_tuple([&fn = function<Is>(), &output = std::get<Is>(outputs)](
+                                      auto it, std::size_t begin, std::size_t end) {
+      // a copy per chunk, so that no function object is shared by two threads
+      auto f = fn;
+      for (; begin != end; ++begin, ++it) {
+        if constexpr (std::is_same<column_result<Is, Tuple>, void>::value) {
+          f(*it);
+        } else {
+          output.set(begin, f(*it));
+        }
+      }
+    }...);
+
+    // one latch for every chunk of every column
+    details::task_group group(ex, this->cancellation_);
+    std::tuple<details::chunk_loop<column_iterator<Is, Tuple>,
+                                   typename std::tuple_element<Is, decltype(bodies)>::type>...>
+        loops{{group, std::get<Is>(inputs), grain, std::get<Is>(bodies)}...};
+    (std::get<Is>(loops).offload(ex), ...);
+    (std::get<Is>(loops).run_last(), ...);
+    group.wait();
+
+    if constexpr (!(std::is_same<column_result<Is, Tuple>, void>::value && ...)) {
+      return std::make_tuple(take(std::get<Is>(outputs))...);
+    }
+  }
+
+public:
+  unzip_for_each(Fn first, Fns... fns) : fns_(std::move(first), std::move(fns)...) {}
+
+  template <typename Tuple> decltype(auto) operator()(Tuple &&columns) {
+    constexpr auto tuple_size = std::tuple_size<typename std::decay<Tuple>::type>::value;
+    static_assert(sizeof...(Fns) == 0 || sizeof...(Fns) + 1 == tuple_size,
+                  "unzip_into needs one function per tuple element, or a single function");
+
+    return run(columns, std::make_index_sequence<tuple_size>{});
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) const & {
+    return pipe_pair<unzip_for_each<Fn, Fns...>, typename std::decay<T3>::type>(
+        *this, std::forward<T3>(rhs));
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) && {
+    return pipe_pair<unzip_for_each<Fn, Fns...>, typename std::decay<T3>::type>(
+        std::move(*this), std::forward<T3>(rhs));
+  }
+};
+
+} // namespace pipeline
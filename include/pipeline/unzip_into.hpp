@@ -3,84 +3,115 @@
 #include <future>
 #include <pipeline/details.hpp>
 #include <pipeline/fn.hpp>
+#include <pipeline/fork_into.hpp>
+#include <pipeline/parallel_stage.hpp>
+#include <pipeline/thread_pool.hpp>
+#include <pipeline/unzip_for_each.hpp>
 #include <thread>
 
 namespace pipeline {
 
-template <typename Fn, typename... Fns> class unzip_into {
+template <typename Fn, typename... Fns>
+class unzip_into : public details::parallel_stage<unzip_into<Fn, Fns...>> {
   std::tuple<Fn, Fns...> fns_;
 
-  template <class F, class Tuple1, class Tuple2, std::size_t... I>
-  auto apply2_impl(F &&f, Tuple1 &&t1, Tuple2 &&t2, std::index_sequence<I...>) {
-    return fork_into((std::forward<F>(f)(std::get<I>(std::forward<Tuple1>(t1)),
-                                         std::get<I>(std::forward<Tuple2>(t2))))...);
+  // The function that handles element I of the input tuple: the I-th
+  // function, or the only one if a single function was given
+  template <std::size_t I> auto &function() {
+    if constexpr (sizeof...(Fns) == 0) {
+      return std::get<0>(fns_);
+    } else {
+      return std::get<I>(fns_);
+    }
+  }
+
+  // The functions of the branches: with a single function, a copy per
+  // branch, since the branches run at the same time
+  template <std::size_t... Is> auto branch_functions(std::index_sequence<Is...>) {
+    if constexpr (sizeof...(Fns) == 0) {
+      return std::make_tuple((static_cast<void>(Is), std::get<0>(fns_))...);
+    } else {
+      return std::tie(std::get<Is>(fns_)...);
+    }
   }
 
-  template <class F, class Tuple1, class Tuple2>
-  constexpr decltype(auto) apply2(F &&f, Tuple1 &&t1, Tuple2 &&t2) {
-    return apply2_impl(
-        std::forward<F>(f), std::forward<Tuple1>(t1), std::forward<Tuple2>(t2),
-        std::make_index_sequence<std::tuple_size<std::remove_reference_t<Tuple1>>::value>{});
+  template <typename Tuple, std::size_t... Is>
+  decltype(auto) unzip(Tuple &&tuple, std::index_sequence<Is...>) {
+    auto functions = branch_functions(std::index_sequence<Is...>{});
+    // Each element goes to exactly one branch, so it is handed over as is:
+    // moved out of an rvalue tuple, passed by reference otherwise
+    auto calls = std::make_tuple([&fn = std::get<Is>(functions), &tuple] {
+      auto call = [&]() -> decltype(auto) { return fn(std::get<Is>(std::forward<Tuple>(tuple))); };
+      return details::invoke_branch(call);
+    }...);
+
+    auto results = details::run_branches(
+        this->get_executor(), this->cancellation_, calls,
+        std::integer_sequence<bool,
+                              details::runs_inline<Is, sizeof...(Is),
+                                                   typename std::decay<decltype(
+                                                       function<Is>())>::type>...>{},
+        std::index_sequence<Is...>{});
+
+    typedef typename std::invoke_result<decltype(function<0>()),
+                                        decltype(std::get<0>(std::forward<Tuple>(tuple)))>::type
+        result_type;
+    if constexpr (!std::is_same<result_type, void>::value) {
+      return details::to_vector<typename std::decay<result_type>::type>(std::move(results));
+    }
   }
 
 public:
-  unzip_into(Fn first, Fns... fns) : fns_(first, fns...) {}
+  unzip_into(Fn first, Fns... fns) : fns_(std::move(first), std::move(fns)...) {}
+
+  // Data-parallel mode for tuples of columns: call the functions on every
+  // element of their column instead of on the column, see unzip_for_each
+  unzip_for_each<Fn, Fns...> for_each() const & { return unzip_into(*this).for_each(); }
+
+  unzip_for_each<Fn, Fns...> for_each() && {
+    auto result = std::make_from_tuple<unzip_for_each<Fn, Fns...>>(std::move(fns_));
+    if (this->executor_) {
+      result.on(*this->executor_);
+    }
+    if (this->cancellation_) {
+      result.cancel_on(*this->cancellation_);
+    }
+    return result;
+  }
 
   template <typename Tuple> decltype(auto) operator()(Tuple &&tuple) {
     // We have a tuple of functions to run in parallel - fns_
     // We have a tuple of args to UNZIP
     // and then pass to each function - tuple_element
-    const auto bind_arg = [](auto &&fn, auto &&arg) {
-      return pipeline::fn(std::bind(fn, std::move(arg)));
-    };
-
-    if constexpr (std::tuple_size<std::tuple<Fn, Fns...>>::value == std::tuple_size<Tuple>::value) {
-      // sizeof(tuple of fns) == sizeof(tuple)
-      // 1-1 mapping
-
-      auto unzipped_fork = apply2(bind_arg, fns_, tuple);
-
-      // Let's say the input args were (arg1, arg2, arg3, ...)
-      // And we have functions (fn1, fn2, fn3, ...)
-
-      // The above code has constructed a fork:
-      // fork(bind(fn1, arg1), bind(fn2, arg2), bind(fn3, arg3), ...)
-      //
-      // Each function is bound to an argument from the input
-      // and because it is a fork, these can/will run in parallel
-
-      // Simply run the fork and return the results
-      return unzipped_fork();
-    } else if constexpr (std::tuple_size<std::tuple<Fn, Fns...>>::value == 1) {
-      // sizeof(tuple of fns) = 1
-      // Unpack the args on the left and pass each arg to the same function
-      // Essentially, we're calling the same function on each of the args
-      // Useful if each arg in the tuple is the same type and we're doing the same operation
-
-      // First, we make a tuple of functions of size = sizeof...(args)
-      // From one function `fn`, we get: tuple {fn, fn, fn, fn, ...}
-      // Then we have arguments (arg1, arg2, arg3, ....)
-
-      // We construct the fork:
-      // fork(bind(fn, arg1), bind(fn, arg2), bind(fn, arg3), ...)
-      //
-      // Each function (the same one in this case) is bound to an argument from the input
-      // and because it is a fork, these can/will run in parallel
-      //
-      // Once the fork is constructed, simply run the fork
-
-      auto repeated_tuple_fn = details::make_repeated_tuple<std::tuple_size<Tuple>::value>(
-          std::make_tuple(std::get<0>(fns_)));
-      auto unzipped_fork = apply2(bind_arg, repeated_tuple_fn, tuple);
-      return unzipped_fork();
-    } else {
-      static_assert(std::tuple_size<std::tuple<Fn, Fns...>>::value ==
-                    std::tuple_size<Tuple>::value);
-    }
+    //
+    // Let's say the input args were (arg1, arg2, arg3, ...)
+    // And we have functions (fn1, fn2, fn3, ...)
+    //
+    // This runs the fork:
+    // fork(fn1(arg1), fn2(arg2), fn3(arg3), ...)
+    //
+    // With a single function `fn`, the same function handles every arg:
+    // fork(fn(arg1), fn(arg2), fn(arg3), ...)
+    // Useful if each arg in the tuple is the same type and we're doing the same operation
+    //
+    // The branches call the stored functions directly; no fork_into or
+    // bound copies of the functions are built per call
+
+    constexpr auto tuple_size = std::tuple_size<typename std::decay<Tuple>::type>::value;
+    static_assert(sizeof...(Fns) == 0 || sizeof...(Fns) + 1 == tuple_size,
+                  "unzip_into needs one function per tuple element, or a single function");
+
+    return unzip(std::forward<Tuple>(tuple), std::make_index_sequence<tuple_size>{});
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) const & {
+    return pipe_pair<unzip_into<Fn, Fns...>, typename std::decay<T3>::type>(*this,
+                                                                            std::forward<T3>(rhs));
   }
 
-  template <typename T3> auto operator|(T3 &&rhs) {
-    return pipe_pair<unzip_into<Fns...>, T3>(*this, std::forward<T3>(rhs));
+  template <typename T3> auto operator|(T3 &&rhs) && {
+    return pipe_pair<unzip_into<Fn, Fns...>, typename std::decay<T3>::type>(std::move(*this),
+                                                                            std::forward<T3>(rhs));
   }
 };
 
@@ -0,0 +1,27 @@
+#include <iostream>
+#include <numeric>
+#include <pipeline/pipeline.hpp>
+#include <string>
+#include <vector>
+using namespace pipeline;
+
+int main() {
+  // A pool with one worker pinned to each CPU of the first NUMA node (or an
+  // unpinned pool where there is no such node)
+  thread_pool pool(cpu_set::numa_node(0));
+  auto squares = for_each([](int a) { return a * a; }).on(pool);
+  auto results = squares(std::vector<int>{1, 2, 3, 4, 5});
+  std::cout << "sum of squares = " << std::accumulate(results.begin(), results.end(), 0) << "\n";
+  // sum of squares = 55
+
+  // Keep the producer and consumer stages of a stream on the same CPUs, so
+  // the queue between them stays in a shared cache
+  const auto node = cpu_set::numa_node(0);
+  auto parse = fn([](std::string line) { return std::stoi(line); });
+  auto print = fn([](int a) { std::cout << a << "\n"; });
+  auto s = stream<std::string>(parse | print, 64, {node, node});
+  for (int i = 1; i <= 3; ++i) {
+    s.push(std::to_string(i));
+  }
+  s.wait(); // 1 2 3
+}
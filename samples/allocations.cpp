@@ -0,0 +1,33 @@
+#include <algorithm>
+#include <cstddef>
+#include <iostream>
+#include <memory_resource>
+#include <numeric>
+#include <pipeline/pipeline.hpp>
+#include <vector>
+using namespace pipeline;
+
+int main() {
+  thread_pool pool(4);
+
+  // Scratch memory owned by the pipeline's caller, reset after every call
+  alignas(std::max_align_t) static std::byte buffer[1 << 16];
+  std::pmr::monotonic_buffer_resource arena(buffer, sizeof buffer);
+
+  auto square = for_each([](int x) { return x * x; }).on(pool).allocate_from(arena);
+  auto sum = [](const std::pmr::vector<int> &v) { return std::accumulate(v.begin(), v.end(), 0L); };
+  auto max = [](const std::pmr::vector<int> &v) { return *std::max_element(v.begin(), v.end()); };
+  auto pipeline = pipe(square, fork_into_tuple(sum, max).on(pool));
+
+  std::vector<int> input(4096);
+  std::iota(input.begin(), input.end(), 0);
+
+  // Once the pool's queues have grown, calls make no heap allocations
+  long total = 0;
+  for (int i = 0; i < 1000; ++i) {
+    auto [s, m] = pipeline(input);
+    total += s + m;
+    arena.release();
+  }
+  std::cout << total << "\n"; // 22914873345000
+}
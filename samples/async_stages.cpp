@@ -0,0 +1,39 @@
+#include <chrono>
+#include <iostream>
+#include <pipeline/pipeline.hpp>
+#include <vector>
+using namespace pipeline;
+using namespace std::chrono_literals;
+
+int main() {
+  thread_pool pool(4);
+  timer_queue io(pool); // stand-in for an event loop
+
+  // An I/O-bound stage: waits 10ms without holding a thread
+  auto fetch = fn([&io](int id) -> task<int> {
+    co_await io.sleep_for(10ms);
+    co_return id * 2;
+  });
+  auto parse = fn([](int response) { return response + 1; });
+
+  auto pipeline = fetch | parse; // returns task<int>
+
+  // 10000 requests in flight at once on 4 threads
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<task<int>> requests;
+  for (int i = 0; i < 10000; ++i) {
+    requests.push_back(pipeline(i));
+  }
+  auto responses = sync_wait(when_all(std::move(requests)));
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+
+  long total = 0;
+  for (auto r : responses) {
+    total += r;
+  }
+  std::cout << "responses: " << responses.size() << "\n"; // responses: 10000
+  std::cout << "total:     " << total << "\n";            // total:     100000000
+  std::cout << "elapsed:   "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count()
+            << "ms\n"; // far below 10000 x 10ms
+}
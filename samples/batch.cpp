@@ -0,0 +1,36 @@
+#include <chrono>
+#include <iostream>
+#include <pipeline/pipeline.hpp>
+#include <thread>
+#include <vector>
+using namespace pipeline;
+using namespace std::chrono_literals;
+
+int main() {
+  // Batches of up to 4 items, or whatever arrived within 20ms
+  auto write_batch = fn([](const std::vector<int> &items) {
+    std::cout << "writing " << items.size() << " items\n";
+  });
+
+  auto s = stream<int>(batch(4, 20ms) | write_batch);
+  for (int i = 0; i < 10; ++i) {
+    s.push(i);
+  }
+  std::this_thread::sleep_for(50ms); // the last 2 items are flushed by the deadline
+  s.push(10);
+  s.wait();
+  // writing 4 items
+  // writing 4 items
+  // writing 2 items
+  // writing 1 items
+
+  // unbatch flattens batches again, e.g., to feed for_each
+  auto pipeline = from(std::vector<std::vector<int>>{{1, 2}, {3}, {4, 5}}) | unbatch() |
+                  for_each([](int a) { return a * a; }) | fn([](const std::vector<int> &squares) {
+                    for (auto &s : squares) {
+                      std::cout << s << " ";
+                    }
+                    std::cout << "\n";
+                  });
+  pipeline(); // 1 4 9 16 25
+}
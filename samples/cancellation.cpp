@@ -0,0 +1,41 @@
+#include <chrono>
+#include <iostream>
+#include <pipeline/pipeline.hpp>
+#include <thread>
+#include <vector>
+using namespace pipeline;
+using namespace std::chrono_literals;
+
+int main() {
+  thread_pool pool(4);
+
+  // The first failure skips the chunks that haven't started yet
+  auto check = for_each([](int a) {
+                 if (a == 3) {
+                   throw std::invalid_argument("bad input: 3");
+                 }
+                 std::this_thread::sleep_for(10ms);
+                 return a;
+               })
+                   .on(pool)
+                   .grain_size(1);
+  try {
+    check(std::vector<int>{1, 2, 3, 4, 5, 6, 7, 8});
+  } catch (const std::invalid_argument &e) {
+    std::cout << e.what() << "\n"; // bad input: 3
+  }
+
+  // Give up on a search after 50ms; the branches poll stop_requested()
+  cancellation timeout(50ms);
+  auto search = [](int) {
+    while (!stop_requested()) {
+      std::this_thread::sleep_for(1ms);
+    }
+    return 0;
+  };
+  try {
+    fork_into(search, search).on(pool).cancel_on(timeout)(42);
+  } catch (const operation_cancelled &e) {
+    std::cout << e.what() << "\n"; // pipeline: operation cancelled
+  }
+}
@@ -0,0 +1,32 @@
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <pipeline/pipeline.hpp>
+#include <string>
+using namespace pipeline;
+
+int main() {
+  const std::string path = "file_sink_sample.txt";
+
+  // Buffers of 64 KiB, written by a background thread
+  auto sink = file_sink(path).buffer_size(64 * 1024).sync(sync_policy::on_flush);
+
+  auto square = fn([](long long a) { return a * a; });
+  auto pipeline = square | sink;
+  for (int i = 1; i <= 100000; ++i) {
+    pipeline(i);
+  }
+  sink.flush(); // written and synced
+
+  std::ifstream file(path);
+  std::string line, last;
+  std::size_t count = 0;
+  while (std::getline(file, line)) {
+    last = line;
+    ++count;
+  }
+  std::cout << count << " lines, last: " << last << "\n"; // 100000 lines, last: 10000000000
+
+  sink.close();
+  std::remove(path.c_str());
+}
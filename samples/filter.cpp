@@ -0,0 +1,27 @@
+#include <iostream>
+#include <pipeline/pipeline.hpp>
+#include <string>
+#include <vector>
+using namespace pipeline;
+
+int main() {
+  auto words = fn([] {
+    return std::vector<std::string>{"pipeline", "of", "stages", "run", "in", "parallel"};
+  });
+
+  // Keep the long words, in order
+  auto is_long = [](const std::string &word) { return word.size() > 3; };
+
+  // Fused with the filter: only the long words are measured
+  auto length = for_each([](const std::string &word) { return word.size(); });
+
+  auto print = fn([](const std::vector<std::size_t> &lengths) {
+    for (auto n : lengths) {
+      std::cout << n << " ";
+    }
+    std::cout << "\n";
+  });
+
+  auto pipeline = words | filter(is_long) | length | print;
+  pipeline(); // 8 6 8
+}
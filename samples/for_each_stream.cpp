@@ -0,0 +1,37 @@
+#include <chrono>
+#include <iostream>
+#include <pipeline/pipeline.hpp>
+#include <thread>
+using namespace pipeline;
+using namespace std::chrono_literals;
+
+int main() {
+  thread_pool pool(4);
+
+  // Item 0 is slow, the others are quick
+  auto work = [](int i) {
+    std::this_thread::sleep_for(i == 0 ? 50ms : 1ms);
+    return i;
+  };
+  auto print = [](int i) { std::cout << i << " "; };
+
+  // Results in input order: 1..7 wait for 0
+  {
+    auto s = stream<int>(for_each(work).on(pool).ordered(8) | print);
+    for (int i = 0; i < 8; ++i) {
+      s.push(i);
+    }
+    s.wait();
+    std::cout << "\n"; // 0 1 2 3 4 5 6 7
+  }
+
+  // Results as they are done: 0 comes last
+  {
+    auto s = stream<int>(for_each(work).on(pool).unordered(8) | print);
+    for (int i = 0; i < 8; ++i) {
+      s.push(i);
+    }
+    s.wait();
+    std::cout << "\n"; // e.g., 1 2 3 4 5 6 7 0
+  }
+}
@@ -0,0 +1,35 @@
+#include <iostream>
+#include <pipeline/pipeline.hpp>
+#include <string>
+#include <vector>
+using namespace pipeline;
+
+int main() {
+  auto generate_input = fn([] { return std::vector<int>{1, 2, 3, 4, 5}; });
+
+  auto forward_it = [](const std::vector<int> &vec) { return vec; };
+
+  auto string_it = [](const std::vector<int> &vec) {
+    std::string result = "{ ";
+    for (auto &v : vec) {
+      result += std::to_string(v) + " ";
+    }
+    result += "}";
+    return result;
+  };
+
+  // results is a std::tuple<std::vector<int>, std::string>
+  auto print_results = [](auto results) {
+    auto &[forwarded, stringified] = results;
+
+    std::cout << "Forwarded   : ";
+    for (auto &e : forwarded) {
+      std::cout << e << " ";
+    }
+    std::cout << "\n";
+    std::cout << "Stringified : " << stringified << "\n";
+  };
+
+  auto pipeline = generate_input | fork_into_tuple(forward_it, string_it) | print_results;
+  pipeline();
+}
@@ -0,0 +1,31 @@
+#include <chrono>
+#include <iostream>
+#include <pipeline/pipeline.hpp>
+#include <string>
+#include <thread>
+using namespace pipeline;
+using namespace std::chrono_literals;
+
+int main() {
+  thread_pool pool(4);
+
+  auto replica = [](std::chrono::milliseconds latency, std::string name) {
+    return [=](const std::string &query) {
+      std::this_thread::sleep_for(latency);
+      return name + ": " + query;
+    };
+  };
+
+  // Take whatever answers arrive within 100ms
+  auto lookup = fork_into_within(100ms, replica(10ms, "us-east"), replica(20ms, "eu-west"),
+                                 replica(300ms, "ap-south"))
+                    .on(pool);
+
+  auto answers = lookup(std::string("status"));
+  for (auto &answer : answers) {
+    std::cout << (answer ? *answer : "(timed out)") << "\n";
+  }
+  // us-east: status
+  // eu-west: status
+  // (timed out)
+}
@@ -0,0 +1,30 @@
+#include <chrono>
+#include <iostream>
+#include <pipeline/pipeline.hpp>
+#include <thread>
+using namespace pipeline;
+using namespace std::chrono_literals;
+
+// Flip to false to compile the instrumentation away
+constexpr bool profiling = true;
+
+int main() {
+  stage_metrics metrics;
+
+  auto parse = instrument<profiling>(fn([](int a) { return a + 1; }), "parse", metrics);
+  auto score = instrument<profiling>(fn([](int a) {
+                                       std::this_thread::sleep_for(1ms); // the bottleneck
+                                       return a * 2;
+                                     }),
+                                     "score", metrics);
+  auto print = instrument<profiling>(fn([](int) {}), "print", metrics);
+
+  auto s = stream<int>(parse | score | print);
+  for (int i = 0; i < 100; ++i) {
+    s.push(i);
+  }
+  s.wait();
+
+  metrics.dump_text(std::cout);
+  metrics.dump_json(std::cout);
+}
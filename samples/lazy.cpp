@@ -0,0 +1,28 @@
+#include <iostream>
+#include <pipeline/pipeline.hpp>
+#include <vector>
+using namespace pipeline;
+
+int main() {
+  std::vector<int> numbers{1, 2, 3, 4, 5};
+
+  auto square = map([](int a) { return a * a; });
+  auto add_one = map([](int a) { return a + 1; });
+
+  // Nothing is computed (and no vector is built) until collect() reads the
+  // range; then each element goes through both maps in a single pass
+  auto pipeline = from(numbers) | lazy() | square | add_one | collect();
+  for (auto n : pipeline()) {
+    std::cout << n << " ";
+  }
+  std::cout << "\n"; // 2 5 10 17 26
+
+  // A parallel stage reads the lazy range in chunks, so square runs inside
+  // for_each's tasks
+  auto halve = for_each([](int a) { return a / 2.0; });
+  auto parallel = lazy() | square | halve;
+  for (auto n : parallel(numbers)) {
+    std::cout << n << " ";
+  }
+  std::cout << "\n"; // 0.5 2 4.5 8 12.5
+}
@@ -0,0 +1,24 @@
+#include <iostream>
+#include <pipeline/pipeline.hpp>
+#include <vector>
+using namespace pipeline;
+
+int main() {
+  std::vector<float> celsius{-40.0f, 0.0f, 21.5f, 37.0f, 100.0f};
+
+  // Fused into a single pass over the data
+  auto to_fahrenheit = map([](float c) { return c * 1.8f; }) | map([](float c) { return c + 32; });
+
+  auto fahrenheit = to_fahrenheit(celsius);
+  for (auto f : fahrenheit) {
+    std::cout << f << " ";
+  }
+  std::cout << "\n"; // -40 32 70.7 98.6 212
+
+  // An rvalue vector is overwritten in place
+  auto doubled = map([](int a) { return a * 2; })(std::vector<int>{1, 2, 3, 4, 5});
+  for (auto d : doubled) {
+    std::cout << d << " ";
+  }
+  std::cout << "\n"; // 2 4 6 8 10
+}
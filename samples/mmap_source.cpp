@@ -0,0 +1,51 @@
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <pipeline/pipeline.hpp>
+#include <string>
+#include <thread>
+using namespace pipeline;
+
+int main() {
+  const std::string path = "mmap_source_sample.csv";
+  {
+    std::ofstream csv(path);
+    for (int i = 1; i <= 100000; ++i) {
+      csv << "item" << i << "," << i % 100 << "\n";
+    }
+  }
+
+  // The quantity column of a line such as "item42,42"
+  auto quantity = [](std::string_view line) {
+    return std::stol(std::string(line.substr(line.find(',') + 1)));
+  };
+
+  // One-shot: the file's lines, as string_views into the mapping, in chunks
+  // of about 64 KiB that for_each handles in parallel
+  auto total = mmap_source(path, 64 * 1024) | for_each([&](std::string_view chunk) {
+                 long sum = 0;
+                 for (auto line : lines(chunk)) {
+                   sum += quantity(line);
+                 }
+                 return sum;
+               });
+  auto sums = total();
+  std::cout << "total: " << std::accumulate(sums.begin(), sums.end(), 0L) << "\n"; // 4950000
+
+  // Streaming: the lines feed a stream one by one
+  auto source = mmap_source(path);
+  auto s = stream<std::string_view>(fn(quantity) | fn([](long q) { return q == 99; }), 1024);
+  long count = 0;
+  std::thread reader([&] {
+    while (auto is_max = s.pop()) {
+      count += *is_max;
+    }
+  });
+  s.push_all(source());
+  s.wait();
+  reader.join();
+  std::cout << "lines with quantity 99: " << count << "\n"; // 1000
+
+  std::remove(path.c_str());
+}
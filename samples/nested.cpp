@@ -0,0 +1,33 @@
+#include <algorithm>
+#include <iostream>
+#include <numeric>
+#include <pipeline/pipeline.hpp>
+#include <string>
+#include <vector>
+using namespace pipeline;
+
+int main() {
+  thread_pool pool(4);
+
+  // Each document is summarized by a fork_into that runs inside for_each,
+  // on the same 4 workers
+  auto summarize =
+      fork_into([](const std::string &doc) { return doc.size(); },
+                [](const std::string &doc) {
+                  return static_cast<std::size_t>(std::count(doc.begin(), doc.end(), ' ') + 1);
+                })
+          .on(pool);
+
+  auto pipeline = for_each(summarize).on(pool);
+
+  std::vector<std::string> docs{"the quick brown fox", "jumps over", "the lazy dog", "again"};
+  auto summaries = pipeline(docs);
+  for (std::size_t i = 0; i < docs.size(); ++i) {
+    std::cout << docs[i] << ": " << summaries[i][0] << " chars, " << summaries[i][1]
+              << " words\n";
+  }
+  // the quick brown fox: 19 chars, 4 words
+  // jumps over: 10 chars, 2 words
+  // the lazy dog: 12 chars, 3 words
+  // again: 5 chars, 1 words
+}
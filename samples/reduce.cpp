@@ -0,0 +1,38 @@
+#include <iostream>
+#include <numeric>
+#include <pipeline/pipeline.hpp>
+#include <vector>
+using namespace pipeline;
+
+int main() {
+  std::vector<int> values(1000000);
+  std::iota(values.begin(), values.end(), 0);
+
+  // Sum of squares: 0 is the identity of +
+  auto sum_of_squares = transform_reduce(0LL, std::plus<>(), [](int a) { return 1LL * a * a; });
+  std::cout << sum_of_squares(values) << "\n"; // 333332833333500000
+
+  // Histogram of last digits: a chunk counts into a histogram of its own,
+  // and two histograms are merged by adding them up
+  typedef std::vector<std::size_t> histogram;
+  auto digits = reduce(histogram(10),
+                       [](histogram h, int a) {
+                         ++h[a % 10];
+                         return h;
+                       })
+                    .combine([](histogram a, const histogram &b) {
+                      for (std::size_t i = 0; i < a.size(); ++i) {
+                        a[i] += b[i];
+                      }
+                      return a;
+                    });
+
+  auto print = fn([](const histogram &h) {
+    for (std::size_t i = 0; i < h.size(); ++i) {
+      std::cout << i << ": " << h[i] << "\n"; // 100000 each
+    }
+  });
+
+  auto pipeline = digits | print;
+  pipeline(values);
+}
@@ -0,0 +1,23 @@
+#include <chrono>
+#include <iostream>
+#include <pipeline/pipeline.hpp>
+#include <string>
+#include <thread>
+using namespace pipeline;
+
+int main() {
+  auto parse = fn([](std::string line) { return std::stoi(line); });
+  auto slow_square = fn([](int a) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    return a * a;
+  });
+  auto print = fn([](int a) { std::cout << a << "\n"; });
+
+  // Each stage runs on its own thread; at most 4 items wait between stages
+  auto s = stream<std::string>(parse | slow_square | print, 4);
+
+  for (int i = 1; i <= 10; ++i) {
+    s.push(std::to_string(i)); // blocks while slow_square falls behind
+  }
+  s.wait(); // 1 4 9 16 25 36 49 64 81 100
+}
@@ -0,0 +1,20 @@
+#include <algorithm>
+#include <iostream>
+#include <numeric>
+#include <pipeline/pipeline.hpp>
+using namespace pipeline;
+
+int main() {
+  // All parallel stages share these 4 workers
+  thread_pool pool(4);
+
+  auto square_all = for_each([](int a) { return a * a; }).on(pool);
+  auto sum_and_max = fork_into(
+      [](const std::vector<int> &v) { return std::accumulate(v.begin(), v.end(), 0); },
+      [](const std::vector<int> &v) { return *std::max_element(v.begin(), v.end()); });
+
+  auto pipeline = from(std::vector<int>{1, 2, 3, 4, 5}) | square_all | sum_and_max.on(pool);
+
+  auto results = pipeline();
+  std::cout << "sum = " << results[0] << ", max = " << results[1] << "\n"; // sum = 55, max = 25
+}
@@ -0,0 +1,28 @@
+#include <iostream>
+#include <pipeline/pipeline.hpp>
+#include <string>
+#include <tuple>
+#include <vector>
+using namespace pipeline;
+
+int main() {
+  // A table stored as one vector per column
+  auto generate_columns = fn([] {
+    return std::make_tuple(std::vector<int>{1, 2, 3, 4, 5},
+                           std::vector<std::string>{"a", "b", "c", "d", "e"});
+  });
+
+  auto square = [](int a) { return a * a; };
+  auto shout = [](const std::string &s) { return s + "!"; };
+
+  // results is a std::tuple<std::vector<int>, std::vector<std::string>>
+  auto print_results = [](auto results) {
+    auto &[squares, shouts] = results;
+    for (std::size_t i = 0; i < squares.size(); ++i) {
+      std::cout << squares[i] << " " << shouts[i] << "\n";
+    }
+  };
+
+  auto pipeline = generate_columns | unzip_into(square, shout).for_each() | print_results;
+  pipeline();
+}
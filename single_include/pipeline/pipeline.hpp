@@ -1,14 +1,51 @@
 #pragma once
+#include <iterator>
 #include <tuple>
+#include <type_traits>
+
+// Coroutine support (pipeline::task, async stages) when built as C++20
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define PIPELINE_HAS_COROUTINES
+#endif
+
+// Promise that a pointer doesn't alias any other pointer in scope, so that
+// loops over it can be vectorized without runtime overlap checks
+#if defined(__GNUC__) || defined(_MSC_VER)
+#define PIPELINE_RESTRICT __restrict
+#else
+#define PIPELINE_RESTRICT
+#endif
 
 namespace pipeline {
 
+template <typename Fn> class fn;
+
+template <typename Fn> class map;
+
+template <typename Pred, typename Fn> class filter;
+
 template <typename T1, typename T2> class pipe_pair;
 
 template <typename Fn, typename... Fns> class fork_into;
 
 namespace details {
 
+// Whether filter stage T1 fuses with stage T2, see filter::operator|
+template <typename T1, typename T2> struct fuses_with_filter : std::false_type {};
+
+// How an iterator can be moved around: its iterator_concept if it has one,
+// since an iterator whose reference is a value (the lines of a file, the
+// elements of a lazy map) can only claim input_iterator_tag as its
+// iterator_category
+template <typename Iterator, typename = void> struct iterator_concept {
+  typedef typename std::iterator_traits<Iterator>::iterator_category type;
+};
+
+template <typename Iterator>
+struct iterator_concept<Iterator, std::void_t<typename Iterator::iterator_concept>> {
+  typedef typename Iterator::iterator_concept type;
+};
+
 // is_tuple constexpr check
 template <typename> struct is_tuple : std::false_type {};
 template <typename... T> struct is_tuple<std::tuple<T...>> : std::true_type {};
@@ -50,269 +87,5095 @@ template <typename... Ts, typename F> void for_each_in_tuple(std::tuple<Ts...> c
   for_each(t, f, std::make_integer_sequence<int, sizeof...(Ts)>());
 }
 
+template <typename... Ts, typename F> void for_each_in_tuple(std::tuple<Ts...> &t, F f) {
+  for_each(t, f, std::make_integer_sequence<int, sizeof...(Ts)>());
+}
+
 } // namespace details
 
 } // namespace pipeline
 #pragma once
-// #include <pipeline/details.hpp>
+#include <cstddef>
+#include <exception>
+#include <fstream>
+#include <initializer_list>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
 
 namespace pipeline {
 
-template <typename Fn> class fn {
-  Fn fn_;
+// CPUs, as numbered by the OS, that a thread may run on. An empty set
+// leaves the thread wherever the OS puts it.
+//
+// Pinning is best effort: it only does something on Linux, and CPUs that
+// don't exist or aren't available to the process are skipped.
+class cpu_set {
+  std::vector<std::size_t> cpus_;
 
 public:
-  fn(Fn fn) : fn_(fn) {}
+  cpu_set() = default;
 
-  template <typename... T> decltype(auto) operator()(T &&... args) { return fn_(args...); }
+  cpu_set(std::initializer_list<std::size_t> cpus) : cpus_(cpus) {}
 
-  template <typename... A> static constexpr bool is_invocable_on() {
-    return std::is_invocable<Fn, A...>::value;
+  explicit cpu_set(std::vector<std::size_t> cpus) : cpus_(std::move(cpus)) {}
+
+  // CPUs `first` to `last`, inclusive
+  static cpu_set range(std::size_t first, std::size_t last) {
+    std::vector<std::size_t> cpus;
+    for (auto cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+    return cpu_set(std::move(cpus));
   }
 
-  template <typename T> auto operator|(T &&rhs) {
-    return pipe_pair<fn<Fn>, T>(*this, std::forward<T>(rhs));
+  // CPUs of a NUMA node, so that threads pinned to them share its memory
+  // (and usually an L3 cache). Empty if the node is unknown.
+  static cpu_set numa_node(std::size_t node) {
+    // e.g., "0-7,16-23"
+    std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    std::string list;
+    if (!std::getline(file, list)) {
+      return {};
+    }
+    std::vector<std::size_t> cpus;
+    std::size_t pos = 0;
+    while (pos < list.size()) {
+      auto end = list.find(',', pos);
+      if (end == std::string::npos) {
+        end = list.size();
+      }
+      const auto item = list.substr(pos, end - pos);
+      const auto dash = item.find('-');
+      try {
+        const auto first = std::stoul(item.substr(0, dash));
+        const auto last = dash == std::string::npos ? first : std::stoul(item.substr(dash + 1));
+        for (auto cpu = first; cpu <= last; ++cpu) {
+          cpus.push_back(cpu);
+        }
+      } catch (const std::exception &) {
+        return {};
+      }
+      pos = end + 1;
+    }
+    return cpu_set(std::move(cpus));
   }
-};
 
-} // namespace pipeline
-#pragma once
-// #include <pipeline/details.hpp>
-// #include <pipeline/fn.hpp>
-#include <functional>
+  bool empty() const { return cpus_.empty(); }
 
-namespace pipeline {
+  std::size_t size() const { return cpus_.size(); }
 
-template <typename T>
-auto from(T&& value) {
-  return fn(std::bind([](auto&& value) -> auto&& { 
-    return std::forward<decltype(value)>(value); 
-  }, std::forward<T>(value)));
-}
+  std::size_t operator[](std::size_t i) const { return cpus_[i]; }
 
-template <typename T>
-auto from(T& value) {
-  return fn([&value] () -> T& { return value; });
-}
+  auto begin() const { return cpus_.begin(); }
 
-template <typename T>
-auto from(const T& value) {
-  return fn([&value] () -> const T& { return value; });
-}
+  auto end() const { return cpus_.end(); }
 
+  // Restricts the calling thread to these CPUs. Returns whether it did.
+  bool pin_current_thread() const {
+#if defined(__linux__)
+    if (cpus_.empty()) {
+      return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (auto cpu : cpus_) {
+      if (cpu < CPU_SETSIZE) {
+        CPU_SET(cpu, &set);
+      }
+    }
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+  }
+};
+
+namespace details {
+
+// Calls f() on a thread pinned to `cpus` and waits for it. Memory that f
+// touches first is then placed on their NUMA node (Linux allocates pages
+// on the node of the thread that first writes them).
+template <typename F> void run_on(const cpu_set &cpus, F &&f) {
+  if (cpus.empty()) {
+    f();
+    return;
+  }
+  std::exception_ptr error;
+  std::thread thread([&cpus, &f, &error] {
+    cpus.pin_current_thread();
+    try {
+      f();
+    } catch (...) {
+      error = std::current_exception();
+    }
+  });
+  thread.join();
+  if (error) {
+    std::rethrow_exception(error);
+  }
 }
+
+} // namespace details
+
+} // namespace pipeline
+
 #pragma once
-// #include <pipeline/details.hpp>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
 
 namespace pipeline {
 
-template <typename T1, typename T2> class pipe_pair {
-  T1 left_;
-  T2 right_;
+// Thrown by a parallel stage that stopped before it was done because it
+// was cancelled, or because an enclosing stage or stream is stopping
+class operation_cancelled : public std::runtime_error {
+public:
+  operation_cancelled() : std::runtime_error("pipeline: operation cancelled") {}
+};
+
+// Asks the stages it is attached to, with .cancel_on(...), to stop early:
+// their tasks that haven't started are skipped, the running ones see
+// stop_requested(), and the stage throws operation_cancelled. Cancelled by
+// cancel(), from any thread, or once its deadline passes. Must outlive the
+// stages it is attached to.
+class cancellation {
+  std::atomic<bool> cancelled_{false};
+  std::chrono::steady_clock::time_point deadline_;
 
 public:
-  pipe_pair(T1 left, T2 right) : left_(left), right_(right) {}
+  cancellation() : deadline_(std::chrono::steady_clock::time_point::max()) {}
 
-  template <typename... T> decltype(auto) operator()(T &&... args) {
-    typedef typename std::result_of<T1(T...)>::type left_result_type;
+  explicit cancellation(std::chrono::steady_clock::time_point deadline) : deadline_(deadline) {}
 
-    if constexpr (!std::is_same<left_result_type, void>::value) {
-      return right_(left_(std::forward<T>(args)...));
-    } else {
-      left_(std::forward<T>(args)...);
-      return right_();
-    }
+  explicit cancellation(std::chrono::steady_clock::duration timeout)
+      : deadline_(std::chrono::steady_clock::now() + timeout) {}
+
+  cancellation(const cancellation &) = delete;
+  cancellation &operator=(const cancellation &) = delete;
+
+  void cancel() { cancelled_.store(true, std::memory_order_release); }
+
+  bool cancelled() const {
+    return cancelled_.load(std::memory_order_acquire) ||
+           (deadline_ != std::chrono::steady_clock::time_point::max() &&
+            std::chrono::steady_clock::now() >= deadline_);
   }
+};
+
+namespace details {
+
+// Stop request of one parallel call or stream. A call made from inside a
+// task of another one stops along with it, so the first failure stops
+// every nested stage too.
+class stop_flag {
+  std::atomic<bool> stopped_{false};
+  const stop_flag *parent_;
+  const cancellation *token_;
+
+public:
+  explicit stop_flag(const stop_flag *parent, const cancellation *token = nullptr)
+      : parent_(parent), token_(token) {}
+
+  void request_stop() { stopped_.store(true, std::memory_order_release); }
 
-  template <typename T3> auto operator|(T3 &&rhs) {
-    return pipe_pair<pipe_pair<T1, T2>, T3>(*this, std::forward<T3>(rhs));
+  bool requested() const {
+    for (auto flag = this; flag; flag = flag->parent_) {
+      if (flag->stopped_.load(std::memory_order_acquire) ||
+          (flag->token_ && flag->token_->cancelled())) {
+        return true;
+      }
+    }
+    return false;
   }
 };
 
-template <typename T1, typename T2> auto pipe(T1 &&t1, T2 &&t2) {
-  return pipe_pair<T1, T2>(std::forward<T1>(t1), std::forward<T2>(t2));
+// The stop flag of the task running on this thread, if any
+inline const stop_flag *&current_stop() {
+  static thread_local const stop_flag *flag = nullptr;
+  return flag;
 }
 
-template <typename T1, typename T2, typename... T> auto pipe(T1 &&t1, T2 &&t2, T &&... args) {
-  return pipe(pipe<T1, T2>(std::forward<T1>(t1), std::forward<T2>(t2)), std::forward<T>(args)...);
+// Makes `flag` the current stop flag while in scope
+class stop_scope {
+  const stop_flag *previous_;
+
+public:
+  explicit stop_scope(const stop_flag &flag) : previous_(current_stop()) { current_stop() = &flag; }
+
+  stop_scope(const stop_scope &) = delete;
+  stop_scope &operator=(const stop_scope &) = delete;
+
+  ~stop_scope() { current_stop() = previous_; }
+};
+
+} // namespace details
+
+// Whether the stage calling this should give up early: another task of its
+// stage (or of a stage it is nested in) failed, its cancellation fired, or
+// its stream is stopping. Long-running functions can poll it and return
+// early; the stage then throws instead of returning partial results.
+inline bool stop_requested() {
+  const auto flag = details::current_stop();
+  return flag && flag->requested();
 }
 
 } // namespace pipeline
+
 #pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
 #include <functional>
-#include <future>
+#include <memory>
+#include <mutex>
+// #include <pipeline/cancellation.hpp>
 // #include <pipeline/details.hpp>
-// #include <pipeline/fn.hpp>
 #include <thread>
+#include <type_traits>
 
 namespace pipeline {
 
-template <typename Fn, typename... Fns> class fork_into {
-  std::tuple<Fn, Fns...> fns_;
+// An executor runs the tasks submitted by the parallel stages
+// (for_each, fork_into, unzip_into). Derive from this class to plug
+// in your own scheduler; see thread_pool for the default one.
+class executor {
+public:
+  virtual ~executor() = default;
+
+  // Run `task` at some point, possibly on another thread
+  virtual void execute(std::function<void()> task) = 0;
+
+  // Number of tasks that can make progress at once; used to size chunks
+  virtual std::size_t concurrency() const { return std::thread::hardware_concurrency(); }
+
+  // Runs one pending task on the calling thread, if there is one, and
+  // returns whether it did. A stage waiting for its tasks calls this to
+  // help out instead of blocking. Executors that can't, or won't on this
+  // thread, return false.
+  virtual bool try_run_pending() { return false; }
+};
+
+namespace details {
+
+// Counts the tasks of one parallel call still in flight and keeps the
+// first exception they threw. Lives on the caller's stack, so waiting for
+// a batch of tasks needs no shared state on the heap. While waiting, the
+// caller runs pending tasks of the executor, so a join nested in a task
+// keeps its worker busy instead of idling it.
+//
+// The first failure, a fired cancellation or a stop of the enclosing
+// call or stream stops the group: tasks check skip() before they start
+// and skip their work, and wait() throws. A group stopped only after all
+// of its work was done doesn't throw.
+class task_group {
+  executor &executor_;
+  stop_flag stop_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::size_t pending_{0};
+  std::exception_ptr error_;
+  std::atomic<bool> skipped_{false};
+
+  bool finished() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return pending_ == 0;
+  }
 
 public:
-  fork_into(Fn first, Fns... fns) : fns_(first, fns...) {}
+  explicit task_group(executor &ex, const cancellation *token = nullptr)
+      : executor_(ex), stop_(current_stop(), token) {}
 
-  template <typename... Args> decltype(auto) operator()(Args &&... args) {
-    typedef typename std::result_of<Fn(Args...)>::type result_type;
+  const stop_flag &stop() const { return stop_; }
 
-    std::vector<std::future<result_type>> futures;
+  // Called before a piece of work starts: true if the group is stopped,
+  // in which case the work is skipped and wait() throws
+  bool skip() {
+    if (!stop_.requested()) {
+      return false;
+    }
+    skipped_.store(true, std::memory_order_relaxed);
+    return true;
+  }
 
-    auto apply_fn = [&futures,
-                     args_tuple = std::tuple<Args...>(std::forward<Args>(args)...)](auto fn) {
-      auto unpack = [](auto tuple, auto fn) { return details::apply(tuple, fn); };
-      futures.push_back(
-          std::async(std::launch::async | std::launch::deferred, unpack, args_tuple, fn));
-    };
+  void add() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++pending_;
+  }
 
-    details::for_each_in_tuple(fns_, apply_fn);
+  // Called by a task when it is finished; its last access to the group
+  void done() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--pending_ == 0) {
+      cv_.notify_all();
+    }
+  }
 
-    if constexpr (std::is_same<result_type, void>::value) {
-      for (auto &f : futures) {
-        f.get();
-      }
-    } else {
-      std::vector<result_type> results;
-      for (auto &f : futures) {
-        results.push_back(f.get());
-      }
-      return results;
+  void fail(std::exception_ptr error) {
+    stop_.request_stop();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!error_) {
+      error_ = std::move(error);
     }
   }
 
-  template <typename T3> auto operator|(T3 &&rhs) {
-    return pipe_pair<fork_into<Fn, Fns...>, T3>(*this, std::forward<T3>(rhs));
+  // Blocks until every task is done, then rethrows the first exception, or
+  // throws operation_cancelled if work was skipped
+  void wait() {
+    while (!finished()) {
+      if (!executor_.try_run_pending()) {
+        // nothing to help with; our tasks are running elsewhere
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait_for(lock, std::chrono::microseconds(100), [this] { return pending_ == 0; });
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+    if (skipped_.load(std::memory_order_relaxed)) {
+      throw operation_cancelled();
+    }
   }
 };
 
+} // namespace details
+
 } // namespace pipeline
+
 #pragma once
-// #include <pipeline/details.hpp>
-// #include <pipeline/fn.hpp>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+// #include <pipeline/affinity.hpp>
+// #include <pipeline/executor.hpp>
+#include <thread>
 #include <vector>
-#include <future>
 
 namespace pipeline {
 
-template <typename Fn> class for_each {
-  Fn fn_;
+namespace details {
+
+// Double-ended queue of tasks in a growable ring buffer. Unlike std::deque
+// it keeps its storage once it has grown, so a pool that runs at a steady
+// load stops allocating for its queues.
+class task_ring {
+  std::vector<std::function<void()>> slots_{8};
+  std::size_t head_{0};
+  std::size_t size_{0};
+
+  void grow() {
+    std::vector<std::function<void()>> slots(slots_.size() * 2);
+    for (std::size_t i = 0; i < size_; ++i) {
+      slots[i] = std::move(slots_[(head_ + i) % slots_.size()]);
+    }
+    slots_ = std::move(slots);
+    head_ = 0;
+  }
 
 public:
-  for_each(Fn fn) : fn_(fn) {}
+  bool empty() const { return size_ == 0; }
 
-  template <typename Container> decltype(auto) operator()(Container &&args) {
-    typedef typename std::result_of<Fn(typename std::decay<Container>::type::value_type &)>::type result_type;
+  void push_back(std::function<void()> task) {
+    if (size_ == slots_.size()) {
+      grow();
+    }
+    slots_[(head_ + size_) % slots_.size()] = std::move(task);
+    ++size_;
+  }
 
-    if constexpr (std::is_same<result_type, void>::value) {
-      // result type is void
-      std::vector<std::future<result_type>> futures;
-      for (auto &arg : std::forward<Container>(args)) {
-        futures.push_back(std::async(std::launch::async | std::launch::deferred, fn_, arg));
-      }
+  std::function<void()> pop_front() {
+    auto task = std::move(slots_[head_]);
+    slots_[head_] = nullptr;
+    head_ = (head_ + 1) % slots_.size();
+    --size_;
+    return task;
+  }
+
+  std::function<void()> pop_back() {
+    auto &slot = slots_[(head_ + size_ - 1) % slots_.size()];
+    auto task = std::move(slot);
+    slot = nullptr;
+    --size_;
+    return task;
+  }
+};
+
+} // namespace details
+
+// Work-stealing pool of worker threads. Each worker owns a task queue;
+// tasks submitted from outside the pool are spread round-robin over the
+// queues.
+//
+// Tasks submitted from one of the pool's own workers (e.g., the branches
+// of a fork_into nested inside a for_each) go onto that worker's queue.
+// A worker runs the newest task of its own queue first, which keeps nested
+// work hot in its cache, and idle workers steal the oldest task of a
+// neighbour's queue, which tends to be the largest piece of work left.
+// A stage waiting for its tasks on one of the workers runs pending tasks
+// meanwhile (see try_run_pending), so nested parallel stages compose
+// without oversubscribing the machine or idling a worker in a join. Other
+// threads just wait: they would pick up unrelated tasks of the pool,
+// which could hold them up for arbitrarily long.
+class thread_pool : public executor {
+  struct worker_queue {
+    std::mutex mutex;
+    details::task_ring tasks;
+  };
 
-      for (auto &f : futures) {
-        f.get();
+  std::vector<std::unique_ptr<worker_queue>> queues_;
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::atomic<std::size_t> pending_{0};
+  std::atomic<std::size_t> next_{0};
+  bool stop_{false};
+
+  inline static thread_local thread_pool *current_pool_ = nullptr;
+  inline static thread_local std::size_t current_index_ = 0;
+
+  bool try_pop(std::size_t index, std::function<void()> &task) {
+    for (std::size_t i = 0; i < queues_.size(); ++i) {
+      auto &queue = *queues_[(index + i) % queues_.size()];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (queue.tasks.empty()) {
+        continue;
       }
-    } else {
-      // result is not void
-      std::vector<result_type> results;
-      std::vector<std::future<result_type>> futures;
-      for (auto &arg : std::forward<Container>(args)) {
-        futures.push_back(std::async(std::launch::async | std::launch::deferred, fn_, arg));
+      if (i == 0) {
+        // own queue, newest task first
+        task = queue.tasks.pop_back();
+      } else {
+        // steal from the other end
+        task = queue.tasks.pop_front();
       }
+      pending_.fetch_sub(1);
+      return true;
+    }
+    return false;
+  }
+
+  // Queue a task submitted from this thread goes to, and is taken from
+  std::size_t home_queue() {
+    return current_pool_ == this ? current_index_ : next_.fetch_add(1) % queues_.size();
+  }
 
-      for (auto &f : futures) {
-        results.push_back(f.get());
+  void start(std::size_t threads, const cpu_set &cpus) {
+    for (std::size_t i = 0; i < threads; ++i) {
+      queues_.push_back(std::make_unique<worker_queue>());
+    }
+    for (std::size_t i = 0; i < threads; ++i) {
+      threads_.emplace_back([this, i, cpu = cpus.empty() ? cpu_set() : cpu_set{cpus[i]}] {
+        cpu.pin_current_thread();
+        run(i);
+      });
+    }
+  }
+
+  void run(std::size_t index) {
+    current_pool_ = this;
+    current_index_ = index;
+    std::function<void()> task;
+    while (true) {
+      if (try_pop(index, task)) {
+        task();
+        task = nullptr;
+        continue;
       }
-      return results;
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] { return stop_ || pending_.load() > 0; });
+      if (stop_ && pending_.load() == 0) {
+        return;
+      }
+    }
+  }
+
+public:
+  explicit thread_pool(std::size_t threads = std::thread::hardware_concurrency()) {
+    start(std::max<std::size_t>(threads, 1), {});
+  }
+
+  // One worker per CPU in `cpus`, each pinned to its CPU, e.g.,
+  // thread_pool(cpu_set::numa_node(0)) keeps a pool on the first socket
+  explicit thread_pool(const cpu_set &cpus) {
+    if (cpus.empty()) {
+      start(std::max<std::size_t>(std::thread::hardware_concurrency(), 1), {});
+    } else {
+      start(cpus.size(), cpus);
+    }
+  }
+
+  thread_pool(const thread_pool &) = delete;
+  thread_pool &operator=(const thread_pool &) = delete;
+
+  // Runs the remaining tasks, then joins the workers
+  ~thread_pool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto &thread : threads_) {
+      thread.join();
+    }
+  }
+
+  std::size_t size() const { return threads_.size(); }
+
+  std::size_t concurrency() const override { return size(); }
+
+  void execute(std::function<void()> task) override {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_.fetch_add(1);
+    }
+    auto &queue = *queues_[home_queue()];
+    {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.tasks.push_back(std::move(task));
     }
+    cv_.notify_one();
+  }
+
+  bool try_run_pending() override {
+    if (current_pool_ != this || pending_.load() == 0) {
+      return false;
+    }
+    std::function<void()> task;
+    if (!try_pop(home_queue(), task)) {
+      return false;
+    }
+    task();
+    return true;
   }
 };
 
+namespace details {
+
+inline std::atomic<executor *> &default_executor_override() {
+  static std::atomic<executor *> ex{nullptr};
+  return ex;
+}
+
+} // namespace details
+
+// The executor used by stages that were not given one with `.on(...)`.
+// Unless overridden, this is a process-wide thread_pool with one worker
+// per hardware thread.
+inline executor &default_executor() {
+  if (auto ex = details::default_executor_override().load()) {
+    return *ex;
+  }
+  static thread_pool pool;
+  return pool;
+}
+
+// Replace the default executor; `ex` must outlive every pipeline using it
+inline void set_default_executor(executor &ex) { details::default_executor_override() = &ex; }
+
 } // namespace pipeline
+
 #pragma once
-#include <functional>
-#include <future>
+#include <algorithm>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <optional>
 // #include <pipeline/details.hpp>
-// #include <pipeline/fn.hpp>
-#include <thread>
+// #include <pipeline/executor.hpp>
+#include <type_traits>
+#include <vector>
 
 namespace pipeline {
 
-template <typename Fn, typename... Fns> class unzip_into {
-  std::tuple<Fn, Fns...> fns_;
+namespace details {
+
+// Grain size used when a stage was not given one: about four chunks per
+// worker, so that uneven chunks still balance out
+inline std::size_t auto_grain_size(std::size_t size, std::size_t concurrency) {
+  return std::max<std::size_t>(1, size / (std::max<std::size_t>(concurrency, 1) * 4));
+}
+
+template <typename Iterator>
+constexpr bool is_random_access =
+    std::is_base_of<std::random_access_iterator_tag,
+                    typename iterator_concept<Iterator>::type>::value;
+
+// The elements a parallel loop runs over, [first, last): how many there
+// are and where each chunk starts. With random access that is just
+// `first`. Otherwise a single pass counts the elements and keeps an
+// iterator to every stride-th one on the way, the stride doubling whenever
+// the marks fill up, so that finding the chunks of, e.g., the lines of a
+// file takes no second pass. Chunks then start at marks: grain() rounds a
+// grain size up to a multiple of the stride.
+template <typename Iterator> class loop_range {
+  static constexpr std::size_t max_marks = 1024;
+
+  Iterator first_;
+  std::size_t size_{0};
+  std::size_t stride_{1};
+  std::vector<Iterator> marks_;
+
+public:
+  loop_range(Iterator first, Iterator last) : first_(first) {
+    if constexpr (is_random_access<Iterator>) {
+      // not std::distance, which goes by iterator_category
+      size_ = static_cast<std::size_t>(last - first);
+    } else {
+      for (; first != last; ++first, ++size_) {
+        if (size_ % stride_ != 0) {
+          continue;
+        }
+        if (marks_.size() == max_marks) {
+          // keep every other mark
+          for (std::size_t i = 1; i < max_marks / 2; ++i) {
+            marks_[i] = marks_[2 * i];
+          }
+          marks_.erase(marks_.begin() + max_marks / 2, marks_.end());
+          stride_ *= 2;
+        }
+        if (size_ % stride_ == 0) {
+          marks_.push_back(first);
+        }
+      }
+    }
+  }
+
+  std::size_t size() const { return size_; }
 
-  template <class F, class Tuple1, class Tuple2, std::size_t... I>
-  auto apply2_impl(F &&f, Tuple1 &&t1, Tuple2 &&t2, std::index_sequence<I...>) {
-    return fork_into((std::forward<F>(f)(std::get<I>(std::forward<Tuple1>(t1)),
-                                         std::get<I>(std::forward<Tuple2>(t2))))...);
+  // `grain`, at least 1 and rounded up so that every chunk starts at a mark
+  std::size_t grain(std::size_t grain) const {
+    grain = std::max<std::size_t>(grain, 1);
+    return (grain + stride_ - 1) / stride_ * stride_;
   }
 
-  template <class F, class Tuple1, class Tuple2>
-  constexpr decltype(auto) apply2(F &&f, Tuple1 &&t1, Tuple2 &&t2) {
-    return apply2_impl(
-        std::forward<F>(f), std::forward<Tuple1>(t1), std::forward<Tuple2>(t2),
-        std::make_index_sequence<std::tuple_size<std::remove_reference_t<Tuple1>>::value>{});
+  // Iterator to element `i`, a multiple of grain()
+  Iterator at(std::size_t i) const {
+    if constexpr (is_random_access<Iterator>) {
+      return first_ + i;
+    } else {
+      return marks_[i / stride_];
+    }
   }
+};
 
-public:
-  unzip_into(Fn first, Fns... fns) : fns_(first, fns...) {}
+// Splits `range` into contiguous chunks of `grain` elements and calls
+// body(chunk_first, begin, end) for each one, where chunk_first points to
+// element `begin`. offload() submits all but the last chunk to an
+// executor, run_last() runs the last one on the calling thread and
+// `group` tracks the submitted chunks; several loops may share a group.
+//
+// A submitted task is just a pointer and an offset, which std::function
+// stores inline, so a loop makes no heap allocations of its own. The loop
+// must stay put until its group is done.
+template <typename Iterator, typename Body> class chunk_loop {
+  task_group &group_;
+  const loop_range<Iterator> &range_;
+  std::size_t size_;
+  std::size_t grain_;
+  Body &body_;
+  std::size_t last_begin_{0};
 
-  template <typename Tuple> decltype(auto) operator()(Tuple &&tuple) {
-    // We have a tuple of functions to run in parallel - fns_
-    // We have a tuple of args to UNZIP
-    // and then pass to each function - tuple_element
-    const auto bind_arg = [](auto &&fn, auto &&arg) {
-      return pipeline::fn(std::bind(fn, std::move(arg)));
-    };
+  void run(std::size_t begin) {
+    if (group_.skip()) {
+      return;
+    }
+    stop_scope scope(group_.stop());
+    try {
+      body_(range_.at(begin), begin, std::min(begin + grain_, size_));
+    } catch (...) {
+      group_.fail(std::current_exception());
+    }
+  }
+
+public:
+  chunk_loop(task_group &group, const loop_range<Iterator> &range, std::size_t grain, Body &body)
+      : group_(group), range_(range), size_(range.size()), grain_(range.grain(grain)),
+        body_(body) {}
 
-    if constexpr (std::tuple_size<std::tuple<Fn, Fns...>>::value == std::tuple_size<Tuple>::value) {
-      // sizeof(tuple of fns) == sizeof(tuple)
-      // 1-1 mapping
+  void offload(executor &ex) {
+    std::size_t begin = 0;
+    for (; size_ - begin > grain_; begin += grain_) {
+      if (group_.skip()) {
+        break;
+      }
+      group_.add();
+      try {
+        ex.execute([this, begin] {
+          run(begin);
+          group_.done();
+        });
+      } catch (...) {
+        // the executor refused the task; the group rethrows on wait()
+        group_.fail(std::current_exception());
+        group_.done();
+        break;
+      }
+    }
+    last_begin_ = begin;
+  }
 
-      auto unzipped_fork = apply2(bind_arg, fns_, tuple);
+  void run_last() {
+    if (size_ > 0) {
+      run(last_begin_);
+    }
+  }
+};
 
-      // Let's say the input args were (arg1, arg2, arg3, ...)
-      // And we have functions (fn1, fn2, fn3, ...)
+// Runs body(chunk_first, begin, end) over `range` in chunks of `grain`
+// elements on `ex`, see chunk_loop. The last chunk runs on the calling
+// thread. Waits for every chunk and rethrows the first exception, if any;
+// once a chunk has thrown (or `token` fired) the chunks not yet started
+// are skipped. A stage that relies on the chunk size should pass
+// range.grain(n) as `grain`.
+template <typename Iterator, typename Body>
+void parallel_for(executor &ex, const loop_range<Iterator> &range, std::size_t grain,
+                  Body &&body, const cancellation *token = nullptr) {
+  task_group group(ex, token);
+  chunk_loop<Iterator, typename std::remove_reference<Body>::type> loop(group, range, grain,
+                                                                        body);
+  loop.offload(ex);
+  loop.run_last();
+  group.wait();
+}
 
-      // The above code has constructed a fork:
-      // fork(bind(fn1, arg1), bind(fn2, arg2), bind(fn3, arg3), ...)
-      //
-      // Each function is bound to an argument from the input
-      // and because it is a fork, these can/will run in parallel
+// Results of a data-parallel map, written by index from several threads:
+// input i produces result i. Results that can't be written by index (no
+// default constructor, or std::vector<bool> whose elements share words)
+// are staged in std::optionals first. Alloc allocates the result vector.
+template <typename R, typename Alloc> class map_output {
+  static constexpr bool by_index =
+      std::is_default_constructible<R>::value && !std::is_same<R, bool>::value;
+  typedef typename std::conditional<by_index, R, std::optional<R>>::type slot_type;
+  typedef typename std::allocator_traits<Alloc>::template rebind_alloc<slot_type> slot_allocator;
 
-      // Simply run the fork and return the results
-      return unzipped_fork();
-    } else if constexpr (std::tuple_size<std::tuple<Fn, Fns...>>::value == 1) {
-      // sizeof(tuple of fns) = 1
-      // Unpack the args on the left and pass each arg to the same function
-      // Essentially, we're calling the same function on each of the args
-      // Useful if each arg in the tuple is the same type and we're doing the same operation
+  Alloc allocator_;
+  std::vector<slot_type, slot_allocator> slots_;
 
-      // First, we make a tuple of functions of size = sizeof...(args)
-      // From one function `fn`, we get: tuple {fn, fn, fn, fn, ...}
-      // Then we have arguments (arg1, arg2, arg3, ....)
+public:
+  map_output(std::size_t size, const Alloc &allocator)
+      : allocator_(allocator), slots_(size, slot_allocator(allocator)) {}
 
-      // We construct the fork:
-      // fork(bind(fn, arg1), bind(fn, arg2), bind(fn, arg3), ...)
-      //
-      // Each function (the same one in this case) is bound to an argument from the input
-      // and because it is a fork, these can/will run in parallel
-      //
-      // Once the fork is constructed, simply run the fork
+  template <typename V> void set(std::size_t i, V &&value) {
+    if constexpr (by_index) {
+      slots_[i] = std::forward<V>(value);
+    } else {
+      slots_[i].emplace(std::forward<V>(value));
+    }
+  }
 
-      auto repeated_tuple_fn = details::make_repeated_tuple<std::tuple_size<Tuple>::value>(
-          std::make_tuple(std::get<0>(fns_)));
-      auto unzipped_fork = apply2(bind_arg, repeated_tuple_fn, tuple);
-      return unzipped_fork();
+  std::vector<R, Alloc> take() {
+    if constexpr (by_index) {
+      return std::move(slots_);
     } else {
-      static_assert(std::tuple_size<std::tuple<Fn, Fns...>>::value ==
-                    std::tuple_size<Tuple>::value);
+      std::vector<R, Alloc> results(allocator_);
+      results.reserve(slots_.size());
+      for (auto &slot : slots_) {
+        results.push_back(std::move(*slot));
+      }
+      return results;
     }
   }
+};
+
+} // namespace details
+
+} // namespace pipeline
+
+#pragma once
+#include <cstddef>
+// #include <pipeline/cancellation.hpp>
+// #include <pipeline/executor.hpp>
+// #include <pipeline/parallel_for.hpp>
+// #include <pipeline/thread_pool.hpp>
+#include <utility>
+
+namespace pipeline {
+
+namespace details {
+
+// What every parallel stage can be told - where to run and when to give up
+// - with its setters, for a stage Derived to inherit
+template <typename Derived> class parallel_stage {
+  template <typename> friend class parallel_stage;
+
+protected:
+  executor *executor_{nullptr};
+  const cancellation *cancellation_{nullptr};
+
+  // The executor given to on(), or the default one
+  executor &get_executor() const { return executor_ ? *executor_ : default_executor(); }
+
+  // Takes the settings that `other` has, keeping its own for the others;
+  // for a stage built out of another one
+  template <typename Other> void adopt_settings(const parallel_stage<Other> &other) {
+    if (other.executor_) {
+      executor_ = other.executor_;
+    }
+    if (other.cancellation_) {
+      cancellation_ = other.cancellation_;
+    }
+  }
+
+public:
+  // Run on `ex` instead of the default executor
+  Derived &on(executor &ex) & {
+    executor_ = &ex;
+    return static_cast<Derived &>(*this);
+  }
+
+  Derived &&on(executor &ex) && { return std::move(on(ex)); }
+
+  // Stop early once `token` is cancelled: tasks not yet started are
+  // skipped and the stage throws operation_cancelled
+  Derived &cancel_on(const cancellation &token) & {
+    cancellation_ = &token;
+    return static_cast<Derived &>(*this);
+  }
+
+  Derived &&cancel_on(const cancellation &token) && { return std::move(cancel_on(token)); }
+};
+
+// A parallel stage that splits its input into chunks of a grain size
+template <typename Derived> class chunked_stage : public parallel_stage<Derived> {
+  template <typename> friend class chunked_stage;
+
+protected:
+  std::size_t grain_size_{0};
+
+  // The grain size for `size` elements on `ex`
+  std::size_t grain(std::size_t size, const executor &ex) const {
+    return grain_size_ ? grain_size_ : auto_grain_size(size, ex.concurrency());
+  }
+
+  template <typename Other> void adopt_settings(const chunked_stage<Other> &other) {
+    parallel_stage<Derived>::adopt_settings(other);
+    if (other.grain_size_) {
+      grain_size_ = other.grain_size_;
+    }
+  }
+
+public:
+  // Number of consecutive elements handled by one task.
+  // 0 (the default) picks a grain size from the input size and executor.
+  Derived &grain_size(std::size_t n) & {
+    grain_size_ = n;
+    return static_cast<Derived &>(*this);
+  }
+
+  Derived &&grain_size(std::size_t n) && { return std::move(grain_size(n)); }
+};
+
+} // namespace details
+
+} // namespace pipeline
+
+#pragma once
+// #include <pipeline/details.hpp>
+
+#ifdef PIPELINE_HAS_COROUTINES
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <mutex>
+#include <optional>
+// #include <pipeline/parallel_for.hpp>
+// #include <pipeline/thread_pool.hpp>
+#include <queue>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace pipeline {
+
+template <typename T = void> class task;
+
+namespace details {
+
+template <typename T> struct is_task : std::false_type {};
+template <typename T> struct is_task<task<T>> : std::true_type {};
+
+// What co_await on a T gives: U for a task<U>, T itself otherwise
+template <typename T> struct awaited { typedef T type; };
+template <typename T> struct awaited<task<T>> { typedef T type; };
+
+class task_promise_base {
+  std::coroutine_handle<> continuation_;
+
+  // Resumes whoever awaits the task, without growing the stack
+  struct final_awaiter {
+    bool await_ready() noexcept { return false; }
+
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+      auto continuation = handle.promise().continuation_;
+      return continuation ? continuation : std::noop_coroutine();
+    }
+
+    void await_resume() noexcept {}
+  };
+
+public:
+  std::suspend_always initial_suspend() noexcept { return {}; }
+
+  final_awaiter final_suspend() noexcept { return {}; }
+
+  void set_continuation(std::coroutine_handle<> continuation) { continuation_ = continuation; }
+};
+
+template <typename T> class task_promise : public task_promise_base {
+  std::variant<std::monostate, T, std::exception_ptr> result_;
+
+public:
+  task<T> get_return_object();
+
+  template <typename U> void return_value(U &&value) {
+    result_.template emplace<1>(std::forward<U>(value));
+  }
+
+  void unhandled_exception() { result_.template emplace<2>(std::current_exception()); }
+
+  T result() {
+    if (result_.index() == 2) {
+      std::rethrow_exception(std::get<2>(result_));
+    }
+    return std::move(std::get<1>(result_));
+  }
+};
+
+template <> class task_promise<void> : public task_promise_base {
+  std::exception_ptr error_;
+
+public:
+  task<void> get_return_object();
+
+  void return_void() {}
+
+  void unhandled_exception() { error_ = std::current_exception(); }
+
+  void result() {
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+  }
+};
+
+} // namespace details
+
+// A lazily started coroutine producing a T. It starts when it is
+// co_awaited and resumes its awaiter when done, so a chain of tasks never
+// blocks a thread while one of them waits on a timer, I/O or an executor.
+//
+// A stage that returns a task is an async stage: `fn(a) | fn(b)` where
+// `a` returns task<T> gives a pipeline that returns a task too, and calls
+// `b` with the awaited T. The pipeline object must outlive the tasks it
+// returns, and async stages should take their arguments by value.
+template <typename T> class task {
+public:
+  typedef details::task_promise<T> promise_type;
+
+private:
+  std::coroutine_handle<promise_type> handle_;
+
+  struct awaiter {
+    std::coroutine_handle<promise_type> handle;
+
+    // A moved-from task has no coroutine, and so no result to wait for
+    bool await_ready() {
+      if (!handle) {
+        throw std::logic_error("pipeline::task: awaiting an empty task");
+      }
+      return handle.done();
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+      handle.promise().set_continuation(awaiting);
+      return handle;
+    }
+
+    T await_resume() { return handle.promise().result(); }
+  };
+
+public:
+  explicit task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+  task(task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+
+  task &operator=(task &&other) noexcept {
+    if (this != &other) {
+      if (handle_) {
+        handle_.destroy();
+      }
+      handle_ = std::exchange(other.handle_, nullptr);
+    }
+    return *this;
+  }
+
+  task(const task &) = delete;
+  task &operator=(const task &) = delete;
+
+  ~task() {
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+
+  bool done() const { return handle_ && handle_.done(); }
+
+  awaiter operator co_await() && { return awaiter{handle_}; }
+
+  awaiter operator co_await() & { return awaiter{handle_}; }
+};
+
+namespace details {
+
+template <typename T> task<T> task_promise<T>::get_return_object() {
+  return task<T>(std::coroutine_handle<task_promise<T>>::from_promise(*this));
+}
+
+inline task<void> task_promise<void>::get_return_object() {
+  return task<void>(std::coroutine_handle<task_promise<void>>::from_promise(*this));
+}
+
+template <typename T, typename Continuation> struct then_result {
+  typedef typename std::invoke_result<Continuation &, T>::type type;
+};
+
+template <typename Continuation> struct then_result<void, Continuation> {
+  typedef typename std::invoke_result<Continuation &>::type type;
+};
+
+// Awaits `first`, then calls `continuation` with its result - what piping
+// an async stage into the next stage turns into
+template <typename T, typename Continuation>
+auto then(task<T> first, Continuation continuation)
+    -> task<typename awaited<typename then_result<T, Continuation>::type>::type> {
+  typedef typename then_result<T, Continuation>::type result_type;
+  if constexpr (std::is_void<T>::value) {
+    co_await std::move(first);
+    if constexpr (is_task<result_type>::value) {
+      co_return co_await continuation();
+    } else {
+      co_return continuation();
+    }
+  } else {
+    auto value = co_await std::move(first);
+    if constexpr (is_task<result_type>::value) {
+      co_return co_await continuation(std::move(value));
+    } else {
+      co_return continuation(std::move(value));
+    }
+  }
+}
+
+// Eagerly started coroutine that nobody awaits; it cleans up after itself
+struct detached {
+  struct promise_type {
+    detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+// Completion state shared by the tasks of a when_all
+class when_all_latch {
+  std::atomic<std::size_t> count_;
+  std::coroutine_handle<> awaiting_;
+  std::mutex mutex_;
+  std::exception_ptr error_;
+
+public:
+  explicit when_all_latch(std::size_t count) : count_(count + 1) {}
+
+  void fail(std::exception_ptr error) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!error_) {
+      error_ = std::move(error);
+    }
+  }
+
+  // The last task to arrive resumes the awaiting coroutine
+  void arrive() {
+    if (count_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      awaiting_.resume();
+    }
+  }
+
+  bool await_ready() { return false; }
+
+  bool await_suspend(std::coroutine_handle<> awaiting) {
+    awaiting_ = awaiting;
+    return count_.fetch_sub(1, std::memory_order_acq_rel) > 1;
+  }
+
+  void await_resume() {
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+  }
+};
+
+template <typename T, typename Output>
+detached run_child(task<T> &child, std::size_t index, Output &output, when_all_latch &latch) {
+  try {
+    if constexpr (std::is_void<T>::value) {
+      co_await child;
+    } else {
+      output.set(index, co_await child);
+    }
+  } catch (...) {
+    latch.fail(std::current_exception());
+  }
+  latch.arrive();
+}
+
+template <typename T>
+using when_all_result =
+    typename std::conditional<std::is_void<T>::value, void, std::vector<T>>::type;
+
+} // namespace details
+
+// Runs every task concurrently and completes once all of them are done.
+// Gives their results in order (nothing for void tasks); rethrows the
+// first exception, if any.
+template <typename T>
+task<details::when_all_result<T>> when_all(std::vector<task<T>> tasks) {
+  if constexpr (std::is_void<T>::value) {
+    details::when_all_latch latch(tasks.size());
+    std::monostate no_output;
+    for (std::size_t i = 0; i < tasks.size(); ++i) {
+      details::run_child(tasks[i], i, no_output, latch);
+    }
+    co_await latch;
+  } else {
+    details::map_output<T, std::allocator<T>> output(tasks.size(), std::allocator<T>());
+    details::when_all_latch latch(tasks.size());
+    for (std::size_t i = 0; i < tasks.size(); ++i) {
+      details::run_child(tasks[i], i, output, latch);
+    }
+    co_await latch;
+    co_return output.take();
+  }
+}
+
+// Awaitable that resumes the awaiting coroutine on `ex`
+inline auto schedule(executor &ex) {
+  struct awaiter {
+    executor &ex;
+
+    bool await_ready() { return false; }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+      ex.execute([handle] { handle.resume(); });
+    }
+
+    void await_resume() {}
+  };
+  return awaiter{ex};
+}
+
+// Resumes coroutines once their deadline passes, on an executor, from a
+// single timer thread - a stand-in for an event loop (epoll, io_uring)
+// that lets thousands of waits share a handful of threads. Every sleep
+// must be over before the queue is destroyed.
+class timer_queue {
+  struct timer {
+    std::chrono::steady_clock::time_point deadline;
+    std::coroutine_handle<> handle;
+
+    bool operator>(const timer &other) const { return deadline > other.deadline; }
+  };
+
+  executor &executor_;
+  std::priority_queue<timer, std::vector<timer>, std::greater<timer>> timers_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_{false};
+  std::thread thread_;
+
+  void add(std::chrono::steady_clock::time_point deadline, std::coroutine_handle<> handle) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      timers_.push({deadline, handle});
+    }
+    cv_.notify_one();
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_) {
+      if (timers_.empty()) {
+        cv_.wait(lock);
+      } else if (const auto deadline = timers_.top().deadline;
+                 deadline > std::chrono::steady_clock::now()) {
+        cv_.wait_until(lock, deadline);
+      } else {
+        const auto handle = timers_.top().handle;
+        timers_.pop();
+        lock.unlock();
+        executor_.execute([handle] { handle.resume(); });
+        lock.lock();
+      }
+    }
+  }
+
+public:
+  explicit timer_queue(executor &ex = default_executor())
+      : executor_(ex), thread_([this] { run(); }) {}
+
+  timer_queue(const timer_queue &) = delete;
+  timer_queue &operator=(const timer_queue &) = delete;
+
+  ~timer_queue() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+  }
+
+  // Awaitable that resumes the awaiting coroutine once `deadline` has passed
+  auto sleep_until(std::chrono::steady_clock::time_point deadline) {
+    struct awaiter {
+      timer_queue &queue;
+      std::chrono::steady_clock::time_point deadline;
+
+      bool await_ready() { return false; }
+
+      void await_suspend(std::coroutine_handle<> handle) { queue.add(deadline, handle); }
+
+      void await_resume() {}
+    };
+    return awaiter{*this, deadline};
+  }
+
+  auto sleep_for(std::chrono::steady_clock::duration duration) {
+    return sleep_until(std::chrono::steady_clock::now() + duration);
+  }
+};
+
+namespace details {
+
+template <typename T> struct sync_wait_state {
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool done{false};
+  std::optional<typename std::conditional<std::is_void<T>::value, std::monostate, T>::type>
+      value;
+  std::exception_ptr error;
+};
+
+template <typename T> detached notify_when_done(task<T> &t, sync_wait_state<T> &state) {
+  try {
+    if constexpr (std::is_void<T>::value) {
+      co_await t;
+      state.value.emplace();
+    } else {
+      state.value.emplace(co_await t);
+    }
+  } catch (...) {
+    state.error = std::current_exception();
+  }
+  std::lock_guard<std::mutex> lock(state.mutex);
+  state.done = true;
+  state.cv.notify_one();
+}
+
+} // namespace details
+
+// Blocks the calling thread until `t` is done and returns its result - the
+// bridge from synchronous code into async stages
+template <typename T> T sync_wait(task<T> t) {
+  details::sync_wait_state<T> state;
+  details::notify_when_done(t, state);
+  {
+    std::unique_lock<std::mutex> lock(state.mutex);
+    state.cv.wait(lock, [&state] { return state.done; });
+  }
+  if (state.error) {
+    std::rethrow_exception(state.error);
+  }
+  if constexpr (!std::is_void<T>::value) {
+    return std::move(*state.value);
+  }
+}
+
+} // namespace pipeline
+
+#endif
+
+#pragma once
+// #include <pipeline/details.hpp>
+// #include <pipeline/task.hpp>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace pipeline {
+
+namespace details {
+
+// A linear chain of functions, each called with the result of the one
+// before it - what fn(a) | fn(b) | fn(c) turns into. Unlike a tree of
+// nested pipe_pairs, the chain is one flat type, so deep chains stay
+// cheap to compile and the optimizer sees a single call.
+template <typename... Fns> class fused {
+  std::tuple<Fns...> fns_;
+
+  template <std::size_t I, typename... T> decltype(auto) call(T &&... args) {
+    auto &stage = std::get<I>(fns_);
+    typedef typename std::invoke_result<decltype(stage), T...>::type result_type;
+    if constexpr (I + 1 == sizeof...(Fns)) {
+      return stage(std::forward<T>(args)...);
+#ifdef PIPELINE_HAS_COROUTINES
+    } else if constexpr (is_task<result_type>::value) {
+      // async stage: the rest of the chain runs once its task is done
+      return then(stage(std::forward<T>(args)...), [this](auto &&... result) -> decltype(auto) {
+        return call<I + 1>(std::forward<decltype(result)>(result)...);
+      });
+#endif
+    } else if constexpr (std::is_same<result_type, void>::value) {
+      stage(std::forward<T>(args)...);
+      return call<I + 1>();
+    } else {
+      return call<I + 1>(stage(std::forward<T>(args)...));
+    }
+  }
+
+public:
+  explicit fused(std::tuple<Fns...> fns) : fns_(std::move(fns)) {}
+
+  template <typename... T> decltype(auto) operator()(T &&... args) {
+    return call<0>(std::forward<T>(args)...);
+  }
+
+  const std::tuple<Fns...> &stages() const & { return fns_; }
+
+  std::tuple<Fns...> stages() && { return std::move(fns_); }
+};
+
+template <typename F> auto fused_stages(F &&f) {
+  if constexpr (is_specialization<typename std::decay<F>::type, fused>::value) {
+    return std::forward<F>(f).stages();
+  } else {
+    return std::make_tuple(std::forward<F>(f));
+  }
+}
+
+template <typename F1, typename F2> auto fuse(F1 &&f1, F2 &&f2) {
+  return fused(std::tuple_cat(fused_stages(std::forward<F1>(f1)),
+                              fused_stages(std::forward<F2>(f2))));
+}
+
+} // namespace details
+
+template <typename Fn> class fn {
+  template <typename> friend class fn;
+
+  Fn fn_;
+
+public:
+  fn(Fn fn) : fn_(std::move(fn)) {}
+
+  template <typename... T> decltype(auto) operator()(T &&... args) {
+    return fn_(std::forward<T>(args)...);
+  }
+
+  template <typename... A> static constexpr bool is_invocable_on() {
+    return std::is_invocable<Fn, A...>::value;
+  }
+
+  // The wrapped function
+  Fn &function() { return fn_; }
+
+  // fn | fn fuses both functions into a single fn
+  template <typename T> auto operator|(T &&rhs) const & {
+    if constexpr (details::is_specialization<typename std::decay<T>::type, pipeline::fn>::value) {
+      return pipeline::fn(details::fuse(fn_, std::forward<T>(rhs).fn_));
+    } else {
+      return pipe_pair<fn<Fn>, typename std::decay<T>::type>(*this, std::forward<T>(rhs));
+    }
+  }
+
+  template <typename T> auto operator|(T &&rhs) && {
+    if constexpr (details::is_specialization<typename std::decay<T>::type, pipeline::fn>::value) {
+      return pipeline::fn(details::fuse(std::move(fn_), std::forward<T>(rhs).fn_));
+    } else {
+      return pipe_pair<fn<Fn>, typename std::decay<T>::type>(std::move(*this),
+                                                             std::forward<T>(rhs));
+    }
+  }
+};
+
+} // namespace pipeline
+
+#pragma once
+// #include <pipeline/details.hpp>
+// #include <pipeline/fn.hpp>
+#include <functional>
+
+namespace pipeline {
+
+template <typename T>
+auto from(T&& value) {
+  return fn(std::bind([](auto&& value) -> auto&& { 
+    return std::forward<decltype(value)>(value); 
+  }, std::forward<T>(value)));
+}
+
+template <typename T>
+auto from(T& value) {
+  return fn([&value] () -> T& { return value; });
+}
+
+template <typename T>
+auto from(const T& value) {
+  return fn([&value] () -> const T& { return value; });
+}
+
+}
+#pragma once
+// #include <pipeline/details.hpp>
+// #include <pipeline/task.hpp>
+
+namespace pipeline {
+
+template <typename T1, typename T2> class pipe_pair {
+  T1 left_;
+  T2 right_;
+
+  template <typename T3>
+  static constexpr bool is_fusable =
+      (details::is_specialization<T2, fn>::value &&
+       details::is_specialization<typename std::decay<T3>::type, fn>::value) ||
+      (details::is_specialization<T2, map>::value &&
+       details::is_specialization<typename std::decay<T3>::type, map>::value) ||
+      details::fuses_with_filter<T2, typename std::decay<T3>::type>::value;
+
+public:
+  pipe_pair(T1 left, T2 right) : left_(std::move(left)), right_(std::move(right)) {}
+
+  template <typename... T> decltype(auto) operator()(T &&... args) {
+    typedef typename std::result_of<T1(T...)>::type left_result_type;
+
+#ifdef PIPELINE_HAS_COROUTINES
+    if constexpr (details::is_task<left_result_type>::value) {
+      // async stage: right_ runs once its task is done
+      return details::then(left_(std::forward<T>(args)...),
+                           [this](auto &&... result) -> decltype(auto) {
+                             return right_(std::forward<decltype(result)>(result)...);
+                           });
+    } else
+#endif
+        if constexpr (!std::is_same<left_result_type, void>::value) {
+      return right_(left_(std::forward<T>(args)...));
+    } else {
+      left_(std::forward<T>(args)...);
+      return right_();
+    }
+  }
+
+  T1 &left() { return left_; }
+
+  T2 &right() { return right_; }
+
+  // (x | fn) | fn fuses the two fns, see fn::operator|; same for map, and
+  // for filter | for_each
+  template <typename T3> auto operator|(T3 &&rhs) const & {
+    if constexpr (is_fusable<T3>) {
+      auto fused = right_ | std::forward<T3>(rhs);
+      return pipe_pair<T1, decltype(fused)>(left_, std::move(fused));
+    } else {
+      return pipe_pair<pipe_pair<T1, T2>, typename std::decay<T3>::type>(*this,
+                                                                         std::forward<T3>(rhs));
+    }
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) && {
+    if constexpr (is_fusable<T3>) {
+      auto fused = std::move(right_) | std::forward<T3>(rhs);
+      return pipe_pair<T1, decltype(fused)>(std::move(left_), std::move(fused));
+    } else {
+      return pipe_pair<pipe_pair<T1, T2>, typename std::decay<T3>::type>(std::move(*this),
+                                                                         std::forward<T3>(rhs));
+    }
+  }
+};
+
+template <typename T1, typename T2> auto pipe(T1 &&t1, T2 &&t2) {
+  return pipe_pair<typename std::decay<T1>::type, typename std::decay<T2>::type>(
+      std::forward<T1>(t1), std::forward<T2>(t2));
+}
+
+template <typename T1, typename T2, typename... T> auto pipe(T1 &&t1, T2 &&t2, T &&... args) {
+  return pipe(pipe<T1, T2>(std::forward<T1>(t1), std::forward<T2>(t2)), std::forward<T>(args)...);
+}
+
+} // namespace pipeline
+#pragma once
+#include <cstddef>
+#include <iterator>
+#include <optional>
+// #include <pipeline/details.hpp>
+// #include <pipeline/fn.hpp>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#if __has_include(<version>)
+#include <version>
+#endif
+
+// Lazy ranges model std::ranges::view when built as C++20
+#if defined(__cpp_lib_ranges)
+#include <ranges>
+#define PIPELINE_HAS_RANGES
+#endif
+
+namespace pipeline {
+
+namespace details {
+
+#ifdef PIPELINE_HAS_RANGES
+typedef std::ranges::view_base view_base;
+#else
+struct view_base {};
+#endif
+
+// The elements of a container without a copy of them: a pointer to an
+// lvalue container, or the container itself when it was an rvalue
+template <typename Range> class lazy_range : public view_base {
+  typedef typename std::remove_reference<Range>::type container_type;
+  typedef typename std::conditional<std::is_lvalue_reference<Range>::value, container_type *,
+                                    container_type>::type storage_type;
+
+  // const like a pointer: some views (std::views::filter) can only be
+  // iterated over non-const
+  mutable storage_type range_;
+
+  container_type &get() const {
+    if constexpr (std::is_pointer<storage_type>::value) {
+      return *range_;
+    } else {
+      return range_;
+    }
+  }
+
+public:
+  typedef typename std::iterator_traits<decltype(
+      std::begin(std::declval<container_type &>()))>::value_type value_type;
+
+  lazy_range(container_type &range) : range_(&range) {}
+
+  lazy_range(container_type &&range) : range_(std::move(range)) {}
+
+  auto begin() const { return std::begin(get()); }
+
+  auto end() const { return std::end(get()); }
+};
+
+// A function object that can be assigned even when Fn can't (a lambda
+// with captures), which a range has to be to be a std::ranges::view.
+// Like the other stages, it calls Fn non-const, also from a const range.
+// A default-constructed one holds no function and can only be assigned to.
+template <typename Fn> class assignable_fn {
+  mutable std::optional<Fn> fn_;
+
+public:
+  assignable_fn() = default;
+
+  assignable_fn(Fn fn) : fn_(std::move(fn)) {}
+
+  assignable_fn(const assignable_fn &) = default;
+  assignable_fn(assignable_fn &&) = default;
+
+  assignable_fn &operator=(const assignable_fn &other) {
+    if (this != &other) {
+      fn_.reset();
+      if (other.fn_) {
+        fn_.emplace(*other.fn_);
+      }
+    }
+    return *this;
+  }
+
+  assignable_fn &operator=(assignable_fn &&other) {
+    if (this != &other) {
+      fn_.reset();
+      if (other.fn_) {
+        fn_.emplace(std::move(*other.fn_));
+      }
+    }
+    return *this;
+  }
+
+  Fn &get() const { return *fn_; }
+};
+
+// Applies fn to the elements of Base as they are read; what map turns into
+// when it is given a lazy range. Iterators move like the ones of Base, up
+// to random access, which their iterator_concept says and parallel stages
+// go by to split the range into chunks. Unless fn returns a reference,
+// *it is a new value on every call, so the iterator_category is only
+// input_iterator_tag. Each iterator calls its own copy of fn, so chunks
+// read in parallel never share one.
+template <typename Base, typename Fn> class transform_range : public view_base {
+  Base base_;
+  assignable_fn<Fn> fn_;
+
+public:
+  class iterator {
+    typedef decltype(std::begin(std::declval<const Base &>())) base_iterator;
+
+    base_iterator it_{};
+    assignable_fn<Fn> fn_;
+
+  public:
+    typedef typename std::invoke_result<Fn &, decltype(*std::declval<base_iterator>())>::type
+        reference;
+    typedef typename std::common_type<
+        std::random_access_iterator_tag,
+        typename details::iterator_concept<base_iterator>::type>::type iterator_concept;
+    typedef typename std::conditional<std::is_reference<reference>::value, iterator_concept,
+                                      std::input_iterator_tag>::type iterator_category;
+    typedef typename std::decay<reference>::type value_type;
+    typedef typename std::iterator_traits<base_iterator>::difference_type difference_type;
+    typedef void pointer;
+
+    iterator() = default;
+
+    iterator(base_iterator it, const Fn &fn) : it_(it), fn_(fn) {}
+
+    reference operator*() const { return fn_.get()(*it_); }
+
+    reference operator[](difference_type n) const { return fn_.get()(it_[n]); }
+
+    iterator &operator++() {
+      ++it_;
+      return *this;
+    }
+
+    iterator operator++(int) {
+      auto previous = *this;
+      ++it_;
+      return previous;
+    }
+
+    iterator &operator--() {
+      --it_;
+      return *this;
+    }
+
+    iterator operator--(int) {
+      auto previous = *this;
+      --it_;
+      return previous;
+    }
+
+    iterator &operator+=(difference_type n) {
+      it_ += n;
+      return *this;
+    }
+
+    iterator &operator-=(difference_type n) {
+      it_ -= n;
+      return *this;
+    }
+
+    friend iterator operator+(iterator it, difference_type n) { return it += n; }
+
+    friend iterator operator+(difference_type n, iterator it) { return it += n; }
+
+    friend iterator operator-(iterator it, difference_type n) { return it -= n; }
+
+    friend difference_type operator-(const iterator &a, const iterator &b) {
+      return a.it_ - b.it_;
+    }
+
+    friend bool operator==(const iterator &a, const iterator &b) { return a.it_ == b.it_; }
+
+    friend bool operator!=(const iterator &a, const iterator &b) { return a.it_ != b.it_; }
+
+    friend bool operator<(const iterator &a, const iterator &b) { return a.it_ < b.it_; }
+
+    friend bool operator>(const iterator &a, const iterator &b) { return a.it_ > b.it_; }
+
+    friend bool operator<=(const iterator &a, const iterator &b) { return a.it_ <= b.it_; }
+
+    friend bool operator>=(const iterator &a, const iterator &b) { return a.it_ >= b.it_; }
+  };
+
+  typedef typename iterator::value_type value_type;
+
+  transform_range(Base base, Fn fn) : base_(std::move(base)), fn_(std::move(fn)) {}
+
+  iterator begin() const { return iterator(std::begin(base_), fn_.get()); }
+
+  iterator end() const { return iterator(std::end(base_), fn_.get()); }
+};
+
+template <typename> struct is_lazy_range : std::false_type {};
+
+template <typename Range> struct is_lazy_range<lazy_range<Range>> : std::true_type {};
+
+template <typename Base, typename Fn>
+struct is_lazy_range<transform_range<Base, Fn>> : std::true_type {};
+
+} // namespace details
+
+// Starts the lazy part of a pipeline: lazy() passes on the container it is
+// given (or a std::ranges view) as a lazy range, without copying it, and
+// a map given a lazy range returns a lazy range in turn, applying its
+// function as the elements are read. Nothing is computed until a stage
+// iterates over the range - collect(), for_each, reduce, a loop - so
+// lazy() | map(f) | map(g) | collect() makes a single pass and builds a
+// single std::vector, however many maps there are. With C++20 the lazy
+// ranges are std::ranges::views, so std::views adaptors apply to them.
+inline auto lazy() {
+  return fn([](auto &&range) {
+    typedef decltype(range) range_type;
+    if constexpr (details::is_lazy_range<typename std::decay<range_type>::type>::value) {
+      return std::forward<range_type>(range);
+    } else {
+      typedef typename std::conditional<std::is_lvalue_reference<range_type>::value, range_type,
+                                        typename std::decay<range_type>::type>::type stored_type;
+      return details::lazy_range<stored_type>(std::forward<range_type>(range));
+    }
+  });
+}
+
+// Reads a range - typically a lazy one - into a std::vector
+inline auto collect() {
+  return fn([](auto &&range) {
+    auto first = std::begin(range);
+    auto last = std::end(range);
+    typedef typename std::decay<decltype(*first)>::type value_type;
+    typedef typename details::iterator_concept<decltype(first)>::type category;
+
+    std::vector<value_type> results;
+    if constexpr (std::is_same<decltype(first), decltype(last)>::value &&
+                  std::is_base_of<std::random_access_iterator_tag, category>::value) {
+      results.reserve(static_cast<std::size_t>(last - first));
+    } else if constexpr (std::is_same<decltype(first), decltype(last)>::value &&
+                         std::is_base_of<std::forward_iterator_tag, category>::value) {
+      results.reserve(static_cast<std::size_t>(std::distance(first, last)));
+    }
+    for (; first != last; ++first) {
+      results.push_back(*first);
+    }
+    return results;
+  });
+}
+
+} // namespace pipeline
+
+#pragma once
+#include <iterator>
+// #include <pipeline/details.hpp>
+// #include <pipeline/fn.hpp>
+// #include <pipeline/lazy.hpp>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace pipeline {
+
+namespace details {
+
+template <typename Container, typename = void> struct is_contiguous : std::false_type {};
+
+template <typename Container>
+struct is_contiguous<Container, std::void_t<decltype(std::data(std::declval<Container &>())),
+                                            decltype(std::size(std::declval<Container &>()))>>
+    : std::true_type {};
+
+// Elements per block of map_n / map_in_place. A loop with a fixed trip
+// count needs no remainder handling, so compilers vectorize it even at -O2
+// (where GCC won't vectorize a loop of unknown length); the leftover
+// elements run one at a time.
+constexpr std::size_t map_block_size = 16;
+
+// The loops the compiler vectorizes: counted, over raw pointers that don't
+// overlap. With fused maps, `fn` is the whole chain, inlined per element.
+template <typename T, typename R, typename Fn>
+void map_n(T *PIPELINE_RESTRICT in, R *PIPELINE_RESTRICT out, std::size_t n, Fn &fn) {
+  std::size_t i = 0;
+  for (; i + map_block_size <= n; i += map_block_size) {
+    for (std::size_t j = 0; j < map_block_size; ++j) {
+      out[i + j] = fn(in[i + j]);
+    }
+  }
+  for (; i < n; ++i) {
+    out[i] = fn(in[i]);
+  }
+}
+
+template <typename T, typename Fn> void map_in_place(T *data, std::size_t n, Fn &fn) {
+  std::size_t i = 0;
+  for (; i + map_block_size <= n; i += map_block_size) {
+    for (std::size_t j = 0; j < map_block_size; ++j) {
+      data[i + j] = fn(data[i + j]);
+    }
+  }
+  for (; i < n; ++i) {
+    data[i] = fn(data[i]);
+  }
+}
+
+} // namespace details
+
+// Element-wise map over a container: map(f)(numbers) returns a std::vector
+// with f applied to each element, in a single sequential pass (for_each is
+// the parallel counterpart).
+//
+// Made for contiguous ranges of numbers: the elements are read and written
+// through raw pointers in a plain counted loop, which compilers turn into
+// SIMD code. map(f) | map(g) fuses into one map, so the data goes through
+// memory once rather than once per stage. Given a std::vector rvalue whose
+// element type the function returns, the results overwrite the input and
+// the same vector is returned - no allocation at all. Given a lazy range
+// (see lazy()), map returns a lazy range too.
+template <typename Fn> class map {
+  template <typename> friend class map;
+
+  Fn fn_;
+
+public:
+  map(Fn fn) : fn_(std::move(fn)) {}
+
+  // The wrapped function
+  Fn &function() { return fn_; }
+
+  template <typename Container> auto operator()(Container &&input) {
+    typedef typename std::decay<Container>::type container_type;
+    typedef decltype(*std::begin(input)) element_type;
+    typedef typename std::decay<typename std::invoke_result<Fn &, element_type>::type>::type
+        result_type;
+    static_assert(!std::is_same<result_type, void>::value,
+                  "map needs a function that returns a value; use for_each for side effects");
+
+    if constexpr (details::is_lazy_range<container_type>::value) {
+      // lazy in, lazy out: fn runs as the elements are read, see lazy()
+      return details::transform_range<container_type, Fn>(std::forward<Container>(input), fn_);
+    } else if constexpr (std::is_rvalue_reference<Container &&>::value &&
+                  !std::is_const<typename std::remove_reference<Container>::type>::value &&
+                  details::is_specialization<container_type, std::vector>::value &&
+                  std::is_same<typename container_type::value_type, result_type>::value &&
+                  !std::is_same<result_type, bool>::value) {
+      details::map_in_place(input.data(), input.size(), fn_);
+      return container_type(std::move(input));
+    } else if constexpr (details::is_contiguous<Container>::value &&
+                         std::is_default_constructible<result_type>::value &&
+                         !std::is_same<result_type, bool>::value) {
+      std::vector<result_type> results(std::size(input));
+      details::map_n(std::data(input), results.data(), results.size(), fn_);
+      return results;
+    } else {
+      std::vector<result_type> results;
+      for (auto &&element : input) {
+        results.push_back(fn_(element));
+      }
+      return results;
+    }
+  }
+
+  // map | map fuses both functions into a single map
+  template <typename T> auto operator|(T &&rhs) const & {
+    if constexpr (details::is_specialization<typename std::decay<T>::type, pipeline::map>::value) {
+      return pipeline::map(details::fuse(fn_, std::forward<T>(rhs).fn_));
+    } else {
+      return pipe_pair<map<Fn>, typename std::decay<T>::type>(*this, std::forward<T>(rhs));
+    }
+  }
+
+  template <typename T> auto operator|(T &&rhs) && {
+    if constexpr (details::is_specialization<typename std::decay<T>::type, pipeline::map>::value) {
+      return pipeline::map(details::fuse(std::move(fn_), std::forward<T>(rhs).fn_));
+    } else {
+      return pipe_pair<map<Fn>, typename std::decay<T>::type>(std::move(*this),
+                                                              std::forward<T>(rhs));
+    }
+  }
+};
+
+} // namespace pipeline
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <memory>
+#include <optional>
+// #include <pipeline/details.hpp>
+// #include <pipeline/fn.hpp>
+// #include <pipeline/parallel_for.hpp>
+// #include <pipeline/parallel_stage.hpp>
+// #include <pipeline/thread_pool.hpp>
+#include <type_traits>
+#include <utility>
+
+namespace pipeline {
+
+namespace details {
+
+// Partial results of a parallel reduction, one per chunk, combined in a
+// binary tree as the chunks finish. The second chunk of a pair to finish
+// merges the pair and carries on up the tree, so the merges of different
+// subtrees run in parallel and nobody waits for a whole level. A partial
+// is always merged with the one to its right, in that order, so `merge`
+// need not be commutative. Each partial has a cache line of its own.
+template <typename T> class reduction_tree {
+  static constexpr std::size_t cache_line = 64;
+
+  struct alignas(cache_line) node {
+    std::optional<T> value;
+    // set by the first of the two halves whose right half starts here
+    std::atomic<bool> arrived{false};
+  };
+
+  std::size_t size_;
+  std::unique_ptr<node[]> nodes_;
+
+public:
+  explicit reduction_tree(std::size_t size)
+      : size_(size), nodes_(std::make_unique<node[]>(size)) {}
+
+  template <typename Merge> void add(std::size_t i, T value, Merge &merge) {
+    nodes_[i].value.emplace(std::move(value));
+    // i is the first chunk of a subtree of `width` chunks
+    for (std::size_t width = 1; width < size_; width *= 2) {
+      const auto left = i & ~(2 * width - 1);
+      const auto right = left + width;
+      if (right >= size_) {
+        continue; // no right half at this level
+      }
+      if (!nodes_[right].arrived.exchange(true, std::memory_order_acq_rel)) {
+        return; // the other half merges
+      }
+      auto &l = nodes_[left].value;
+      auto &r = nodes_[right].value;
+      l.emplace(merge(std::move(*l), std::move(*r)));
+      r.reset();
+      i = left;
+    }
+  }
+
+  T take() { return std::move(*nodes_[0].value); }
+};
+
+struct identity {
+  template <typename U> U &&operator()(U &&value) const { return std::forward<U>(value); }
+};
+
+// Partials are merged with the reduction's own op
+struct merge_with_op {};
+
+} // namespace details
+
+// Parallel reduction of a container: each chunk folds its elements into an
+// accumulator of its own, starting from a copy of `init`, with
+// acc = op(std::move(acc), element); the partials are then merged
+// pairwise in a tree, with op(std::move(left), std::move(right)) or the
+// function given to combine(). `init` is therefore the identity of op
+// (0 for a sum, an empty histogram, ...), and op must be associative.
+// Each chunk folds and merges with its own copies of op, the transform
+// and the merge function, so stateful function objects don't race.
+template <typename T, typename Op, typename Transform = details::identity,
+          typename Combine = details::merge_with_op>
+class reduce : public details::chunked_stage<reduce<T, Op, Transform, Combine>> {
+  template <typename, typename, typename, typename> friend class reduce;
+
+  T init_;
+  Op op_;
+  Transform transform_;
+  Combine combine_;
+
+  static T merge(Op &op, Combine &combine, T left, T right) {
+    if constexpr (std::is_same<Combine, details::merge_with_op>::value) {
+      return op(std::move(left), std::move(right));
+    } else {
+      return combine(std::move(left), std::move(right));
+    }
+  }
+
+public:
+  reduce(T init, Op op, Transform transform = {}, Combine combine = {})
+      : init_(std::move(init)), op_(std::move(op)), transform_(std::move(transform)),
+        combine_(std::move(combine)) {}
+
+  // Merge partial results with merge(std::move(left), std::move(right))
+  // instead of op, for when folding in an element and merging two
+  // accumulators differ, e.g., counting into a histogram vs adding two
+  template <typename Merge> reduce<T, Op, Transform, Merge> combine(Merge merge) const & {
+    return reduce(*this).combine(std::move(merge));
+  }
+
+  template <typename Merge> reduce<T, Op, Transform, Merge> combine(Merge merge) && {
+    reduce<T, Op, Transform, Merge> result(std::move(init_), std::move(op_),
+                                           std::move(transform_), std::move(merge));
+    result.adopt_settings(*this);
+    return result;
+  }
+
+  template <typename Container> T operator()(Container &&args) {
+    auto &ex = this->get_executor();
+    const details::loop_range<decltype(std::begin(args))> input(std::begin(args), std::end(args));
+    const auto size = input.size();
+    if (size == 0) {
+      return init_;
+    }
+    const auto grain = input.grain(this->grain(size, ex));
+
+    details::reduction_tree<T> tree((size + grain - 1) / grain);
+    details::parallel_for(ex, input, grain,
+                          [this, &tree, grain](auto it, std::size_t begin, std::size_t end) {
+                            const auto chunk = begin / grain;
+                            auto op = op_;
+                            auto transform = transform_;
+                            T acc = init_;
+                            for (; begin != end; ++begin, ++it) {
+                              acc = op(std::move(acc), transform(*it));
+                            }
+                            // the merges up the tree run on this chunk's copies too
+                            auto combine = combine_;
+                            auto merge = [&op, &combine](T left, T right) {
+                              return reduce::merge(op, combine, std::move(left),
+                                                   std::move(right));
+                            };
+                            tree.add(chunk, std::move(acc), merge);
+                          },
+                          this->cancellation_);
+    return tree.take();
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) const & {
+    return pipe_pair<reduce<T, Op, Transform, Combine>, typename std::decay<T3>::type>(
+        *this, std::forward<T3>(rhs));
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) && {
+    return pipe_pair<reduce<T, Op, Transform, Combine>, typename std::decay<T3>::type>(
+        std::move(*this), std::forward<T3>(rhs));
+  }
+};
+
+// reduce over transform(element) rather than the elements themselves, e.g.,
+// transform_reduce(0.0, std::plus<>(), [](const order &o) { return o.total; })
+template <typename T, typename Op, typename Transform>
+auto transform_reduce(T init, Op op, Transform transform) {
+  return reduce<T, Op, Transform>(std::move(init), std::move(op), std::move(transform));
+}
+
+} // namespace pipeline
+
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+// #include <pipeline/details.hpp>
+// #include <pipeline/fn.hpp>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define PIPELINE_HAS_MMAP
+#endif
+
+namespace pipeline {
+
+namespace details {
+
+// Forward range over the records of a text, as std::string_views into it.
+// Next(text, pos) gives the length of the record starting at pos, including
+// its separator; View(record) trims it to what the range yields. Iterators
+// hold the text and functions themselves, so they outlive the range.
+template <typename Next, typename View> class record_range {
+  std::string_view text_;
+  Next next_;
+  View view_;
+
+public:
+  class iterator {
+    std::string_view text_;
+    std::size_t pos_{0};
+    std::size_t length_{0};
+    Next next_{};
+    View view_{};
+
+  public:
+    // Records are views made on the fly, not references into the range,
+    // which a C++17 forward iterator must yield; it is one all the same
+    typedef std::input_iterator_tag iterator_category;
+    typedef std::forward_iterator_tag iterator_concept;
+    typedef std::string_view value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const std::string_view *pointer;
+    typedef std::string_view reference;
+
+    iterator() = default;
+
+    iterator(std::string_view text, std::size_t pos, const Next &next, const View &view)
+        : text_(text), pos_(pos), length_(pos < text.size() ? next(text, pos) : 0), next_(next),
+          view_(view) {}
+
+    std::string_view operator*() const { return view_(text_.substr(pos_, length_)); }
+
+    iterator &operator++() {
+      pos_ += length_;
+      length_ = pos_ < text_.size() ? next_(text_, pos_) : 0;
+      return *this;
+    }
+
+    iterator operator++(int) {
+      auto previous = *this;
+      ++*this;
+      return previous;
+    }
+
+    bool operator==(const iterator &other) const { return pos_ == other.pos_; }
+
+    bool operator!=(const iterator &other) const { return pos_ != other.pos_; }
+  };
+
+  typedef std::string_view value_type;
+
+  record_range(std::string_view text, Next next, View view)
+      : text_(text), next_(std::move(next)), view_(std::move(view)) {}
+
+  iterator begin() const { return iterator(text_, 0, next_, view_); }
+
+  iterator end() const { return iterator(text_, text_.size(), next_, view_); }
+};
+
+// Length of the line starting at `pos`, with its '\n' if it has one
+inline std::size_t line_length(std::string_view text, std::size_t pos) {
+  const auto newline = std::memchr(text.data() + pos, '\n', text.size() - pos);
+  return newline ? static_cast<const char *>(newline) - (text.data() + pos) + 1
+                 : text.size() - pos;
+}
+
+struct next_line {
+  std::size_t operator()(std::string_view text, std::size_t pos) const {
+    return line_length(text, pos);
+  }
+};
+
+// A line without its "\n" or "\r\n"
+struct trim_newline {
+  std::string_view operator()(std::string_view line) const {
+    if (!line.empty() && line.back() == '\n') {
+      line.remove_suffix(1);
+    }
+    if (!line.empty() && line.back() == '\r') {
+      line.remove_suffix(1);
+    }
+    return line;
+  }
+};
+
+// At least `size` bytes, extended to the end of the line they stop in
+struct next_chunk {
+  std::size_t size;
+
+  std::size_t operator()(std::string_view text, std::size_t pos) const {
+    const auto length = std::min(std::max<std::size_t>(size, 1), text.size() - pos);
+    const auto end = pos + length;
+    if (end == text.size() || text[end - 1] == '\n') {
+      return length;
+    }
+    return length + line_length(text, end);
+  }
+};
+
+struct whole_record {
+  std::string_view operator()(std::string_view record) const { return record; }
+};
+
+} // namespace details
+
+// The lines of `text`, without their "\n" or "\r\n", as std::string_views
+// into it. Found lazily with memchr, so iterating over a huge text doesn't
+// allocate.
+inline auto lines(std::string_view text) {
+  return details::record_range<details::next_line, details::trim_newline>(text, {}, {});
+}
+
+// `text` in pieces of about `size` bytes, each one extended to the end of
+// the line it stops in, so no line is split across two chunks. Handing
+// chunks to for_each, rather than lines, keeps tasks large.
+inline auto chunks(std::string_view text, std::size_t size) {
+  return details::record_range<details::next_chunk, details::whole_record>(
+      text, details::next_chunk{size}, {});
+}
+
+// A file mapped read-only into memory, for reading large inputs without
+// copying them. The kernel is told the whole file will be needed, so it
+// starts reading it in; not that it will be read sequentially, since
+// parallel stages read their chunks all over it at once. Where mmap isn't
+// available, the file is read into memory instead.
+class mapped_file {
+  const char *data_{nullptr};
+  std::size_t size_{0};
+  std::string buffer_; // without mmap
+
+  [[noreturn]] static void fail(const std::string &path) {
+    throw std::system_error(errno, std::generic_category(), "pipeline::mapped_file: " + path);
+  }
+
+  void unmap() {
+#ifdef PIPELINE_HAS_MMAP
+    if (size_ > 0 && buffer_.empty()) {
+      munmap(const_cast<char *>(data_), size_);
+    }
+#endif
+  }
+
+public:
+  explicit mapped_file(const std::string &path) {
+#ifdef PIPELINE_HAS_MMAP
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      fail(path);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+      const auto error = errno;
+      close(fd);
+      errno = error;
+      fail(path);
+    }
+    size_ = static_cast<std::size_t>(info.st_size);
+    if (size_ > 0) {
+      void *data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+        const auto error = errno;
+        close(fd);
+        errno = error;
+        fail(path);
+      }
+      madvise(data, size_, MADV_WILLNEED);
+      data_ = static_cast<const char *>(data);
+    }
+    close(fd);
+#else
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+      fail(path);
+    }
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    buffer_ = contents.str();
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+#endif
+  }
+
+  mapped_file(mapped_file &&other) noexcept
+      : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)),
+        buffer_(std::move(other.buffer_)) {
+    if (!buffer_.empty()) {
+      data_ = buffer_.data();
+    }
+  }
+
+  mapped_file &operator=(mapped_file &&other) noexcept {
+    if (this != &other) {
+      unmap();
+      data_ = std::exchange(other.data_, nullptr);
+      size_ = std::exchange(other.size_, 0);
+      buffer_ = std::move(other.buffer_);
+      if (!buffer_.empty()) {
+        data_ = buffer_.data();
+      }
+    }
+    return *this;
+  }
+
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+
+  ~mapped_file() { unmap(); }
+
+  std::string_view contents() const { return std::string_view(data_, size_); }
+
+  std::size_t size() const { return size_; }
+
+  auto lines() const { return pipeline::lines(contents()); }
+
+  auto chunks(std::size_t size) const { return pipeline::chunks(contents(), size); }
+};
+
+namespace details {
+
+// Records of a mapped file that keep it mapped, so that they can be read
+// after the stage that gave them is gone
+template <typename Records> class mapped_records {
+  std::shared_ptr<const mapped_file> file_;
+  Records records_;
+
+public:
+  typedef typename Records::value_type value_type;
+
+  mapped_records(std::shared_ptr<const mapped_file> file, Records records)
+      : file_(std::move(file)), records_(std::move(records)) {}
+
+  auto begin() const { return records_.begin(); }
+
+  auto end() const { return records_.end(); }
+};
+
+template <typename Records>
+mapped_records<Records> make_mapped_records(std::shared_ptr<const mapped_file> file,
+                                            Records records) {
+  return mapped_records<Records>(std::move(file), std::move(records));
+}
+
+} // namespace details
+
+// Source stage over the file at `path`: calling it gives the lines of the
+// file (or, given a chunk size, chunks of whole lines) as std::string_views
+// into a mapped_file, e.g., mmap_source("access.log") | for_each(parse).
+// The file is mapped once, when the stage is made, and stays mapped as long
+// as the stage, a copy of it or a range it returned exists; so does
+// `for (auto line : mmap_source(path)())`.
+inline auto mmap_source(const std::string &path) {
+  auto file = std::make_shared<const mapped_file>(path);
+  return fn([file] { return details::make_mapped_records(file, file->lines()); });
+}
+
+inline auto mmap_source(const std::string &path, std::size_t chunk_size) {
+  auto file = std::make_shared<const mapped_file>(path);
+  return fn([file, chunk_size] {
+    return details::make_mapped_records(file, file->chunks(chunk_size));
+  });
+}
+
+} // namespace pipeline
+
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <mutex>
+// #include <pipeline/details.hpp>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <climits>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#else
+#include <fstream>
+#endif
+
+namespace pipeline {
+
+// When a file_sink asks the OS to make its writes durable (fsync)
+enum class sync_policy {
+  never,      // leave it to the OS
+  on_flush,   // after the writes of each flush() and close()
+  every_write // after every batch of buffers written
+};
+
+namespace details {
+
+typedef std::vector<char> write_buffer;
+
+// The file a file_sink writes to. Writes a batch of buffers with one
+// writev call where possible.
+class output_file {
+#if defined(__unix__) || defined(__APPLE__)
+  int fd_{-1};
+  std::string path_;
+
+  [[noreturn]] void fail() const {
+    throw std::system_error(errno, std::generic_category(), "pipeline::file_sink: " + path_);
+  }
+
+public:
+  explicit output_file(const std::string &path) : path_(path) {
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0) {
+      fail();
+    }
+  }
+
+  ~output_file() { ::close(fd_); }
+
+  void write(std::vector<write_buffer> &buffers) {
+    std::vector<iovec> pending;
+    for (auto &buffer : buffers) {
+      if (!buffer.empty()) {
+        pending.push_back(iovec{buffer.data(), buffer.size()});
+      }
+    }
+    auto first = pending.begin();
+    while (first != pending.end()) {
+      const auto count = std::min<std::ptrdiff_t>(pending.end() - first, IOV_MAX);
+      const auto written = ::writev(fd_, &*first, static_cast<int>(count));
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        fail();
+      }
+      // skip what was written, which may end in the middle of a buffer
+      auto left = static_cast<std::size_t>(written);
+      while (first != pending.end() && left >= first->iov_len) {
+        left -= first->iov_len;
+        ++first;
+      }
+      if (left > 0) {
+        first->iov_base = static_cast<char *>(first->iov_base) + left;
+        first->iov_len -= left;
+      }
+    }
+  }
+
+  void sync() {
+    if (::fsync(fd_) != 0) {
+      fail();
+    }
+  }
+#else
+  std::ofstream file_;
+  std::string path_;
+
+  [[noreturn]] void fail() const {
+    throw std::system_error(std::make_error_code(std::errc::io_error),
+                            "pipeline::file_sink: " + path_);
+  }
+
+public:
+  explicit output_file(const std::string &path)
+      : file_(path, std::ios::binary | std::ios::trunc), path_(path) {
+    if (!file_) {
+      fail();
+    }
+  }
+
+  void write(std::vector<write_buffer> &buffers) {
+    for (auto &buffer : buffers) {
+      file_.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    }
+    if (!file_) {
+      fail();
+    }
+  }
+
+  void sync() {
+    if (!file_.flush()) {
+      fail();
+    }
+  }
+#endif
+};
+
+// The state a file_sink and its copies share: the buffer being filled,
+// the full buffers waiting for the writer thread and the written ones
+// waiting to be reused.
+class file_writer {
+  static constexpr auto no_interval = std::chrono::steady_clock::duration::max();
+
+  output_file file_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::size_t buffer_size_{1 << 20};
+  std::size_t buffers_{2};
+  sync_policy sync_{sync_policy::never};
+  std::chrono::steady_clock::duration flush_interval_{no_interval};
+  write_buffer active_;
+  std::vector<write_buffer> full_;
+  std::vector<write_buffer> free_;
+  std::size_t writing_{0};
+  std::uint64_t submitted_{0}; // buffers handed to the writer
+  std::uint64_t written_{0};
+  std::uint64_t syncs_requested_{0}; // by flush(), with sync_policy::on_flush
+  std::uint64_t synced_{0};
+  bool stop_{false};
+  std::exception_ptr error_;
+  std::thread thread_;
+
+  void rethrow_if_failed() {
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+  }
+
+  // Hands the active buffer to the writer and starts a new one
+  void submit() {
+    full_.push_back(std::move(active_));
+    ++submitted_;
+    if (free_.empty()) {
+      active_ = write_buffer();
+    } else {
+      active_ = std::move(free_.back());
+      free_.pop_back();
+    }
+    active_.reserve(buffer_size_);
+    cv_.notify_all();
+  }
+
+  // Makes room for `size` more bytes, handing the active buffer off once
+  // it is full; blocks while every other buffer is still being written
+  void reserve(std::unique_lock<std::mutex> &lock, std::size_t size) {
+    rethrow_if_failed();
+    if (stop_) {
+      throw std::logic_error("pipeline::file_sink: the sink is closed");
+    }
+    if (active_.empty() || active_.size() + size <= buffer_size_) {
+      return;
+    }
+    cv_.wait(lock, [this] { return full_.size() + writing_ + 1 < buffers_ || error_; });
+    rethrow_if_failed();
+    submit();
+  }
+
+  bool has_work() const { return !full_.empty() || synced_ < syncs_requested_; }
+
+  void run() {
+    std::vector<write_buffer> batch;
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto last_flush = std::chrono::steady_clock::now();
+    while (true) {
+      if (flush_interval_ == no_interval) {
+        cv_.wait(lock, [this] {
+          return stop_ || has_work() || flush_interval_ != no_interval;
+        });
+      } else if (!cv_.wait_until(lock, last_flush + flush_interval_,
+                                 [this] { return stop_ || has_work(); })) {
+        // time-based flush of a partly filled buffer
+        if (!active_.empty() && !error_) {
+          submit();
+        }
+        last_flush = std::chrono::steady_clock::now();
+      }
+      if (!has_work()) {
+        if (stop_) {
+          return;
+        }
+        continue;
+      }
+
+      // a flush() syncs even when it had nothing left to write
+      batch.swap(full_);
+      writing_ = batch.size();
+      const auto syncs = syncs_requested_;
+      const bool sync = (sync_ == sync_policy::every_write && !batch.empty()) || synced_ < syncs;
+      lock.unlock();
+      std::exception_ptr error;
+      try {
+        file_.write(batch);
+        if (sync) {
+          file_.sync();
+        }
+      } catch (...) {
+        error = std::current_exception();
+      }
+      lock.lock();
+
+      if (error && !error_) {
+        error_ = error;
+      }
+      written_ += batch.size();
+      synced_ = syncs;
+      writing_ = 0;
+      for (auto &buffer : batch) {
+        buffer.clear();
+        free_.push_back(std::move(buffer));
+      }
+      batch.clear();
+      cv_.notify_all();
+    }
+  }
+
+public:
+  explicit file_writer(const std::string &path) : file_(path), thread_([this] { run(); }) {
+    active_.reserve(buffer_size_);
+  }
+
+  file_writer(const file_writer &) = delete;
+  file_writer &operator=(const file_writer &) = delete;
+
+  ~file_writer() {
+    try {
+      close();
+    } catch (...) {
+      // errors are reported by an explicit flush() or close()
+    }
+  }
+
+  void configure(std::size_t buffer_size, std::size_t buffers, sync_policy sync,
+                 std::chrono::steady_clock::duration flush_interval) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      buffer_size_ = std::max<std::size_t>(buffer_size, 1);
+      buffers_ = std::max<std::size_t>(buffers, 2);
+      sync_ = sync;
+      flush_interval_ = flush_interval;
+    }
+    cv_.notify_all();
+  }
+
+  // Appends whatever `write(buffer)` appends, at most `size` bytes
+  template <typename Write> void append(std::size_t size, Write &&write) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    reserve(lock, size);
+    write(active_);
+  }
+
+  // Hands off what was appended so far and waits until it is written (and
+  // synced, with sync_policy::on_flush)
+  void flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    rethrow_if_failed();
+    if (!active_.empty()) {
+      submit();
+    }
+    const auto target = submitted_;
+    const auto sync_target = sync_ == sync_policy::on_flush ? ++syncs_requested_ : synced_;
+    cv_.notify_all();
+    cv_.wait(lock, [this, target, sync_target] {
+      return (written_ >= target && synced_ >= sync_target) || error_;
+    });
+    rethrow_if_failed();
+  }
+
+  void close() {
+    if (!thread_.joinable()) {
+      return;
+    }
+    std::exception_ptr error;
+    try {
+      flush();
+    } catch (...) {
+      error = std::current_exception();
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+};
+
+template <typename T>
+constexpr bool is_text = std::is_convertible<const T &, std::string_view>::value;
+
+template <typename T, typename = void> struct is_text_range : std::false_type {};
+
+template <typename T>
+struct is_text_range<T, std::void_t<decltype(std::begin(std::declval<const T &>()))>>
+    : std::bool_constant<is_text<typename std::decay<decltype(
+          *std::begin(std::declval<const T &>()))>::type>> {};
+
+} // namespace details
+
+// Sink stage that writes each record it is given to a file, followed by a
+// delimiter ("\n" by default). Records are strings, numbers (formatted
+// with std::to_chars, bools as 0 or 1) or ranges of strings.
+//
+// Records are copied into large buffers that a background thread writes
+// out, several at a time with writev, so the stages feeding the sink never
+// wait on a write syscall unless every buffer is still being written.
+// Copies of the sink share its file, buffers and thread; records from
+// concurrent callers don't interleave but come in no particular order.
+// Written records reach the file once a buffer fills up, on flush() or
+// close(), when the last copy of the sink is destroyed, or every
+// flush_every(interval).
+class file_sink {
+  std::shared_ptr<details::file_writer> writer_;
+  std::string delimiter_{"\n"};
+  std::size_t buffer_size_{1 << 20};
+  std::size_t buffers_{2};
+  sync_policy sync_{sync_policy::never};
+  std::chrono::steady_clock::duration flush_interval_{std::chrono::steady_clock::duration::max()};
+
+  void configure() { writer_->configure(buffer_size_, buffers_, sync_, flush_interval_); }
+
+  void write_text(std::string_view text) {
+    writer_->append(text.size() + delimiter_.size(), [&](details::write_buffer &buffer) {
+      buffer.insert(buffer.end(), text.begin(), text.end());
+      buffer.insert(buffer.end(), delimiter_.begin(), delimiter_.end());
+    });
+  }
+
+public:
+  // Creates (or truncates) the file at `path`
+  explicit file_sink(const std::string &path)
+      : writer_(std::make_shared<details::file_writer>(path)) {}
+
+  // Bytes per buffer, 1 MiB by default
+  file_sink &buffer_size(std::size_t bytes) & {
+    buffer_size_ = bytes;
+    configure();
+    return *this;
+  }
+
+  file_sink &&buffer_size(std::size_t bytes) && { return std::move(buffer_size(bytes)); }
+
+  // Number of buffers, at least (and by default) 2: one being filled while
+  // the others are written
+  file_sink &buffers(std::size_t count) & {
+    buffers_ = count;
+    configure();
+    return *this;
+  }
+
+  file_sink &&buffers(std::size_t count) && { return std::move(buffers(count)); }
+
+  file_sink &sync(sync_policy policy) & {
+    sync_ = policy;
+    configure();
+    return *this;
+  }
+
+  file_sink &&sync(sync_policy policy) && { return std::move(sync(policy)); }
+
+  // Also write partly filled buffers once `interval` has passed, so that
+  // records of a slow stream don't sit in memory indefinitely
+  file_sink &flush_every(std::chrono::steady_clock::duration interval) & {
+    flush_interval_ = interval;
+    configure();
+    return *this;
+  }
+
+  file_sink &&flush_every(std::chrono::steady_clock::duration interval) && {
+    return std::move(flush_every(interval));
+  }
+
+  // Written after each record; may be empty
+  file_sink &delimiter(std::string delimiter) & {
+    delimiter_ = std::move(delimiter);
+    return *this;
+  }
+
+  file_sink &&delimiter(std::string delimiter) && {
+    return std::move(this->delimiter(std::move(delimiter)));
+  }
+
+  template <typename T> void operator()(const T &record) {
+    if constexpr (details::is_text<T>) {
+      write_text(record);
+    } else if constexpr (std::is_same<T, bool>::value) {
+      write_text(record ? "1" : "0");
+    } else if constexpr (std::is_arithmetic<T>::value) {
+      char text[64];
+      const auto end = std::to_chars(text, text + sizeof text, record).ptr;
+      write_text(std::string_view(text, static_cast<std::size_t>(end - text)));
+    } else {
+      static_assert(details::is_text_range<T>::value,
+                    "file_sink writes strings, numbers or ranges of strings");
+      for (const auto &item : record) {
+        write_text(item);
+      }
+    }
+  }
+
+  // Waits until every record given so far is written; rethrows a write
+  // error, if any
+  void flush() { writer_->flush(); }
+
+  // Flushes and stops the background thread; the sink can't be used after
+  void close() { writer_->close(); }
+};
+
+} // namespace pipeline
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+namespace pipeline {
+
+namespace details {
+
+// Spin, then yield, then sleep - used while waiting for tasks in flight.
+// Blocking queue operations park instead once spinning and yielding are
+// exhausted(), see spsc_queue.
+class backoff {
+  unsigned count_{0};
+
+public:
+  void operator()() {
+    if (count_ < 64) {
+      ++count_;
+    } else if (count_ < 128) {
+      ++count_;
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+  }
+
+  bool exhausted() const { return count_ >= 128; }
+
+  void reset() { count_ = 0; }
+};
+
+// Bounded lock-free single-producer/single-consumer ring buffer.
+//
+// One thread pushes, another pops. The producer close()s the queue once
+// it is done; the consumer cancel()s it when it stops consuming early, which
+// makes pending and future pushes fail instead of blocking forever.
+//
+// A side that has to wait spins and yields for a moment, then parks on a
+// condition variable until the other side makes progress, so an idle
+// stream doesn't use any CPU. Each push or pop checks for a parked peer
+// after a fence, and only takes the mutex to wake one up.
+template <typename T> class spsc_queue {
+  static constexpr std::size_t cache_line = 64;
+
+  std::size_t mask_;
+  std::unique_ptr<std::optional<T>[]> slots_;
+
+  alignas(cache_line) std::atomic<std::size_t> head_{0}; // next slot to pop
+  std::size_t cached_tail_{0};                           // consumer's view of tail_
+
+  alignas(cache_line) std::atomic<std::size_t> tail_{0}; // next slot to push
+  std::size_t cached_head_{0};                           // producer's view of head_
+
+  alignas(cache_line) std::atomic<bool> closed_{false};
+  std::atomic<bool> cancelled_{false};
+
+  std::atomic<unsigned> parked_{0};
+  std::mutex park_mutex_;
+  std::condition_variable park_cv_;
+
+  // Wakes the other side if it is parked. The fence orders the caller's
+  // update of the queue before the read of parked_, as park() orders its
+  // update of parked_ before re-checking the queue, so a wake-up can't be
+  // missed.
+  void wake() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (parked_.load(std::memory_order_relaxed) > 0) {
+      std::lock_guard<std::mutex> lock(park_mutex_);
+      park_cv_.notify_all();
+    }
+  }
+
+  // Sleeps until ready() or `deadline`
+  template <typename Ready, typename Clock, typename Duration>
+  void park(Ready ready, const std::chrono::time_point<Clock, Duration> &deadline) {
+    std::unique_lock<std::mutex> lock(park_mutex_);
+    parked_.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (deadline == std::chrono::time_point<Clock, Duration>::max()) {
+      park_cv_.wait(lock, ready);
+    } else {
+      park_cv_.wait_until(lock, deadline, ready);
+    }
+    parked_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  bool can_push() const {
+    return tail_.load(std::memory_order_relaxed) - head_.load(std::memory_order_acquire) <= mask_ ||
+           cancelled_.load(std::memory_order_acquire);
+  }
+
+  bool can_pop() const {
+    return head_.load(std::memory_order_relaxed) != tail_.load(std::memory_order_acquire) ||
+           cancelled_.load(std::memory_order_acquire) || closed_.load(std::memory_order_acquire);
+  }
+
+public:
+  typedef T value_type;
+
+  // `capacity` is rounded up to a power of two
+  explicit spsc_queue(std::size_t capacity) {
+    std::size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    mask_ = size - 1;
+    slots_ = std::make_unique<std::optional<T>[]>(size);
+  }
+
+  spsc_queue(const spsc_queue &) = delete;
+  spsc_queue &operator=(const spsc_queue &) = delete;
+
+  std::size_t capacity() const { return mask_ + 1; }
+
+  // Producer side. Returns false if the queue is full.
+  bool try_push(T &&value) {
+    const auto tail = tail_.load(std::memory_order_relaxed);
+    if (tail - cached_head_ > mask_) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail - cached_head_ > mask_) {
+        return false;
+      }
+    }
+    slots_[tail & mask_].emplace(std::move(value));
+    tail_.store(tail + 1, std::memory_order_release);
+    wake();
+    return true;
+  }
+
+  // Producer side. Blocks while the queue is full; returns false if the
+  // consumer cancelled the queue.
+  bool push(T value) {
+    backoff wait;
+    while (!try_push(std::move(value))) {
+      if (cancelled_.load(std::memory_order_acquire)) {
+        return false;
+      }
+      if (wait.exhausted()) {
+        park([this] { return can_push(); }, std::chrono::steady_clock::time_point::max());
+      } else {
+        wait();
+      }
+    }
+    return true;
+  }
+
+  // Consumer side. Returns std::nullopt if the queue is empty.
+  std::optional<T> try_pop() {
+    const auto head = head_.load(std::memory_order_relaxed);
+    if (head == cached_tail_) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if (head == cached_tail_) {
+        return std::nullopt;
+      }
+    }
+    auto &slot = slots_[head & mask_];
+    std::optional<T> value(std::move(slot));
+    slot.reset();
+    head_.store(head + 1, std::memory_order_release);
+    wake();
+    return value;
+  }
+
+  // Consumer side. Blocks while the queue is empty; returns std::nullopt
+  // once the queue is closed and drained, or cancelled.
+  std::optional<T> pop() {
+    backoff wait;
+    while (true) {
+      if (auto value = try_pop()) {
+        return value;
+      }
+      if (cancelled_.load(std::memory_order_acquire)) {
+        return std::nullopt;
+      }
+      if (closed_.load(std::memory_order_acquire)) {
+        // a push may have landed just before close()
+        return try_pop();
+      }
+      if (wait.exhausted()) {
+        park([this] { return can_pop(); }, std::chrono::steady_clock::time_point::max());
+      } else {
+        wait();
+      }
+    }
+  }
+
+  // Consumer side. Like pop(), but gives up and returns std::nullopt once
+  // `deadline` has passed.
+  template <typename Clock, typename Duration>
+  std::optional<T> pop_until(const std::chrono::time_point<Clock, Duration> &deadline) {
+    backoff wait;
+    while (true) {
+      if (auto value = try_pop()) {
+        return value;
+      }
+      if (cancelled_.load(std::memory_order_acquire)) {
+        return std::nullopt;
+      }
+      if (closed_.load(std::memory_order_acquire)) {
+        return try_pop();
+      }
+      if (Clock::now() >= deadline) {
+        return std::nullopt;
+      }
+      if (wait.exhausted()) {
+        park([this] { return can_pop(); }, deadline);
+      } else {
+        wait();
+      }
+    }
+  }
+
+  // Producer side: no more values will be pushed
+  void close() {
+    closed_.store(true, std::memory_order_release);
+    wake();
+  }
+
+  // Consumer side: no more values will be popped. May also be called from
+  // another thread to stop both sides.
+  void cancel() {
+    cancelled_.store(true, std::memory_order_release);
+    wake();
+  }
+
+  bool closed() const { return closed_.load(std::memory_order_acquire); }
+
+  bool cancelled() const { return cancelled_.load(std::memory_order_acquire); }
+};
+
+} // namespace details
+
+} // namespace pipeline
+
+#pragma once
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+// #include <pipeline/affinity.hpp>
+// #include <pipeline/cancellation.hpp>
+// #include <pipeline/details.hpp>
+// #include <pipeline/fn.hpp>
+// #include <pipeline/pipe_pair.hpp>
+// #include <pipeline/spsc_queue.hpp>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+namespace pipeline {
+
+namespace details {
+
+template <typename T> struct is_fused_fn : std::false_type {};
+template <typename... Fns> struct is_fused_fn<fn<fused<Fns...>>> : std::true_type {};
+
+// Flattens a chain of pipe_pairs, e.g., (a | b) | c, into a tuple of its
+// stages (a, b, c). Fused fns are split back into one stage per function.
+template <typename T> auto stages_of(T &&stage) {
+  typedef typename std::decay<T>::type stage_type;
+  if constexpr (is_specialization<stage_type, pipe_pair>::value) {
+    return std::tuple_cat(stages_of(stage.left()), stages_of(stage.right()));
+  } else if constexpr (is_fused_fn<stage_type>::value) {
+    return std::apply([](auto &... fns) { return std::make_tuple(pipeline::fn(fns)...); },
+                      stage.function().stages());
+  } else {
+    return std::make_tuple(std::forward<T>(stage));
+  }
+}
+
+// Per-stream state of a stage that is called once per item. Stages that
+// emit zero or several results per item (see batch) provide their own
+// state through a stream_state<In>() member instead.
+template <typename Stage, typename In> class call_state {
+  Stage &stage_;
+
+public:
+  typedef typename std::invoke_result<Stage &, In>::type result_type;
+  typedef typename std::conditional<std::is_same<result_type, void>::value, void,
+                                    typename std::decay<result_type>::type>::type output_type;
+
+  explicit call_state(Stage &stage) : stage_(stage) {}
+
+  template <typename Emit> void process(In &&item, Emit &emit) {
+    if constexpr (std::is_same<result_type, void>::value) {
+      stage_(std::move(item));
+    } else {
+      emit(stage_(std::move(item)));
+    }
+  }
+
+  template <typename Emit> void flush(Emit &) {}
+
+  std::chrono::steady_clock::time_point deadline() const {
+    return std::chrono::steady_clock::time_point::max();
+  }
+};
+
+template <typename Stage, typename In, typename = void>
+struct has_stream_state : std::false_type {};
+
+template <typename Stage, typename In>
+struct has_stream_state<
+    Stage, In, std::void_t<decltype(std::declval<Stage &>().template stream_state<In>())>>
+    : std::true_type {};
+
+// Stream states may want to know how long their stage waited for input
+template <typename State, typename = void> struct has_queue_wait_hook : std::false_type {};
+
+template <typename State>
+struct has_queue_wait_hook<State, std::void_t<decltype(std::declval<State &>().on_queue_wait(
+                                      std::chrono::steady_clock::duration()))>>
+    : std::true_type {};
+
+// Stream states may need to do more when the input ends than on a
+// deadline (e.g., wait for work still in flight); they do it in finish()
+template <typename State, typename Emit, typename = void> struct has_finish : std::false_type {};
+
+template <typename State, typename Emit>
+struct has_finish<State, Emit,
+                  std::void_t<decltype(std::declval<State &>().finish(std::declval<Emit &>()))>>
+    : std::true_type {};
+
+template <typename State, typename Emit> void finish_state(State &state, Emit &emit) {
+  if constexpr (has_finish<State, Emit>::value) {
+    state.finish(emit);
+  } else {
+    state.flush(emit);
+  }
+}
+
+template <typename In, typename Stage> auto make_stream_state(Stage &stage) {
+  if constexpr (has_stream_state<Stage, In>::value) {
+    return stage.template stream_state<In>();
+  } else {
+    return call_state<Stage, In>(stage);
+  }
+}
+
+template <typename Stage, typename In>
+using stream_output_t =
+    typename decltype(make_stream_state<In>(std::declval<Stage &>()))::output_type;
+
+// The queues in front of each stage (and after the last one, unless it
+// returns void) of a stream fed with `In`
+template <typename In, typename... Stages> struct stream_queues;
+
+template <typename In> struct stream_queues<In> {
+  typedef std::tuple<std::unique_ptr<spsc_queue<In>>> type;
+  typedef In output_type;
+};
+
+template <> struct stream_queues<void> {
+  typedef std::tuple<> type;
+  typedef void output_type;
+};
+
+template <typename In, typename Stage, typename... Stages>
+struct stream_queues<In, Stage, Stages...> {
+  typedef stream_output_t<Stage, In> result_type;
+  static_assert(sizeof...(Stages) == 0 || !std::is_same<result_type, void>::value,
+                "only the last stage of a stream may return void");
+
+  typedef stream_queues<result_type, Stages...> next;
+  typedef decltype(std::tuple_cat(std::declval<std::tuple<std::unique_ptr<spsc_queue<In>>>>(),
+                                  std::declval<typename next::type>())) type;
+  typedef typename next::output_type output_type;
+};
+
+} // namespace details
+
+// Runs each stage of a pipeline on its own thread, connected by bounded
+// single-producer/single-consumer queues. While stage N works on one item,
+// stage N - 1 is already working on the next one.
+//
+// push() feeds the first stage (from a single thread) and blocks while its
+// queue is full, so a slow stage throttles everything upstream of it. If
+// the last stage returns a value, pop() its results until it returns
+// std::nullopt. Call close() when there is no more input, then wait().
+//
+// stop(), or an exception in any stage, stops the whole stream at once:
+// queued items are dropped, and parallel stages skip the tasks they have
+// not started and see stop_requested() in the ones that are running.
+template <typename In, typename... Stages> class streaming_pipeline {
+  typedef details::stream_queues<In, Stages...> queues_traits;
+  typedef typename queues_traits::type queues_type;
+
+public:
+  typedef typename queues_traits::output_type output_type;
+
+private:
+  static constexpr bool has_output = !std::is_same<output_type, void>::value;
+
+  std::tuple<Stages...> stages_;
+  std::vector<cpu_set> placement_;
+  queues_type queues_;
+  std::vector<std::thread> threads_;
+  details::stop_flag stop_{nullptr};
+  std::mutex error_mutex_;
+  std::exception_ptr error_;
+
+  template <std::size_t I> auto &queue() { return *std::get<I>(queues_); }
+
+  // CPUs stage I runs on; anywhere if none were given
+  const cpu_set &placement(std::size_t stage) const {
+    static const cpu_set anywhere;
+    return stage < placement_.size() ? placement_[stage] : anywhere;
+  }
+
+  // The input queue of a pinned stage is allocated on that stage's CPUs,
+  // so its buffer lives in the consumer's NUMA node
+  template <std::size_t... Is> void make_queues(std::size_t capacity, std::index_sequence<Is...>) {
+    (details::run_on(placement(Is),
+                     [this, capacity] {
+                       std::get<Is>(queues_) = std::make_unique<
+                           typename std::tuple_element<Is, queues_type>::type::element_type>(
+                           capacity);
+                     }),
+     ...);
+  }
+
+  template <std::size_t... Is> void cancel_queues(std::index_sequence<Is...>) {
+    (queue<Is>().cancel(), ...);
+  }
+
+  template <std::size_t... Is> void start(std::index_sequence<Is...>) {
+    threads_.reserve(sizeof...(Is));
+    try {
+      (threads_.emplace_back([this] { run_stage<Is>(); }), ...);
+    } catch (...) {
+      // a thread couldn't be started: stop and join the ones that were
+      stop();
+      join();
+      throw;
+    }
+  }
+
+  template <std::size_t I> void run_stage() {
+    typedef typename std::tuple_element<I, queues_type>::type::element_type::value_type input_type;
+    constexpr bool has_next = I + 1 < std::tuple_size<queues_type>::value;
+
+    placement(I).pin_current_thread();
+    details::stop_scope scope(stop_);
+    auto &input = queue<I>();
+    bool stopped = false;
+    auto emit = [this, &stopped](auto &&result) {
+      if constexpr (has_next) {
+        if (!stopped && !queue<I + 1>().push(std::forward<decltype(result)>(result))) {
+          stopped = true; // downstream has stopped
+        }
+      }
+    };
+
+    try {
+      auto state = details::make_stream_state<input_type>(std::get<I>(stages_));
+      auto pop = [&input, &state](auto deadline) {
+        if constexpr (details::has_queue_wait_hook<decltype(state)>::value) {
+          const auto start = std::chrono::steady_clock::now();
+          auto value = input.pop_until(deadline);
+          state.on_queue_wait(std::chrono::steady_clock::now() - start);
+          return value;
+        } else {
+          return input.pop_until(deadline);
+        }
+      };
+
+      while (!stopped && !stop_.requested()) {
+        const auto deadline = state.deadline();
+        if (auto value = pop(deadline)) {
+          state.process(std::move(*value), emit);
+        } else if (std::chrono::steady_clock::now() >= deadline) {
+          state.flush(emit);
+        } else {
+          // input closed and drained
+          details::finish_state(state, emit);
+          break;
+        }
+      }
+    } catch (...) {
+      {
+        // once stopping, other stages may fail with operation_cancelled
+        std::lock_guard<std::mutex> lock(error_mutex_);
+        if (!error_ && !stop_.requested()) {
+          error_ = std::current_exception();
+        }
+      }
+      stop();
+    }
+    // stop upstream stages, let downstream stages drain
+    input.cancel();
+    if constexpr (has_next) {
+      queue<I + 1>().close();
+    }
+  }
+
+  void rethrow_if_failed() {
+    std::lock_guard<std::mutex> lock(error_mutex_);
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+  }
+
+  void join() {
+    for (auto &thread : threads_) {
+      if (thread.joinable()) {
+        thread.join();
+      }
+    }
+  }
+
+public:
+  // `placement` gives the CPUs each stage's thread is pinned to, in stage
+  // order; stages past its end, or with an empty cpu_set, aren't pinned
+  streaming_pipeline(std::size_t capacity, Stages... stages, std::vector<cpu_set> placement = {})
+      : stages_(std::move(stages)...), placement_(std::move(placement)) {
+    make_queues(capacity, std::make_index_sequence<std::tuple_size<queues_type>::value>{});
+    start(std::index_sequence_for<Stages...>{});
+  }
+
+  streaming_pipeline(const streaming_pipeline &) = delete;
+  streaming_pipeline &operator=(const streaming_pipeline &) = delete;
+
+  // Closes the input and waits for the stages to finish; results that were
+  // not popped are dropped
+  ~streaming_pipeline() {
+    close();
+    if constexpr (has_output) {
+      queue<sizeof...(Stages)>().cancel();
+    }
+    join();
+  }
+
+  // Feeds one item to the first stage, blocking while its queue is full.
+  // Rethrows the exception of a failed stage.
+  void push(In value) {
+    if (!queue<0>().push(std::move(value))) {
+      rethrow_if_failed();
+      throw std::runtime_error("pipeline::streaming_pipeline: stream has stopped");
+    }
+  }
+
+  // Feeds every element of `range` to the first stage, e.g., the lines of
+  // an mmap_source; see push()
+  template <typename Range> void push_all(Range &&range) {
+    for (auto &&value : range) {
+      push(In(std::forward<decltype(value)>(value)));
+    }
+  }
+
+  // Next result of the last stage; std::nullopt once the stream is closed
+  // and drained. Rethrows the exception of a failed stage.
+  template <typename T = output_type> std::optional<T> pop() {
+    static_assert(has_output, "the last stage of this stream returns void");
+    auto value = queue<sizeof...(Stages)>().pop();
+    if (!value) {
+      rethrow_if_failed();
+    }
+    return value;
+  }
+
+  // No more input will be pushed
+  void close() { queue<0>().close(); }
+
+  // Stops every stage as soon as possible, dropping the items in flight.
+  // Safe to call from any thread; wait() still joins the stages.
+  void stop() {
+    stop_.request_stop();
+    cancel_queues(std::make_index_sequence<std::tuple_size<queues_type>::value>{});
+  }
+
+  // Closes the input and waits for every stage to drain. Pop all results
+  // first if the last stage returns a value.
+  void wait() {
+    close();
+    join();
+    rethrow_if_failed();
+  }
+};
+
+// Turns a pipeline (a | b | c) into a streaming_pipeline fed with values of
+// type `In`, with queues of `capacity` items between stages. `placement`
+// optionally pins stage i to placement[i], e.g., to keep a producer and its
+// consumer on CPUs that share an L3 cache.
+template <typename In, typename Pipeline>
+auto stream(Pipeline &&pipeline, std::size_t capacity = 1024,
+            std::vector<cpu_set> placement = {}) {
+  return std::apply(
+      [capacity, &placement](auto &&... stages) {
+        return streaming_pipeline<In, typename std::decay<decltype(stages)>::type...>(
+            capacity, std::move(stages)..., std::move(placement));
+      },
+      details::stages_of(std::forward<Pipeline>(pipeline)));
+}
+
+} // namespace pipeline
+
+#pragma once
+#include <chrono>
+#include <iterator>
+// #include <pipeline/details.hpp>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace pipeline {
+
+namespace details {
+
+// Streaming state of batch for items of type T. Each batch's storage is
+// handed downstream with the batch, so the next batch gets a buffer of its
+// own, reserved when its first item arrives: none is allocated after the
+// last batch, or while the stream is idle.
+template <typename T> class batcher {
+  std::size_t size_;
+  std::chrono::steady_clock::duration max_delay_;
+  std::vector<T> buffer_;
+  std::chrono::steady_clock::time_point deadline_;
+
+public:
+  typedef std::vector<T> output_type;
+
+  batcher(std::size_t size, std::chrono::steady_clock::duration max_delay)
+      : size_(size), max_delay_(max_delay) {}
+
+  template <typename Emit> void process(T &&item, Emit &emit) {
+    if (buffer_.empty()) {
+      buffer_.reserve(size_);
+      deadline_ = max_delay_ == std::chrono::steady_clock::duration::max()
+                      ? std::chrono::steady_clock::time_point::max()
+                      : std::chrono::steady_clock::now() + max_delay_;
+    }
+    buffer_.push_back(std::move(item));
+    if (buffer_.size() >= size_) {
+      flush(emit);
+    }
+  }
+
+  template <typename Emit> void flush(Emit &emit) {
+    if (!buffer_.empty()) {
+      emit(std::move(buffer_));
+      buffer_.clear();
+    }
+  }
+
+  std::chrono::steady_clock::time_point deadline() const {
+    return buffer_.empty() ? std::chrono::steady_clock::time_point::max() : deadline_;
+  }
+};
+
+// Streaming state of unbatch for batches of type Batch
+template <typename Batch> class unbatcher {
+public:
+  typedef typename std::decay<Batch>::type::value_type output_type;
+
+  template <typename Emit> void process(Batch &&batch, Emit &emit) {
+    for (auto &item : batch) {
+      emit(std::move(item));
+    }
+  }
+
+  template <typename Emit> void flush(Emit &) {}
+
+  std::chrono::steady_clock::time_point deadline() const {
+    return std::chrono::steady_clock::time_point::max();
+  }
+};
+
+} // namespace details
+
+// Groups items into std::vectors of `size` items.
+//
+// Called on a container, returns the container's items split into
+// batches. In a stream, emits a batch once `size` items have arrived or
+// `max_delay` after the first item of the batch arrived, whichever comes
+// first; a partial batch is also emitted when the stream closes.
+class batch {
+  std::size_t size_;
+  std::chrono::steady_clock::duration max_delay_;
+
+public:
+  explicit batch(std::size_t size,
+                 std::chrono::steady_clock::duration max_delay =
+                     std::chrono::steady_clock::duration::max())
+      : size_(size > 0 ? size : 1), max_delay_(max_delay) {}
+
+  template <typename Container> auto operator()(Container &&items) const {
+    typedef typename std::decay<Container>::type::value_type value_type;
+    std::vector<std::vector<value_type>> batches;
+    std::vector<value_type> current;
+    for (auto &item : items) {
+      if (current.empty()) {
+        current.reserve(size_);
+      }
+      if constexpr (std::is_lvalue_reference<Container>::value) {
+        current.push_back(item);
+      } else {
+        current.push_back(std::move(item));
+      }
+      if (current.size() == size_) {
+        batches.push_back(std::move(current));
+        current = {};
+      }
+    }
+    if (!current.empty()) {
+      batches.push_back(std::move(current));
+    }
+    return batches;
+  }
+
+  template <typename T> details::batcher<T> stream_state() const {
+    return details::batcher<T>(size_, max_delay_);
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) const {
+    return pipe_pair<batch, typename std::decay<T3>::type>(*this, std::forward<T3>(rhs));
+  }
+};
+
+// The inverse of batch: flattens a container of batches into their items
+class unbatch {
+public:
+  template <typename Container> auto operator()(Container &&batches) const {
+    typedef typename std::decay<Container>::type::value_type batch_type;
+    std::vector<typename batch_type::value_type> items;
+    for (auto &b : batches) {
+      if constexpr (std::is_lvalue_reference<Container>::value) {
+        items.insert(items.end(), std::begin(b), std::end(b));
+      } else {
+        items.insert(items.end(), std::make_move_iterator(std::begin(b)),
+                     std::make_move_iterator(std::end(b)));
+      }
+    }
+    return items;
+  }
+
+  template <typename Batch> details::unbatcher<Batch> stream_state() const {
+    return details::unbatcher<Batch>();
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) const {
+    return pipe_pair<unbatch, typename std::decay<T3>::type>(*this, std::forward<T3>(rhs));
+  }
+};
+
+} // namespace pipeline
+
+#pragma once
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <ostream>
+// #include <pipeline/details.hpp>
+// #include <pipeline/stream.hpp>
+#include <set>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+namespace pipeline {
+
+// Receives timings from instrumented stages. Calls may arrive from
+// several threads at once.
+class observer {
+public:
+  virtual ~observer() = default;
+
+  // `stage` ran once for `duration` on `thread`
+  virtual void on_call(const std::string &stage, std::chrono::nanoseconds duration,
+                       std::thread::id thread) = 0;
+
+  // Streaming only: `stage` waited `duration` for an input item or for
+  // room in its output queue
+  virtual void on_queue_wait(const std::string &, std::chrono::nanoseconds) {}
+};
+
+namespace details {
+
+// Reports the time between its construction and destruction as one call
+class call_timer {
+  observer &observer_;
+  const std::string &stage_;
+  std::chrono::steady_clock::time_point start_;
+  std::chrono::steady_clock::duration excluded_{0};
+
+public:
+  call_timer(observer &obs, const std::string &stage)
+      : observer_(obs), stage_(stage), start_(std::chrono::steady_clock::now()) {}
+
+  ~call_timer() {
+    const auto duration = std::chrono::steady_clock::now() - start_ - excluded_;
+    observer_.on_call(stage_, std::chrono::duration_cast<std::chrono::nanoseconds>(duration),
+                      std::this_thread::get_id());
+  }
+
+  // Leave `duration` (e.g., time blocked on a full queue) out of the call
+  void exclude(std::chrono::steady_clock::duration duration) { excluded_ += duration; }
+};
+
+// Streaming state of an instrumented stage: times the wrapped state's
+// process(), one call per item, and reports the time spent waiting on the
+// stream's queues. Flushes on a deadline and the final finish are not
+// calls of the stage, so they aren't counted, but their time blocked on
+// the output queue is.
+template <typename State> class instrumented_state {
+  State state_;
+  const std::string &stage_;
+  observer &observer_;
+
+  // `timer`, if any, leaves the time blocked on the output queue out
+  template <typename Emit> auto timed(call_timer *timer, Emit &emit) {
+    return [this, timer, &emit](auto &&result) {
+      const auto start = std::chrono::steady_clock::now();
+      emit(std::forward<decltype(result)>(result));
+      const auto blocked = std::chrono::steady_clock::now() - start;
+      if (timer) {
+        timer->exclude(blocked);
+      }
+      on_queue_wait(blocked);
+    };
+  }
+
+public:
+  typedef typename State::output_type output_type;
+
+  instrumented_state(State state, const std::string &stage, observer &obs)
+      : state_(std::move(state)), stage_(stage), observer_(obs) {}
+
+  template <typename In, typename Emit> void process(In &&item, Emit &emit) {
+    call_timer timer(observer_, stage_);
+    auto timed_emit = timed(&timer, emit);
+    state_.process(std::forward<In>(item), timed_emit);
+  }
+
+  template <typename Emit> void flush(Emit &emit) {
+    auto timed_emit = timed(nullptr, emit);
+    state_.flush(timed_emit);
+  }
+
+  template <typename Emit> void finish(Emit &emit) {
+    auto timed_emit = timed(nullptr, emit);
+    finish_state(state_, timed_emit);
+  }
+
+  std::chrono::steady_clock::time_point deadline() const { return state_.deadline(); }
+
+  void on_queue_wait(std::chrono::steady_clock::duration duration) {
+    observer_.on_queue_wait(stage_,
+                            std::chrono::duration_cast<std::chrono::nanoseconds>(duration));
+  }
+};
+
+} // namespace details
+
+// Wraps a stage and reports every call of it to an observer, under a name.
+// Works in one-shot pipelines, as a fork branch and in streams.
+template <typename Stage> class instrumented {
+  Stage stage_;
+  std::string name_;
+  observer *observer_;
+
+public:
+  instrumented(Stage stage, std::string name, observer &obs)
+      : stage_(std::move(stage)), name_(std::move(name)), observer_(&obs) {}
+
+  template <typename... T> decltype(auto) operator()(T &&... args) {
+    details::call_timer timer(*observer_, name_);
+    return stage_(std::forward<T>(args)...);
+  }
+
+  const std::string &name() const { return name_; }
+
+  template <typename In> auto stream_state() {
+    auto state = details::make_stream_state<In>(stage_);
+    return details::instrumented_state<decltype(state)>(std::move(state), name_, *observer_);
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) const & {
+    return pipe_pair<instrumented<Stage>, typename std::decay<T3>::type>(*this,
+                                                                         std::forward<T3>(rhs));
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) && {
+    return pipe_pair<instrumented<Stage>, typename std::decay<T3>::type>(std::move(*this),
+                                                                         std::forward<T3>(rhs));
+  }
+};
+
+// instrument(stage, "name", obs) reports the stage's calls to `obs`.
+// instrument<false>(...) returns the stage itself, so instrumentation
+// behind a compile-time switch costs nothing when it is off.
+template <bool Enabled = true, typename Stage>
+auto instrument(Stage stage, std::string name, observer &obs) {
+  if constexpr (Enabled) {
+    return instrumented<Stage>(std::move(stage), std::move(name), obs);
+  } else {
+    return stage;
+  }
+}
+
+// Observer that aggregates per-stage call counts, a histogram of call
+// durations, queue wait time and the threads each stage ran on
+class stage_metrics : public observer {
+public:
+  struct stats {
+    std::uint64_t calls{0};
+    std::chrono::nanoseconds total{0};
+    std::chrono::nanoseconds max{0};
+    // histogram[i] counts calls that took [2^i, 2^(i+1)) nanoseconds
+    std::array<std::uint64_t, 64> histogram{};
+    std::chrono::nanoseconds queue_wait{0};
+    std::set<std::thread::id> threads;
+
+    // Upper bound of the duration within which `fraction` of the calls finished
+    std::chrono::nanoseconds percentile(double fraction) const {
+      std::uint64_t seen = 0;
+      for (std::size_t i = 0; i < histogram.size(); ++i) {
+        seen += histogram[i];
+        if (calls > 0 && seen >= fraction * calls) {
+          return i < 62 ? std::min(max, std::chrono::nanoseconds(std::int64_t(2) << i)) : max;
+        }
+      }
+      return max;
+    }
+  };
+
+private:
+  mutable std::mutex mutex_;
+  std::map<std::string, stats> stages_;
+
+  static void write_json_string(std::ostream &os, const std::string &s) {
+    os << '"';
+    for (auto c : s) {
+      if (static_cast<unsigned char>(c) < 0x20) {
+        // Control characters are written as \u00XX
+        static constexpr char hex[] = "0123456789abcdef";
+        os << "\\u00" << hex[(c >> 4) & 0xf] << hex[c & 0xf];
+      } else {
+        if (c == '"' || c == '\\') {
+          os << '\\';
+        }
+        os << c;
+      }
+    }
+    os << '"';
+  }
+
+public:
+  void on_call(const std::string &stage, std::chrono::nanoseconds duration,
+               std::thread::id thread) override {
+    std::size_t bucket = 0;
+    while (bucket < 62 && (std::int64_t(2) << bucket) <= duration.count()) {
+      ++bucket;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto &s = stages_[stage];
+    ++s.calls;
+    s.total += duration;
+    s.max = std::max(s.max, duration);
+    ++s.histogram[bucket];
+    s.threads.insert(thread);
+  }
+
+  void on_queue_wait(const std::string &stage, std::chrono::nanoseconds duration) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stages_[stage].queue_wait += duration;
+  }
+
+  // Copy of the statistics gathered so far, by stage name
+  std::map<std::string, stats> snapshot() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stages_;
+  }
+
+  void reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stages_.clear();
+  }
+
+  // One line per stage; durations in microseconds
+  void dump_text(std::ostream &os) const {
+    const auto stages = snapshot();
+    const auto us = [](std::chrono::nanoseconds ns) { return ns.count() / 1000.0; };
+    os << std::left << std::setw(20) << "stage" << std::right << std::setw(10) << "calls"
+       << std::setw(14) << "total_us" << std::setw(12) << "mean_us" << std::setw(12) << "p50_us"
+       << std::setw(12) << "p99_us" << std::setw(12) << "max_us" << std::setw(14) << "wait_us"
+       << std::setw(9) << "threads" << "\n";
+    os << std::fixed << std::setprecision(1);
+    for (const auto &[name, s] : stages) {
+      os << std::left << std::setw(20) << name << std::right << std::setw(10) << s.calls
+         << std::setw(14) << us(s.total) << std::setw(12)
+         << (s.calls ? us(s.total) / s.calls : 0.0) << std::setw(12) << us(s.percentile(0.5))
+         << std::setw(12) << us(s.percentile(0.99)) << std::setw(12) << us(s.max)
+         << std::setw(14) << us(s.queue_wait) << std::setw(9) << s.threads.size() << "\n";
+    }
+  }
+
+  // {"stages": [{"name": ..., "calls": ..., ...}, ...]}; durations in nanoseconds
+  void dump_json(std::ostream &os) const {
+    const auto stages = snapshot();
+    os << "{\"stages\": [";
+    bool first = true;
+    for (const auto &[name, s] : stages) {
+      os << (first ? "" : ", ") << "{\"name\": ";
+      write_json_string(os, name);
+      os << ", \"calls\": " << s.calls << ", \"total_ns\": " << s.total.count()
+         << ", \"max_ns\": " << s.max.count() << ", \"queue_wait_ns\": " << s.queue_wait.count()
+         << ", \"threads\": " << s.threads.size() << ", \"histogram_ns\": {";
+      bool first_bucket = true;
+      for (std::size_t i = 0; i < s.histogram.size(); ++i) {
+        if (s.histogram[i]) {
+          os << (first_bucket ? "" : ", ") << "\"" << (std::uint64_t(1) << i) << "\": "
+             << s.histogram[i];
+          first_bucket = false;
+        }
+      }
+      os << "}}";
+      first = false;
+    }
+    os << "]}\n";
+  }
+};
+
+} // namespace pipeline
+
+#pragma once
+#include <exception>
+#include <functional>
+#include <optional>
+// #include <pipeline/details.hpp>
+// #include <pipeline/fn.hpp>
+// #include <pipeline/parallel_stage.hpp>
+// #include <pipeline/thread_pool.hpp>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace pipeline {
+
+// Marks a fork_into / fork_into_tuple / unzip_into branch as cheap: it
+// runs on the calling thread instead of being handed to the executor
+template <typename Fn> class cheap {
+  Fn fn_;
+
+public:
+  cheap(Fn fn) : fn_(std::move(fn)) {}
+
+  template <typename... T> decltype(auto) operator()(T &&... args) {
+    return fn_(std::forward<T>(args)...);
+  }
+};
+
+namespace details {
+
+// Result of a fork branch; void becomes std::monostate so that it fits in a tuple
+template <typename T> struct branch_result { typedef T type; };
+template <> struct branch_result<void> { typedef std::monostate type; };
+
+template <typename F> auto invoke_branch(F &f) {
+  typedef typename std::invoke_result<F &>::type result_type;
+  if constexpr (std::is_same<result_type, void>::value) {
+    f();
+    return std::monostate{};
+  } else {
+    return typename branch_result<result_type>::type(f());
+  }
+}
+
+// A trivial branch result (a number, most often) is value-initialized up
+// front rather than kept in a std::optional, so no uninitialized bytes are
+// ever copied, even on paths the compiler can't rule out
+template <typename T> class trivial_value {
+  T value_{};
+  bool engaged_{false};
+
+public:
+  template <typename U> void emplace(U &&value) {
+    value_ = std::forward<U>(value);
+    engaged_ = true;
+  }
+
+  explicit operator bool() const { return engaged_; }
+
+  T &operator*() { return value_; }
+};
+
+template <typename T>
+using branch_value =
+    typename std::conditional<std::is_trivially_copyable<T>::value &&
+                                  std::is_default_constructible<T>::value &&
+                                  std::is_move_assignable<T>::value,
+                              trivial_value<T>, std::optional<T>>::type;
+
+// Result slot of one fork branch. An exception is passed to the group,
+// which stops the branches that haven't started yet and rethrows it once
+// every branch is joined. An offloaded branch is handed to the executor as
+// a pointer to its slot, which std::function stores without allocating.
+template <typename Call> class branch {
+  typedef decltype(std::declval<Call &>()()) result_type;
+
+  // Converts to the result of call_, so the result is constructed right in
+  // value_ rather than moved there from a temporary
+  struct result_of_call {
+    Call &call;
+    operator result_type() const { return call(); }
+  };
+
+  Call &call_;
+  task_group *group_{nullptr};
+  branch_value<result_type> value_;
+
+public:
+  explicit branch(Call &call) : call_(call) {}
+
+  void run(task_group &group) {
+    if (group.skip()) {
+      return;
+    }
+    stop_scope scope(group.stop());
+    try {
+      value_.emplace(result_of_call{call_});
+    } catch (...) {
+      group.fail(std::current_exception());
+    }
+  }
+
+  // Runs the branch on `ex`; `group` tracks when it is done
+  void start(executor &ex, task_group &group) {
+    group_ = &group;
+    group.add();
+    try {
+      ex.execute([this] {
+        run(*group_);
+        group_->done();
+      });
+    } catch (...) {
+      group.fail(std::current_exception());
+      group.done();
+    }
+  }
+
+  // Only called once the group was joined without an error, so every
+  // branch has a value
+  result_type get() {
+    if (!value_) {
+      throw operation_cancelled();
+    }
+    return std::move(*value_);
+  }
+};
+
+// The calling thread would only block while waiting for the branches, so
+// it runs the last one itself, along with any branch marked cheap
+template <std::size_t I, std::size_t N, typename Fn>
+constexpr bool runs_inline = I + 1 == N || is_specialization<Fn, cheap>::value;
+
+// Runs each call in the tuple `calls` once, in parallel on `ex`; call I
+// runs on the calling thread if Inline[I]. Waits for all of them and
+// returns their results as a tuple. The completion latch and the result
+// slots live on this stack frame, since the number of branches is fixed.
+template <typename Calls, bool... Inline, std::size_t... Is>
+auto run_branches(executor &ex, const cancellation *token, Calls &calls,
+                  std::integer_sequence<bool, Inline...>, std::index_sequence<Is...>) {
+  std::tuple<branch<typename std::tuple_element<Is, Calls>::type>...> branches{
+      std::get<Is>(calls)...};
+
+  // offload branches left to right, then run the inline ones
+  task_group group(ex, token);
+  ((Inline ? void() : std::get<Is>(branches).start(ex, group)), ...);
+  ((Inline ? std::get<Is>(branches).run(group) : void()), ...);
+
+  // join every branch before an exception can unwind what they refer to
+  group.wait();
+  return std::make_tuple(std::get<Is>(branches).get()...);
+}
+
+// Runs every function in `fns` on the same `args`, in parallel on `ex`.
+// Waits for all of them and returns their results as a tuple.
+template <typename Fns, typename ArgsTuple, std::size_t... Is>
+auto fork(executor &ex, const cancellation *token, Fns &fns, const ArgsTuple &args,
+          std::index_sequence<Is...>) {
+  auto calls = std::make_tuple([&fn = std::get<Is>(fns), &args] {
+    auto call = [&] { return std::apply(fn, args); };
+    return invoke_branch(call);
+  }...);
+  return run_branches(
+      ex, token, calls,
+      std::integer_sequence<bool, runs_inline<Is, sizeof...(Is),
+                                              typename std::tuple_element<Is, Fns>::type>...>{},
+      std::index_sequence<Is...>{});
+}
+
+// The results of a fork, moved into a std::vector<R>
+template <typename R, typename Results> std::vector<R> to_vector(Results &&results) {
+  return std::apply(
+      [](auto &&... branch_results) {
+        std::vector<R> vector;
+        vector.reserve(sizeof...(branch_results));
+        (vector.push_back(std::move(branch_results)), ...);
+        return vector;
+      },
+      std::forward<Results>(results));
+}
+
+} // namespace details
+
+template <typename Fn, typename... Fns>
+class fork_into : public details::parallel_stage<fork_into<Fn, Fns...>> {
+  std::tuple<Fn, Fns...> fns_;
+
+public:
+  fork_into(Fn first, Fns... fns) : fns_(std::move(first), std::move(fns)...) {}
+
+  template <typename... Args> decltype(auto) operator()(Args &&... args) {
+    typedef typename std::result_of<Fn(const typename std::decay<Args>::type &...)>::type
+        result_type;
+
+    // Every branch reads the same, immutable arguments
+    const auto args_tuple = std::forward_as_tuple(std::as_const(args)...);
+    auto results = details::fork(this->get_executor(), this->cancellation_, fns_, args_tuple,
+                                 std::index_sequence_for<Fn, Fns...>{});
+
+    if constexpr (!std::is_same<result_type, void>::value) {
+      return details::to_vector<result_type>(std::move(results));
+    }
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) const & {
+    return pipe_pair<fork_into<Fn, Fns...>, typename std::decay<T3>::type>(*this,
+                                                                           std::forward<T3>(rhs));
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) && {
+    return pipe_pair<fork_into<Fn, Fns...>, typename std::decay<T3>::type>(std::move(*this),
+                                                                           std::forward<T3>(rhs));
+  }
+};
+
+} // namespace pipeline
+
+#pragma once
+// #include <pipeline/details.hpp>
+// #include <pipeline/fork_into.hpp>
+// #include <pipeline/parallel_stage.hpp>
+// #include <pipeline/thread_pool.hpp>
+#include <tuple>
+#include <utility>
+
+namespace pipeline {
+
+// Like fork_into, but returns std::tuple<R1, R2, ...> holding the result
+// of each branch with its own type, so the branches don't need to agree
+// on a common result type (or a std::variant). Branches returning void
+// contribute a std::monostate.
+template <typename Fn, typename... Fns>
+class fork_into_tuple : public details::parallel_stage<fork_into_tuple<Fn, Fns...>> {
+  std::tuple<Fn, Fns...> fns_;
+
+public:
+  fork_into_tuple(Fn first, Fns... fns) : fns_(std::move(first), std::move(fns)...) {}
+
+  template <typename... Args> auto operator()(Args &&... args) {
+    // Every branch reads the same, immutable arguments
+    const auto args_tuple = std::forward_as_tuple(std::as_const(args)...);
+    return details::fork(this->get_executor(), this->cancellation_, fns_, args_tuple,
+                         std::index_sequence_for<Fn, Fns...>{});
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) const & {
+    return pipe_pair<fork_into_tuple<Fn, Fns...>, typename std::decay<T3>::type>(
+        *this, std::forward<T3>(rhs));
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) && {
+    return pipe_pair<fork_into_tuple<Fn, Fns...>, typename std::decay<T3>::type>(
+        std::move(*this), std::forward<T3>(rhs));
+  }
+};
+
+} // namespace pipeline
+
+#pragma once
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+// #include <pipeline/cancellation.hpp>
+// #include <pipeline/details.hpp>
+// #include <pipeline/fork_into.hpp>
+// #include <pipeline/parallel_stage.hpp>
+// #include <pipeline/thread_pool.hpp>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace pipeline {
+
+namespace details {
+
+// What a timed fork shares with its branches. Branches that miss the
+// deadline keep running after the call has returned, so unlike a plain
+// fork this lives on the heap and owns copies of the functions and the
+// arguments. For the same reason `stop` has no parent: the enclosing
+// call's stop flag may be gone by the time a straggler checks it. The
+// caller passes a stop of the enclosing call on to `stop` instead. `stop`
+// fires at the deadline by itself.
+template <typename Fns, typename Args, typename R, std::size_t N> struct timed_fork_state {
+  Fns fns;
+  Args args;
+  cancellation deadline;
+  stop_flag stop{nullptr, &deadline};
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::size_t pending{N};
+  std::array<std::optional<R>, N> results;
+  std::exception_ptr error;
+
+  timed_fork_state(const Fns &fns, Args args, std::chrono::steady_clock::time_point deadline)
+      : fns(fns), args(std::move(args)), deadline(deadline) {}
+
+  template <std::size_t I> void run() {
+    if (!stop.requested()) {
+      stop_scope scope(stop);
+      try {
+        auto call = [this] { return std::apply(std::get<I>(fns), std::as_const(args)); };
+        auto value = invoke_branch(call);
+        std::lock_guard<std::mutex> lock(mutex);
+        std::get<I>(results).emplace(std::move(value));
+      } catch (...) {
+        // past the deadline, an exception is the branch giving up
+        if (!stop.requested()) {
+          fail(std::current_exception());
+        }
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    --pending;
+    cv.notify_all();
+  }
+
+  void fail(std::exception_ptr e) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!error) {
+      error = std::move(e);
+    }
+  }
+};
+
+} // namespace details
+
+// Like fork_into, but waits at most `timeout` for the branches. Returns a
+// std::vector with a std::optional per branch, empty for the branches
+// that didn't finish in time (std::monostate for branches returning void).
+// If a branch throws before the deadline, the exception is rethrown.
+//
+// Branches still running at the deadline see stop_requested() and their
+// results are dropped; branches that haven't started are skipped. Each
+// call works on its own copies of the functions and the arguments, so it
+// doesn't wait for them. Every branch but the cheap ones runs on the
+// executor, and a cheap branch only starts before the deadline. The
+// caller runs no other tasks while it waits, so it returns at the
+// deadline; nested in a stage on the same pool, it keeps its worker until
+// then, so when such calls can fill the pool, run the branches on a pool
+// of their own with on(). If the call is cancelled, or the enclosing call
+// or stream stops, the branches are stopped too and the call throws
+// operation_cancelled, unless every branch was done.
+template <typename Fn, typename... Fns>
+class fork_into_within : public details::parallel_stage<fork_into_within<Fn, Fns...>> {
+  std::tuple<Fn, Fns...> fns_;
+  std::chrono::steady_clock::duration timeout_;
+
+  // How often a waiting caller checks whether it was cancelled
+  static constexpr std::chrono::microseconds poll_interval{100};
+
+  template <std::size_t I>
+  static constexpr bool is_cheap =
+      details::is_specialization<typename std::tuple_element<I, std::tuple<Fn, Fns...>>::type,
+                                 cheap>::value;
+
+  template <typename State, typename Expired, std::size_t... Is>
+  void start(executor &ex, const std::shared_ptr<State> &state, Expired &expired,
+             std::index_sequence<Is...>) {
+    // offload branches left to right, then run the cheap ones
+    (offload<Is>(ex, state), ...);
+    ((is_cheap<Is> ? run_cheap<Is>(*state, expired) : void()), ...);
+  }
+
+  template <std::size_t I, typename State, typename Expired>
+  static void run_cheap(State &state, Expired &expired) {
+    if (expired()) {
+      state.stop.request_stop(); // run() skips the branch
+    }
+    state.template run<I>();
+  }
+
+  template <std::size_t I, typename State>
+  void offload(executor &ex, const std::shared_ptr<State> &state) {
+    if constexpr (!is_cheap<I>) {
+      try {
+        ex.execute([state] { state->template run<I>(); });
+      } catch (...) {
+        // the executor refused the task
+        state->fail(std::current_exception());
+        std::lock_guard<std::mutex> lock(state->mutex);
+        --state->pending;
+      }
+    }
+  }
+
+public:
+  fork_into_within(std::chrono::steady_clock::duration timeout, Fn first, Fns... fns)
+      : fns_(std::move(first), std::move(fns)...), timeout_(timeout) {}
+
+  template <typename... Args> auto operator()(Args &&... args) {
+    typedef typename std::invoke_result<Fn &, const typename std::decay<Args>::type &...>::type
+        result_type;
+    typedef typename details::branch_result<result_type>::type value_type;
+    typedef details::timed_fork_state<std::tuple<Fn, Fns...>,
+                                      std::tuple<typename std::decay<Args>::type...>, value_type,
+                                      sizeof...(Fns) + 1>
+        state_type;
+
+    auto &ex = this->get_executor();
+    const details::stop_flag parent(details::current_stop(), this->cancellation_);
+    const auto deadline = std::chrono::steady_clock::now() + timeout_;
+    auto expired = [&parent, deadline] {
+      return std::chrono::steady_clock::now() >= deadline || parent.requested();
+    };
+    auto state = std::make_shared<state_type>(
+        fns_, std::tuple<typename std::decay<Args>::type...>(std::forward<Args>(args)...),
+        deadline);
+    start(ex, state, expired, std::index_sequence_for<Fn, Fns...>{});
+
+    auto finished = [&state] { return state->pending == 0 || state->error; };
+    std::unique_lock<std::mutex> lock(state->mutex);
+    while (!finished() && !expired()) {
+      state->cv.wait_until(
+          lock, std::min(deadline, std::chrono::steady_clock::now() + poll_interval), finished);
+    }
+    // stragglers give up
+    state->stop.request_stop();
+    if (state->error) {
+      std::rethrow_exception(state->error);
+    }
+    if (state->pending > 0 && parent.requested()) {
+      throw operation_cancelled();
+    }
+    std::vector<std::optional<value_type>> results;
+    results.reserve(sizeof...(Fns) + 1);
+    for (auto &result : state->results) {
+      results.push_back(std::move(result));
+    }
+    return results;
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) const & {
+    return pipe_pair<fork_into_within<Fn, Fns...>, typename std::decay<T3>::type>(
+        *this, std::forward<T3>(rhs));
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) && {
+    return pipe_pair<fork_into_within<Fn, Fns...>, typename std::decay<T3>::type>(
+        std::move(*this), std::forward<T3>(rhs));
+  }
+};
+
+} // namespace pipeline
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+// #include <pipeline/details.hpp>
+// #include <pipeline/fn.hpp>
+// #include <pipeline/parallel_for.hpp>
+// #include <pipeline/parallel_stage.hpp>
+// #include <pipeline/spsc_queue.hpp>
+// #include <pipeline/thread_pool.hpp>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+namespace pipeline {
+
+namespace details {
+
+// Streaming state of for_each: calls fn on each item on an executor, with
+// at most `window` items in flight. Ordered, results leave in input order
+// through a reorder buffer of `window` slots. Unordered, they leave as soon
+// as they are done, so one slow item doesn't hold back the ones after it.
+// Once an item fails, or the stream stops, the items still queued are
+// skipped and the first exception is rethrown.
+template <typename Fn, typename In> class parallel_map_state {
+  typedef typename std::invoke_result<Fn &, In>::type result_type;
+  static constexpr bool returns_void = std::is_same<result_type, void>::value;
+  typedef typename std::conditional<returns_void, std::monostate,
+                                    typename std::decay<result_type>::type>::type value_type;
+
+  // How often a stage with items in flight checks for finished ones while
+  // no new input arrives
+  static constexpr std::chrono::microseconds poll_interval{100};
+
+  struct slot {
+    std::optional<In> input;
+    std::optional<value_type> value;
+    bool failed{false}; // or skipped
+    std::atomic<bool> done{false};
+  };
+
+  Fn &fn_;
+  executor &executor_;
+  const cancellation *token_;
+  stop_flag stop_;
+  std::mutex error_mutex_;
+  std::exception_ptr error_;
+  bool ordered_;
+  std::size_t window_;
+  std::unique_ptr<slot[]> slots_;
+  std::size_t submitted_{0}; // ordered: sequence number of the next item
+  std::size_t emitted_{0};   // ordered: sequence number of the next result
+  std::vector<std::size_t> free_; // unordered: free slots
+  std::size_t in_flight_{0};
+  std::atomic<std::size_t> running_{0};
+
+  void run(std::size_t index) {
+    auto &s = slots_[index];
+    if (stop_.requested()) {
+      s.failed = true;
+    } else {
+      stop_scope scope(stop_);
+      try {
+        auto fn = fn_;
+        if constexpr (returns_void) {
+          fn(std::move(*s.input));
+          s.value.emplace();
+        } else {
+          s.value.emplace(fn(std::move(*s.input)));
+        }
+      } catch (...) {
+        s.failed = true;
+        stop_.request_stop();
+        std::lock_guard<std::mutex> lock(error_mutex_);
+        if (!error_) {
+          error_ = std::current_exception();
+        }
+      }
+    }
+    s.input.reset();
+    s.done.store(true, std::memory_order_release);
+    running_.fetch_sub(1, std::memory_order_release);
+  }
+
+  void wait_all() {
+    backoff wait;
+    while (running_.load(std::memory_order_acquire) > 0) {
+      wait();
+    }
+  }
+
+  template <typename Emit> void deliver(std::size_t index, Emit &emit) {
+    auto &s = slots_[index];
+    s.done.store(false, std::memory_order_relaxed);
+    --in_flight_;
+    if (s.failed) {
+      // nothing may still refer to this state once the error unwinds it
+      wait_all();
+      std::lock_guard<std::mutex> lock(error_mutex_);
+      if (error_) {
+        std::rethrow_exception(error_);
+      }
+      throw operation_cancelled();
+    }
+    if constexpr (!returns_void) {
+      emit(std::move(*s.value));
+    }
+    s.value.reset();
+  }
+
+  // Emits the results that are ready; returns whether there were any
+  template <typename Emit> bool drain(Emit &emit) {
+    bool any = false;
+    if (ordered_) {
+      while (in_flight_ > 0 && slots_[emitted_ % window_].done.load(std::memory_order_acquire)) {
+        deliver(emitted_++ % window_, emit);
+        any = true;
+      }
+    } else {
+      for (std::size_t i = 0; i < window_ && in_flight_ > 0; ++i) {
+        if (slots_[i].done.load(std::memory_order_acquire)) {
+          deliver(i, emit);
+          free_.push_back(i);
+          any = true;
+        }
+      }
+    }
+    return any;
+  }
+
+public:
+  typedef typename std::conditional<returns_void, void, value_type>::type output_type;
+
+  parallel_map_state(Fn &fn, executor &ex, const cancellation *token, bool ordered,
+                     std::size_t window)
+      : fn_(fn), executor_(ex), token_(token), stop_(current_stop(), token), ordered_(ordered),
+        window_(std::max<std::size_t>(window, 1)), slots_(std::make_unique<slot[]>(window_)) {
+    if (!ordered_) {
+      for (std::size_t i = window_; i > 0; --i) {
+        free_.push_back(i - 1);
+      }
+    }
+  }
+
+  parallel_map_state(parallel_map_state &&other)
+      : parallel_map_state(other.fn_, other.executor_, other.token_, other.ordered_,
+                           other.window_) {}
+
+  ~parallel_map_state() { wait_all(); }
+
+  template <typename Emit> void process(In &&item, Emit &emit) {
+    backoff wait;
+    while (in_flight_ == window_) {
+      if (!drain(emit)) {
+        wait();
+      }
+    }
+
+    std::size_t index;
+    if (ordered_) {
+      index = submitted_++ % window_;
+    } else {
+      index = free_.back();
+      free_.pop_back();
+    }
+    slots_[index].input.emplace(std::move(item));
+    ++in_flight_;
+    running_.fetch_add(1, std::memory_order_relaxed);
+    executor_.execute([this, index] { run(index); });
+
+    drain(emit);
+  }
+
+  template <typename Emit> void flush(Emit &emit) { drain(emit); }
+
+  // Input has ended: wait for the items in flight
+  template <typename Emit> void finish(Emit &emit) {
+    backoff wait;
+    while (in_flight_ > 0) {
+      if (!drain(emit)) {
+        wait();
+      }
+    }
+  }
+
+  std::chrono::steady_clock::time_point deadline() const {
+    return in_flight_ > 0 ? std::chrono::steady_clock::now() + poll_interval
+                          : std::chrono::steady_clock::time_point::max();
+  }
+};
+
+} // namespace details
+
+// Calls fn on every element of a container, in chunks on an executor.
+// Each chunk (and, in a stream, each item) works on its own copy of fn,
+// so a stateful or mutable function object is never called from two
+// threads at once.
+//
+// Pmr: results are a std::pmr::vector allocated from a memory resource,
+// see allocate_from()
+template <typename Fn, bool Pmr = false>
+class for_each : public details::chunked_stage<for_each<Fn, Pmr>> {
+  template <typename, bool> friend class for_each;
+  template <typename, typename> friend class filter;
+
+  Fn fn_;
+  std::pmr::memory_resource *resource_{nullptr};
+  bool ordered_{true};
+  std::size_t window_{0};
+
+  template <typename T> auto allocator() const {
+    if constexpr (Pmr) {
+      return std::pmr::polymorphic_allocator<T>(resource_);
+    } else {
+      return std::allocator<T>();
+    }
+  }
+
+public:
+  for_each(Fn fn) : fn_(std::move(fn)) {}
+
+  // In a stream, for_each calls the function on each item, several items at
+  // once on the executor, with at most `window` items in flight (0, the
+  // default, is twice the executor's concurrency). ordered() - the default -
+  // emits results in input order, holding back finished results behind a
+  // slower one; unordered() emits them as soon as they are done.
+  for_each &ordered(std::size_t window = 0) & {
+    ordered_ = true;
+    window_ = window;
+    return *this;
+  }
+
+  for_each &&ordered(std::size_t window = 0) && {
+    ordered_ = true;
+    window_ = window;
+    return std::move(*this);
+  }
+
+  for_each &unordered(std::size_t window = 0) & {
+    ordered_ = false;
+    window_ = window;
+    return *this;
+  }
+
+  for_each &&unordered(std::size_t window = 0) && {
+    ordered_ = false;
+    window_ = window;
+    return std::move(*this);
+  }
+
+  // Allocate results from `resource` and return them as a std::pmr::vector.
+  // With a pooling resource (e.g., std::pmr::unsynchronized_pool_resource)
+  // a pipeline called over and over reuses the same memory instead of
+  // going to the heap each time.
+  for_each<Fn, true> allocate_from(std::pmr::memory_resource &resource) const & {
+    return for_each(*this).allocate_from(resource);
+  }
+
+  for_each<Fn, true> allocate_from(std::pmr::memory_resource &resource) && {
+    for_each<Fn, true> result(std::move(fn_));
+    result.adopt_settings(*this);
+    result.resource_ = &resource;
+    result.ordered_ = ordered_;
+    result.window_ = window_;
+    return result;
+  }
+
+  template <typename Container> decltype(auto) operator()(Container &&args) {
+    typedef typename std::result_of<Fn(typename std::decay<Container>::type::value_type &)>::type result_type;
+
+    auto &ex = this->get_executor();
+    const details::loop_range<decltype(std::begin(args))> input(std::begin(args), std::end(args));
+    const auto size = input.size();
+    const auto grain = this->grain(size, ex);
+
+    if constexpr (std::is_same<result_type, void>::value) {
+      // result type is void
+      details::parallel_for(ex, input, grain,
+                            [this](auto it, std::size_t begin, std::size_t end) {
+                              auto fn = fn_;
+                              for (; begin != end; ++begin, ++it) {
+                                fn(*it);
+                              }
+                            },
+                            this->cancellation_);
+    } else {
+      // result is not void - each chunk writes its results in place
+      details::map_output<result_type, decltype(allocator<result_type>())> output(
+          size, allocator<result_type>());
+      details::parallel_for(ex, input, grain,
+                            [this, &output](auto it, std::size_t begin, std::size_t end) {
+                              auto fn = fn_;
+                              for (; begin != end; ++begin, ++it) {
+                                output.set(begin, fn(*it));
+                              }
+                            },
+                            this->cancellation_);
+      return output.take();
+    }
+  }
+
+  // Streams of items the function takes one at a time (rather than streams
+  // of containers) run through a parallel_map_state
+  template <typename In, typename = std::enable_if_t<std::is_invocable<Fn &, In>::value>>
+  auto stream_state() {
+    auto &ex = this->get_executor();
+    return details::parallel_map_state<Fn, In>(fn_, ex, this->cancellation_, ordered_,
+                                               window_ ? window_ : 2 * ex.concurrency());
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) const & {
+    return pipe_pair<for_each<Fn, Pmr>, typename std::decay<T3>::type>(*this,
+                                                                       std::forward<T3>(rhs));
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) && {
+    return pipe_pair<for_each<Fn, Pmr>, typename std::decay<T3>::type>(std::move(*this),
+                                                                       std::forward<T3>(rhs));
+  }
+};
+
+} // namespace pipeline
+
+#pragma once
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <numeric>
+// #include <pipeline/details.hpp>
+// #include <pipeline/fn.hpp>
+// #include <pipeline/for_each.hpp>
+// #include <pipeline/parallel_for.hpp>
+// #include <pipeline/parallel_stage.hpp>
+// #include <pipeline/thread_pool.hpp>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace pipeline {
+
+namespace details {
+
+// filter on its own: survivors are copied as they are
+struct keep {};
+
+template <typename Pred, typename Fn>
+struct fuses_with_filter<filter<Pred, keep>, pipeline::for_each<Fn, false>> : std::true_type {};
+
+} // namespace details
+
+// Keeps the elements of a container for which pred(element) is true, in
+// order, evaluating pred in parallel chunks. A first pass records which
+// elements pass and counts them per chunk; a prefix sum over the counts
+// gives each chunk its offset into a result of exactly the right size,
+// which the second pass fills in parallel. Elements of a non-const
+// container rvalue are moved rather than copied. Each chunk calls its own
+// copies of pred and fn. Elements are read once each: when reading one
+// makes a new value (a lazy map calls its function), each chunk keeps its
+// survivors until the second pass moves them into the result.
+//
+// filter(pred) | for_each(fn) fuses into one stage that calls fn on the
+// survivors only and writes its results straight into the output, so
+// neither rejected elements nor the survivors themselves are ever copied.
+// With a void fn it is a single pass: fn is called right after pred.
+template <typename Pred, typename Fn = details::keep>
+class filter : public details::chunked_stage<filter<Pred, Fn>> {
+  template <typename, typename> friend class filter;
+
+  Pred pred_;
+  Fn fn_;
+
+  static constexpr bool keeps = std::is_same<Fn, details::keep>::value;
+
+public:
+  filter(Pred pred, Fn fn = {}) : pred_(std::move(pred)), fn_(std::move(fn)) {}
+
+  template <typename Container> auto operator()(Container &&args) {
+    typedef typename std::decay<Container>::type::value_type value_type;
+    typedef typename std::conditional<keeps, std::decay<value_type>,
+                                      std::invoke_result<Fn &, value_type &>>::type::type
+        fn_result_type;
+    typedef typename std::conditional<std::is_same<fn_result_type, void>::value, void,
+                                      typename std::decay<fn_result_type>::type>::type
+        result_type;
+    constexpr bool moves = keeps && std::is_rvalue_reference<Container &&>::value &&
+                           !std::is_const<typename std::remove_reference<Container>::type>::value;
+    // *it makes a new element on every call (a lazy map calls its function
+    // again), so such elements are read once and kept until they're placed
+    constexpr bool buffers = !std::is_reference<decltype(*std::begin(args))>::value;
+
+    auto &ex = this->get_executor();
+    const details::loop_range<decltype(std::begin(args))> input(std::begin(args), std::end(args));
+    const auto size = input.size();
+    const auto grain = input.grain(this->grain(size, ex));
+
+    if constexpr (std::is_same<result_type, void>::value) {
+      details::parallel_for(ex, input, grain,
+                            [this](auto it, std::size_t begin, std::size_t end) {
+                              auto pred = pred_;
+                              auto fn = fn_;
+                              for (; begin != end; ++begin, ++it) {
+                                auto &&element = *it;
+                                if (pred(element)) {
+                                  fn(element);
+                                }
+                              }
+                            },
+                            this->cancellation_);
+    } else if constexpr (buffers) {
+      // survivors, or fn of them, per chunk
+      std::vector<std::vector<result_type>> survivors((size + grain - 1) / grain);
+      std::vector<std::size_t> offsets(survivors.size() + 1);
+      details::parallel_for(ex, input, grain,
+                            [this, &survivors, &offsets, grain](auto it, std::size_t begin,
+                                                                std::size_t end) {
+                              auto pred = pred_;
+                              auto fn = fn_;
+                              const auto chunk = begin / grain;
+                              auto &kept = survivors[chunk];
+                              for (; begin != end; ++begin, ++it) {
+                                auto &&element = *it;
+                                if (!pred(element)) {
+                                  continue;
+                                }
+                                if constexpr (keeps) {
+                                  kept.push_back(std::move(element));
+                                } else {
+                                  kept.push_back(fn(element));
+                                }
+                              }
+                              offsets[chunk + 1] = kept.size();
+                            },
+                            this->cancellation_);
+      std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+      details::map_output<result_type, std::allocator<result_type>> output(
+          offsets.back(), std::allocator<result_type>());
+      details::parallel_for(ex, input, grain,
+                            [&survivors, &offsets, &output, grain](auto, std::size_t begin,
+                                                                   std::size_t) {
+                              auto offset = offsets[begin / grain];
+                              for (auto &&value : survivors[begin / grain]) {
+                                output.set(offset++, std::move(value));
+                              }
+                            },
+                            this->cancellation_);
+      return output.take();
+    } else {
+      // which elements pass, and how many per chunk
+      std::unique_ptr<bool[]> passed(new bool[size]);
+      std::vector<std::size_t> offsets((size + grain - 1) / grain + 1);
+      details::parallel_for(ex, input, grain,
+                            [this, &passed, &offsets, grain](auto it, std::size_t begin,
+                                                             std::size_t end) {
+                              auto pred = pred_;
+                              std::size_t count = 0;
+                              for (auto i = begin; i != end; ++i, ++it) {
+                                passed[i] = static_cast<bool>(pred(*it));
+                                count += passed[i];
+                              }
+                              offsets[begin / grain + 1] = count;
+                            },
+                            this->cancellation_);
+      // offsets[c] is where the survivors of chunk c go
+      std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+      details::map_output<result_type, std::allocator<result_type>> output(
+          offsets.back(), std::allocator<result_type>());
+      details::parallel_for(ex, input, grain,
+                            [this, &passed, &offsets, &output, grain](
+                                auto it, std::size_t begin, std::size_t end) {
+                              auto offset = offsets[begin / grain];
+                              auto fn = fn_;
+                              for (; begin != end; ++begin, ++it) {
+                                if (!passed[begin]) {
+                                  continue;
+                                }
+                                if constexpr (moves) {
+                                  output.set(offset++, std::move(*it));
+                                } else if constexpr (keeps) {
+                                  output.set(offset++, *it);
+                                } else {
+                                  output.set(offset++, fn(*it));
+                                }
+                              }
+                            },
+                            this->cancellation_);
+      return output.take();
+    }
+  }
+
+  // filter(pred) | for_each(fn) fuses into a single stage, see above. The
+  // fused stage runs on the for_each's executor and grain size, if set.
+  template <typename T3> auto operator|(T3 &&rhs) const & {
+    return filter(*this) | std::forward<T3>(rhs);
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) && {
+    if constexpr (details::fuses_with_filter<filter, typename std::decay<T3>::type>::value) {
+      auto fn = std::forward<T3>(rhs).fn_;
+      filter<Pred, decltype(fn)> fused(std::move(pred_), std::move(fn));
+      fused.adopt_settings(*this);
+      fused.adopt_settings(rhs);
+      return fused;
+    } else {
+      return pipe_pair<filter<Pred, Fn>, typename std::decay<T3>::type>(std::move(*this),
+                                                                         std::forward<T3>(rhs));
+    }
+  }
+};
+
+} // namespace pipeline
+
+#pragma once
+#include <array>
+#include <iterator>
+#include <memory>
+// #include <pipeline/details.hpp>
+// #include <pipeline/parallel_for.hpp>
+// #include <pipeline/parallel_stage.hpp>
+// #include <pipeline/thread_pool.hpp>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+namespace pipeline {
+
+// Data-parallel unzip_into for struct-of-arrays inputs: takes a tuple of
+// columns (ranges) and calls the I-th function on every element of the
+// I-th column - or the only function on every element of every column.
+//
+// Each column is split into contiguous chunks and the chunks of all the
+// columns are spread over the executor at once, so a task stays within
+// one column and large columns don't end up as one task each. Returns a
+// std::tuple with a std::vector of results per column (std::monostate for
+// a column whose function returns void), or nothing if every function
+// returns void. Build one with unzip_into(...).for_each().
+template <typename Fn, typename... Fns>
+class unzip_for_each : public details::chunked_stage<unzip_for_each<Fn, Fns...>> {
+  std::tuple<Fn, Fns...> fns_;
+
+  template <std::size_t I>
+  using function_type =
+      typename std::tuple_element<sizeof...(Fns) == 0 ? 0 : I, std::tuple<Fn, Fns...>>::type;
+
+  template <std::size_t I> function_type<I> &function() {
+    return std::get<sizeof...(Fns) == 0 ? 0 : I>(fns_);
+  }
+
+  template <std::size_t I, typename Tuple>
+  using column_iterator = decltype(std::begin(std::get<I>(std::declval<Tuple &>())));
+
+  template <std::size_t I, typename Tuple>
+  using column_result =
+      typename std::invoke_result<function_type<I> &,
+                                  decltype(*std::declval<column_iterator<I, Tuple>>())>::type;
+
+  // Where the results of column I go; nothing for a void column
+  template <std::size_t I, typename Tuple> auto make_output(std::size_t size) {
+    typedef column_result<I, Tuple> result_type;
+    if constexpr (std::is_same<result_type, void>::value) {
+      return std::monostate{};
+    } else {
+      return details::map_output<result_type, std::allocator<result_type>>(
+          size, std::allocator<result_type>());
+    }
+  }
+
+  template <typename Output> static auto take(Output &output) {
+    if constexpr (std::is_same<Output, std::monostate>::value) {
+      return std::monostate{};
+    } else {
+      return output.take();
+    }
+  }
+
+  template <typename Tuple, std::size_t... Is>
+  decltype(auto) run(Tuple &columns, std::index_sequence<Is...>) {
+    auto &ex = this->get_executor();
+
+    const std::tuple<details::loop_range<column_iterator<Is, Tuple>>...> inputs{
+        {std::begin(std::get<Is>(columns)), std::end(std::get<Is>(columns))}...};
+    const std::array<std::size_t, sizeof...(Is)> sizes{std::get<Is>(inputs).size()...};
+    std::size_t total = 0;
+    for (auto size : sizes) {
+      total += size;
+    }
+    // grain sizes apply to each column, picked from the total size
+    const auto grain = this->grain(total, ex);
+
+    auto outputs = std::make_tuple(make_output<Is, Tuple>(sizes[Is])...);
+    auto bodies = std::make_tuple([&fn = function<Is>(), &output = std::get<Is>(outputs)](
+                                      auto it, std::size_t begin, std::size_t end) {
+      // a copy per chunk, so that no function object is shared by two threads
+      auto f = fn;
+      for (; begin != end; ++begin, ++it) {
+        if constexpr (std::is_same<column_result<Is, Tuple>, void>::value) {
+          f(*it);
+        } else {
+          output.set(begin, f(*it));
+        }
+      }
+    }...);
+
+    // one latch for every chunk of every column
+    details::task_group group(ex, this->cancellation_);
+    std::tuple<details::chunk_loop<column_iterator<Is, Tuple>,
+                                   typename std::tuple_element<Is, decltype(bodies)>::type>...>
+        loops{{group, std::get<Is>(inputs), grain, std::get<Is>(bodies)}...};
+    (std::get<Is>(loops).offload(ex), ...);
+    (std::get<Is>(loops).run_last(), ...);
+    group.wait();
+
+    if constexpr (!(std::is_same<column_result<Is, Tuple>, void>::value && ...)) {
+      return std::make_tuple(take(std::get<Is>(outputs))...);
+    }
+  }
+
+public:
+  unzip_for_each(Fn first, Fns... fns) : fns_(std::move(first), std::move(fns)...) {}
+
+  template <typename Tuple> decltype(auto) operator()(Tuple &&columns) {
+    constexpr auto tuple_size = std::tuple_size<typename std::decay<Tuple>::type>::value;
+    static_assert(sizeof...(Fns) == 0 || sizeof...(Fns) + 1 == tuple_size,
+                  "unzip_into needs one function per tuple element, or a single function");
+
+    return run(columns, std::make_index_sequence<tuple_size>{});
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) const & {
+    return pipe_pair<unzip_for_each<Fn, Fns...>, typename std::decay<T3>::type>(
+        *this, std::forward<T3>(rhs));
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) && {
+    return pipe_pair<unzip_for_each<Fn, Fns...>, typename std::decay<T3>::type>(
+        std::move(*this), std::forward<T3>(rhs));
+  }
+};
+
+} // namespace pipeline
+
+#pragma once
+#include <functional>
+#include <future>
+// #include <pipeline/details.hpp>
+// #include <pipeline/fn.hpp>
+// #include <pipeline/fork_into.hpp>
+// #include <pipeline/parallel_stage.hpp>
+// #include <pipeline/thread_pool.hpp>
+// #include <pipeline/unzip_for_each.hpp>
+#include <thread>
+
+namespace pipeline {
+
+template <typename Fn, typename... Fns>
+class unzip_into : public details::parallel_stage<unzip_into<Fn, Fns...>> {
+  std::tuple<Fn, Fns...> fns_;
+
+  // The function that handles element I of the input tuple: the I-th
+  // function, or the only one if a single function was given
+  template <std::size_t I> auto &function() {
+    if constexpr (sizeof...(Fns) == 0) {
+      return std::get<0>(fns_);
+    } else {
+      return std::get<I>(fns_);
+    }
+  }
+
+  // The functions of the branches: with a single function, a copy per
+  // branch, since the branches run at the same time
+  template <std::size_t... Is> auto branch_functions(std::index_sequence<Is...>) {
+    if constexpr (sizeof...(Fns) == 0) {
+      return std::make_tuple((static_cast<void>(Is), std::get<0>(fns_))...);
+    } else {
+      return std::tie(std::get<Is>(fns_)...);
+    }
+  }
+
+  template <typename Tuple, std::size_t... Is>
+  decltype(auto) unzip(Tuple &&tuple, std::index_sequence<Is...>) {
+    auto functions = branch_functions(std::index_sequence<Is...>{});
+    // Each element goes to exactly one branch, so it is handed over as is:
+    // moved out of an rvalue tuple, passed by reference otherwise
+    auto calls = std::make_tuple([&fn = std::get<Is>(functions), &tuple] {
+      auto call = [&]() -> decltype(auto) { return fn(std::get<Is>(std::forward<Tuple>(tuple))); };
+      return details::invoke_branch(call);
+    }...);
+
+    auto results = details::run_branches(
+        this->get_executor(), this->cancellation_, calls,
+        std::integer_sequence<bool,
+                              details::runs_inline<Is, sizeof...(Is),
+                                                   typename std::decay<decltype(
+                                                       function<Is>())>::type>...>{},
+        std::index_sequence<Is...>{});
+
+    typedef typename std::invoke_result<decltype(function<0>()),
+                                        decltype(std::get<0>(std::forward<Tuple>(tuple)))>::type
+        result_type;
+    if constexpr (!std::is_same<result_type, void>::value) {
+      return details::to_vector<typename std::decay<result_type>::type>(std::move(results));
+    }
+  }
+
+public:
+  unzip_into(Fn first, Fns... fns) : fns_(std::move(first), std::move(fns)...) {}
+
+  // Data-parallel mode for tuples of columns: call the functions on every
+  // element of their column instead of on the column, see unzip_for_each
+  unzip_for_each<Fn, Fns...> for_each() const & { return unzip_into(*this).for_each(); }
+
+  unzip_for_each<Fn, Fns...> for_each() && {
+    auto result = std::make_from_tuple<unzip_for_each<Fn, Fns...>>(std::move(fns_));
+    if (this->executor_) {
+      result.on(*this->executor_);
+    }
+    if (this->cancellation_) {
+      result.cancel_on(*this->cancellation_);
+    }
+    return result;
+  }
+
+  template <typename Tuple> decltype(auto) operator()(Tuple &&tuple) {
+    // We have a tuple of functions to run in parallel - fns_
+    // We have a tuple of args to UNZIP
+    // and then pass to each function - tuple_element
+    //
+    // Let's say the input args were (arg1, arg2, arg3, ...)
+    // And we have functions (fn1, fn2, fn3, ...)
+    //
+    // This runs the fork:
+    // fork(fn1(arg1), fn2(arg2), fn3(arg3), ...)
+    //
+    // With a single function `fn`, the same function handles every arg:
+    // fork(fn(arg1), fn(arg2), fn(arg3), ...)
+    // Useful if each arg in the tuple is the same type and we're doing the same operation
+    //
+    // The branches call the stored functions directly; no fork_into or
+    // bound copies of the functions are built per call
+
+    constexpr auto tuple_size = std::tuple_size<typename std::decay<Tuple>::type>::value;
+    static_assert(sizeof...(Fns) == 0 || sizeof...(Fns) + 1 == tuple_size,
+                  "unzip_into needs one function per tuple element, or a single function");
+
+    return unzip(std::forward<Tuple>(tuple), std::make_index_sequence<tuple_size>{});
+  }
+
+  template <typename T3> auto operator|(T3 &&rhs) const & {
+    return pipe_pair<unzip_into<Fn, Fns...>, typename std::decay<T3>::type>(*this,
+                                                                            std::forward<T3>(rhs));
+  }
 
-  template <typename T3> auto operator|(T3 &&rhs) {
-    return pipe_pair<unzip_into<Fns...>, T3>(*this, std::forward<T3>(rhs));
+  template <typename T3> auto operator|(T3 &&rhs) && {
+    return pipe_pair<unzip_into<Fn, Fns...>, typename std::decay<T3>::type>(std::move(*this),
+                                                                            std::forward<T3>(rhs));
   }
 };
 
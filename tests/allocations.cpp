@@ -0,0 +1,84 @@
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <memory_resource>
+#include <new>
+#include <numeric>
+#include <pipeline/pipeline.hpp>
+#include <tuple>
+#include <vector>
+using namespace pipeline;
+
+// Count every heap allocation in the process
+static std::atomic<std::size_t> allocations{0};
+
+void *operator new(std::size_t size) {
+  ++allocations;
+  if (auto p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+static int failures = 0;
+
+// Runs `call` a few times to warm up (the first calls grow the pool's task
+// queues), then fails if any of a thousand more calls allocates
+template <typename Call> static void expect_no_allocations(const char *what, Call call) {
+  for (int i = 0; i < 100; ++i) {
+    call();
+  }
+  const auto before = allocations.load();
+  for (int i = 0; i < 1000; ++i) {
+    call();
+  }
+  const auto count = allocations.load() - before;
+  if (count != 0) {
+    std::cerr << "FAILED: " << what << " allocated " << count << " times\n";
+    ++failures;
+  }
+}
+
+int main() {
+  thread_pool pool(4);
+
+  std::vector<int> input(4096);
+  std::iota(input.begin(), input.end(), 0);
+
+  // for_each into memory from the caller's arena, then a fork over it
+  alignas(std::max_align_t) static std::byte buffer[1 << 16];
+  std::pmr::monotonic_buffer_resource arena(buffer, sizeof buffer);
+  auto square = for_each([](int x) { return x * x; }).on(pool).allocate_from(arena);
+  auto sum = [](const std::pmr::vector<int> &v) { return std::accumulate(v.begin(), v.end(), 0L); };
+  auto first = [](const std::pmr::vector<int> &v) { return v.front(); };
+  auto pipeline = pipe(square, fork_into_tuple(sum, first).on(pool));
+  long total = 0;
+  expect_no_allocations("for_each | fork_into_tuple", [&] {
+    auto [s, f] = pipeline(input);
+    total += s + f;
+    arena.release();
+  });
+
+  // unzip_into hands each column to its branch by reference; branches that
+  // return nothing build no result vector
+  auto increment = [](std::vector<int> &column) {
+    for (auto &x : column) {
+      ++x;
+    }
+  };
+  auto increment_columns = unzip_into(increment).on(pool);
+  auto columns = std::make_tuple(input, input, input);
+  expect_no_allocations("unzip_into", [&] { increment_columns(columns); });
+
+  // a for_each that returns nothing builds no result vector either
+  std::atomic<long> seen{0};
+  auto count = for_each([&seen](int x) { seen.fetch_add(x, std::memory_order_relaxed); }).on(pool);
+  expect_no_allocations("void for_each", [&] { count(input); });
+
+  return failures == 0 ? 0 : 1;
+}
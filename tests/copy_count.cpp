@@ -0,0 +1,71 @@
+#include <cstddef>
+#include <iostream>
+#include <pipeline/pipeline.hpp>
+#include <vector>
+using namespace pipeline;
+
+// A large buffer that counts how often it is copied or moved
+struct buffer {
+  static inline int copies = 0;
+  static inline int moves = 0;
+
+  std::vector<char> data;
+
+  buffer() : data(1 << 20) {}
+  buffer(const buffer &other) : data(other.data) { ++copies; }
+  buffer(buffer &&other) noexcept : data(std::move(other.data)) { ++moves; }
+  buffer &operator=(const buffer &other) {
+    data = other.data;
+    ++copies;
+    return *this;
+  }
+  buffer &operator=(buffer &&other) noexcept {
+    data = std::move(other.data);
+    ++moves;
+    return *this;
+  }
+};
+
+static int failures = 0;
+
+static void expect(bool condition, const char *what) {
+  if (!condition) {
+    std::cerr << "FAILED: " << what << "\n";
+    ++failures;
+  }
+}
+
+// Values are moved, never copied, from stage to stage
+static void pipe_pair_moves() {
+  buffer::copies = buffer::moves = 0;
+  auto make = fn([] { return buffer{}; });
+  auto touch = fn([](buffer b) {
+    b.data[0] = 1;
+    return b;
+  });
+  auto size_of = [](const buffer &b) { return b.data.size(); };
+  auto first_byte = [](const buffer &b) { return std::size_t(b.data[0]); };
+
+  auto results = (make | touch | touch | fork_into(size_of, first_byte))();
+  expect(results[0] == std::size_t(1) << 20, "pipe_pair result");
+  expect(results[1] == 1, "pipe_pair result");
+  expect(buffer::copies == 0, "pipe_pair copies nothing");
+  expect(buffer::moves <= 4, "pipe_pair moves each value at most once per stage");
+}
+
+// fork_into hands the same value to every branch by reference
+static void fork_into_shares() {
+  buffer::copies = buffer::moves = 0;
+  auto size_of = [](const buffer &b) { return b.data.size(); };
+  buffer b;
+  auto results = fork_into(size_of, size_of, size_of)(b);
+  expect(results[2] == std::size_t(1) << 20, "fork_into result");
+  expect(buffer::copies == 0, "fork_into copies nothing");
+  expect(buffer::moves == 0, "fork_into moves nothing");
+}
+
+int main() {
+  pipe_pair_moves();
+  fork_into_shares();
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,137 @@
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <numeric>
+#include <pipeline/pipeline.hpp>
+#include <thread>
+#include <vector>
+using namespace pipeline;
+
+static int failures = 0;
+
+static void expect(bool condition, const char *what) {
+  if (!condition) {
+    std::cerr << "FAILED: " << what << "\n";
+    ++failures;
+  }
+}
+
+static std::vector<int> numbers(std::size_t n) {
+  std::vector<int> result(n);
+  std::iota(result.begin(), result.end(), 0);
+  return result;
+}
+
+static auto multiple_of_3 = [](int a) { return a % 3 == 0; };
+
+// Survivors keep their order, and there are as many as there should be,
+// whatever the grain size
+static void keeps_order() {
+  thread_pool pool(4);
+  const auto input = numbers(1000);
+  std::vector<int> expected;
+  for (auto a : input) {
+    if (multiple_of_3(a)) {
+      expected.push_back(a);
+    }
+  }
+  for (std::size_t grain : {0, 1, 7, 64, 999, 1000, 5000}) {
+    auto kept = filter(multiple_of_3).on(pool).grain_size(grain)(input);
+    expect(kept == expected, "filter loses, adds or reorders elements");
+    auto none = filter([](int) { return false; }).on(pool).grain_size(grain)(input);
+    expect(none.empty(), "filter keeps rejected elements");
+    auto all = filter([](int) { return true; }).on(pool).grain_size(grain)(input);
+    expect(all == input, "filter drops elements");
+  }
+  expect(filter(multiple_of_3)(std::vector<int>()).empty(), "filter of nothing isn't empty");
+}
+
+// filter | for_each calls fn on the survivors only, once each, and returns
+// its results in order
+static void fused_calls_survivors() {
+  thread_pool pool(4);
+  const auto input = numbers(1000);
+  for (std::size_t grain : {0, 1, 64}) {
+    std::atomic<int> calls{0};
+    std::atomic<int> rejected{0};
+    auto stage = (filter(multiple_of_3) | for_each([&](int a) {
+                    ++calls;
+                    rejected += !multiple_of_3(a);
+                    return a / 3;
+                  }))
+                     .on(pool)
+                     .grain_size(grain);
+    const auto result = stage(input);
+    expect(calls == 334 && rejected == 0, "fused filter calls fn on rejected elements");
+    expect(result == numbers(334), "fused filter reorders results");
+
+    calls = 0;
+    rejected = 0;
+    (filter(multiple_of_3) | for_each([&](int a) {
+       ++calls;
+       rejected += !multiple_of_3(a);
+     }))
+        .on(pool)
+        .grain_size(grain)(input);
+    expect(calls == 334 && rejected == 0, "fused void filter calls fn on rejected elements");
+  }
+}
+
+// Elements of a std::vector<bool> are read through proxies, not
+// references
+static void filters_bools() {
+  thread_pool pool(4);
+  std::vector<bool> input;
+  for (int i = 0; i < 100; ++i) {
+    input.push_back(i % 4 == 0);
+  }
+  for (std::size_t grain : {0, 1, 7}) {
+    auto kept = filter([](bool b) { return b; }).on(pool).grain_size(grain)(input);
+    expect(kept == std::vector<bool>(25, true), "filter of bools keeps the wrong elements");
+    auto negated = (filter([](bool b) { return !b; }) | for_each([](bool b) { return !b; }))
+                       .on(pool)
+                       .grain_size(grain)(input);
+    expect(negated == std::vector<bool>(75, true), "fused filter of bools calls fn wrongly");
+  }
+}
+
+// A predicate that notices when one copy of it is called from two threads
+// at once, which a data race checker would report
+struct exclusive_pred {
+  static inline std::atomic<int> overlaps{0};
+
+  std::atomic<int> callers{0};
+
+  exclusive_pred() = default;
+  exclusive_pred(const exclusive_pred &) {}
+
+  bool operator()(int a) {
+    if (callers.fetch_add(1) != 0) {
+      ++overlaps;
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+    callers.fetch_sub(1);
+    return a % 2 == 0;
+  }
+};
+
+// Each chunk calls its own copies of pred and fn
+static void calls_own_copies() {
+  exclusive_pred::overlaps = 0;
+  thread_pool pool(4);
+  const auto input = numbers(400);
+  expect(filter(exclusive_pred()).on(pool).grain_size(8)(input).size() == 200,
+         "filter keeps the wrong elements");
+  std::atomic<int> calls{0};
+  (filter(exclusive_pred()) | for_each([&](int) { ++calls; })).on(pool).grain_size(8)(input);
+  expect(calls == 200, "fused filter calls fn the wrong number of times");
+  expect(exclusive_pred::overlaps == 0, "a predicate is called from two threads at once");
+}
+
+int main() {
+  keeps_order();
+  fused_calls_survivors();
+  filters_bools();
+  calls_own_copies();
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,100 @@
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <pipeline/pipeline.hpp>
+#include <thread>
+#include <vector>
+using namespace pipeline;
+using namespace std::chrono_literals;
+
+static int failures = 0;
+
+static void expect(bool condition, const char *what) {
+  if (!condition) {
+    std::cerr << "FAILED: " << what << "\n";
+    ++failures;
+  }
+}
+
+// A stateful branch that notices when one copy of it is called from two
+// threads at once, which a data race checker would report
+struct exclusive_branch {
+  static inline std::atomic<int> overlaps{0};
+
+  std::atomic<int> callers{0};
+  int calls = 0;
+
+  exclusive_branch() = default;
+  exclusive_branch(const exclusive_branch &other) : calls(other.calls) {}
+
+  int operator()(int a) {
+    if (callers.fetch_add(1) != 0) {
+      ++overlaps;
+    }
+    ++calls;
+    std::this_thread::sleep_for(200us);
+    callers.fetch_sub(1);
+    return a;
+  }
+};
+
+// Each call, and each branch still running from an earlier call, has its
+// own copy of the functions
+static void calls_own_copies() {
+  exclusive_branch::overlaps = 0;
+  thread_pool pool(4);
+  std::vector<int> input(64, 1);
+  auto stage =
+      for_each(fork_into_within(20ms, exclusive_branch(), exclusive_branch()).on(pool)).on(pool);
+  stage(input);
+  stage(input);
+  expect(exclusive_branch::overlaps == 0, "a branch function is called from two threads at once");
+}
+
+// A call returns at its deadline, even on a pool worker whose own queue
+// holds a slow branch that never checks stop_requested()
+static void returns_at_deadline() {
+  thread_pool pool(4);
+  std::atomic<long long> slowest{0};
+  auto slow = [](int a) {
+    std::this_thread::sleep_for(100ms);
+    return a;
+  };
+  auto fast = [](int a) { return a; };
+  std::vector<int> input(8, 1);
+  for_each([&](int a) {
+    const auto start = std::chrono::steady_clock::now();
+    fork_into_within(20ms, slow, fast).on(pool)(a);
+    const auto took = std::chrono::duration_cast<std::chrono::milliseconds>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+    for (auto seen = slowest.load(); took > seen && !slowest.compare_exchange_weak(seen, took);) {
+    }
+  })
+      .on(pool)(input);
+  expect(slowest < 60, "a call returns well after its deadline");
+}
+
+// cancel_on stops the branches and the call throws operation_cancelled
+static void cancels() {
+  cancellation token;
+  token.cancel();
+  auto slow = [](int a) {
+    std::this_thread::sleep_for(50ms);
+    return a;
+  };
+  bool thrown = false;
+  try {
+    fork_into_within(1s, slow, slow).cancel_on(token)(1);
+  } catch (const operation_cancelled &) {
+    thrown = true;
+  }
+  expect(thrown, "a cancelled call throws operation_cancelled");
+}
+
+int main() {
+  calls_own_copies();
+  returns_at_deadline();
+  cancels();
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,90 @@
+#include <atomic>
+#include <iostream>
+#include <list>
+#include <numeric>
+#include <pipeline/pipeline.hpp>
+#include <vector>
+using namespace pipeline;
+
+static int failures = 0;
+
+static void expect(bool condition, const char *what) {
+  if (!condition) {
+    std::cerr << "FAILED: " << what << "\n";
+    ++failures;
+  }
+}
+
+// A map function with a counter of its own per copy, which notices when a
+// copy is called from two threads at once, and a count of all calls
+struct counted_map {
+  static inline std::atomic<int> calls{0};
+  static inline std::atomic<int> overlaps{0};
+
+  std::atomic<int> callers{0};
+  int own_calls = 0;
+
+  counted_map() = default;
+  counted_map(const counted_map &other) : own_calls(other.own_calls) {}
+
+  int operator()(int a) {
+    if (callers.fetch_add(1) != 0) {
+      ++overlaps;
+    }
+    ++own_calls;
+    ++calls;
+    callers.fetch_sub(1);
+    return 3 * a;
+  }
+};
+
+static auto even = [](int a) { return a % 2 == 0; };
+
+// Every stage reading lazy() | map(f) calls f exactly once per element,
+// and no copy of f from two threads at once
+template <typename Container> static void calls_once(const Container &input) {
+  thread_pool pool(4);
+  const auto size = static_cast<int>(input.size());
+  for (std::size_t grain : {0, 1, 64}) {
+    counted_map::calls = 0;
+    auto kept = (lazy() | map(counted_map()) | filter(even).on(pool).grain_size(grain))(input);
+    expect(counted_map::calls == size, "lazy map | filter calls f more than once per element");
+    expect(kept.size() == input.size() / 2 + input.size() % 2, "lazy map | filter keeps wrongly");
+
+    counted_map::calls = 0;
+    auto plus_one = (filter(even) | for_each([](int a) { return a + 1; })).on(pool);
+    auto fused = (lazy() | map(counted_map()) | plus_one.grain_size(grain))(input);
+    expect(counted_map::calls == size,
+           "lazy map | filter | for_each calls f more than once per element");
+    expect(fused.size() == kept.size() && (fused.empty() || fused[1] == 7),
+           "lazy map | filter | for_each returns wrong results");
+
+    counted_map::calls = 0;
+    std::atomic<int> survivors{0};
+    (lazy() | map(counted_map()) |
+     (filter(even) | for_each([&](int) { ++survivors; })).on(pool).grain_size(grain))(input);
+    expect(counted_map::calls == size,
+           "lazy map | filter | void for_each calls f more than once per element");
+    expect(survivors == static_cast<int>(kept.size()), "lazy map | filter | void for_each");
+
+    counted_map::calls = 0;
+    auto sum = (lazy() | map(counted_map()) |
+                reduce(0L, std::plus<>()).on(pool).grain_size(grain))(input);
+    expect(counted_map::calls == size, "lazy map | reduce calls f more than once per element");
+    expect(sum == 3L * size * (size - 1) / 2, "lazy map | reduce sums wrongly");
+
+    counted_map::calls = 0;
+    auto all = (lazy() | map(counted_map()) | collect())(input);
+    expect(counted_map::calls == size, "lazy map | collect calls f more than once per element");
+    expect(all.size() == input.size(), "lazy map | collect loses elements");
+  }
+  expect(counted_map::overlaps == 0, "a copy of a lazy map's f is called from two threads");
+}
+
+int main() {
+  std::vector<int> numbers(1000);
+  std::iota(numbers.begin(), numbers.end(), 0);
+  calls_once(numbers);
+  calls_once(std::list<int>(numbers.begin(), numbers.end()));
+  return failures == 0 ? 0 : 1;
+}
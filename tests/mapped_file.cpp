@@ -0,0 +1,87 @@
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <pipeline/pipeline.hpp>
+#include <string>
+#include <string_view>
+#include <vector>
+using namespace pipeline;
+
+static int failures = 0;
+
+static void expect(bool condition, const char *what) {
+  if (!condition) {
+    std::cerr << "FAILED: " << what << "\n";
+    ++failures;
+  }
+}
+
+static const std::string path = "mapped_file_test.txt";
+
+// The range a source returns keeps the file mapped after the source is
+// gone, e.g., in a range-for over a temporary source
+static void ranges_own_the_mapping() {
+  long lines = 0;
+  long sum = 0;
+  for (auto line : mmap_source(path)()) {
+    ++lines;
+    sum += std::stol(std::string(line));
+  }
+  expect(lines == 10000, "mmap_source gives the wrong number of lines");
+  expect(sum == 10000L * 9999 / 2, "mmap_source gives the wrong lines");
+
+  auto chunks = mmap_source(path, 4096)();
+  long chunked_lines = 0;
+  for (auto chunk : chunks) {
+    for (auto line : pipeline::lines(chunk)) {
+      chunked_lines += !line.empty();
+    }
+  }
+  expect(chunked_lines == 10000, "mmap_source chunks lose or split lines");
+}
+
+// Copies of a range stay valid when the original is destroyed
+static void copies_outlive_the_original() {
+  auto copy = [] {
+    auto source = mmap_source(path);
+    auto range = source();
+    auto copied = range;
+    return copied;
+  }();
+  std::vector<std::string_view> firsts;
+  for (auto line : copy) {
+    firsts.push_back(line);
+    if (firsts.size() == 3) {
+      break;
+    }
+  }
+  expect(firsts == std::vector<std::string_view>{"0", "1", "2"},
+         "a copied range doesn't read the file");
+}
+
+// Parallel stages read the lines in chunks, in order
+static void for_each_reads_in_order() {
+  thread_pool pool(4);
+  auto parse = for_each([](std::string_view line) { return std::stol(std::string(line)); })
+                   .on(pool)
+                   .grain_size(100);
+  const auto numbers = (mmap_source(path) | parse)();
+  std::vector<long> expected(10000);
+  std::iota(expected.begin(), expected.end(), 0L);
+  expect(numbers == expected, "for_each over mmap_source loses or reorders lines");
+}
+
+int main() {
+  {
+    std::ofstream file(path);
+    for (int i = 0; i < 10000; ++i) {
+      file << i << (i % 3 ? "\n" : "\r\n");
+    }
+  }
+  ranges_own_the_mapping();
+  copies_outlive_the_original();
+  for_each_reads_in_order();
+  std::remove(path.c_str());
+  return failures == 0 ? 0 : 1;
+}
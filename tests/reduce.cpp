@@ -0,0 +1,111 @@
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <pipeline/pipeline.hpp>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace pipeline;
+
+static int failures = 0;
+
+static void expect(bool condition, const char *what) {
+  if (!condition) {
+    std::cerr << "FAILED: " << what << "\n";
+    ++failures;
+  }
+}
+
+static std::vector<std::string> letters(std::size_t n) {
+  std::vector<std::string> result;
+  for (std::size_t i = 0; i < n; ++i) {
+    result.push_back(std::string(1, static_cast<char>('a' + i % 26)));
+  }
+  return result;
+}
+
+static std::string concatenated(const std::vector<std::string> &input) {
+  std::string result;
+  for (auto &s : input) {
+    result += s;
+  }
+  return result;
+}
+
+// Concatenation isn't commutative: partials must be merged in chunk order
+static void keeps_chunk_order() {
+  thread_pool pool(4);
+  const auto input = letters(1000);
+  const auto expected = concatenated(input);
+  for (std::size_t grain : {0, 1, 3, 64, 999, 1000, 5000}) {
+    auto concat = reduce(std::string(), [](std::string acc, const std::string &s) {
+                    return acc += s;
+                  }).on(pool).grain_size(grain);
+    expect(concat(input) == expected, "reduce merges partials out of order");
+
+    // merging two accumulators differs from folding in an element
+    auto lengths = reduce(std::vector<std::size_t>(),
+                          [](std::vector<std::size_t> acc, const std::string &s) {
+                            acc.push_back(s.size() + (s[0] - 'a'));
+                            return acc;
+                          })
+                       .combine([](std::vector<std::size_t> left,
+                                   const std::vector<std::size_t> &right) {
+                         left.insert(left.end(), right.begin(), right.end());
+                         return left;
+                       })
+                       .on(pool)
+                       .grain_size(grain);
+    const auto result = lengths(input);
+    bool ordered = result.size() == input.size();
+    for (std::size_t i = 0; ordered && i < result.size(); ++i) {
+      ordered = result[i] == 1 + i % 26;
+    }
+    expect(ordered, "reduce with combine merges partials out of order");
+  }
+}
+
+// An op that notices when one copy of it is called from two threads at
+// once, which a data race checker would report
+struct exclusive_sum {
+  static inline std::atomic<int> overlaps{0};
+
+  std::atomic<int> callers{0};
+
+  exclusive_sum() = default;
+  exclusive_sum(const exclusive_sum &) {}
+
+  long operator()(long acc, long a) {
+    if (callers.fetch_add(1) != 0) {
+      ++overlaps;
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+    callers.fetch_sub(1);
+    return acc + a;
+  }
+};
+
+// Each chunk folds, and merges up the tree, with copies of its own
+static void calls_own_copies() {
+  exclusive_sum::overlaps = 0;
+  thread_pool pool(4);
+  const std::vector<long> input(400, 1);
+  auto sum = reduce(0L, exclusive_sum()).on(pool).grain_size(8);
+  auto combined = reduce(0L, exclusive_sum()).combine(exclusive_sum()).on(pool).grain_size(8);
+  expect(sum(input) == 400 && combined(input) == 400, "reduce sums wrongly");
+  expect(exclusive_sum::overlaps == 0, "an op is called from two threads at once");
+}
+
+// The result of an empty input is init, and one element is op(init, e)
+static void small_inputs() {
+  auto sum = transform_reduce(10, std::plus<>(), [](int a) { return 2 * a; });
+  expect(sum(std::vector<int>()) == 10, "reduce of nothing isn't init");
+  expect(sum(std::vector<int>{5}) == 20, "reduce of one element isn't op(init, e)");
+}
+
+int main() {
+  keeps_chunk_order();
+  calls_own_copies();
+  small_inputs();
+  return failures == 0 ? 0 : 1;
+}